@@ -981,6 +981,18 @@ void EditProfileDialog::setupScrollingPage(const Profile::Ptr profile)
 
     setupRadio(pageamounts, scrollFullPage);
 
+    BooleanOption options[] = { {
+            _ui->reflowLinesButton , Profile::ReflowLines,
+            SLOT(toggleReflowLines(bool))
+        },
+        {
+            _ui->saveOutputWithSessionButton , Profile::SaveOutputWithSession,
+            SLOT(toggleSaveOutputWithSession(bool))
+        },
+        { 0 , Profile::Property(0) , 0 }
+    };
+    setupCheckBoxes(options , profile);
+
     // signals and slots
     connect(_ui->historySizeWidget, &Konsole::HistorySizeWidget::historySizeChanged, this, &Konsole::EditProfileDialog::historySizeChanged);
 }
@@ -1013,6 +1025,14 @@ void EditProfileDialog::scrollHalfPage()
 {
     updateTempProfileProperty(Profile::ScrollFullPage, Enum::ScrollPageHalf);
 }
+void EditProfileDialog::toggleReflowLines(bool enable)
+{
+    updateTempProfileProperty(Profile::ReflowLines, enable);
+}
+void EditProfileDialog::toggleSaveOutputWithSession(bool enable)
+{
+    updateTempProfileProperty(Profile::SaveOutputWithSession, enable);
+}
 void EditProfileDialog::setupMousePage(const Profile::Ptr profile)
 {
     BooleanOption  options[] = { {
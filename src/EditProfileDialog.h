@@ -146,6 +146,8 @@ private slots:
 
     void scrollFullPage();
     void scrollHalfPage();
+    void toggleReflowLines(bool);
+    void toggleSaveOutputWithSession(bool);
 
     // keyboard page
     void editKeyBinding();
@@ -23,9 +23,13 @@
 #include "Emulation.h"
 
 // Qt
+#include <QtCore/QMutexLocker>
+#include <QtCore/QThread>
 #include <QtGui/QKeyEvent>
 
 // Konsole
+#include "History.h"
+#include "IncrementalDecoder.h"
 #include "KeyboardTranslator.h"
 #include "KeyboardTranslatorManager.h"
 #include "Screen.h"
@@ -33,20 +37,50 @@
 
 using namespace Konsole;
 
+// the amount of queued output which is processed by the output thread
+// before the main thread gets a chance to take the output lock
+static const int SLICE_SIZE = 16 * 1024;
+
+// the amount of queued output above which the terminal program is not read
+// from anymore, until the output thread has processed half of it
+static const int MAX_BACKLOG = 1024 * 1024;
+
+// the time for which the output is processed without the output thread
+// and without updating the views, after which the terminal program is not
+// read from until they have been updated
+static const int MAX_UPDATE_DELAY = 100; // milliseconds
+
 Emulation::Emulation() :
     _currentScreen(0),
     _codec(0),
-    _decoder(0),
+    _decoder(new IncrementalDecoder()),
     _keyTranslator(0),
     _usesMouse(false),
     _bracketedPasteMode(false),
-    _imageSizeInitialized(false)
+    _bulkTimer1(this),
+    _bulkTimer2(this),
+    _imageSizeInitialized(false),
+    _snapshotSource(new OutputSnapshotSource(this)),
+    _outputThread(0),
+    _guiThread(0),
+    _processingOffset(0),
+    _processingScheduled(false),
+    _backlogged(false)
 {
+    qRegisterMetaType<const Konsole::HistoryType*>();
+
+    // the queues keep their capacity when they are emptied
+    _queuedData.reserve(SLICE_SIZE);
+    _processingData.reserve(SLICE_SIZE);
+    _updateTime.start();
+
     // create screens with a default size
     _screen[0] = new Screen(40, 80);
     _screen[1] = new Screen(40, 80);
     _currentScreen = _screen[0];
 
+    updateHistoryOwner();
+
     QObject::connect(&_bulkTimer1, &QTimer::timeout, this, &Konsole::Emulation::showBulk);
     QObject::connect(&_bulkTimer2, &QTimer::timeout, this, &Konsole::Emulation::showBulk);
 
@@ -75,9 +109,86 @@ void Emulation::bracketedPasteModeChanged(bool bracketedPasteMode)
     _bracketedPasteMode = bracketedPasteMode;
 }
 
+bool Emulation::outputThreadEnabled() const
+{
+    return _outputThread != 0;
+}
+
+void Emulation::setOutputThreadEnabled(bool enable)
+{
+    if (enable == outputThreadEnabled())
+        return;
+
+    if (enable) {
+        // the output thread only reports its own backlog
+        bool caughtUp;
+        {
+            QMutexLocker locker(&_queueLock);
+            caughtUp = _backlogged;
+            _backlogged = false;
+        }
+        if (caughtUp)
+            emit outputBacklogChanged();
+
+        _guiThread = thread();
+        _outputThread = new QThread();
+        _outputThread->start();
+
+        {
+            OutputLocker locker(&_outputLock);
+            _screen[0]->historyScroll()->setOwner(_outputLock.mutex(), _outputThread);
+            _screen[1]->historyScroll()->setOwner(_outputLock.mutex(), _outputThread);
+        }
+        moveToThread(_outputThread);
+    } else {
+        QMetaObject::invokeMethod(this, "leaveOutputThread", Qt::BlockingQueuedConnection);
+
+        _outputThread->quit();
+        _outputThread->wait();
+        delete _outputThread;
+        _outputThread = 0;
+    }
+}
+
+void Emulation::leaveOutputThread()
+{
+    // the main thread waits for this, so no more data is queued
+    while (_processingScheduled)
+        processQueuedData();
+
+    OutputLocker locker(&_outputLock);
+    _screen[0]->historyScroll()->setOwner(_outputLock.mutex(), _guiThread);
+    _screen[1]->historyScroll()->setOwner(_outputLock.mutex(), _guiThread);
+    moveToThread(_guiThread);
+}
+
+bool Emulation::outputBacklogged() const
+{
+    QMutexLocker locker(&_queueLock);
+    return _backlogged;
+}
+
+bool Emulation::onOtherThread() const
+{
+    return _outputThread && QThread::currentThread() != _outputThread;
+}
+
+OutputLock* Emulation::outputLock() const
+{
+    return &_outputLock;
+}
+
+void Emulation::updateHistoryOwner()
+{
+    _screen[0]->historyScroll()->setOwner(_outputLock.mutex(), thread());
+    _screen[1]->historyScroll()->setOwner(_outputLock.mutex(), thread());
+}
+
 ScreenWindow* Emulation::createWindow()
 {
-    ScreenWindow* window = new ScreenWindow(_currentScreen);
+    OutputLocker locker(&_outputLock);
+
+    ScreenWindow* window = new ScreenWindow(_currentScreen, &_outputLock);
     _windows << window;
 
     connect(window , &Konsole::ScreenWindow::selectionChanged, this , &Konsole::Emulation::bufferedUpdate);
@@ -95,12 +206,24 @@ void Emulation::checkScreenInUse()
 
 void Emulation::checkSelectedText()
 {
-    QString text = _currentScreen->selectedText(true);
+    QString text;
+    {
+        OutputLocker locker(&_outputLock);
+        text = _currentScreen->selectedText(true);
+    }
     emit selectionChanged(text);
 }
 
 Emulation::~Emulation()
 {
+    Q_ASSERT(!_outputThread);
+
+    // snapshots which are still being read can no longer read the history
+    {
+        QMutexLocker locker(&_snapshotSource->mutex);
+        _snapshotSource->emulation = 0;
+    }
+
     foreach(ScreenWindow* window, _windows) {
         delete window;
     }
@@ -127,27 +250,126 @@ void Emulation::setScreen(int index)
 
 void Emulation::clearHistory()
 {
+    // the history objects are created on the thread of the emulation
+    if (onOtherThread()) {
+        QMetaObject::invokeMethod(this, "clearHistory", Qt::BlockingQueuedConnection);
+        return;
+    }
+
+    OutputLocker locker(&_outputLock);
     _screen[0]->setScroll(_screen[0]->getScroll() , false);
+    updateHistoryOwner();
 }
 void Emulation::setHistory(const HistoryType& history)
 {
-    _screen[0]->setScroll(history);
+    if (onOtherThread()) {
+        QMetaObject::invokeMethod(this, "setHistoryOnOutputThread", Qt::BlockingQueuedConnection,
+                                  Q_ARG(const Konsole::HistoryType*, &history));
+        return;
+    }
+
+    setHistoryOnOutputThread(&history);
+}
+
+void Emulation::setHistoryOnOutputThread(const HistoryType* history)
+{
+    {
+        OutputLocker locker(&_outputLock);
+        _screen[0]->setScroll(*history);
+        updateHistoryOwner();
+    }
 
     showBulk();
 }
 
 const HistoryType& Emulation::history() const
 {
+    OutputLocker locker(&_outputLock);
     return _screen[0]->getScroll();
 }
 
+qint64 Emulation::historyMemoryUsage() const
+{
+    OutputLocker locker(&_outputLock);
+    return _screen[0]->historyMemoryUsage();
+}
+
+void Emulation::setHistorySearchIndexEnabled(bool enable)
+{
+    OutputLocker locker(&_outputLock);
+    _screen[0]->setSearchIndexEnabled(enable);
+}
+
+void Emulation::setReflowLines(bool reflow)
+{
+    // the alternate screen is used by full screen programs, which redraw
+    // their output for the new size themselves
+    OutputLocker locker(&_outputLock);
+    _screen[0]->setReflowLines(reflow);
+}
+
+bool Emulation::isReflowingHistory() const
+{
+    OutputLocker locker(&_outputLock);
+    const MigratingHistoryScroll* migrating = dynamic_cast<const MigratingHistoryScroll*>(_screen[0]->historyScroll());
+    return migrating && migrating->isReflowing();
+}
+
+bool Emulation::searchCandidateLines(const QString& text, QList<QPair<int, int> >& lines) const
+{
+    OutputLocker locker(&_outputLock);
+    return _currentScreen->searchCandidateLines(text, lines);
+}
+
+OutputSnapshot Emulation::outputSnapshot()
+{
+    OutputLocker locker(&_outputLock);
+
+    OutputSnapshot snapshot(_snapshotSource, _currentScreen->historyScroll());
+    for (int line = 0; line < _currentScreen->getLines(); line++) {
+        bool wrapped = false;
+        const QVector<Character> cells = _currentScreen->imageLine(line, wrapped);
+        snapshot.appendScreenLine(cells, wrapped);
+    }
+
+    return snapshot;
+}
+
+HistoryScroll* Emulation::historyScroll() const
+{
+    return _screen[0]->historyScroll();
+}
+
+void Emulation::saveScreenState(QDataStream& stream) const
+{
+    OutputLocker locker(&_outputLock);
+    _screen[0]->saveState(stream);
+    _screen[1]->saveState(stream);
+}
+
+bool Emulation::restoreScreenState(QDataStream& stream)
+{
+    {
+        OutputLocker locker(&_outputLock);
+        if (!_screen[0]->restoreState(stream))
+            return false;
+        _screen[1]->restoreState(stream);
+
+        setScreen(0);
+    }
+    bufferedUpdate();
+
+    return true;
+}
+
 void Emulation::setCodec(const QTextCodec * codec)
 {
     if (codec) {
-        _codec = codec;
-
-        delete _decoder;
-        _decoder = _codec->makeDecoder();
+        {
+            OutputLocker locker(&_outputLock);
+            _codec = codec;
+            _decoder->setCodec(_codec);
+        }
 
         emit useUtf8Request(utf8());
     } else {
@@ -191,6 +413,12 @@ void Emulation::receiveChar(int c)
     }
 }
 
+void Emulation::receiveChars(const ushort* chars, int count)
+{
+    for (int i = 0; i < count; i++)
+        receiveChar(chars[i]);
+}
+
 void Emulation::sendKeyEvent(QKeyEvent* ev)
 {
     emit stateSet(NOTIFYNORMAL);
@@ -213,26 +441,109 @@ void Emulation::sendMouseEvent(int /*buttons*/, int /*column*/, int /*row*/, int
 */
 
 void Emulation::receiveData(const char* text, int length)
+{
+    if (!_outputThread) {
+        // the views are up to date unless an update is scheduled already
+        if (!_bulkTimer2.isActive())
+            _updateTime.start();
+
+        processData(text, length);
+
+        // give the views a chance to be updated, see showBulk()
+        if (!_backlogged && _updateTime.elapsed() > MAX_UPDATE_DELAY) {
+            {
+                QMutexLocker locker(&_queueLock);
+                _backlogged = true;
+            }
+            emit outputBacklogChanged();
+        }
+        return;
+    }
+
+    bool backlogged = false;
+    {
+        QMutexLocker locker(&_queueLock);
+        _queuedData.append(text, length);
+        if (!_processingScheduled) {
+            _processingScheduled = true;
+            QMetaObject::invokeMethod(this, "processQueuedData", Qt::QueuedConnection);
+        }
+
+        if (!_backlogged && _queuedData.size() > MAX_BACKLOG) {
+            _backlogged = true;
+            backlogged = true;
+        }
+    }
+
+    if (backlogged)
+        emit outputBacklogChanged();
+}
+
+void Emulation::processQueuedData()
+{
+    if (_processingOffset == _processingData.size()) {
+        QMutexLocker locker(&_queueLock);
+        _processingData.swap(_queuedData);
+        _queuedData.resize(0);
+        _processingOffset = 0;
+
+        if (_processingData.isEmpty()) {
+            _processingScheduled = false;
+            return;
+        }
+    }
+
+    const int length = qMin(SLICE_SIZE, _processingData.size() - _processingOffset);
+    processData(_processingData.constData() + _processingOffset, length);
+    _processingOffset += length;
+
+    // let the views take the lock before the next slice is processed
+    _outputLock.yield();
+
+    bool pending = _processingOffset < _processingData.size();
+    bool caughtUp = false;
+    {
+        QMutexLocker locker(&_queueLock);
+        if (!pending) {
+            pending = !_queuedData.isEmpty();
+            _processingScheduled = pending;
+        }
+
+        const int backlog = _queuedData.size() + _processingData.size() - _processingOffset;
+        if (_backlogged && backlog <= MAX_BACKLOG / 2) {
+            _backlogged = false;
+            caughtUp = true;
+        }
+    }
+
+    if (caughtUp)
+        emit outputBacklogChanged();
+
+    // other events, such as the timers and resizing, are handled between
+    // the slices
+    if (pending)
+        QMetaObject::invokeMethod(this, "processQueuedData", Qt::QueuedConnection);
+}
+
+void Emulation::processData(const char* text, int length)
 {
     emit stateSet(NOTIFYACTIVITY);
 
     bufferedUpdate();
 
-    QString unicodeText = _decoder->toUnicode(text, length);
+    bool zmodem;
+    {
+        OutputLocker locker(&_outputLock);
+        const int count = _decoder->decode(text, length);
 
-    //send characters to terminal emulator
-    for (int i = 0; i < unicodeText.length(); i++)
-        receiveChar(unicodeText[i].unicode());
+        //send characters to terminal emulator
+        receiveChars(_decoder->characters(), count);
 
-    //look for z-modem indicator
-    //-- someone who understands more about z-modems that I do may be able to move
-    //this check into the above for loop?
-    for (int i = 0; i < length; i++) {
-        if (text[i] == '\030') {
-            if ((length - i - 1 > 3) && (qstrncmp(text + i + 1, "B00", 3) == 0))
-                emit zmodemDetected();
-        }
+        zmodem = _decoder->zmodemDetected();
     }
+
+    if (zmodem)
+        emit zmodemDetected();
 }
 
 //OLDER VERSION
@@ -287,24 +598,62 @@ void Emulation::writeToStream(TerminalCharacterDecoder* decoder ,
                               int startLine ,
                               int endLine)
 {
+    OutputLocker locker(&_outputLock);
     _currentScreen->writeLinesToStream(decoder, startLine, endLine);
 }
 
 int Emulation::lineCount() const
 {
     // sum number of lines currently on _screen plus number of lines in history
+    OutputLocker locker(&_outputLock);
     return _currentScreen->getLines() + _currentScreen->getHistLines();
 }
 
 void Emulation::showBulk()
 {
+    // the timers belong to the thread of the emulation
+    if (QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, "showBulk", Qt::QueuedConnection);
+        return;
+    }
+
     _bulkTimer1.stop();
     _bulkTimer2.stop();
 
+    ReflowedLines reflowedLines;
+    {
+        // the windows show a copy of the screen, so that they can be
+        // drawn while the next output is processed
+        OutputLocker locker(&_outputLock);
+        reflowedLines = _screen[0]->updateReflowedLines();
+        // the history may have lost lines to the memory budget while
+        // another session produced output
+        _screen[0]->forgetDroppedSelection();
+
+        if (!_windows.isEmpty()) {
+            const ScreenFrame frame(_currentScreen);
+            foreach(ScreenWindow* window, _windows) {
+                window->addFrame(frame);
+            }
+        }
+
+        _currentScreen->resetScrolledLines();
+        _currentScreen->resetDroppedLines();
+        _screen[0]->resetReflowedLines();
+    }
+
+    foreach(const ReflowedLines::Range& range, reflowedLines.ranges)
+        emit linesReflowed(range.firstLine, range.oldCount, range.newCount);
+
     emit outputChanged();
 
-    _currentScreen->resetScrolledLines();
-    _currentScreen->resetDroppedLines();
+    if (!_outputThread && _backlogged) {
+        {
+            QMutexLocker locker(&_queueLock);
+            _backlogged = false;
+        }
+        emit outputBacklogChanged();
+    }
 }
 
 void Emulation::bufferedUpdate()
@@ -312,6 +661,11 @@ void Emulation::bufferedUpdate()
     static const int BULK_TIMEOUT1 = 10;
     static const int BULK_TIMEOUT2 = 40;
 
+    if (QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, "bufferedUpdate", Qt::QueuedConnection);
+        return;
+    }
+
     _bulkTimer1.setSingleShot(true);
     _bulkTimer1.start(BULK_TIMEOUT1);
     if (!_bulkTimer2.isActive()) {
@@ -330,6 +684,15 @@ void Emulation::setImageSize(int lines, int columns)
     if ((lines < 1) || (columns < 1))
         return;
 
+    // resizing creates history objects, which belong to the thread of
+    // the emulation
+    if (onOtherThread()) {
+        QMetaObject::invokeMethod(this, "setImageSize", Qt::BlockingQueuedConnection,
+                                  Q_ARG(int, lines), Q_ARG(int, columns));
+        return;
+    }
+
+    OutputLocker locker(&_outputLock);
     QSize screenSize[2] = { QSize(_screen[0]->getColumns(),
                                   _screen[0]->getLines()),
                             QSize(_screen[1]->getColumns(),
@@ -347,6 +710,13 @@ void Emulation::setImageSize(int lines, int columns)
     } else {
         _screen[0]->resizeImage(lines, columns);
         _screen[1]->resizeImage(lines, columns);
+        updateHistoryOwner();
+
+        // the lines of the history are wrapped again in the background
+        if (MigratingHistoryScroll* migrating = dynamic_cast<MigratingHistoryScroll*>(_screen[0]->historyScroll())) {
+            connect(migrating, &Konsole::MigratingHistoryScroll::linesMigrated, this, &Konsole::Emulation::bufferedUpdate,
+                    Qt::UniqueConnection);
+        }
 
         emit imageSizeChanged(lines, columns);
 
@@ -367,6 +737,7 @@ void Emulation::setImageSize(int lines, int columns)
 
 QSize Emulation::imageSize() const
 {
+    OutputLocker locker(&_outputLock);
     return QSize(_currentScreen->getColumns(), _currentScreen->getLines());
 }
 
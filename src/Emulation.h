@@ -24,19 +24,31 @@
 #define EMULATION_H
 
 // Qt
+#include <QtCore/QByteArray>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QMutex>
+#include <QtCore/QPair>
+#include <QtCore/QSharedPointer>
 #include <QtCore/QSize>
 #include <QtCore/QTextCodec>
 #include <QtCore/QTimer>
 
 // Konsole
 #include "konsoleprivate_export.h"
+#include "OutputLock.h"
 
 class QKeyEvent;
+class QDataStream;
+class QThread;
 
 namespace Konsole
 {
 class KeyboardTranslator;
 class HistoryType;
+class HistoryScroll;
+class IncrementalDecoder;
+class OutputSnapshot;
+struct OutputSnapshotSource;
 class Screen;
 class ScreenWindow;
 class TerminalCharacterDecoder;
@@ -113,6 +125,12 @@ enum {
  * is emitted whenever the activity state is set.  This can be used to determine
  * how long the emulation has been active/idle for and also respond to
  * a 'bell' event in different ways.
+ *
+ * The output can be processed by a thread of its own, see
+ * setOutputThreadEnabled().  The screens and the history are then
+ * protected by outputLock(), which the methods of the emulation and its
+ * screen windows take themselves.  Objects which access the screens
+ * directly must hold the lock while doing so.
  */
 class KONSOLEPRIVATE_EXPORT Emulation : public QObject
 {
@@ -130,6 +148,35 @@ public:
      */
     ScreenWindow* createWindow();
 
+    /**
+     * Sets whether the output of the terminal program is processed by a
+     * thread of its own, so that a program which produces a lot of output
+     * does not make the user interface unresponsive.
+     *
+     * The data passed to receiveData() is then queued and processed by the
+     * output thread, which also owns the emulation and its timers.  The
+     * output thread must be disabled before the emulation is deleted.
+     */
+    void setOutputThreadEnabled(bool enable);
+    /** Returns true if the output is processed by a thread of its own. */
+    bool outputThreadEnabled() const;
+    /**
+     * Returns true if the output thread has fallen behind with processing
+     * the data passed to receiveData().  The terminal program should not
+     * be read from until it has caught up again.  See outputBacklogChanged()
+     *
+     * Without the output thread, the emulation is backlogged once the data
+     * has been processed for a while without updating the views, until
+     * they have been updated.
+     */
+    bool outputBacklogged() const;
+
+    /**
+     * Returns the lock which protects the screens and the history of the
+     * emulation.  See setOutputThreadEnabled()
+     */
+    OutputLock* outputLock() const;
+
     /** Returns the size of the screen image which the emulation produces */
     QSize imageSize() const;
 
@@ -149,8 +196,53 @@ public:
     void setHistory(const HistoryType&);
     /** Returns the history store used by this emulation.  See setHistory() */
     const HistoryType& history() const;
+    /** Returns the number of bytes of memory used by the history store. */
+    qint64 historyMemoryUsage() const;
     /** Clears the history scroll. */
-    void clearHistory();
+    Q_INVOKABLE void clearHistory();
+    /**
+     * Sets whether the lines added to the history are indexed to speed up
+     * searching through them.  See searchCandidateLines().
+     */
+    void setHistorySearchIndexEnabled(bool enable);
+    /**
+     * Sets whether the lines of the primary screen and its history are
+     * wrapped again when the number of columns changes, see
+     * Screen::setReflowLines().  This is disabled by default.
+     */
+    void setReflowLines(bool reflow);
+    /** Returns true while the lines of the history are being wrapped again. */
+    bool isReflowingHistory() const;
+    /**
+     * Finds the lines of the output which may contain @p text, using the
+     * history search index.  See Screen::searchCandidateLines()
+     */
+    bool searchCandidateLines(const QString& text, QList<QPair<int, int> >& lines) const;
+
+    /**
+     * Returns a snapshot of the current output (the history and the image
+     * of the current screen), which can be read on other threads.  The lines
+     * of the snapshot are the same as those of writeToStream().  Only the
+     * screen image is copied here, the history lines are read by the
+     * snapshot when they are needed.
+     */
+    OutputSnapshot outputSnapshot();
+
+    /** Returns the history scroll which stores the lines of the primary screen. */
+    HistoryScroll* historyScroll() const;
+
+    /**
+     * Writes the contents and state of both screens to @p stream.
+     * The history is not included, see historyScroll().
+     */
+    void saveScreenState(QDataStream& stream) const;
+    /**
+     * Restores the screens from the state written by saveScreenState().
+     * The primary screen is made the active one, because the program which
+     * used the alternate screen when the state was saved is not running
+     * any more.
+     */
+    bool restoreScreenState(QDataStream& stream);
 
     /**
      * Copies the output history from @p startLine to @p endLine
@@ -201,10 +293,10 @@ public:
     /**
      * Copies the current image into the history and clears the screen.
      */
-    virtual void clearEntireScreen() = 0;
+    Q_INVOKABLE virtual void clearEntireScreen() = 0;
 
     /** Resets the state of the terminal. */
-    virtual void reset() = 0;
+    Q_INVOKABLE virtual void reset() = 0;
 
     /**
      * Returns true if the active terminal program wants
@@ -249,13 +341,16 @@ public slots:
 
     /**
      * Processes an incoming stream of characters.  receiveData() decodes the incoming
-     * character buffer using the current codec(), and then calls receiveChar() for
-     * each unicode character in the resulting buffer.
+     * character buffer using the current codec(), and then passes the resulting
+     * unicode characters to receiveChars().
      *
      * receiveData() also starts a timer which causes the outputChanged() signal
      * to be emitted when it expires.  The timer allows multiple updates in quick
      * succession to be buffered into a single outputChanged() signal emission.
      *
+     * If the output thread is enabled, the data is copied into a queue and
+     * processed by the output thread later.
+     *
      * @param buffer A string of characters received from the terminal program.
      * @param len The length of @p buffer
      */
@@ -339,6 +434,17 @@ signals:
      */
     void outputChanged();
 
+    /**
+     * Emitted before outputChanged() when lines of the history have been
+     * wrapped again at a new width in the background, see
+     * setReflowLines().  The @p oldCount lines from the absolute line
+     * @p firstLine (see HistoryScroll::droppedLineCount()) have been
+     * replaced by @p newCount lines, and the lines after them have moved by
+     * the difference.  If several ranges of lines have been wrapped again,
+     * the signal is emitted for each of them in turn.
+     */
+    void linesReflowed(qint64 firstLine, int oldCount, int newCount);
+
     /**
      * Emitted when the program running in the terminal wishes to update the
      * session's title.  This also allows terminal programs to customize other
@@ -426,6 +532,12 @@ signals:
      */
     void sessionAttributeRequest(int id);
 
+    /**
+     * Emitted when the output thread falls behind with processing the
+     * received data, and when it has caught up again.  See outputBacklogged()
+     */
+    void outputBacklogChanged();
+
 protected:
     virtual void setMode(int mode) = 0;
     virtual void resetMode(int mode) = 0;
@@ -436,6 +548,12 @@ protected:
      */
     virtual void receiveChar(int ch);
 
+    /**
+     * Processes @p count incoming characters starting at @p chars.  The
+     * default implementation calls receiveChar() for each character.
+     */
+    virtual void receiveChars(const ushort* chars, int count);
+
     /**
      * Sets the active screen.  The terminal has two screens, primary and alternate.
      * The primary screen is used by default.  When certain interactive programs such
@@ -452,6 +570,13 @@ protected:
 
     void setCodec(EmulationCodec codec);
 
+    /**
+     * Returns true if the output thread is enabled and the caller runs on
+     * another thread.  Methods which create or delete history objects are
+     * invoked on the output thread in that case.
+     */
+    bool onOtherThread() const;
+
     QList<ScreenWindow*> _windows;
 
     Screen* _currentScreen;  // pointer to the screen which is currently active,
@@ -463,12 +588,15 @@ protected:
     //                      scrollbars are not enabled in this mode )
 
 
-    //decodes an incoming C-style character stream into a unicode QString using
+    //decodes an incoming C-style character stream into unicode characters using
     //the current text codec.  (this allows for rendering of non-ASCII characters in text files etc.)
     const QTextCodec* _codec;
-    QTextDecoder* _decoder;
+    IncrementalDecoder* _decoder;
     const KeyboardTranslator* _keyTranslator; // the keyboard layout
 
+    // protects the screens and the history, see outputLock()
+    mutable OutputLock _outputLock;
+
 protected slots:
     /**
      * Schedules an update of attached views.
@@ -492,13 +620,46 @@ private slots:
 
     void bracketedPasteModeChanged(bool bracketedPasteMode);
 
+    // process the data queued by receiveData() on the output thread
+    void processQueuedData();
+    // moves the emulation back to the main thread
+    void leaveOutputThread();
+    void setHistoryOnOutputThread(const Konsole::HistoryType* history);
+
 private:
+    // decodes and processes data on the thread of the emulation
+    void processData(const char* text, int length);
+    // makes the history scrolls use the output lock and the thread of
+    // the emulation
+    void updateHistoryOwner();
+
     bool _usesMouse;
     bool _bracketedPasteMode;
     QTimer _bulkTimer1;
     QTimer _bulkTimer2;
     bool _imageSizeInitialized;
+
+    // shared with the snapshots of the output, see outputSnapshot()
+    QSharedPointer<OutputSnapshotSource> _snapshotSource;
+
+    QThread* _outputThread;
+    QThread* _guiThread;
+
+    // the data received but not processed yet by the output thread.
+    // Incoming data is appended to _queuedData, which is swapped with
+    // _processingData once that has been processed completely.
+    mutable QMutex _queueLock;
+    QByteArray _queuedData;
+    QByteArray _processingData;
+    int _processingOffset;
+    bool _processingScheduled;
+    bool _backlogged;
+    // the time since the output which the views do not show yet was
+    // received, see receiveData()
+    QElapsedTimer _updateTime;
 };
 }
 
+Q_DECLARE_METATYPE(const Konsole::HistoryType*)
+
 #endif // ifndef EMULATION_H
@@ -24,16 +24,49 @@
 
 // KDE
 #include <QDebug>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QThread>
+#include <QtCore/QTimer>
 
 // Konsole
 #include "TerminalDisplay.h"
 #include "SessionManager.h"
 #include "Session.h"
 #include "Screen.h"
+#include "ScreenWindow.h"
+#include "OutputLock.h"
 
 using namespace Konsole;
 
+namespace Konsole
+{
+// removes the unused characters from the table on the main thread, where
+// the sessions and their views live
+class ExtendedCharCleaner : public QObject
+{
+    Q_OBJECT
+
+public slots:
+    void cleanUp() {
+        QMutexLocker locker(&ExtendedCharTable::instance.mutex);
+
+        if (!ExtendedCharTable::instance.removeUnusedExtendedChars()) {
+            // some screen is busy, try again later
+            QTimer::singleShot(RETRY_DELAY, this, SLOT(cleanUp()));
+            return;
+        }
+        ExtendedCharTable::instance.cleanUpRequested = false;
+        deleteLater();
+    }
+
+private:
+    static const int RETRY_DELAY = 100;
+};
+}
+
 ExtendedCharTable::ExtendedCharTable()
+    : cleanUpRequested(false)
 {
 }
 
@@ -52,6 +85,8 @@ ExtendedCharTable ExtendedCharTable::instance;
 
 ushort ExtendedCharTable::createExtendedChar(const ushort* unicodePoints , ushort length)
 {
+    QMutexLocker locker(&mutex);
+
     // look for this sequence of points in the table
     ushort hash = extendedCharHash(unicodePoints, length);
     const ushort initialHash = hash;
@@ -69,27 +104,8 @@ ushort ExtendedCharTable::createExtendedChar(const ushort* unicodePoints , ushor
             hash++;
 
             if (hash == initialHash) {
-                if (!triedCleaningSolution) {
+                if (!triedCleaningSolution && removeUnusedExtendedChars()) {
                     triedCleaningSolution = true;
-                    // All the hashes are full, go to all Screens and try to free any
-                    // This is slow but should happen very rarely
-                    QSet<ushort> usedExtendedChars;
-                    const SessionManager* sm = SessionManager::instance();
-                    foreach(const Session * s, sm->sessions()) {
-                        foreach(const TerminalDisplay * td, s->views()) {
-                            usedExtendedChars += td->screenWindow()->screen()->usedExtendedChars();
-                        }
-                    }
-
-                    QHash<ushort, ushort*>::iterator it = extendedCharTable.begin();
-                    QHash<ushort, ushort*>::iterator itEnd = extendedCharTable.end();
-                    while (it != itEnd) {
-                        if (usedExtendedChars.contains(it.key())) {
-                            ++it;
-                        } else {
-                            it = extendedCharTable.erase(it);
-                        }
-                    }
                 } else {
                     qWarning() << "Using all the extended char hashes, going to miss this extended character";
                     return 0;
@@ -110,8 +126,63 @@ ushort ExtendedCharTable::createExtendedChar(const ushort* unicodePoints , ushor
     return hash;
 }
 
+bool ExtendedCharTable::removeUnusedExtendedChars()
+{
+    // The sessions belong to the main thread, other threads leave the
+    // cleaning to it.  The characters are missed until it is done.
+    if (QThread::currentThread() != QCoreApplication::instance()->thread()) {
+        if (!cleanUpRequested) {
+            cleanUpRequested = true;
+            ExtendedCharCleaner* cleaner = new ExtendedCharCleaner();
+            cleaner->moveToThread(QCoreApplication::instance()->thread());
+            QMetaObject::invokeMethod(cleaner, "cleanUp", Qt::QueuedConnection);
+        }
+        return false;
+    }
+
+    QSet<ushort> usedExtendedChars;
+    if (!collectUsedExtendedChars(usedExtendedChars))
+        return false;
+
+    QHash<ushort, ushort*>::iterator it = extendedCharTable.begin();
+    QHash<ushort, ushort*>::iterator itEnd = extendedCharTable.end();
+    while (it != itEnd) {
+        if (usedExtendedChars.contains(it.key())) {
+            ++it;
+        } else {
+            it = extendedCharTable.erase(it);
+        }
+    }
+    return true;
+}
+
+bool ExtendedCharTable::collectUsedExtendedChars(QSet<ushort>& usedExtendedChars) const
+{
+    // All the hashes are full, go to all Screens and try to free any
+    // This is slow but should happen very rarely.
+    //
+    // Screens whose output is being processed by another thread are not
+    // waited for, since that thread may be waiting for this table.
+    const SessionManager* sm = SessionManager::instance();
+    foreach(const Session * s, sm->sessions()) {
+        foreach(const TerminalDisplay * td, s->views()) {
+            OutputLock* lock = td->screenWindow()->lock();
+            if (lock && !lock->tryLock())
+                return false;
+
+            usedExtendedChars += td->screenWindow()->screen()->usedExtendedChars();
+
+            if (lock)
+                lock->unlock();
+        }
+    }
+    return true;
+}
+
 ushort* ExtendedCharTable::lookupExtendedChar(ushort hash , ushort& length) const
 {
+    QMutexLocker locker(&mutex);
+
     // look up index in table and if found, set the length
     // argument and return a pointer to the character sequence
 
@@ -151,3 +222,4 @@ bool ExtendedCharTable::extendedCharMatch(ushort hash , const ushort* unicodePoi
     return true;
 }
 
+#include "ExtendedCharTable.moc"
@@ -24,6 +24,8 @@
 
 // Qt
 #include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QSet>
 
 namespace Konsole
 {
@@ -35,6 +37,8 @@ namespace Konsole
  */
 class ExtendedCharTable
 {
+    friend class ExtendedCharCleaner;
+
 public:
     /** Constructs a new character table. */
     ExtendedCharTable();
@@ -61,6 +65,8 @@ public:
      * character sequence.
      *
      * @return A unicode character sequence of size @p length.
+     *
+     * The table may be used by several threads.
      */
     ushort* lookupExtendedChar(ushort hash , ushort& length) const;
 
@@ -72,10 +78,22 @@ private:
     // tests whether the entry in the table specified by 'hash' matches the
     // character sequence 'unicodePoints' of size 'length'
     bool extendedCharMatch(ushort hash , const ushort* unicodePoints , ushort length) const;
+    // removes the characters which no screen uses from the table, returns
+    // false if that could not be done now.  On threads other than the main
+    // thread this asks the main thread to do it.
+    bool removeUnusedExtendedChars();
+    // adds the characters used by the screens of all sessions to
+    // 'usedExtendedChars', returns false if not all screens could be checked
+    bool collectUsedExtendedChars(QSet<ushort>& usedExtendedChars) const;
+    // the emulations of sessions may process their output on threads of
+    // their own, see Emulation::setOutputThreadEnabled()
+    mutable QMutex mutex;
     // internal, maps hash keys to character sequence buffers.  The first ushort
     // in each value is the length of the buffer, followed by the ushorts in the buffer
     // themselves.
     QHash<ushort, ushort*> extendedCharTable;
+    // whether the main thread has been asked to remove the unused characters
+    bool cleanUpRequested;
 };
 }
 #endif  // end of EXTENDEDCHARTABLE_H
@@ -24,13 +24,23 @@
 // System
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 
 // KDE
 #include <QDebug>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QMap>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QRunnable>
+#include <QtCore/QTemporaryFile>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
 
 #include <QDir>
 #include <qplatformdefs.h>
@@ -38,8 +48,11 @@
 #include <KConfigGroup>
 #include <KSharedConfig>
 
-// Reasonable line size
-static const int LINE_SIZE = 1024;
+// Konsole
+#include "Emulation.h"
+#include "OutputLock.h"
+#include "Screen.h"
+#include "TerminalCharacterDecoder.h"
 
 using namespace Konsole;
 
@@ -60,15 +73,23 @@ Q_GLOBAL_STATIC(QString, historyFileLocation);
    at constant costs.
 */
 
-// History File ///////////////////////////////////////////
-HistoryFile::HistoryFile()
+// History File Container ///////////////////////////////////
+
+HistoryFileContainer::HistoryFileContainer()
     : _fd(-1),
-      _length(0),
-      _fileMap(0),
-      _readWriteBalance(0)
+      _errorReported(false),
+      _reservedLength(0),
+      _writtenLength(0),
+      _mapUseCounter(0)
 {
+    for (int i = 0; i < MAX_MAP_WINDOWS; i++) {
+        _mapWindows[i].data = 0;
+        _mapWindows[i].offset = 0;
+        _mapWindows[i].length = 0;
+        _mapWindows[i].lastUsed = 0;
+    }
+
     // Determine the temp directory once
-    // This class is called 3 times for each "unlimited" scrollback.
     // This has the down-side that users must restart to
     // load changes (currently only 2 choices).
     if (!historyFileLocation.exists()) {
@@ -81,113 +102,327 @@ HistoryFile::HistoryFile()
         QDir().mkpath(*historyFileLocation());
     }
     const QString tmpDir = *historyFileLocation();
-    const QString tmpFormat = tmpDir + QLatin1Char('/') + "konsole-XXXXXX.history";
-    _tmpFile.setFileTemplate(tmpFormat);
-    if (_tmpFile.open()) {
-        _tmpFile.setAutoRemove(true);
-        _fd = _tmpFile.handle();
+
+#ifdef O_TMPFILE
+    // a file without a name, which cannot be left behind
+    _fd = QT_OPEN(QFile::encodeName(tmpDir).constData(), O_TMPFILE | O_RDWR | O_EXCL, 0600);
+#endif
+
+    // O_TMPFILE is not supported by all systems and file systems
+    if (_fd < 0) {
+        QTemporaryFile tmpFile(tmpDir + QLatin1Char('/') + "konsole-XXXXXX.history");
+        tmpFile.setAutoRemove(false);
+        if (tmpFile.open()) {
+            _fd = dup(tmpFile.handle());
+            tmpFile.remove();
+        }
     }
+
+    if (_fd < 0)
+        qWarning() << "Unable to create history file in" << tmpDir;
 }
 
-HistoryFile::~HistoryFile()
+HistoryFileContainer::~HistoryFileContainer()
 {
-    if (_fileMap)
-        unmap();
+    for (int i = 0; i < MAX_MAP_WINDOWS; i++)
+        releaseWindow(_mapWindows[i]);
+
+    if (_fd >= 0)
+        QT_CLOSE(_fd);
 }
 
-//TODO:  Mapping the entire file in will cause problems if the history file becomes exceedingly large,
-//(ie. larger than available memory).  HistoryFile::map() should only map in sections of the file at a time,
-//to avoid this.
-void HistoryFile::map()
+qint64 HistoryFileContainer::allocateExtent()
 {
-    Q_ASSERT(_fileMap == 0);
+    const qint64 offset = _reservedLength;
+    _reservedLength += EXTENT_SIZE;
+    return offset;
+}
 
-    _fileMap = (char*)mmap(0 , _length , PROT_READ , MAP_PRIVATE , _fd , 0);
+bool HistoryFileContainer::write(const char* data, int count, qint64 offset)
+{
+    while (count > 0) {
+        const ssize_t written = pwrite(_fd, data, count, offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            reportError("HistoryFileContainer::write");
+            return false;
+        }
+        data += written;
+        count -= written;
+        offset += written;
+        _writtenLength = qMax(_writtenLength, offset);
+    }
+    return true;
+}
 
-    //if mmap'ing fails, fall back to the read-lseek combination
-    if (_fileMap == MAP_FAILED) {
-        _readWriteBalance = 0;
-        _fileMap = 0;
-        qWarning() << "mmap'ing history failed.  errno = " << errno;
+bool HistoryFileContainer::read(char* data, int count, qint64 offset)
+{
+    while (count > 0) {
+        const ssize_t bytesRead = pread(_fd, data, count, offset);
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+        if (bytesRead <= 0) {
+            reportError("HistoryFileContainer::read");
+            return false;
+        }
+        data += bytesRead;
+        count -= bytesRead;
+        offset += bytesRead;
     }
+    return true;
 }
 
-void HistoryFile::unmap()
+void HistoryFileContainer::reportError(const char* operation)
+{
+    if (_errorReported)
+        return;
+
+    _errorReported = true;
+    perror(operation);
+}
+
+void HistoryFileContainer::releaseWindow(MapWindow& window)
 {
-    int result = munmap(_fileMap , _length);
+    if (!window.data)
+        return;
+
+    int result = munmap(window.data, window.length);
     Q_ASSERT(result == 0);
     Q_UNUSED(result);
 
-    _fileMap = 0;
+    window.data = 0;
+    window.length = 0;
+}
+
+// Only single extents are mapped in at a time, so that exceedingly large
+// history files (ie. larger than available memory or address space) can
+// still be read through mmap.
+const char* HistoryFileContainer::map(qint64 offset, int count)
+{
+    const qint64 extentOffset = offset - (offset % EXTENT_SIZE);
+    Q_ASSERT(offset + count <= extentOffset + EXTENT_SIZE);
+    Q_ASSERT(offset + count <= _writtenLength);
+
+    for (int i = 0; i < MAX_MAP_WINDOWS; i++) {
+        MapWindow& window = _mapWindows[i];
+        if (window.data && window.offset == extentOffset && offset + count <= window.offset + window.length) {
+            window.lastUsed = ++_mapUseCounter;
+            return window.data + (offset - window.offset);
+        }
+    }
+
+    // pick the slot to map the extent into: the same extent (which was
+    // mapped before more data was added), a free slot or the least
+    // recently used extent, in that order.
+    MapWindow* slot = 0;
+    for (int i = 0; i < MAX_MAP_WINDOWS && !slot; i++) {
+        if (_mapWindows[i].data && _mapWindows[i].offset == extentOffset)
+            slot = &_mapWindows[i];
+    }
+    for (int i = 0; i < MAX_MAP_WINDOWS && !slot; i++) {
+        if (!_mapWindows[i].data)
+            slot = &_mapWindows[i];
+    }
+    if (!slot) {
+        slot = &_mapWindows[0];
+        for (int i = 1; i < MAX_MAP_WINDOWS; i++) {
+            if (_mapWindows[i].lastUsed < slot->lastUsed)
+                slot = &_mapWindows[i];
+        }
+    }
+
+    releaseWindow(*slot);
+
+    // pages past the end of the file must not be mapped
+    const qint64 length = qMin(_writtenLength - extentOffset, EXTENT_SIZE);
+    void* data = QT_MMAP(0, length, PROT_READ, MAP_PRIVATE, _fd, extentOffset);
+    if (data == MAP_FAILED) {
+        qWarning() << "mmap'ing history failed.  errno = " << errno;
+        return 0;
+    }
+
+    slot->data = static_cast<char*>(data);
+    slot->offset = extentOffset;
+    slot->length = length;
+    slot->lastUsed = ++_mapUseCounter;
+    return slot->data + (offset - extentOffset);
+}
+
+// History File ///////////////////////////////////////////
+HistoryFile::HistoryFile(HistoryFileContainer* container)
+    : _container(container),
+      _length(0),
+      _flushedLength(0),
+      _flushTimer(this),
+      _lock(0),
+      _writeFailed(false),
+      _dataLost(false),
+      _mapped(false),
+      _readWriteBalance(0)
+{
+    _writeBuffer.reserve(WRITE_BUFFER_SIZE);
+    _flushTimer.setSingleShot(true);
+    _flushTimer.setInterval(FLUSH_DELAY);
+    connect(&_flushTimer, SIGNAL(timeout()), this, SLOT(flush()));
+}
+
+HistoryFile::~HistoryFile()
+{
+}
+
+void HistoryFile::map()
+{
+    Q_ASSERT(!_mapped);
+
+    _mapped = true;
+}
+
+void HistoryFile::unmap()
+{
+    _mapped = false;
 }
 
 bool HistoryFile::isMapped() const
 {
-    return (_fileMap != 0);
+    return _mapped;
 }
 
-void HistoryFile::add(const unsigned char* buffer, int count)
+void HistoryFile::setOwner(QMutex* lock, QThread* thread)
 {
-    if (_fileMap)
-        unmap();
+    _lock = lock;
+    moveToThread(thread);
+}
 
+void HistoryFile::add(const unsigned char* buffer, int count)
+{
     _readWriteBalance++;
 
-    int rc = 0;
+    _writeBuffer.append(reinterpret_cast<const char*>(buffer), count);
+    _length += count;
 
-    rc = QT_LSEEK(_fd, _length, SEEK_SET);
-    if (rc < 0) {
-        perror("HistoryFile::add.seek");
-        return;
+    if (_writeBuffer.size() >= (_writeFailed ? MAX_WRITE_BUFFER_SIZE : WRITE_BUFFER_SIZE))
+        flush();
+    else if (!_flushTimer.isActive())
+        _flushTimer.start();
+}
+
+void HistoryFile::flush()
+{
+    QMutexLocker locker(_lock);
+
+    _flushTimer.stop();
+
+    const char* data = _writeBuffer.constData();
+    int remaining = _writeBuffer.size();
+    while (remaining > 0) {
+        if (_flushedLength / HistoryFileContainer::EXTENT_SIZE == _extents.size())
+            _extents.append(_container->allocateExtent());
+
+        // the part of the buffer which fits into the current extent
+        const int count = qMin<qint64>(remaining, HistoryFileContainer::EXTENT_SIZE
+                                                  - _flushedLength % HistoryFileContainer::EXTENT_SIZE);
+        if (!_container->write(data, count, fileOffset(_flushedLength))) {
+            // keep whatever could not be written, it is retried on the next flush
+            _writeBuffer.remove(0, _writeBuffer.size() - remaining);
+            _writeFailed = true;
+            if (_writeBuffer.size() >= MAX_WRITE_BUFFER_SIZE)
+                dropOldestData(_writeBuffer.size() - MAX_WRITE_BUFFER_SIZE / 2);
+            _flushTimer.start();
+            return;
+        }
+        data += count;
+        remaining -= count;
+        _flushedLength += count;
     }
-    rc = write(_fd, buffer, count);
-    if (rc < 0) {
-        perror("HistoryFile::add.write");
-        return;
+
+    _writeFailed = false;
+    // resize() keeps the reserved capacity, unlike clear()
+    _writeBuffer.resize(0);
+}
+
+void HistoryFile::dropOldestData(int count)
+{
+    _dataLost = true;
+    _writeBuffer.remove(0, count);
+
+    // the extents are still allocated, so that the later data is stored
+    // at the same offsets
+    while (count > 0) {
+        if (_flushedLength / HistoryFileContainer::EXTENT_SIZE == _extents.size())
+            _extents.append(_container->allocateExtent());
+
+        const int extentCount = qMin<qint64>(count, HistoryFileContainer::EXTENT_SIZE
+                                                    - _flushedLength % HistoryFileContainer::EXTENT_SIZE);
+        count -= extentCount;
+        _flushedLength += extentCount;
     }
-    _length += rc;
 }
 
-void HistoryFile::get(unsigned char* buffer, int size, int loc)
+void HistoryFile::get(unsigned char* buffer, int size, qint64 loc)
 {
     //count number of get() calls vs. number of add() calls.
     //If there are many more get() calls compared with add()
     //calls (decided by using MAP_THRESHOLD) then mmap the log
     //file to improve performance.
     _readWriteBalance--;
-    if (!_fileMap && _readWriteBalance < MAP_THRESHOLD)
+    if (!_mapped && _readWriteBalance < MAP_THRESHOLD)
         map();
 
-    if (_fileMap) {
-        for (int i = 0; i < size; i++)
-            buffer[i] = _fileMap[loc + i];
-    } else {
-        int rc = 0;
+    if (loc < 0 || size < 0 || loc + size > _length) {
+        fprintf(stderr, "getHist(...,%d,%lld): invalid args.\n", size, static_cast<long long>(loc));
+        return;
+    }
 
-        if (loc < 0 || size < 0 || loc + size > _length)
-            fprintf(stderr, "getHist(...,%d,%d): invalid args.\n", size, loc);
-        rc = QT_LSEEK(_fd, loc, SEEK_SET);
-        if (rc < 0) {
-            perror("HistoryFile::get.seek");
-            return;
-        }
-        rc = read(_fd, buffer, size);
-        if (rc < 0) {
-            perror("HistoryFile::get.read");
-            return;
+    // the part of the requested data which has not been written yet
+    if (loc + size > _flushedLength) {
+        const qint64 bufferStart = qMax(loc, _flushedLength);
+        const int count = loc + size - bufferStart;
+        memcpy(buffer + (bufferStart - loc), _writeBuffer.constData() + (bufferStart - _flushedLength), count);
+        size -= count;
+    }
+
+    // a read may span several extents
+    while (size > 0) {
+        const int count = qMin<qint64>(size, HistoryFileContainer::EXTENT_SIZE
+                                             - loc % HistoryFileContainer::EXTENT_SIZE);
+        const qint64 offset = fileOffset(loc);
+
+        const char* data = _mapped && !_dataLost ? _container->map(offset, count) : 0;
+        if (data) {
+            memcpy(buffer, data, count);
+        } else {
+            //if mmap'ing fails, fall back to read calls
+            if (_mapped && !_dataLost) {
+                unmap();
+                _readWriteBalance = 0;
+            }
+            if (!_container->read(reinterpret_cast<char*>(buffer), count, offset)) {
+                // the data was dropped or could not be read
+                memset(buffer, 0, size);
+                return;
+            }
         }
+
+        buffer += count;
+        loc += count;
+        size -= count;
     }
 }
 
-int HistoryFile::len() const
+qint64 HistoryFile::len() const
 {
     return _length;
 }
 
 // History Scroll abstract base class //////////////////////////////////////
 
+static QAtomicInt nextScrollSerialNumber;
+
 HistoryScroll::HistoryScroll(HistoryType* t)
     : _historyType(t)
+    , _serialNumber(nextScrollSerialNumber.fetchAndAddRelaxed(1) + 1)
+    , _lock(0)
 {
 }
 
@@ -196,11 +431,22 @@ HistoryScroll::~HistoryScroll()
     delete _historyType;
 }
 
+void HistoryScroll::renewSerialNumber()
+{
+    _serialNumber = nextScrollSerialNumber.fetchAndAddRelaxed(1) + 1;
+}
+
 bool HistoryScroll::hasScroll()
 {
     return true;
 }
 
+void HistoryScroll::setOwner(QMutex* lock, QThread* thread)
+{
+    Q_UNUSED(thread);
+    _lock = lock;
+}
+
 // History Scroll File //////////////////////////////////////
 
 /*
@@ -216,6 +462,9 @@ bool HistoryScroll::hasScroll()
 
 HistoryScrollFile::HistoryScrollFile(const QString& logFileName)
     : HistoryScroll(new HistoryTypeFile(logFileName))
+    , _index(&_container)
+    , _cells(&_container)
+    , _lineflags(&_container)
 {
 }
 
@@ -225,7 +474,7 @@ HistoryScrollFile::~HistoryScrollFile()
 
 int HistoryScrollFile::getLines()
 {
-    return _index.len() / sizeof(int);
+    return _index.len() / sizeof(qint64);
 }
 
 int HistoryScrollFile::getLineLen(int lineno)
@@ -236,22 +485,25 @@ int HistoryScrollFile::getLineLen(int lineno)
 bool HistoryScrollFile::isWrappedLine(int lineno)
 {
     if (lineno >= 0 && lineno <= getLines()) {
+        if (!_lineflags.isMapped())
+            _lineflags.map();
+
         unsigned char flag;
-        _lineflags.get((unsigned char*)&flag, sizeof(unsigned char), (lineno)*sizeof(unsigned char));
+        _lineflags.get((unsigned char*)&flag, sizeof(unsigned char), static_cast<qint64>(lineno) * sizeof(unsigned char));
         return flag;
     }
     return false;
 }
 
-int HistoryScrollFile::startOfLine(int lineno)
+qint64 HistoryScrollFile::startOfLine(int lineno)
 {
     if (lineno <= 0) return 0;
     if (lineno <= getLines()) {
         if (!_index.isMapped())
             _index.map();
 
-        int res;
-        _index.get((unsigned char*)&res, sizeof(int), (lineno - 1)*sizeof(int));
+        qint64 res;
+        _index.get((unsigned char*)&res, sizeof(qint64), static_cast<qint64>(lineno - 1) * sizeof(qint64));
         return res;
     }
     return _cells.len();
@@ -269,15 +521,20 @@ void HistoryScrollFile::addCells(const Character text[], int count)
 
 void HistoryScrollFile::addLine(bool previousWrapped)
 {
-    if (_index.isMapped())
-        _index.unmap();
-
-    int locn = _cells.len();
-    _index.add((unsigned char*)&locn, sizeof(int));
+    qint64 locn = _cells.len();
+    _index.add((unsigned char*)&locn, sizeof(qint64));
     unsigned char flags = previousWrapped ? 0x01 : 0x00;
     _lineflags.add((unsigned char*)&flags, sizeof(unsigned char));
 }
 
+void HistoryScrollFile::setOwner(QMutex* lock, QThread* thread)
+{
+    HistoryScroll::setOwner(lock, thread);
+    _index.setOwner(lock, thread);
+    _cells.setOwner(lock, thread);
+    _lineflags.setOwner(lock, thread);
+}
+
 // History Scroll None //////////////////////////////////////
 
 HistoryScrollNone::HistoryScrollNone()
@@ -343,13 +600,94 @@ void CompactHistoryBlock::deallocate()
     Q_ASSERT(_allocCount >= 0);
 }
 
+void CompactHistoryBlock::release()
+{
+    Q_ASSERT(isCompressed() && !_released);
+
+    // the pages are returned to the system and read as zeroes until they
+    // are written again, the address range stays reserved
+    madvise(_blockStart, _blockLength, MADV_DONTNEED);
+    _released = true;
+}
+
+void CompactHistoryBlock::restore()
+{
+    Q_ASSERT(_released);
+
+    const QByteArray data = qUncompress(_compressed);
+    Q_ASSERT(data.size() == _tail - _blockStart);
+    memcpy(_blockStart, data.constData(), data.size());
+    _released = false;
+}
+
+void CompactHistoryBlock::discardCompressed()
+{
+    if (_released)
+        restore();
+    _compressed.clear();
+    pendingCompression.clear();
+}
+
+namespace
+{
+// compresses a copy of the contents of a CompactHistoryBlock
+class CompactHistoryBlockCompressor : public QRunnable
+{
+public:
+    CompactHistoryBlockCompressor(const QByteArray& contents,
+                                  const QSharedPointer<CompactHistoryBlockCompression>& result)
+        : _contents(contents)
+        , _result(result)
+    {
+    }
+
+    virtual void run() {
+        // compression must not slow down the threads which handle output.
+        // The lowest priority has no effect on Linux, only the idle priority
+        // does.  The thread of the pool is kept, so this is only done once.
+        QThread* thread = QThread::currentThread();
+        if (thread->priority() != QThread::IdlePriority)
+            thread->setPriority(QThread::IdlePriority);
+
+        _result->data = qCompress(_contents, 1);
+        _result->done.storeRelease(1);
+    }
+
+private:
+    QByteArray _contents;
+    QSharedPointer<CompactHistoryBlockCompression> _result;
+};
+
+class CompactHistoryCompressionPool : public QThreadPool
+{
+public:
+    CompactHistoryCompressionPool() {
+        setMaxThreadCount(1);
+        setExpiryTimeout(-1);
+    }
+};
+}
+
+Q_GLOBAL_STATIC(CompactHistoryCompressionPool, compactHistoryCompressionPool)
+
 void* CompactHistoryBlockList::allocate(size_t size)
 {
+    // keep all allocations aligned for the objects which follow byte arrays
+    static const size_t ALIGNMENT = sizeof(void*);
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
     CompactHistoryBlock* block;
     if (list.isEmpty() || list.last()->remaining() < size) {
-        block = new CompactHistoryBlock();
+        if (!spareBlocks.isEmpty()) {
+            block = spareBlocks.takeLast();
+        } else {
+            block = new CompactHistoryBlock();
+            _allocatedSize += block->memoryUsage();
+        }
         list.append(block);
         ////qDebug() << "new block created, remaining " << block->remaining() << "number of blocks=" << list.size();
+
+        compressColdBlocks();
     } else {
         block = list.last();
         ////qDebug() << "old block used, remaining " << block->remaining();
@@ -374,15 +712,216 @@ void CompactHistoryBlockList::deallocate(void* ptr)
 
     if (!block->isInUse()) {
         list.removeAt(i);
-        delete block;
+        forget(block);
+
+        if (spareBlocks.size() < MAX_SPARE_BLOCKS) {
+            const size_t oldUsage = block->memoryUsage();
+            block->reset();
+            _allocatedSize = _allocatedSize - oldUsage + block->memoryUsage();
+            spareBlocks.append(block);
+        } else {
+            _allocatedSize -= block->memoryUsage();
+            delete block;
+        }
         ////qDebug() << "block deleted, new size = " << list.size();
     }
 }
 
+void CompactHistoryBlockList::releaseSpareBlocks()
+{
+    foreach(CompactHistoryBlock* block, spareBlocks) {
+        _allocatedSize -= block->memoryUsage();
+        delete block;
+    }
+    spareBlocks.clear();
+}
+
+void CompactHistoryBlockList::setCompressionEnabled(bool enable)
+{
+    if (enable == _compressionEnabled)
+        return;
+
+    _compressionEnabled = enable;
+    if (enable)
+        compressColdBlocks();
+    else
+        restoreAll();
+}
+
+void CompactHistoryBlockList::compressColdBlocks()
+{
+    collectCompressedBlocks();
+
+    if (!_compressionEnabled)
+        return;
+
+    for (int i = 0; i < list.size() - HOT_BLOCKS; i++) {
+        CompactHistoryBlock* block = list.at(i);
+        if (block->isCompressed() || block->pendingCompression)
+            continue;
+
+        // the compression works on a copy, so the block can still be read
+        // and freed while it runs
+        block->pendingCompression = QSharedPointer<CompactHistoryBlockCompression>(new CompactHistoryBlockCompression());
+        compactHistoryCompressionPool()->start(new CompactHistoryBlockCompressor(block->contents(),
+                                                                                 block->pendingCompression));
+        _compressing.append(block);
+    }
+}
+
+void CompactHistoryBlockList::collectCompressedBlocks()
+{
+    for (int i = 0; i < _compressing.size(); ) {
+        CompactHistoryBlock* block = _compressing.at(i);
+        if (!block->pendingCompression->done.loadAcquire() || _pinned.contains(block)) {
+            i++;
+            continue;
+        }
+
+        _compressing.removeAt(i);
+        block->setCompressed(block->pendingCompression->data);
+        block->pendingCompression.clear();
+        release(block);
+    }
+}
+
+void CompactHistoryBlockList::pinBlock(const void* ptr)
+{
+    if (!ptr)
+        return;
+
+    // the lines which are read are usually close together and recent, so
+    // the search starts at the last block which was used and at the end
+    CompactHistoryBlock* block = 0;
+    if (_lastTouched && _lastTouched->contains(ptr)) {
+        block = _lastTouched;
+    } else {
+        for (int i = list.size() - 1; i >= 0; i--) {
+            if (list.at(i)->contains(ptr)) {
+                block = list.at(i);
+                break;
+            }
+        }
+        if (!block)
+            return;
+        _lastTouched = block;
+    }
+
+    if (!_pinned.contains(block))
+        _pinned.append(block);
+
+    if (block->isReleased()) {
+        restore(block);
+
+        // keep a few decompressed blocks, the ones which were used the
+        // longest time ago are released again unless they are pinned
+        _restoredBlocks.append(block);
+        for (int i = 0; i < _restoredBlocks.size() && _restoredBlocks.size() > MAX_RESTORED_BLOCKS; ) {
+            if (_pinned.contains(_restoredBlocks.at(i)))
+                i++;
+            else
+                release(_restoredBlocks.takeAt(i));
+        }
+    } else if (block->isCompressed()) {
+        const int index = _restoredBlocks.indexOf(block);
+        if (index != -1 && index != _restoredBlocks.size() - 1)
+            _restoredBlocks.move(index, _restoredBlocks.size() - 1);
+    }
+}
+
+void CompactHistoryBlockList::restoreAll()
+{
+    foreach(CompactHistoryBlock* block, list)
+        discardCompressed(block);
+}
+
+void CompactHistoryBlockList::release(CompactHistoryBlock* block)
+{
+    const size_t oldUsage = block->memoryUsage();
+    block->release();
+    _allocatedSize = _allocatedSize - oldUsage + block->memoryUsage();
+    _releasedCount++;
+}
+
+void CompactHistoryBlockList::restore(CompactHistoryBlock* block)
+{
+    const size_t oldUsage = block->memoryUsage();
+    block->restore();
+    _allocatedSize = _allocatedSize - oldUsage + block->memoryUsage();
+    _releasedCount--;
+}
+
+void CompactHistoryBlockList::discardCompressed(CompactHistoryBlock* block)
+{
+    forget(block);
+
+    const size_t oldUsage = block->memoryUsage();
+    block->discardCompressed();
+    _allocatedSize = _allocatedSize - oldUsage + block->memoryUsage();
+}
+
+void CompactHistoryBlockList::forget(CompactHistoryBlock* block)
+{
+    if (block->isReleased())
+        _releasedCount--;
+    _compressing.removeOne(block);
+    _restoredBlocks.removeOne(block);
+    _pinned.removeOne(block);
+    if (_lastTouched == block)
+        _lastTouched = 0;
+}
+
 CompactHistoryBlockList::~CompactHistoryBlockList()
 {
+    // running compressions work on copies and are simply ignored
     qDeleteAll(list.begin(), list.end());
     list.clear();
+    qDeleteAll(spareBlocks.begin(), spareBlocks.end());
+    spareBlocks.clear();
+}
+
+CompactHistoryFormatTable::FormatKey CompactHistoryFormatTable::keyOf(const Character& c)
+{
+    Q_STATIC_ASSERT(sizeof(CharacterColor) == sizeof(quint32));
+
+    quint32 fg;
+    quint32 bg;
+    memcpy(&fg, &c.foregroundColor, sizeof(fg));
+    memcpy(&bg, &c.backgroundColor, sizeof(bg));
+
+    return FormatKey((quint64(fg) << 32) | bg, c.rendition | (c.isRealCharacter ? 0x100 : 0));
+}
+
+int CompactHistoryFormatTable::indexOf(const Character& c)
+{
+    const FormatKey key = keyOf(c);
+
+    QHash<FormatKey, int>::const_iterator iter = _indexes.constFind(key);
+    if (iter != _indexes.constEnd())
+        return iter.value();
+
+    if (_formats.count() == MAX_FORMATS)
+        return -1;
+
+    CharacterFormat format;
+    format.setFormat(c);
+    format.startPos = 0;
+
+    _formats.append(format);
+    _indexes.insert(key, _formats.count() - 1);
+    return _formats.count() - 1;
+}
+
+void CompactHistoryFormatTable::clear()
+{
+    _formats.clear();
+    _indexes.clear();
+}
+
+size_t CompactHistoryFormatTable::allocatedMemory() const
+{
+    return _formats.capacity() * sizeof(CharacterFormat)
+           + _indexes.capacity() * (sizeof(FormatKey) + sizeof(int) + 2 * sizeof(void*));
 }
 
 void* CompactHistoryLine::operator new(size_t size, CompactHistoryBlockList& blockList)
@@ -390,12 +929,14 @@ void* CompactHistoryLine::operator new(size_t size, CompactHistoryBlockList& blo
     return blockList.allocate(size);
 }
 
-CompactHistoryLine::CompactHistoryLine(const TextLine& line, CompactHistoryBlockList& bList)
+CompactHistoryLine::CompactHistoryLine(const TextLine& line, CompactHistoryBlockList& bList, CompactHistoryFormatTable& formats)
     : _blockListRef(bList),
       _formatArray(0),
       _text(0),
       _formatLength(0),
-      _wrapped(false)
+      _wrapped(false),
+      _narrowText(true),
+      _inlineFormats(false)
 {
     _length = line.size();
 
@@ -414,36 +955,53 @@ CompactHistoryLine::CompactHistoryLine(const TextLine& line, CompactHistoryBlock
         }
 
         ////qDebug() << "number of different formats in string: " << _formatLength;
-        _formatArray = (CharacterFormat*) _blockListRef.allocate(sizeof(CharacterFormat) * _formatLength);
+        // if the table of formats is full, even after compacting it (see
+        // CompactHistoryScroll::addCellsVector()), the line keeps its
+        // formats itself
+        _inlineFormats = formats.count() > CompactHistoryFormatTable::MAX_FORMATS - _formatLength;
+        if (_inlineFormats)
+            _formats = (CharacterFormat*) _blockListRef.allocate(sizeof(CharacterFormat) * _formatLength);
+        else
+            _formatArray = (CompactHistoryFormatRun*) _blockListRef.allocate(sizeof(CompactHistoryFormatRun) * _formatLength);
         Q_ASSERT(_formatArray != 0);
-        _text = (quint16*) _blockListRef.allocate(sizeof(quint16) * line.size());
+
+        // most output is ASCII, which only needs one byte per character
+        for (int i = 0; i < _length && _narrowText; i++)
+            _narrowText = line[i].character <= 0xff;
+
+        _text = _blockListRef.allocate((_narrowText ? sizeof(quint8) : sizeof(quint16)) * line.size());
         Q_ASSERT(_text != 0);
 
         _length = line.size();
         _wrapped = false;
 
-        // record formats and their positions in the format array
+        // record formats and their positions in the format array.  Unless
+        // the line keeps its formats itself, the table of formats has room
+        // for all of them
         c = line[0];
-        _formatArray[0].setFormat(c);
-        _formatArray[0].startPos = 0;                      // there's always at least 1 format (for the entire line, unless a change happens)
+        setRun(0, 0, c, formats);                         // there's always at least 1 format (for the entire line, unless a change happens)
 
         k = 1;                                            // look for possible format changes
         int j = 1;
         while (k < _length && j < _formatLength) {
             if (!(line[k].equalsFormat(c))) {
                 c = line[k];
-                _formatArray[j].setFormat(c);
-                _formatArray[j].startPos = k;
-                ////qDebug() << "format entry " << j << " at pos " << _formatArray[j].startPos << " " << &(_formatArray[j].startPos) ;
+                setRun(j, k, c, formats);
+                ////qDebug() << "format entry " << j << " at pos " << runStart(j) << " " << &(_formatArray[j].startPos) ;
                 j++;
             }
             k++;
         }
 
         // copy character values
-        for (int i = 0; i < line.size(); i++) {
-            _text[i] = line[i].character;
-            ////qDebug() << "char " << i << " at mem " << &(text[i]);
+        if (_narrowText) {
+            quint8* text = static_cast<quint8*>(_text);
+            for (int i = 0; i < line.size(); i++)
+                text[i] = line[i].character;
+        } else {
+            quint16* text = static_cast<quint16*>(_text);
+            for (int i = 0; i < line.size(); i++)
+                text[i] = line[i].character;
         }
     }
     ////qDebug() << "line created, length " << length << " at " << &(length);
@@ -458,54 +1016,188 @@ CompactHistoryLine::~CompactHistoryLine()
     _blockListRef.deallocate(this);
 }
 
-void CompactHistoryLine::getCharacter(int index, Character& r)
+void CompactHistoryLine::setRun(int run, int startPos, const Character& c, CompactHistoryFormatTable& formats)
+{
+    if (_inlineFormats) {
+        _formats[run].setFormat(c);
+        _formats[run].startPos = startPos;
+        return;
+    }
+
+    const int formatIndex = formats.indexOf(c);
+    Q_ASSERT(formatIndex >= 0);
+    _formatArray[run].formatIndex = formatIndex;
+    _formatArray[run].startPos = startPos;
+}
+
+int CompactHistoryLine::formatIndexAt(int index) const
+{
+    // binary search for the last format run starting at or before index
+    int low = 0;
+    int high = _formatLength - 1;
+    while (low < high) {
+        const int mid = (low + high + 1) / 2;
+        if (runStart(mid) <= index)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+void CompactHistoryLine::remapFormats(const QVector<int>& mapping)
+{
+    if (_inlineFormats)
+        return;
+
+    for (int i = 0; i < _formatLength; i++)
+        _formatArray[i].formatIndex = mapping[_formatArray[i].formatIndex];
+}
+
+void CompactHistoryLine::countFormats(QVector<int>& uses) const
+{
+    if (_inlineFormats)
+        return;
+
+    for (int i = 0; i < _formatLength; i++)
+        uses[_formatArray[i].formatIndex]++;
+}
+
+void CompactHistoryLine::getCharacter(int index, Character& r, const CompactHistoryFormatTable& formats)
 {
     Q_ASSERT(index < _length);
-    int formatPos = 0;
-    while ((formatPos + 1) < _formatLength && index >= _formatArray[formatPos + 1].startPos)
-        formatPos++;
+    const CharacterFormat& format = runFormat(formatIndexAt(index), formats);
 
-    r.character = _text[index];
-    r.rendition = _formatArray[formatPos].rendition;
-    r.foregroundColor = _formatArray[formatPos].fgColor;
-    r.backgroundColor = _formatArray[formatPos].bgColor;
-    r.isRealCharacter = _formatArray[formatPos].isRealCharacter;
+    r.character = characterAt(index);
+    r.rendition = format.rendition;
+    r.foregroundColor = format.fgColor;
+    r.backgroundColor = format.bgColor;
+    r.isRealCharacter = format.isRealCharacter;
 }
 
-void CompactHistoryLine::getCharacters(Character* array, int size, int startColumn)
+void CompactHistoryLine::getCharacters(Character* array, int size, int startColumn, const CompactHistoryFormatTable& formats)
 {
     Q_ASSERT(startColumn >= 0 && size >= 0);
     Q_ASSERT(startColumn + size <= static_cast<int>(getLength()));
 
-    for (int i = startColumn; i < size + startColumn; i++) {
-        getCharacter(i, array[i - startColumn]);
+    if (size == 0)
+        return;
+
+    // decode the requested span run by run, locating the first run only once
+    int formatPos = formatIndexAt(startColumn);
+    const int endColumn = startColumn + size;
+    int column = startColumn;
+
+    while (column < endColumn) {
+        const CharacterFormat& format = runFormat(formatPos, formats);
+        const int runEnd = (formatPos + 1 < _formatLength) ? qMin(static_cast<int>(runStart(formatPos + 1)), endColumn)
+                                                          : endColumn;
+
+        for (; column < runEnd; column++) {
+            Character& r = array[column - startColumn];
+            r.character = characterAt(column);
+            r.rendition = format.rendition;
+            r.foregroundColor = format.fgColor;
+            r.backgroundColor = format.bgColor;
+            r.isRealCharacter = format.isRealCharacter;
+        }
+        formatPos++;
     }
 }
 
 CompactHistoryScroll::CompactHistoryScroll(unsigned int maxLineCount)
     : HistoryScroll(new CompactHistoryType(maxLineCount))
     , _lines()
+    , _head(0)
     , _blockList()
+    , _droppedLineCount(0)
+    , _linesUntilCompaction(0)
 {
     ////qDebug() << "scroll of length " << maxLineCount << " created";
     setMaxNbLines(maxLineCount);
+
+    // the manager does not exist any more during application shutdown
+    if (HistoryMemoryManager* manager = HistoryMemoryManager::instance())
+        manager->addScroll(this);
 }
 
 CompactHistoryScroll::~CompactHistoryScroll()
 {
-    qDeleteAll(_lines.begin(), _lines.end());
+    // the manager may have been destroyed already during application shutdown
+    if (HistoryMemoryManager* manager = HistoryMemoryManager::instance())
+        manager->removeScroll(this);
+    // the lines are not deleted one by one, which would decompress the
+    // blocks they are in, their memory is freed with the blocks
     _lines.clear();
 }
 
+CompactHistoryLine* CompactHistoryScroll::lineAt(int lineNumber) const
+{
+    int index = _head + lineNumber;
+    if (index >= _lines.size())
+        index -= _lines.size();
+    return _lines[index];
+}
+
+CompactHistoryLine* CompactHistoryScroll::residentLineAt(int lineNumber)
+{
+    // the finished compressions are collected first, so that none of the
+    // blocks of the line is released again while it is used
+    _blockList.beginAccess();
+    CompactHistoryLine* line = lineAt(lineNumber);
+    _blockList.pin(line);
+    line->pin();
+    return line;
+}
+
+// returns the number of runs of characters with the same format in 'line'
+static int formatRunCount(const TextLine& line)
+{
+    int runs = line.isEmpty() ? 0 : 1;
+    for (int i = 1; i < line.size(); i++) {
+        if (!line[i].equalsFormat(line[i - 1]))
+            runs++;
+    }
+    return runs;
+}
+
 void CompactHistoryScroll::addCellsVector(const TextLine& cells)
 {
-    CompactHistoryLine* line;
-    line = new(_blockList) CompactHistoryLine(cells, _blockList);
+    if (_maxLineCount == 0)
+        return;
+
+    const size_t oldMemory = _blockList.allocatedSize();
+
+    // make room for the formats of the new line.  Each compaction visits
+    // all lines, so if most formats are still used afterwards, the table
+    // is only compacted again once many lines have been replaced.  Until
+    // then, the lines whose formats do not fit keep them themselves.
+    const int runs = formatRunCount(cells);
+    if (_formats.count() > CompactHistoryFormatTable::MAX_FORMATS - runs && _linesUntilCompaction == 0) {
+        compactFormats();
+        if (_formats.count() > CompactHistoryFormatTable::MAX_FORMATS / 2)
+            _linesUntilCompaction = _lines.size() / 2;
+    }
+    if (_linesUntilCompaction > 0)
+        _linesUntilCompaction--;
+
+    if (_lines.size() < static_cast<int>(_maxLineCount)) {
+        _lines.append(new(_blockList) CompactHistoryLine(cells, _blockList, _formats));
+    } else {
+        // the history is full, replace the oldest line.  It is released
+        // first so that its memory can be re-used for the new line.
+        delete residentLineAt(0);
+        _lines[_head] = new(_blockList) CompactHistoryLine(cells, _blockList, _formats);
+        _head++;
+        if (_head == _lines.size())
+            _head = 0;
+        _droppedLineCount++;
+    }
 
-    if (_lines.size() > static_cast<int>(_maxLineCount)) {
-        delete _lines.takeAt(0);
+    if (_blockList.allocatedSize() > oldMemory) {
+        if (HistoryMemoryManager* manager = HistoryMemoryManager::instance())
+            manager->scrollGrew(this);
     }
-    _lines.append(line);
 }
 
 void CompactHistoryScroll::addCells(const Character a[], int count)
@@ -517,7 +1209,10 @@ void CompactHistoryScroll::addCells(const Character a[], int count)
 
 void CompactHistoryScroll::addLine(bool previousWrapped)
 {
-    CompactHistoryLine* line = _lines.last();
+    if (_lines.isEmpty())
+        return;
+
+    CompactHistoryLine* line = residentLineAt(_lines.size() - 1);
     ////qDebug() << "last line at address " << line;
     line->setWrapped(previousWrapped);
 }
@@ -534,7 +1229,7 @@ int CompactHistoryScroll::getLineLen(int lineNumber)
         //Q_ASSERT(lineNumber >= 0 && lineNumber < _lines.size());
         return 0;
     }
-    CompactHistoryLine* line = _lines[lineNumber];
+    CompactHistoryLine* line = residentLineAt(lineNumber);
     ////qDebug() << "request for line at address " << line;
     return line->getLength();
 }
@@ -543,26 +1238,1035 @@ void CompactHistoryScroll::getCells(int lineNumber, int startColumn, int count,
 {
     if (count == 0) return;
     Q_ASSERT(lineNumber < _lines.size());
-    CompactHistoryLine* line = _lines[lineNumber];
+    CompactHistoryLine* line = residentLineAt(lineNumber);
     Q_ASSERT(startColumn >= 0);
     Q_ASSERT((unsigned int)startColumn <= line->getLength() - count);
-    line->getCharacters(buffer, count, startColumn);
+    line->getCharacters(buffer, count, startColumn, _formats);
+}
+
+void CompactHistoryScroll::markViewed()
+{
+    if (HistoryMemoryManager* manager = HistoryMemoryManager::instance())
+        manager->scrollViewed(this);
 }
 
 void CompactHistoryScroll::setMaxNbLines(unsigned int lineCount)
 {
     _maxLineCount = lineCount;
+    _blockList.setCompressionEnabled(lineCount >= MIN_LINES_FOR_COMPRESSION);
 
-    while (_lines.size() > static_cast<int>(lineCount)) {
-        delete _lines.takeAt(0);
-    }
+    const int count = _lines.size();
+    if (count > static_cast<int>(lineCount))
+        dropOldestLines(count - lineCount);
+    else
+        unwrapLines();
     ////qDebug() << "set max lines to: " << _maxLineCount;
 }
 
+void CompactHistoryScroll::unwrapLines()
+{
+    if (_head == 0)
+        return;
+
+    HistoryArray lines;
+    lines.reserve(_lines.size());
+    for (int i = 0; i < _lines.size(); i++)
+        lines.append(lineAt(i));
+    _lines = lines;
+    _head = 0;
+}
+
+void CompactHistoryScroll::dropOldestLines(int count)
+{
+    count = qMin(count, _lines.size());
+    if (count <= 0)
+        return;
+
+    for (int i = 0; i < count; i++)
+        delete residentLineAt(i);
+
+    // store the remaining lines in order, so that new lines can be appended again
+    HistoryArray lines;
+    lines.reserve(_lines.size() - count);
+    for (int i = count; i < _lines.size(); i++)
+        lines.append(lineAt(i));
+    _lines = lines;
+    _head = 0;
+    _droppedLineCount += count;
+
+    _blockList.releaseSpareBlocks();
+}
+
+void CompactHistoryScroll::compactFormats()
+{
+    const int oldCount = _formats.count();
+
+    // the formats of all lines are changed, so their compressed copies
+    // become invalid
+    _blockList.restoreAll();
+
+    QVector<int> uses(oldCount, 0);
+    foreach(const CompactHistoryLine* line, _lines)
+        line->countFormats(uses);
+
+    // add the formats which are still used to a new table, in their old order
+    CompactHistoryFormatTable formats;
+    QVector<int> mapping(oldCount, -1);
+    Character c;
+    for (int i = 0; i < oldCount; i++) {
+        if (uses[i] == 0)
+            continue;
+
+        const CharacterFormat& format = _formats.format(i);
+        c.rendition = format.rendition;
+        c.foregroundColor = format.fgColor;
+        c.backgroundColor = format.bgColor;
+        c.isRealCharacter = format.isRealCharacter;
+        mapping[i] = formats.indexOf(c);
+    }
+
+    foreach(CompactHistoryLine* line, _lines)
+        line->remapFormats(mapping);
+
+    _formats = formats;
+
+    _blockList.compressColdBlocks();
+}
+
+size_t CompactHistoryScroll::allocatedMemory() const
+{
+    return _blockList.allocatedSize() + _lines.capacity() * sizeof(CompactHistoryLine*)
+           + _formats.allocatedMemory();
+}
+
 bool CompactHistoryScroll::isWrappedLine(int lineNumber)
 {
     Q_ASSERT(lineNumber < _lines.size());
-    return _lines[lineNumber]->isWrapped();
+    return residentLineAt(lineNumber)->isWrapped();
+}
+
+//////////////////////////////////////////////////////////////////////
+// History Memory Manager
+//////////////////////////////////////////////////////////////////////
+
+Q_GLOBAL_STATIC(HistoryMemoryManager, theHistoryMemoryManager)
+HistoryMemoryManager* HistoryMemoryManager::instance()
+{
+    return theHistoryMemoryManager;
+}
+
+HistoryMemoryManager::HistoryMemoryManager()
+    : _budget(0),
+      _viewCounter(0),
+      _enforcing(false)
+{
+}
+
+void HistoryMemoryManager::setBudget(qint64 bytes)
+{
+    QMutexLocker locker(&_mutex);
+    _budget = qMax(Q_INT64_C(0), bytes);
+    enforceBudget();
+}
+
+qint64 HistoryMemoryManager::budget() const
+{
+    QMutexLocker locker(&_mutex);
+    return _budget;
+}
+
+qint64 HistoryMemoryManager::currentMemory(CompactHistoryScroll* scroll, const ScrollInfo& info)
+{
+    // waiting for the lock of another scroll could deadlock with the
+    // thread which holds it, if that thread is adding lines too.  The
+    // lock of the scroll which grew is held by this thread already.
+    QMutex* lock = scroll->lock();
+    if (lock && !lock->tryLock())
+        return info.memory;
+
+    const qint64 memory = scroll->allocatedMemory();
+    if (lock)
+        lock->unlock();
+    return memory;
+}
+
+qint64 HistoryMemoryManager::usage() const
+{
+    QMutexLocker locker(&_mutex);
+    qint64 total = 0;
+    QHashIterator<CompactHistoryScroll*, ScrollInfo> iter(_scrolls);
+    while (iter.hasNext()) {
+        iter.next();
+        total += currentMemory(iter.key(), iter.value());
+    }
+    return total;
+}
+
+void HistoryMemoryManager::addScroll(CompactHistoryScroll* scroll)
+{
+    QMutexLocker locker(&_mutex);
+    // a new history is not the first one to lose lines
+    ScrollInfo info;
+    info.lastViewed = ++_viewCounter;
+    info.memory = 0;
+    _scrolls.insert(scroll, info);
+}
+
+void HistoryMemoryManager::removeScroll(CompactHistoryScroll* scroll)
+{
+    QMutexLocker locker(&_mutex);
+    _scrolls.remove(scroll);
+}
+
+void HistoryMemoryManager::scrollGrew(CompactHistoryScroll* scroll)
+{
+    QMutexLocker locker(&_mutex);
+    QHash<CompactHistoryScroll*, ScrollInfo>::iterator iter = _scrolls.find(scroll);
+    if (iter != _scrolls.end())
+        iter->memory = scroll->allocatedMemory();
+    enforceBudget();
+}
+
+void HistoryMemoryManager::scrollViewed(CompactHistoryScroll* scroll)
+{
+    QMutexLocker locker(&_mutex);
+    QHash<CompactHistoryScroll*, ScrollInfo>::iterator iter = _scrolls.find(scroll);
+    if (iter != _scrolls.end())
+        iter->lastViewed = ++_viewCounter;
+}
+
+void HistoryMemoryManager::enforceBudget()
+{
+    if (_budget == 0 || _enforcing)
+        return;
+
+    // the memory of the scrolls is only read with their locks held, the
+    // others count with what they used last
+    qint64 total = 0;
+    QMap<quint64, CompactHistoryScroll*> candidates;
+    for (QHash<CompactHistoryScroll*, ScrollInfo>::iterator iter = _scrolls.begin(); iter != _scrolls.end(); ++iter) {
+        iter->memory = currentMemory(iter.key(), iter.value());
+        total += iter->memory;
+        candidates.insert(iter->lastViewed, iter.key());
+    }
+    if (total <= _budget)
+        return;
+
+    _enforcing = true;
+
+    // the least recently viewed scrolls come first
+    foreach(CompactHistoryScroll* scroll, candidates) {
+        QMutex* lock = scroll->lock();
+        if (lock && !lock->tryLock())
+            continue;
+
+        // drop lines in steps, since memory is only returned once
+        // all the lines in a block have been dropped
+        ScrollInfo& info = _scrolls[scroll];
+        total += qint64(scroll->allocatedMemory()) - info.memory;
+        info.memory = scroll->allocatedMemory();
+        while (total > _budget && scroll->getLines() > 0) {
+            const qint64 before = info.memory;
+            scroll->dropOldestLines(qMax(1, scroll->getLines() / 8));
+            info.memory = scroll->allocatedMemory();
+            total -= before - info.memory;
+        }
+
+        if (lock)
+            lock->unlock();
+
+        if (total <= _budget)
+            break;
+    }
+
+    _enforcing = false;
+}
+
+////////////////////////////////////////////////////////////////
+// Compressed History Scroll File //////////////////////////////
+////////////////////////////////////////////////////////////////
+
+/*
+   Serialized chunk layout (all values in host byte order, the history
+   file is private to this process):
+
+     quint32 lineCount, textLength, formatCount
+     quint32 lineTextStart[lineCount + 1]
+     quint32 lineFormatStart[lineCount + 1]
+     quint8  lineFlags[lineCount]
+     quint16 text[textLength]
+     CharacterFormat formats[formatCount]
+
+   The serialized chunk is passed through qCompress() before it is
+   written to the history file.
+*/
+
+CompressedHistoryChunk::CompressedHistoryChunk()
+{
+    clear();
+}
+
+void CompressedHistoryChunk::clear()
+{
+    _text.clear();
+    _formats.clear();
+    _lineTextStart.clear();
+    _lineFormatStart.clear();
+    _lineFlags.clear();
+
+    _lineTextStart.append(0);
+    _lineFormatStart.append(0);
+}
+
+int CompressedHistoryChunk::lineLength(int line) const
+{
+    Q_ASSERT(line >= 0 && line < lineCount());
+    return _lineTextStart[line + 1] - _lineTextStart[line];
+}
+
+bool CompressedHistoryChunk::isWrappedLine(int line) const
+{
+    Q_ASSERT(line >= 0 && line < lineCount());
+    return _lineFlags[line] & LINE_WRAPPED;
+}
+
+void CompressedHistoryChunk::appendCells(const Character cells[], int count)
+{
+    const int lineStart = _lineTextStart.last();
+    const int lineFormatStart = _lineFormatStart.last();
+
+    for (int i = 0; i < count; i++) {
+        const Character& c = cells[i];
+        const bool startsNewRun = (_formats.size() == lineFormatStart)
+                                  || _formats.last().rendition != c.rendition
+                                  || _formats.last().fgColor != c.foregroundColor
+                                  || _formats.last().bgColor != c.backgroundColor
+                                  || _formats.last().isRealCharacter != c.isRealCharacter;
+        if (startsNewRun) {
+            CharacterFormat format;
+            format.setFormat(c);
+            format.startPos = _text.size() - lineStart;
+            _formats.append(format);
+        }
+        _text.append(c.character);
+    }
+}
+
+void CompressedHistoryChunk::closeLine(bool wrapped)
+{
+    _lineFlags.append(wrapped ? LINE_WRAPPED : LINE_DEFAULT);
+    _lineTextStart.append(_text.size());
+    _lineFormatStart.append(_formats.size());
+}
+
+void CompressedHistoryChunk::getCells(int line, int column, int count, Character res[]) const
+{
+    Q_ASSERT(column >= 0 && count >= 0);
+    Q_ASSERT(column + count <= lineLength(line));
+
+    if (count == 0)
+        return;
+
+    const quint16* text = _text.constData() + _lineTextStart[line];
+    const CharacterFormat* formats = _formats.constData() + _lineFormatStart[line];
+    const int formatCount = _lineFormatStart[line + 1] - _lineFormatStart[line];
+
+    // find the run which covers the first requested column
+    int low = 0;
+    int high = formatCount - 1;
+    while (low < high) {
+        const int mid = (low + high + 1) / 2;
+        if (formats[mid].startPos <= column)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    const int startColumn = column;
+    const int endColumn = column + count;
+    for (int formatPos = low; column < endColumn; formatPos++) {
+        const CharacterFormat& format = formats[formatPos];
+        const int runEnd = (formatPos + 1 < formatCount) ? qMin(static_cast<int>(formats[formatPos + 1].startPos), endColumn)
+                                                        : endColumn;
+        for (; column < runEnd; column++) {
+            Character& r = res[column - startColumn];
+            r.character = text[column];
+            r.rendition = format.rendition;
+            r.foregroundColor = format.fgColor;
+            r.backgroundColor = format.bgColor;
+            r.isRealCharacter = format.isRealCharacter;
+        }
+    }
+}
+
+QByteArray CompressedHistoryChunk::serialize() const
+{
+    Q_ASSERT(_lineTextStart.last() == static_cast<quint32>(_text.size()));
+
+    const quint32 header[3] = { static_cast<quint32>(lineCount()),
+                                static_cast<quint32>(_text.size()),
+                                static_cast<quint32>(_formats.size())
+                              };
+
+    QByteArray data;
+    data.reserve(sizeof(header)
+                 + 2 * _lineTextStart.size() * sizeof(quint32)
+                 + _lineFlags.size() * sizeof(quint8)
+                 + _text.size() * sizeof(quint16)
+                 + _formats.size() * sizeof(CharacterFormat));
+
+    data.append(reinterpret_cast<const char*>(header), sizeof(header));
+    data.append(reinterpret_cast<const char*>(_lineTextStart.constData()), _lineTextStart.size() * sizeof(quint32));
+    data.append(reinterpret_cast<const char*>(_lineFormatStart.constData()), _lineFormatStart.size() * sizeof(quint32));
+    data.append(reinterpret_cast<const char*>(_lineFlags.constData()), _lineFlags.size() * sizeof(quint8));
+    data.append(reinterpret_cast<const char*>(_text.constData()), _text.size() * sizeof(quint16));
+    data.append(reinterpret_cast<const char*>(_formats.constData()), _formats.size() * sizeof(CharacterFormat));
+
+    return data;
+}
+
+bool CompressedHistoryChunk::deserialize(const QByteArray& data)
+{
+    quint32 header[3];
+    if (data.size() < static_cast<int>(sizeof(header)))
+        return false;
+    memcpy(header, data.constData(), sizeof(header));
+
+    const int lines = header[0];
+    const int textLength = header[1];
+    const int formatCount = header[2];
+
+    const int expectedSize = sizeof(header)
+                             + 2 * (lines + 1) * sizeof(quint32)
+                             + lines * sizeof(quint8)
+                             + textLength * sizeof(quint16)
+                             + formatCount * sizeof(CharacterFormat);
+    if (data.size() != expectedSize)
+        return false;
+
+    _lineTextStart.resize(lines + 1);
+    _lineFormatStart.resize(lines + 1);
+    _lineFlags.resize(lines);
+    _text.resize(textLength);
+    _formats.resize(formatCount);
+
+    const char* pos = data.constData() + sizeof(header);
+    memcpy(_lineTextStart.data(), pos, (lines + 1) * sizeof(quint32));
+    pos += (lines + 1) * sizeof(quint32);
+    memcpy(_lineFormatStart.data(), pos, (lines + 1) * sizeof(quint32));
+    pos += (lines + 1) * sizeof(quint32);
+    memcpy(_lineFlags.data(), pos, lines * sizeof(quint8));
+    pos += lines * sizeof(quint8);
+    memcpy(_text.data(), pos, textLength * sizeof(quint16));
+    pos += textLength * sizeof(quint16);
+    memcpy(_formats.data(), pos, formatCount * sizeof(CharacterFormat));
+
+    return true;
+}
+
+CompressedHistoryScrollFile::CompressedHistoryScrollFile(const QString& logFileName)
+    : HistoryScroll(new HistoryTypeFile(logFileName)),
+      _chunkData(&_container),
+      _cachedChunkIndex(-1),
+      _lineCount(0)
+{
+}
+
+CompressedHistoryScrollFile::~CompressedHistoryScrollFile()
+{
+}
+
+void CompressedHistoryScrollFile::setOwner(QMutex* lock, QThread* thread)
+{
+    HistoryScroll::setOwner(lock, thread);
+    _chunkData.setOwner(lock, thread);
+}
+
+int CompressedHistoryScrollFile::getLines()
+{
+    return _lineCount;
+}
+
+const CompressedHistoryChunk* CompressedHistoryScrollFile::chunkForLine(int lineno)
+{
+    const int chunkIndex = lineno / LINES_PER_CHUNK;
+
+    // lines which have not been compressed yet
+    if (chunkIndex >= _chunkIndex.size())
+        return &_pendingChunk;
+
+    if (chunkIndex != _cachedChunkIndex) {
+        const ChunkLocation& location = _chunkIndex[chunkIndex];
+        QByteArray compressed(location.size, Qt::Uninitialized);
+        _chunkData.get(reinterpret_cast<unsigned char*>(compressed.data()), location.size, location.offset);
+
+        if (!_cachedChunk.deserialize(qUncompress(compressed))) {
+            qWarning() << "Corrupt history chunk" << chunkIndex;
+            _cachedChunk.clear();
+            _cachedChunkIndex = -1;
+            return 0;
+        }
+        _cachedChunkIndex = chunkIndex;
+    }
+    return &_cachedChunk;
+}
+
+int CompressedHistoryScrollFile::getLineLen(int lineno)
+{
+    if (lineno < 0 || lineno >= _lineCount)
+        return 0;
+
+    const CompressedHistoryChunk* chunk = chunkForLine(lineno);
+    return chunk ? chunk->lineLength(lineno % LINES_PER_CHUNK) : 0;
+}
+
+bool CompressedHistoryScrollFile::isWrappedLine(int lineno)
+{
+    if (lineno < 0 || lineno >= _lineCount)
+        return false;
+
+    const CompressedHistoryChunk* chunk = chunkForLine(lineno);
+    return chunk ? chunk->isWrappedLine(lineno % LINES_PER_CHUNK) : false;
+}
+
+void CompressedHistoryScrollFile::getCells(int lineno, int colno, int count, Character res[])
+{
+    if (count == 0)
+        return;
+    Q_ASSERT(lineno >= 0 && lineno < _lineCount);
+
+    const CompressedHistoryChunk* chunk = chunkForLine(lineno);
+    if (chunk) {
+        chunk->getCells(lineno % LINES_PER_CHUNK, colno, count, res);
+    } else {
+        for (int i = 0; i < count; i++)
+            res[i] = Character();
+    }
+}
+
+void CompressedHistoryScrollFile::addCells(const Character text[], int count)
+{
+    _pendingChunk.appendCells(text, count);
+}
+
+void CompressedHistoryScrollFile::addLine(bool previousWrapped)
+{
+    _pendingChunk.closeLine(previousWrapped);
+    _lineCount++;
+
+    if (_pendingChunk.lineCount() == LINES_PER_CHUNK)
+        flushPendingChunk();
+}
+
+void CompressedHistoryScrollFile::flushPendingChunk()
+{
+    // favour speed over size, chunks are written while output is scrolling
+    const QByteArray compressed = qCompress(_pendingChunk.serialize(), 1);
+
+    ChunkLocation location;
+    location.offset = _chunkData.len();
+    location.size = compressed.size();
+
+    _chunkData.add(reinterpret_cast<const unsigned char*>(compressed.constData()), compressed.size());
+    _chunkIndex.append(location);
+
+    _pendingChunk.clear();
+}
+
+////////////////////////////////////////////////////////////////
+// Migrating History Scroll ////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+// the time to wait before lines are wrapped again, so that the lines are
+// only wrapped once while a window is being resized
+static const int REFLOW_DELAY = 250; // milliseconds
+
+void ReflowedLines::add(qint64 firstLine, int oldCount, int newCount)
+{
+    if (oldCount == 0 && newCount == 0)
+        return;
+
+    Range range;
+    range.firstLine = firstLine;
+    range.oldCount = oldCount;
+    range.newCount = newCount;
+    ranges << range;
+}
+
+void ReflowedLines::add(const ReflowedLines& lines)
+{
+    ranges << lines.ranges;
+    droppedCount += lines.droppedCount;
+}
+
+qint64 ReflowedLines::map(qint64 line) const
+{
+    foreach(const Range& range, ranges) {
+        if (line >= range.firstLine + range.oldCount)
+            line += range.newCount - range.oldCount;
+        else if (line >= range.firstLine)
+            line = range.firstLine;
+    }
+    return line;
+}
+
+MigratingHistoryScroll::MigratingHistoryScroll(HistoryType* type, HistoryScroll* from, HistoryScroll* to, int lineCount,
+                                               int columns)
+    : HistoryScroll(type)
+    , _from(from)
+    , _to(to)
+    , _startLine(from->getLines() - lineCount)
+    , _nextLine(_startLine)
+    , _endLine(from->getLines())
+    , _columns(columns)
+    , _pendingSize(0)
+    , _initialDroppedLineCount(to->droppedLineCount())
+    , _migrateTimer(this)
+{
+    Q_ASSERT(lineCount >= 0 && lineCount <= from->getLines());
+
+    keepOldLines(from);
+
+    _migrateTimer.setInterval(columns > 0 ? REFLOW_DELAY : 0);
+    connect(&_migrateTimer, SIGNAL(timeout()), this, SLOT(migrateLines()));
+    _migrateTimer.start();
+}
+
+MigratingHistoryScroll::~MigratingHistoryScroll()
+{
+    delete _from;
+    delete _to;
+}
+
+void MigratingHistoryScroll::keepOldLines(HistoryScroll* scroll)
+{
+    if (CompactHistoryScroll* compact = dynamic_cast<CompactHistoryScroll*>(scroll)) {
+        if (HistoryMemoryManager* manager = HistoryMemoryManager::instance())
+            manager->removeScroll(compact);
+        return;
+    }
+
+    // a conversion which has been stopped, see unwrap()
+    if (MigratingHistoryScroll* migrating = dynamic_cast<MigratingHistoryScroll*>(scroll)) {
+        if (migrating->_from)
+            keepOldLines(migrating->_from);
+        keepOldLines(migrating->_to);
+    }
+}
+
+HistoryScroll* MigratingHistoryScroll::unwrap(HistoryScroll* scroll)
+{
+    MigratingHistoryScroll* migrating = dynamic_cast<MigratingHistoryScroll*>(scroll);
+    if (!migrating)
+        return scroll;
+
+    // the lines are copied from where they are at the moment, which must
+    // not change any more
+    if (!migrating->isFinished()) {
+        migrating->_migrateTimer.stop();
+        return migrating;
+    }
+
+    HistoryScroll* to = migrating->_to;
+    migrating->_to = 0;
+    delete migrating;
+
+    return to;
+}
+
+HistoryScroll* MigratingHistoryScroll::reflow(HistoryScroll* scroll, int columns)
+{
+    MigratingHistoryScroll* migrating = dynamic_cast<MigratingHistoryScroll*>(scroll);
+    if (migrating && !migrating->isFinished() && migrating->_columns > 0) {
+        // start again from the old lines, instead of wrapping the lines
+        // which are being wrapped.  The lines which have been wrapped
+        // already are replaced by the old lines again.
+        const qint64 droppedLineCount = migrating->droppedLineCount();
+        migrating->_reflowedLines.add(droppedLineCount, migrating->_to->getLines(),
+                                      migrating->_nextLine - migrating->_startLine);
+
+        delete migrating->_to;
+        migrating->_to = migrating->getType().scroll(0);
+        migrating->_nextLine = migrating->_startLine;
+        migrating->_columns = columns;
+        // the lines keep their positions, see droppedLineCount()
+        migrating->_initialDroppedLineCount = migrating->_to->droppedLineCount() - droppedLineCount;
+        migrating->renewSerialNumber();
+        migrating->_migrateTimer.start(REFLOW_DELAY);
+        return migrating;
+    }
+
+    if (!scroll->hasScroll() || scroll->getLines() == 0)
+        return scroll;
+
+    scroll = unwrap(scroll);
+
+    // the new history has the same type as the old one
+    const HistoryType& type = scroll->getType();
+    HistoryType* newType;
+    if (type.isUnlimited())
+        newType = new HistoryTypeFile();
+    else
+        newType = new CompactHistoryType(type.maximumLineCount());
+
+    return new MigratingHistoryScroll(newType, scroll, newType->scroll(0), scroll->getLines(), columns);
+}
+
+void MigratingHistoryScroll::migrateLines()
+{
+    // copy lines in batches until the time slice is used up, so that
+    // output and input are not held up
+    static const int LINES_PER_BATCH = 256;
+    static const int TIME_SLICE = 5; // milliseconds
+
+    {
+        QMutexLocker locker(lock());
+
+        // the first step may have been delayed, see reflow()
+        _migrateTimer.setInterval(0);
+
+        QElapsedTimer timer;
+        timer.start();
+
+        while (!isFinished() && timer.elapsed() < TIME_SLICE)
+            copyLines(LINES_PER_BATCH);
+    }
+
+    emit linesMigrated();
+}
+
+ReflowedLines MigratingHistoryScroll::takeReflowedLines()
+{
+    const ReflowedLines lines = _reflowedLines;
+    _reflowedLines = ReflowedLines();
+    return lines;
+}
+
+void MigratingHistoryScroll::finish()
+{
+    while (!isFinished())
+        copyLines(qMax(_endLine - _nextLine, _pendingLines.count()));
+}
+
+void MigratingHistoryScroll::copyLines(int count)
+{
+    const qint64 firstLine = droppedLineCount() + _to->getLines();
+    const qint64 droppedLines = droppedLineCount();
+    const int oldLines = getLines();
+    int oldCount = 0;
+
+    const int endLine = qMin(_endLine, _nextLine + count);
+    while (_nextLine < endLine) {
+        if (_columns > 0) {
+            const int nextLine = _nextLine;
+            reflowLine();
+            oldCount += _nextLine - nextLine;
+            continue;
+        }
+
+        const int length = _from->getLineLen(_nextLine);
+        _cells.resize(length);
+        _from->getCells(_nextLine, 0, length, _cells.data());
+        _to->addCells(_cells.constData(), length);
+        _to->addLine(_from->isWrappedLine(_nextLine));
+        _nextLine++;
+    }
+
+    // all old lines are copied, the new lines follow them
+    if (_nextLine == _endLine) {
+        for (int i = 0; i < count && !_pendingLines.isEmpty(); i++) {
+            _pendingSize -= _pendingLines.first().count();
+            _to->addCellsVector(_pendingLines.takeFirst());
+            _to->addLine(_pendingLineWrapped.takeFirst());
+        }
+    }
+
+    if (_columns > 0) {
+        const int droppedCount = int(droppedLineCount() - droppedLines);
+        _reflowedLines.add(firstLine, oldCount, getLines() - oldLines + oldCount + droppedCount);
+        _reflowedLines.droppedCount += droppedCount;
+    }
+
+    if (_nextLine < _endLine || !_pendingLines.isEmpty())
+        return;
+
+    _migrateTimer.stop();
+    delete _from;
+    _from = 0;
+    _cells.clear();
+
+    // the lines which were read before may have been wrapped differently
+    if (_columns > 0)
+        renewSerialNumber();
+}
+
+void MigratingHistoryScroll::reflowLine()
+{
+    _cells.resize(0);
+    bool wrapped = true;
+    while (wrapped && _nextLine < _endLine) {
+        const int start = _cells.count();
+        const int length = _from->getLineLen(_nextLine);
+        _cells.resize(start + length);
+        _from->getCells(_nextLine, 0, length, _cells.data() + start);
+        wrapped = _from->isWrappedLine(_nextLine);
+        _nextLine++;
+    }
+
+    // the last part keeps the wrapped flag of the last old line, which
+    // may be wrapped into the first line of the screen
+    int pos = 0;
+    do {
+        const int length = Screen::wrappedLength(_cells.constData() + pos, _cells.count() - pos, _columns);
+        _to->addCells(_cells.constData() + pos, length);
+        pos += length;
+        _to->addLine(pos < _cells.count() || wrapped);
+    } while (pos < _cells.count());
+}
+
+int MigratingHistoryScroll::getLines()
+{
+    return _to->getLines() + (_endLine - _nextLine) + _pendingLines.count();
+}
+
+int MigratingHistoryScroll::getLineLen(int lineno)
+{
+    if (lineno < _to->getLines())
+        return _to->getLineLen(lineno);
+    lineno -= _to->getLines();
+
+    if (lineno < _endLine - _nextLine)
+        return _from->getLineLen(_nextLine + lineno);
+    lineno -= _endLine - _nextLine;
+
+    return _pendingLines.value(lineno).count();
+}
+
+void MigratingHistoryScroll::getCells(int lineno, int colno, int count, Character res[])
+{
+    if (lineno < _to->getLines()) {
+        _to->getCells(lineno, colno, count, res);
+        return;
+    }
+    lineno -= _to->getLines();
+
+    if (lineno < _endLine - _nextLine) {
+        _from->getCells(_nextLine + lineno, colno, count, res);
+        return;
+    }
+    lineno -= _endLine - _nextLine;
+
+    Q_ASSERT(lineno < _pendingLines.count());
+    Q_ASSERT(colno + count <= _pendingLines[lineno].count());
+    memcpy(res, _pendingLines[lineno].constData() + colno, count * sizeof(Character));
+}
+
+bool MigratingHistoryScroll::isWrappedLine(int lineno)
+{
+    if (lineno < _to->getLines())
+        return _to->isWrappedLine(lineno);
+    lineno -= _to->getLines();
+
+    if (lineno < _endLine - _nextLine)
+        return _from->isWrappedLine(_nextLine + lineno);
+    lineno -= _endLine - _nextLine;
+
+    return _pendingLineWrapped.value(lineno);
+}
+
+void MigratingHistoryScroll::addCells(const Character a[], int count)
+{
+    if (isFinished()) {
+        _to->addCells(a, count);
+        return;
+    }
+
+    // the memory which the lines which are kept aside may use, if the new
+    // history has no limit
+    static const int MAX_PENDING_SIZE = 16 * 1024 * 1024; // bytes
+
+    QVector<Character> line(count);
+    memcpy(line.data(), a, count * sizeof(Character));
+    _pendingLines << line;
+    _pendingLineWrapped << false;
+    _pendingSize += count;
+
+    // if the new history has no limit, none of the lines can be dropped,
+    // so the remaining old lines are copied at once to make room
+    const int maxLineCount = getType().maximumLineCount();
+    if (maxLineCount >= 0 && _pendingLines.count() > maxLineCount)
+        dropOldLines();
+    else if (maxLineCount < 0 && _pendingSize * sizeof(Character) > size_t(MAX_PENDING_SIZE))
+        finish();
+}
+
+void MigratingHistoryScroll::dropOldLines()
+{
+    const int maxLineCount = getType().maximumLineCount();
+    const qint64 droppedLines = droppedLineCount();
+
+    // the lines which are kept aside are all that remains, the new history
+    // is empty and there are no old lines to copy any more
+    int dropCount = _pendingLines.count() - maxLineCount;
+    if (_nextLine < _endLine || _to->getLines() > 0) {
+        dropCount += _to->getLines() + (_endLine - _nextLine);
+        _startLine = _endLine;
+        _nextLine = _endLine;
+        delete _to;
+        _to = getType().scroll(0);
+        _to->setOwner(lock(), thread());
+    }
+
+    while (_pendingLines.count() > maxLineCount) {
+        _pendingSize -= _pendingLines.first().count();
+        _pendingLines.removeFirst();
+        _pendingLineWrapped.removeFirst();
+    }
+
+    // the remaining lines keep their positions, see droppedLineCount()
+    _initialDroppedLineCount = _to->droppedLineCount() - (droppedLines + dropCount);
+}
+
+void MigratingHistoryScroll::addLine(bool previousWrapped)
+{
+    if (isFinished()) {
+        _to->addLine(previousWrapped);
+        return;
+    }
+
+    if (!_pendingLineWrapped.isEmpty())
+        _pendingLineWrapped.last() = previousWrapped;
+}
+
+size_t MigratingHistoryScroll::allocatedMemory() const
+{
+    size_t memory = _to->allocatedMemory();
+    if (_from)
+        memory += _from->allocatedMemory();
+    foreach(const QVector<Character>& line, _pendingLines)
+        memory += line.capacity() * sizeof(Character);
+    return memory;
+}
+
+void MigratingHistoryScroll::markViewed()
+{
+    _to->markViewed();
+}
+
+qint64 MigratingHistoryScroll::droppedLineCount() const
+{
+    // the lines before the first copied line are not part of this history
+    return _to->droppedLineCount() - _initialDroppedLineCount;
+}
+
+void MigratingHistoryScroll::setOwner(QMutex* lock, QThread* thread)
+{
+    HistoryScroll::setOwner(lock, thread);
+    moveToThread(thread);
+
+    if (_from)
+        _from->setOwner(lock, thread);
+    if (_to)
+        _to->setOwner(lock, thread);
+}
+
+////////////////////////////////////////////////////////////////
+// Output snapshot
+////////////////////////////////////////////////////////////////
+
+OutputSnapshot::OutputSnapshot()
+    : _historySerialNumber(0)
+    , _firstHistoryLine(0)
+    , _historyLines(0)
+    , _chunkStart(0)
+{
+}
+
+OutputSnapshot::OutputSnapshot(const QSharedPointer<OutputSnapshotSource>& source, HistoryScroll* history)
+    : _source(source)
+    , _historySerialNumber(history->serialNumber())
+    , _firstHistoryLine(history->droppedLineCount())
+    , _historyLines(history->getLines())
+    , _chunkStart(0)
+{
+}
+
+void OutputSnapshot::appendScreenLine(const QVector<Character>& cells, bool wrapped)
+{
+    _screenLines << cells;
+    _screenLineWrapped << wrapped;
+}
+
+void OutputSnapshot::readChunk(int line)
+{
+    _chunkStart = line - line % LINES_PER_CHUNK;
+    const int count = qMin(LINES_PER_CHUNK, _historyLines - _chunkStart);
+
+    _chunkLines.resize(count);
+    for (int i = 0; i < count; i++)
+        _chunkLines[i].clear();
+    _chunkLineWrapped.fill(false, count);
+
+    if (!_source)
+        return;
+
+    QMutexLocker sourceLocker(&_source->mutex);
+    if (!_source->emulation)
+        return;
+
+    // the lock is only held while one chunk is read, so that the output
+    // is not held up for long
+    OutputLocker locker(_source->emulation->outputLock());
+    HistoryScroll* history = _source->emulation->historyScroll();
+    if (history->serialNumber() != _historySerialNumber)
+        return;
+
+    const qint64 firstLine = _firstHistoryLine + _chunkStart - history->droppedLineCount();
+    for (int i = 0; i < count; i++) {
+        const qint64 historyLine = firstLine + i;
+        if (historyLine < 0 || historyLine >= history->getLines())
+            continue;
+
+        QVector<Character>& cells = _chunkLines[i];
+        const int length = history->getLineLen(historyLine);
+        cells.resize(length);
+        history->getCells(historyLine, 0, length, cells.data());
+        // the snapshot may be read after the characters have been removed
+        // from the ExtendedCharTable
+        Screen::resolveExtendedChars(cells.data(), length);
+        _chunkLineWrapped[i] = history->isWrappedLine(historyLine);
+    }
+}
+
+void OutputSnapshot::getLine(int line, QVector<Character>& cells, bool& wrapped)
+{
+    Q_ASSERT(line >= 0 && line < lineCount());
+
+    if (line < _historyLines) {
+        if (line < _chunkStart || line >= _chunkStart + _chunkLines.count())
+            readChunk(line);
+        cells = _chunkLines[line - _chunkStart];
+        wrapped = _chunkLineWrapped[line - _chunkStart];
+    } else {
+        cells = _screenLines[line - _historyLines];
+        wrapped = _screenLineWrapped[line - _historyLines];
+    }
+}
+
+void OutputSnapshot::writeToStream(TerminalCharacterDecoder* decoder, int startLine, int endLine)
+{
+    QVector<Character> cells;
+
+    const int lastLine = qMin(endLine, lineCount() - 1);
+    for (int line = startLine; line <= lastLine; line++) {
+        bool wrapped = false;
+        getLine(line, cells, wrapped);
+
+        if (line != endLine && !wrapped)
+            cells << Character('\n');
+
+        decoder->decodeLine(cells.constData(), cells.count(), wrapped ? LINE_WRAPPED : LINE_DEFAULT);
+    }
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -613,26 +2317,21 @@ bool HistoryTypeFile::isEnabled() const
 
 HistoryScroll* HistoryTypeFile::scroll(HistoryScroll* old) const
 {
-    if (dynamic_cast<HistoryFile *>(old))
+    old = MigratingHistoryScroll::unwrap(old);
+
+    if (dynamic_cast<HistoryScrollFile*>(old) || dynamic_cast<CompressedHistoryScrollFile*>(old))
         return old; // Unchanged.
 
-    HistoryScroll* newScroll = new HistoryScrollFile(_fileName);
-
-    Character line[LINE_SIZE];
-    int lines = (old != 0) ? old->getLines() : 0;
-    for (int i = 0; i < lines; i++) {
-        int size = old->getLineLen(i);
-        if (size > LINE_SIZE) {
-            Character* tmp_line = new Character[size];
-            old->getCells(i, 0, size, tmp_line);
-            newScroll->addCells(tmp_line, size);
-            newScroll->addLine(old->isWrappedLine(i));
-            delete [] tmp_line;
-        } else {
-            old->getCells(i, 0, size, line);
-            newScroll->addCells(line, size);
-            newScroll->addLine(old->isWrappedLine(i));
-        }
+    KConfigGroup configGroup(KSharedConfig::openConfig(), "FileLocation");
+    HistoryScroll* newScroll;
+    if (configGroup.readEntry("scrollbackCompression", true))
+        newScroll = new CompressedHistoryScrollFile(_fileName);
+    else
+        newScroll = new HistoryScrollFile(_fileName);
+
+    if (old && old->getLines() > 0) {
+        // the lines are copied in the background
+        return new MigratingHistoryScroll(new HistoryTypeFile(_fileName), old, newScroll, old->getLines());
     }
 
     delete old;
@@ -664,11 +2363,20 @@ int CompactHistoryType::maximumLineCount() const
 HistoryScroll* CompactHistoryType::scroll(HistoryScroll* old) const
 {
     if (old) {
+        old = MigratingHistoryScroll::unwrap(old);
+
         CompactHistoryScroll* oldBuffer = dynamic_cast<CompactHistoryScroll*>(old);
         if (oldBuffer) {
             oldBuffer->setMaxNbLines(_maxLines);
             return oldBuffer;
         }
+
+        // the most recent lines are copied in the background
+        if (old->getLines() > 0) {
+            const int lineCount = qMin(old->getLines(), int(_maxLines));
+            return new MigratingHistoryScroll(new CompactHistoryType(_maxLines), old,
+                                              new CompactHistoryScroll(_maxLines), lineCount);
+        }
         delete old;
     }
     return new CompactHistoryScroll(_maxLines);
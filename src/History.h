@@ -25,51 +25,174 @@
 #include <sys/mman.h>
 
 // Qt
+#include <QtCore/QAtomicInt>
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
 #include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QPair>
+#include <QtCore/QSharedPointer>
 #include <QtCore/QVector>
-#include <QtCore/QTemporaryFile>
+#include <QtCore/QTimer>
 
 #include "konsoleprivate_export.h"
 
 // Konsole
 #include "Character.h"
 
+class QThread;
+
 namespace Konsole
 {
+class Emulation;
+class TerminalCharacterDecoder;
+
 /*
    An extendable tmpfile(1) based buffer.
+
+   Appended data is collected in a write buffer which is written to the
+   file once it is full or shortly after the first unwritten append.
+   Reads of data which has not been written yet are served from the buffer.
 */
 
-class HistoryFile
+/**
+ * The temporary file which holds the HistoryFile streams of one history.
+ *
+ * The file is divided into extents of EXTENT_SIZE bytes, each of which
+ * belongs to one of the streams, so that a history needs a single file
+ * descriptor however many streams it has.  Extents are reserved as the
+ * streams grow; the parts which have not been written yet are holes in the
+ * file and take up no space.
+ *
+ * The file is created without a name where the system supports it, and is
+ * removed right after it has been created otherwise, so that it disappears
+ * with the process.
+ */
+class HistoryFileContainer
+{
+public:
+    HistoryFileContainer();
+    ~HistoryFileContainer();
+
+    // reserves a new extent at the end of the file and returns its offset
+    qint64 allocateExtent();
+
+    bool write(const char* data, int count, qint64 offset);
+    bool read(char* data, int count, qint64 offset);
+
+    // returns the data at 'offset' of the file, which must have been
+    // written already and must not extend past the end of its extent.  The
+    // extent is mapped in if necessary.  Returns 0 if mmap'ing fails
+    const char* map(qint64 offset, int count);
+
+    // size of each extent, must be a multiple of the page size
+    static const qint64 EXTENT_SIZE = 8 * 1024 * 1024;
+
+private:
+    Q_DISABLE_COPY(HistoryFileContainer)
+
+    struct MapWindow {
+        char* data;
+        qint64 offset;
+        qint64 length;
+        quint64 lastUsed;
+    };
+
+    void releaseWindow(MapWindow& window);
+    //prints the error of a failed write or read, only the first one is
+    //printed since they tend to persist (eg. when the disk is full)
+    void reportError(const char* operation);
+
+    int _fd;
+    bool _errorReported;
+    // the number of bytes reserved for extents and the end of the data
+    // which has been written
+    qint64 _reservedLength;
+    qint64 _writtenLength;
+
+    //the mapped extents of the file, shared by all streams.  Since data is
+    //only ever appended to an extent, these stay valid when more is written.
+    static const int MAX_MAP_WINDOWS = 8;
+    MapWindow _mapWindows[MAX_MAP_WINDOWS];
+    quint64 _mapUseCounter;
+};
+
+/**
+ * An append-only stream of bytes stored in the extents of a
+ * HistoryFileContainer.
+ */
+class HistoryFile : public QObject
 {
+    Q_OBJECT
+
 public:
-    HistoryFile();
+    explicit HistoryFile(HistoryFileContainer* container);
     virtual ~HistoryFile();
 
     virtual void add(const unsigned char* bytes, int len);
-    virtual void get(unsigned char* bytes, int len, int loc);
-    virtual int  len() const;
+    virtual void get(unsigned char* bytes, int len, qint64 loc);
+    virtual qint64 len() const;
 
-    //mmaps the file in read-only mode
+    //switches the stream to mmap'ed reads.  The extents of the container
+    //are mapped in read-only mode on demand
     void map();
-    //un-mmaps the file
+    //switches the stream back to read() calls
     void unmap();
-    //returns true if the file is mmap'ed
+    //returns true if the stream is mmap'ed
     bool isMapped() const;
 
+    //sets the lock which is held while the flush timer writes the stream
+    //and moves the stream to 'thread', see HistoryScroll::setOwner()
+    void setOwner(QMutex* lock, QThread* thread);
+
+public slots:
+    //writes the contents of the write buffer to the file
+    void flush();
 
 private:
-    int  _fd;
-    int  _length;
-    QTemporaryFile _tmpFile;
+    //drops 'count' bytes from the start of the write buffer
+    void dropOldestData(int count);
 
-    //pointer to start of mmap'ed file data, or 0 if the file is not mmap'ed
-    char* _fileMap;
+    //returns the offset in the container of position 'loc' of the stream
+    qint64 fileOffset(qint64 loc) const {
+        return _extents[loc / HistoryFileContainer::EXTENT_SIZE] + loc % HistoryFileContainer::EXTENT_SIZE;
+    }
+
+    HistoryFileContainer* _container;
+    //the offsets of the extents which hold the stream, in order
+    QVector<qint64> _extents;
+    qint64 _length;
+
+    //data which has been added but not written to the file yet.  It
+    //starts at _flushedLength in the stream.
+    QByteArray _writeBuffer;
+    qint64 _flushedLength;
+    QTimer _flushTimer;
+    QMutex* _lock;
+
+    //the write buffer is flushed when it grows beyond this size
+    static const int WRITE_BUFFER_SIZE = 64 * 1024;
+    //or this many milliseconds after the first unwritten append
+    static const int FLUSH_DELAY = 500;
+    //while writing fails the buffer is only flushed by the timer, or when
+    //it grows beyond this size.  If that fails too the oldest half of the
+    //buffer is dropped and reads of it return zeros.
+    static const int MAX_WRITE_BUFFER_SIZE = 16 * 1024 * 1024;
+
+    //true if the last flush failed to write the buffer
+    bool _writeFailed;
+    //true if data was dropped from the write buffer.  The stream is not
+    //read through mmap any more, since the dropped data may lie past the
+    //end of the file.
+    bool _dataLost;
+
+    //true if reads are served from mapped extents of the container
+    bool _mapped;
 
     //incremented whenever 'add' is called and decremented whenever
     //'get' is called.
     //this is used to detect when a large number of lines are being read and processed from the history
-    //and automatically mmap the file for better performance (saves the overhead of many lseek-read calls).
+    //and automatically mmap the file for better performance (saves the overhead of many read calls).
     int _readWriteBalance;
 
     //when _readWriteBalance goes below this threshold, the file will be mmap'ed automatically
@@ -107,6 +230,38 @@ public:
 
     virtual void addLine(bool previousWrapped = false) = 0;
 
+    // returns the number of bytes of memory held for the stored lines
+    virtual size_t allocatedMemory() const {
+        return 0;
+    }
+
+    // called when lines of the history are displayed, see
+    // HistoryMemoryManager
+    virtual void markViewed() {}
+
+    // returns the number of lines which have been removed from the start
+    // of the history since it was created.  Adding this to a line number
+    // gives a position which stays the same while older lines are dropped.
+    virtual qint64 droppedLineCount() const {
+        return 0;
+    }
+
+    // returns a number which identifies this scroll and is never re-used
+    // for another scroll within the process
+    quint64 serialNumber() const {
+        return _serialNumber;
+    }
+
+    // returns the lock which is held while the scroll is used, or 0 if the
+    // scroll is only used by one thread.  See setOwner()
+    QMutex* lock() const {
+        return _lock;
+    }
+
+    // sets lock() and moves the objects of the scroll which handle events,
+    // such as timers, to 'thread'.  See Emulation::setOutputThreadEnabled()
+    virtual void setOwner(QMutex* lock, QThread* thread);
+
     //
     // FIXME:  Passing around constant references to HistoryType instances
     // is very unsafe, because those references will no longer
@@ -117,7 +272,15 @@ public:
     }
 
 protected:
+    // gives the scroll a new serial number, after its lines have changed
+    // in other ways than by adding lines
+    void renewSerialNumber();
+
     HistoryType* _historyType;
+
+private:
+    quint64 _serialNumber;
+    QMutex* _lock;
 };
 
 //////////////////////////////////////////////////////////////////////
@@ -138,10 +301,13 @@ public:
     virtual void addCells(const Character a[], int count);
     virtual void addLine(bool previousWrapped = false);
 
+    virtual void setOwner(QMutex* lock, QThread* thread);
+
 private:
-    int startOfLine(int lineno);
+    qint64 startOfLine(int lineno);
 
-    HistoryFile _index; // lines Row(int)
+    HistoryFileContainer _container;
+    HistoryFile _index; // lines Row(qint64)
     HistoryFile _cells; // text  Row(Character)
     HistoryFile _lineflags; // flags Row(unsigned char)
 };
@@ -197,6 +363,56 @@ public:
     bool isRealCharacter;
 };
 
+// a run of characters with the same format in a CompactHistoryLine
+struct CompactHistoryFormatRun {
+    quint16 startPos;
+    // index of the format in the scroll's CompactHistoryFormatTable
+    quint16 formatIndex;
+};
+
+/**
+ * The distinct character formats used by the lines of a CompactHistoryScroll.
+ * Output rarely uses more than a few dozen formats, so the lines only store
+ * the index of the format of each run, which is much smaller than the format.
+ */
+class CompactHistoryFormatTable
+{
+public:
+    /**
+     * Returns the index of the format of @p c, adding the format to the
+     * table if necessary.  Returns -1 if the table is full, which
+     * CompactHistoryLine avoids by keeping the formats of a line itself if
+     * they might not fit.
+     */
+    int indexOf(const Character& c);
+
+    const CharacterFormat& format(int index) const {
+        return _formats[index];
+    }
+    int count() const {
+        return _formats.count();
+    }
+
+    void clear();
+
+    size_t allocatedMemory() const;
+
+    static const int MAX_FORMATS = 0x10000;
+
+private:
+    typedef QPair<quint64, quint16> FormatKey;
+    static FormatKey keyOf(const Character& c);
+
+    QVector<CharacterFormat> _formats;
+    QHash<FormatKey, int> _indexes;
+};
+
+// the result of compressing a CompactHistoryBlock on a worker thread
+struct CompactHistoryBlockCompression {
+    QAtomicInt done;
+    QByteArray data;
+};
+
 class CompactHistoryBlock
 {
 public:
@@ -207,6 +423,7 @@ public:
         Q_ASSERT(_head != MAP_FAILED);
         _tail = _blockStart = _head;
         _allocCount = 0;
+        _released = false;
     }
 
     virtual ~CompactHistoryBlock() {
@@ -221,13 +438,54 @@ public:
         return _blockLength;
     }
     virtual void* allocate(size_t length);
-    virtual bool contains(void* addr) {
+    virtual bool contains(const void* addr) {
         return addr >= _blockStart && addr < (_blockStart + _blockLength);
     }
     virtual void deallocate();
     virtual bool isInUse() {
         return _allocCount != 0;
     };
+    // makes the whole block available again, it must not be in use
+    virtual void reset() {
+        Q_ASSERT(!isInUse());
+        // released memory reads as zeroes, which does not matter here
+        _compressed.clear();
+        pendingCompression.clear();
+        _released = false;
+        _tail = _blockStart;
+    }
+
+    // Once a block is no longer written to, a compressed copy of it can be
+    // made, after which the memory of the block is released until it is
+    // used again.  The block keeps its address in the meantime, so that
+    // pointers into it stay valid.
+
+    // returns a copy of the used part of the block
+    QByteArray contents() const {
+        return QByteArray(reinterpret_cast<const char*>(_blockStart), _tail - _blockStart);
+    }
+    void setCompressed(const QByteArray& data) {
+        _compressed = data;
+    }
+    bool isCompressed() const {
+        return !_compressed.isEmpty();
+    }
+    // releases the memory of a compressed block
+    void release();
+    // decompresses a released block into its memory
+    void restore();
+    // forgets the compressed copy, before the block is modified
+    void discardCompressed();
+    bool isReleased() const {
+        return _released;
+    }
+    // returns the number of bytes of memory held by the block
+    size_t memoryUsage() const {
+        return (_released ? 0 : _blockLength) + _compressed.size();
+    }
+
+    // the compression of the block which is in progress, if any
+    QSharedPointer<CompactHistoryBlockCompression> pendingCompression;
 
 private:
     size_t _blockLength;
@@ -235,12 +493,18 @@ private:
     quint8* _tail;
     quint8* _blockStart;
     int _allocCount;
+    QByteArray _compressed;
+    bool _released;
 };
 
 class CompactHistoryBlockList
 {
 public:
-    CompactHistoryBlockList() {}
+    CompactHistoryBlockList()
+        : _allocatedSize(0)
+        , _releasedCount(0)
+        , _compressionEnabled(false)
+        , _lastTouched(0) {}
     ~CompactHistoryBlockList();
 
     void* allocate(size_t size);
@@ -248,14 +512,79 @@ public:
     int length() {
         return list.size();
     }
+    // returns the number of bytes held by the list, including spare blocks
+    size_t allocatedSize() const {
+        return _allocatedSize;
+    }
+    // unmaps the spare blocks
+    void releaseSpareBlocks();
+
+    // specifies whether the blocks which are no longer written to are
+    // compressed on a worker thread
+    void setCompressionEnabled(bool enable);
+    // starts an access to the blocks: unpins the blocks of the previous
+    // access and releases the blocks whose compression has finished.  No
+    // block is released after this until the next access starts, apart
+    // from those which are not pinned.
+    void beginAccess() {
+        _pinned.clear();
+        if (!_compressing.isEmpty())
+            collectCompressedBlocks();
+    }
+    // makes the memory at 'ptr' accessible, decompressing its block if
+    // it has been released, and keeps the block from being released
+    // until the next access starts
+    void pin(const void* ptr) {
+        if (_releasedCount > 0 || !_compressing.isEmpty())
+            pinBlock(ptr);
+    }
+    // makes all blocks accessible and forgets their compressed copies,
+    // before the contents of the blocks are changed
+    void restoreAll();
+    // starts compressing the blocks which are no longer written to
+    void compressColdBlocks();
+
 private:
+    void pinBlock(const void* ptr);
+    // releases the blocks whose compression has finished, except for
+    // pinned ones
+    void collectCompressedBlocks();
+    void release(CompactHistoryBlock* block);
+    void restore(CompactHistoryBlock* block);
+    void discardCompressed(CompactHistoryBlock* block);
+    // removes the block from the lists of blocks which are being compressed,
+    // have been restored or are pinned
+    void forget(CompactHistoryBlock* block);
+
     QList<CompactHistoryBlock*> list;
+    size_t _allocatedSize;
+
+    // blocks which are no longer in use are kept here for re-use
+    // instead of being unmapped, so that a history which is full
+    // does not need to map new blocks
+    QList<CompactHistoryBlock*> spareBlocks;
+    static const int MAX_SPARE_BLOCKS = 2;
+
+    int _releasedCount;
+    bool _compressionEnabled;
+    // blocks which are being compressed
+    QList<CompactHistoryBlock*> _compressing;
+    // released blocks which have been restored, least recently used first
+    QList<CompactHistoryBlock*> _restoredBlocks;
+    // blocks which are used by the current access
+    QList<CompactHistoryBlock*> _pinned;
+    CompactHistoryBlock* _lastTouched;
+
+    // the most recent blocks are not compressed
+    static const int HOT_BLOCKS = 4;
+    // number of released blocks which are kept decompressed
+    static const int MAX_RESTORED_BLOCKS = 4;
 };
 
 class CompactHistoryLine
 {
 public:
-    CompactHistoryLine(const TextLine&, CompactHistoryBlockList& blockList);
+    CompactHistoryLine(const TextLine&, CompactHistoryBlockList& blockList, CompactHistoryFormatTable& formats);
     virtual ~CompactHistoryLine();
 
     // custom new operator to allocate memory from custom pool instead of heap
@@ -264,8 +593,8 @@ public:
         /* do nothing, deallocation from pool is done in destructor*/
     };
 
-    virtual void getCharacters(Character* array, int length, int startColumn);
-    virtual void getCharacter(int index, Character& r);
+    virtual void getCharacters(Character* array, int length, int startColumn, const CompactHistoryFormatTable& formats);
+    virtual void getCharacter(int index, Character& r, const CompactHistoryFormatTable& formats);
     virtual bool isWrapped() const {
         return _wrapped;
     };
@@ -276,18 +605,67 @@ public:
         return _length;
     };
 
+    // replaces the index of each format with mapping[index]
+    void remapFormats(const QVector<int>& mapping);
+    // increments uses[index] for the index of each format of the line
+    void countFormats(QVector<int>& uses) const;
+
+    // returns true if the line stores its formats itself, because they
+    // did not fit into the table of formats
+    bool hasInlineFormats() const {
+        return _inlineFormats;
+    }
+
+    // returns true if the characters of the line are stored in one byte each
+    bool hasNarrowText() const {
+        return _narrowText;
+    }
+
+    // makes the characters and formats of the line accessible for the
+    // current access, the line itself must have been pinned already
+    void pin() const {
+        _blockListRef.pin(_formatArray);
+        _blockListRef.pin(_text);
+    }
+
 protected:
+    // returns the index of the format run which covers column 'index'
+    int formatIndexAt(int index) const;
+
+    // sets the start and the format of the format run 'run'
+    void setRun(int run, int startPos, const Character& c, CompactHistoryFormatTable& formats);
+
+    quint16 runStart(int run) const {
+        return _inlineFormats ? _formats[run].startPos : _formatArray[run].startPos;
+    }
+    const CharacterFormat& runFormat(int run, const CompactHistoryFormatTable& formats) const {
+        return _inlineFormats ? _formats[run] : formats.format(_formatArray[run].formatIndex);
+    }
+
+    quint16 characterAt(int index) const {
+        return _narrowText ? static_cast<const quint8*>(_text)[index]
+                           : static_cast<const quint16*>(_text)[index];
+    }
+
     CompactHistoryBlockList& _blockListRef;
-    CharacterFormat* _formatArray;
+    union {
+        CompactHistoryFormatRun* _formatArray;
+        // the formats of the runs, if _inlineFormats is set
+        CharacterFormat* _formats;
+    };
     quint16 _length;
-    quint16* _text;
+    // the character values, one byte each if they all fit into a byte
+    // (_narrowText is set), two bytes each otherwise
+    void* _text;
     quint16 _formatLength;
     bool _wrapped;
+    bool _narrowText;
+    bool _inlineFormats;
 };
 
 class KONSOLEPRIVATE_EXPORT CompactHistoryScroll : public HistoryScroll
 {
-    typedef QList<CompactHistoryLine*> HistoryArray;
+    typedef QVector<CompactHistoryLine*> HistoryArray;
 
 public:
     explicit CompactHistoryScroll(unsigned int maxNbLines = 1000);
@@ -304,12 +682,467 @@ public:
 
     void setMaxNbLines(unsigned int nbLines);
 
+    virtual size_t allocatedMemory() const;
+
+    // removes the @p count oldest lines and returns unused memory
+    void dropOldestLines(int count);
+
+    virtual qint64 droppedLineCount() const {
+        return _droppedLineCount;
+    }
+
+    // tells the HistoryMemoryManager that this scroll has been displayed.
+    // Other reads, e.g. searches, do not count.
+    virtual void markViewed();
+
 private:
     bool hasDifferentColors(const TextLine& line) const;
+    CompactHistoryLine* lineAt(int lineNumber) const;
+    // returns the line and makes sure that its memory stays accessible
+    // until another line is accessed
+    CompactHistoryLine* residentLineAt(int lineNumber);
+    // removes the formats which are no longer used from _formats
+    void compactFormats();
+    // stores the lines in order from the start of _lines
+    void unwrapLines();
+
+    // once it holds _maxLineCount lines, _lines is used as a ring buffer
+    // in which _head is the index of the oldest line
     HistoryArray _lines;
+    int _head;
     CompactHistoryBlockList _blockList;
+    CompactHistoryFormatTable _formats;
 
     unsigned int _maxLineCount;
+    qint64 _droppedLineCount;
+    // the number of lines to add before the format table is compacted
+    // again, after a compaction which left it more than half full
+    int _linesUntilCompaction;
+
+    // the blocks of histories with at least this many lines are compressed
+    // once they are no longer written to
+    static const unsigned int MIN_LINES_FOR_COMPRESSION = 50000;
+};
+
+/**
+ * Keeps track of the memory used by all CompactHistoryScroll instances
+ * in the process.  If a memory budget is set and the scrolls together
+ * use more than that, the oldest lines of the least recently viewed
+ * scrolls are dropped until they fit into the budget again.  Scrolls whose
+ * lock() is held by another thread at the time are skipped, as are the old
+ * histories of a MigratingHistoryScroll, whose lines are still being copied.
+ *
+ * The screens and windows of the scrolls notice the dropped lines by their
+ * HistoryScroll::droppedLineCount(), see Screen::forgetDroppedSelection()
+ * and ScreenWindow::notifyOutputChanged().
+ */
+class KONSOLEPRIVATE_EXPORT HistoryMemoryManager
+{
+public:
+    HistoryMemoryManager();
+
+    /** Returns the history memory manager instance. */
+    static HistoryMemoryManager* instance();
+
+    /**
+     * Sets the number of bytes all compact history scrolls together
+     * may use, or 0 for no limit.
+     */
+    void setBudget(qint64 bytes);
+    /** Returns the budget set with setBudget() */
+    qint64 budget() const;
+
+    /**
+     * Returns the number of bytes used by all compact history scrolls.
+     * The scrolls whose lock() is held by another thread count with the
+     * memory they used when it was last known.
+     */
+    qint64 usage() const;
+
+    void addScroll(CompactHistoryScroll* scroll);
+    void removeScroll(CompactHistoryScroll* scroll);
+
+    /**
+     * Called by scrolls whenever they have allocated more memory, with
+     * their lock() held.
+     */
+    void scrollGrew(CompactHistoryScroll* scroll);
+
+    /**
+     * Called when @p scroll has been displayed, with its lock() held.
+     * The least recently viewed scrolls lose their lines first.
+     */
+    void scrollViewed(CompactHistoryScroll* scroll);
+
+private:
+    void enforceBudget();
+
+    // what is known about a scroll without holding its lock
+    struct ScrollInfo {
+        quint64 lastViewed;
+        qint64 memory;
+    };
+
+    // returns the memory used by 'scroll' if its lock can be taken, or
+    // the memory it used when it was last known otherwise
+    static qint64 currentMemory(CompactHistoryScroll* scroll, const ScrollInfo& info);
+
+    // the scrolls belong to emulations which may process their output on
+    // threads of their own, see HistoryScroll::lock()
+    mutable QMutex _mutex;
+    QHash<CompactHistoryScroll*, ScrollInfo> _scrolls;
+    qint64 _budget;
+    quint64 _viewCounter;
+    bool _enforcing;
+};
+
+//////////////////////////////////////////////////////////////////////
+// Compressed file-based history
+// Lines are grouped into chunks of a fixed number of lines. Each chunk
+// stores the text and the attribute runs separately (as
+// CompactHistoryLine does in memory) and is compressed before being
+// appended to the history file.
+//////////////////////////////////////////////////////////////////////
+
+class CompressedHistoryChunk
+{
+public:
+    CompressedHistoryChunk();
+
+    int lineCount() const {
+        return _lineFlags.size();
+    }
+    int lineLength(int line) const;
+    bool isWrappedLine(int line) const;
+    void getCells(int line, int column, int count, Character res[]) const;
+
+    // appends cells to the line which is currently being built
+    void appendCells(const Character cells[], int count);
+    // completes the line which is currently being built
+    void closeLine(bool wrapped);
+
+    void clear();
+
+    // the serialized form only contains completed lines
+    QByteArray serialize() const;
+    bool deserialize(const QByteArray& data);
+
+private:
+    QVector<quint16> _text;
+    QVector<CharacterFormat> _formats;
+    // start offsets of each line in _text and _formats.  These contain one entry
+    // more than there are completed lines, the last entry being the start of the
+    // line currently being built
+    QVector<quint32> _lineTextStart;
+    QVector<quint32> _lineFormatStart;
+    QVector<quint8> _lineFlags;
+};
+
+class KONSOLEPRIVATE_EXPORT CompressedHistoryScrollFile : public HistoryScroll
+{
+public:
+    explicit CompressedHistoryScrollFile(const QString& logFileName);
+    virtual ~CompressedHistoryScrollFile();
+
+    virtual int  getLines();
+    virtual int  getLineLen(int lineno);
+    virtual void getCells(int lineno, int colno, int count, Character res[]);
+    virtual bool isWrappedLine(int lineno);
+
+    virtual void addCells(const Character a[], int count);
+    virtual void addLine(bool previousWrapped = false);
+
+    virtual void setOwner(QMutex* lock, QThread* thread);
+
+    // number of lines stored in one compressed chunk
+    static const int LINES_PER_CHUNK = 256;
+
+private:
+    // returns the chunk which holds line 'lineno', decompressing it
+    // from the history file if necessary
+    const CompressedHistoryChunk* chunkForLine(int lineno);
+    void flushPendingChunk();
+
+    struct ChunkLocation {
+        qint64 offset;
+        int size;
+    };
+
+    HistoryFileContainer _container;
+    HistoryFile _chunkData;
+    QVector<ChunkLocation> _chunkIndex;
+
+    CompressedHistoryChunk _pendingChunk;
+    CompressedHistoryChunk _cachedChunk;
+    int _cachedChunkIndex;
+
+    int _lineCount;
+};
+
+//////////////////////////////////////////////////////////////////////
+// History which is being converted into another type
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * Describes the lines of a history which have been wrapped again at a new
+ * width, see MigratingHistoryScroll::takeReflowedLines().
+ *
+ * Each range replaces the oldCount lines from the absolute line firstLine
+ * (see HistoryScroll::droppedLineCount()) by newCount lines, the lines
+ * after them have moved by the difference.  The ranges are kept in the
+ * order in which the lines were wrapped, since each one refers to the line
+ * numbers after the ones before it.
+ */
+struct ReflowedLines {
+    struct Range {
+        qint64 firstLine;
+        int oldCount;
+        int newCount;
+    };
+
+    ReflowedLines()
+        : droppedCount(0) {}
+
+    bool isEmpty() const {
+        return ranges.isEmpty() && droppedCount == 0;
+    }
+    // adds lines which have been wrapped after those of this object
+    void add(qint64 firstLine, int oldCount, int newCount);
+    void add(const ReflowedLines& lines);
+    // returns the absolute line which @p line has moved to, lines which
+    // have been wrapped again move to the first of their new lines
+    qint64 map(qint64 line) const;
+
+    QVector<Range> ranges;
+    // the number of lines which have been dropped from the start of the
+    // history meanwhile, because it became too long
+    int droppedCount;
+};
+
+/**
+ * A history which is converted into another type of history in the
+ * background, so that changing the history type does not block while all
+ * lines are copied.  See HistoryType::scroll().
+ *
+ * The lines of the old history are copied into the new one in small steps
+ * on the event loop.  Until that is finished, the lines which have not been
+ * copied yet are read from the old history, and lines which are added are
+ * kept aside and appended to the new history afterwards.  After that, all
+ * calls are passed on to the new history.  Once the lines which are kept
+ * aside fill the new history by themselves, the old lines are dropped.
+ *
+ * The lines can also be wrapped at a new width while they are copied, see
+ * reflow().  Until that is finished, the lines which have not been copied
+ * yet keep their old width, even if they are shown.  The number of lines changes while they are
+ * wrapped again, see takeReflowedLines(), and linesMigrated() is emitted
+ * after each step so that the change can be shown.
+ */
+class KONSOLEPRIVATE_EXPORT MigratingHistoryScroll : public QObject, public HistoryScroll
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructs a history of type @p type (which it takes ownership of)
+     * which copies the last @p lineCount lines of @p from into @p to.
+     * @p from is deleted once all lines have been copied.
+     *
+     * If @p columns is greater than 0, wrapped lines are joined and wrapped
+     * again at @p columns columns while they are copied.
+     */
+    MigratingHistoryScroll(HistoryType* type, HistoryScroll* from, HistoryScroll* to, int lineCount,
+                           int columns = 0);
+    virtual ~MigratingHistoryScroll();
+
+    virtual int  getLines();
+    virtual int  getLineLen(int lineno);
+    virtual void getCells(int lineno, int colno, int count, Character res[]);
+    virtual bool isWrappedLine(int lineno);
+
+    virtual void addCells(const Character a[], int count);
+    virtual void addLine(bool previousWrapped = false);
+
+    virtual size_t allocatedMemory() const;
+    virtual void markViewed();
+    virtual qint64 droppedLineCount() const;
+
+    virtual void setOwner(QMutex* lock, QThread* thread);
+
+    /** Returns true once all lines have been copied into the new history. */
+    bool isFinished() const {
+        return _from == 0;
+    }
+    /** Returns true while lines are being wrapped at a new width. */
+    bool isReflowing() const {
+        return _from != 0 && _columns > 0;
+    }
+
+    /** Copies all of the remaining lines at once. */
+    void finish();
+
+    /**
+     * Returns the lines which have been wrapped again since the last call,
+     * which changes the line numbers of the lines after them.
+     */
+    ReflowedLines takeReflowedLines();
+
+    /**
+     * If @p scroll is a MigratingHistoryScroll which has finished, returns
+     * the new history, deleting @p scroll.  If it has not finished yet, it
+     * stops copying lines and is returned, so that it can be converted
+     * again without waiting for all of its lines to be copied first.
+     * Otherwise returns @p scroll.
+     */
+    static HistoryScroll* unwrap(HistoryScroll* scroll);
+
+    /**
+     * Returns a history which holds the lines of @p scroll wrapped at
+     * @p columns columns, which takes ownership of @p scroll.  The lines
+     * are wrapped in the background.  If @p scroll is being wrapped
+     * already, it starts again with the new width instead.
+     */
+    static HistoryScroll* reflow(HistoryScroll* scroll, int columns);
+
+signals:
+    /** Emitted after some of the lines have been copied in the background. */
+    void linesMigrated();
+
+private slots:
+    // copies lines for a few milliseconds
+    void migrateLines();
+
+private:
+    Q_DISABLE_COPY(MigratingHistoryScroll)
+
+    // copies 'count' lines from the old history
+    void copyLines(int count);
+    // joins the next line of the old history with the lines it is wrapped
+    // into and adds it to the new history, wrapped at _columns
+    void reflowLine();
+    // drops the old lines and the oldest lines added since, when more
+    // lines have been added than the new history can hold
+    void dropOldLines();
+    // removes the compact histories of 'scroll' from the
+    // HistoryMemoryManager, so that none of the old lines are dropped while
+    // they are still read by their line numbers
+    static void keepOldLines(HistoryScroll* scroll);
+
+    HistoryScroll* _from;
+    HistoryScroll* _to;
+
+    // the lines of the old history which have not been copied yet
+    int _startLine;
+    int _nextLine;
+    int _endLine;
+    // the width at which lines are wrapped, 0 if they are copied as they are
+    int _columns;
+
+    // lines added before all old lines were copied, at most as many as
+    // the new history can hold, see addCells()
+    QList<QVector<Character> > _pendingLines;
+    QList<bool> _pendingLineWrapped;
+    // the number of cells of _pendingLines
+    qint64 _pendingSize;
+
+    qint64 _initialDroppedLineCount;
+    QTimer _migrateTimer;
+    QVector<Character> _cells;
+
+    // the lines which have been wrapped again since takeReflowedLines()
+    ReflowedLines _reflowedLines;
+};
+
+/**
+ * The emulation whose history the OutputSnapshot objects made of its output
+ * read their lines from.  It is shared by the emulation and the snapshots,
+ * and 'emulation' is set to 0 when the emulation is destroyed, after which
+ * the history lines of the snapshots read as empty lines.
+ */
+struct OutputSnapshotSource {
+    explicit OutputSnapshotSource(Emulation* emulation)
+        : emulation(emulation) {}
+
+    // protects 'emulation'
+    QMutex mutex;
+    Emulation* emulation;
+};
+
+/**
+ * The output of an emulation, made of its history and the screen image, at
+ * one point in time.  See Emulation::outputSnapshot().
+ *
+ * The screen image is copied when the snapshot is made, the lines of the
+ * history are only read when they are needed, LINES_PER_CHUNK lines at a
+ * time, while holding the output lock of the emulation.  This can be done
+ * on other threads, so that the history does not have to be copied on the
+ * main thread.  Further output does not change the lines of the snapshot,
+ * but lines which have been dropped from the history since, or all lines
+ * if the history has been replaced or cleared, read as empty lines.
+ */
+class KONSOLEPRIVATE_EXPORT OutputSnapshot
+{
+public:
+    OutputSnapshot();
+    /**
+     * Constructs a snapshot of the lines which are currently in @p history,
+     * which belongs to the emulation of @p source.  The output lock of the
+     * emulation must be held.
+     */
+    OutputSnapshot(const QSharedPointer<OutputSnapshotSource>& source, HistoryScroll* history);
+
+    /** Appends a line of the screen image to the snapshot. */
+    void appendScreenLine(const QVector<Character>& cells, bool wrapped);
+
+    /** Returns the number of lines in the snapshot. */
+    int lineCount() const {
+        return _historyLines + _screenLines.count();
+    }
+
+    /** Returns the number of lines of the history, which precede the screen lines. */
+    int historyLineCount() const {
+        return _historyLines;
+    }
+
+    /** Returns the HistoryScroll::serialNumber() of the history. */
+    quint64 historySerialNumber() const {
+        return _historySerialNumber;
+    }
+    /** Returns the absolute number of the first line of the history. */
+    qint64 firstHistoryLine() const {
+        return _firstHistoryLine;
+    }
+
+    /**
+     * Copies the cells of line @p line into @p cells.  @p wrapped is set
+     * to whether the line continues on the next line.
+     */
+    void getLine(int line, QVector<Character>& cells, bool& wrapped);
+
+    /**
+     * Copies the lines from @p startLine to @p endLine into a stream using
+     * @p decoder, in the same way as Emulation::writeToStream().
+     */
+    void writeToStream(TerminalCharacterDecoder* decoder, int startLine, int endLine);
+
+    /** The number of history lines which are read at once. */
+    static const int LINES_PER_CHUNK = 1000;
+
+private:
+    // reads the history lines of the chunk which contains 'line'
+    void readChunk(int line);
+
+    QSharedPointer<OutputSnapshotSource> _source;
+    quint64 _historySerialNumber;
+    qint64 _firstHistoryLine;
+    int _historyLines;
+
+    QVector<QVector<Character> > _screenLines;
+    QVector<bool> _screenLineWrapped;
+
+    // the history lines which have been read last, starting at _chunkStart
+    QVector<QVector<Character> > _chunkLines;
+    QVector<bool> _chunkLineWrapped;
+    int _chunkStart;
 };
 
 //////////////////////////////////////////////////////////////////////
@@ -364,6 +1197,11 @@ public:
     virtual bool isEnabled() const;
     virtual int maximumLineCount() const;
 
+    /**
+     * Converts @p old into a file-based history.  Depending on the
+     * "scrollbackCompression" setting this is a CompressedHistoryScrollFile
+     * or an uncompressed HistoryScrollFile.
+     */
     virtual HistoryScroll* scroll(HistoryScroll *) const;
 
 protected:
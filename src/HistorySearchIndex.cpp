@@ -0,0 +1,178 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "HistorySearchIndex.h"
+
+// Qt
+#include <QtCore/QMap>
+
+// Standard
+#include <algorithm>
+
+using namespace Konsole;
+
+HistorySearchIndex::HistorySearchIndex()
+    : _firstLine(0)
+    , _endLine(0)
+    , _prunedBlock(0)
+    , _carry(0)
+    , _carryLength(0)
+{
+    _lineStream.setString(&_lineText, QIODevice::WriteOnly);
+}
+
+void HistorySearchIndex::reset(qint64 firstLine)
+{
+    _postings.clear();
+    _firstLine = firstLine;
+    _endLine = firstLine;
+    _prunedBlock = firstLine / LINES_PER_BLOCK;
+    _carry = 0;
+    _carryLength = 0;
+}
+
+void HistorySearchIndex::addTrigram(quint64 trigram, quint32 block)
+{
+    QVector<quint32>& blocks = _postings[trigram];
+    if (blocks.isEmpty() || blocks.last() != block)
+        blocks.append(block);
+}
+
+void HistorySearchIndex::addLine(const Character* cells, int count, bool wrapped)
+{
+    _lineText.clear();
+    _decoder.begin(&_lineStream);
+    _decoder.decodeLine(cells, count, LINE_DEFAULT);
+    _decoder.end();
+    _lineStream.flush();
+
+    const quint32 block = _endLine / LINES_PER_BLOCK;
+
+    quint64 trigram = _carry;
+    int length = _carryLength;
+    for (int i = 0; i < _lineText.length(); i++) {
+        trigram = nextTrigram(trigram, _lineText[i]);
+        if (++length >= 3)
+            addTrigram(trigram, block);
+    }
+
+    if (wrapped) {
+        _carry = trigram;
+        _carryLength = qMin(length, 2);
+    } else {
+        _carry = 0;
+        _carryLength = 0;
+    }
+
+    _endLine++;
+}
+
+void HistorySearchIndex::removeLinesBefore(qint64 line)
+{
+    static const quint32 PRUNE_INTERVAL = 1024;
+
+    if (line <= _firstLine)
+        return;
+
+    _firstLine = qMin(line, _endLine);
+
+    // stale entries are skipped by findCandidates(), so they are only
+    // removed once in a while
+    if (_firstLine / LINES_PER_BLOCK - _prunedBlock >= PRUNE_INTERVAL)
+        prune();
+}
+
+void HistorySearchIndex::prune()
+{
+    const quint32 firstBlock = _firstLine / LINES_PER_BLOCK;
+
+    QMutableHashIterator<quint64, QVector<quint32> > iter(_postings);
+    while (iter.hasNext()) {
+        QVector<quint32>& blocks = iter.next().value();
+        const int stale = std::lower_bound(blocks.constBegin(), blocks.constEnd(), firstBlock) - blocks.constBegin();
+        if (stale == blocks.count())
+            iter.remove();
+        else if (stale > 0)
+            blocks.remove(0, stale);
+    }
+
+    _prunedBlock = firstBlock;
+}
+
+bool HistorySearchIndex::findCandidates(const QString& text, QVector<LineRange>& ranges) const
+{
+    // a mask with one bit for each trigram of the text is used below, so
+    // only the first trigrams are used for long texts
+    static const int MAX_TRIGRAMS = 64;
+
+    if (text.length() < 3)
+        return false;
+
+    QVector<quint64> trigrams;
+    quint64 trigram = 0;
+    for (int i = 0; i < text.length() && trigrams.count() < MAX_TRIGRAMS; i++) {
+        trigram = nextTrigram(trigram, text[i]);
+        if (i >= 2 && !trigrams.contains(trigram))
+            trigrams << trigram;
+    }
+
+    // find out which of the trigrams occur in each block
+    const quint32 firstBlock = _firstLine / LINES_PER_BLOCK;
+    QMap<quint32, quint64> blockMasks;
+    for (int i = 0; i < trigrams.count(); i++) {
+        QHash<quint64, QVector<quint32> >::const_iterator blocks = _postings.constFind(trigrams[i]);
+        if (blocks == _postings.constEnd())
+            return true;
+
+        QVector<quint32>::const_iterator block = std::lower_bound(blocks->constBegin(), blocks->constEnd(), firstBlock);
+        for (; block != blocks->constEnd(); ++block)
+            blockMasks[*block] |= quint64(1) << i;
+    }
+
+    const quint64 allTrigrams = trigrams.count() == MAX_TRIGRAMS ? ~quint64(0)
+                                : (quint64(1) << trigrams.count()) - 1;
+
+    // a match of n characters spans at most n lines, so all of its trigrams
+    // occur within a window of this many blocks
+    const int window = 2 + text.length() / LINES_PER_BLOCK;
+
+    QMap<quint32, quint64>::const_iterator iter = blockMasks.constBegin();
+    for (; iter != blockMasks.constEnd(); ++iter) {
+        quint64 mask = 0;
+        QMap<quint32, quint64>::const_iterator next = iter;
+        for (; next != blockMasks.constEnd() && next.key() < iter.key() + window; ++next)
+            mask |= next.value();
+
+        if (mask != allTrigrams)
+            continue;
+
+        // the first two characters of a match may be on the lines before the
+        // block in which its first trigram ends
+        const qint64 first = qMax(_firstLine, qint64(iter.key()) * LINES_PER_BLOCK - 2);
+        const qint64 last = qMin(_endLine, (qint64(iter.key()) + window) * LINES_PER_BLOCK) - 1;
+
+        if (!ranges.isEmpty() && ranges.last().second >= first - 1)
+            ranges.last().second = qMax(ranges.last().second, last);
+        else
+            ranges << LineRange(first, last);
+    }
+
+    return true;
+}
@@ -0,0 +1,126 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef HISTORYSEARCHINDEX_H
+#define HISTORYSEARCHINDEX_H
+
+// Qt
+#include <QtCore/QHash>
+#include <QtCore/QPair>
+#include <QtCore/QString>
+#include <QtCore/QTextStream>
+#include <QtCore/QVector>
+
+// Konsole
+#include "Character.h"
+#include "TerminalCharacterDecoder.h"
+#include "konsoleprivate_export.h"
+
+namespace Konsole
+{
+/**
+ * An index of the trigrams (sequences of three characters) which occur in
+ * the lines of a history, used to find the lines which may contain a piece
+ * of text without decoding the whole history.
+ *
+ * Lines are identified by absolute line numbers, which stay the same while
+ * older lines are removed from the history (see
+ * HistoryScroll::droppedLineCount()).  The index does not record the lines
+ * in which each trigram occurs, but the blocks of LINES_PER_BLOCK lines, which
+ * keeps it small.  Text is indexed the way PlainTextDecoder produces it, so
+ * the candidates are exact for searches through decoded output.  Trigrams
+ * which continue from a wrapped line into the next one are indexed as well.
+ *
+ * The index is case-insensitive.
+ */
+class KONSOLEPRIVATE_EXPORT HistorySearchIndex
+{
+public:
+    /** A range of absolute line numbers, including the first and last line. */
+    typedef QPair<qint64, qint64> LineRange;
+
+    HistorySearchIndex();
+
+    /**
+     * Removes all lines from the index.  The next line added with addLine()
+     * will be line @p firstLine.
+     */
+    void reset(qint64 firstLine);
+
+    /** Returns the number of the first line which is indexed. */
+    qint64 firstLine() const {
+        return _firstLine;
+    }
+    /** Returns the number of the line which will be indexed next. */
+    qint64 endLine() const {
+        return _endLine;
+    }
+
+    /**
+     * Adds the next line of the history to the index.
+     * @p wrapped specifies whether the line continues on the next line.
+     */
+    void addLine(const Character* cells, int count, bool wrapped);
+
+    /** Removes the lines before @p line from the index. */
+    void removeLinesBefore(qint64 line);
+
+    /**
+     * Finds the indexed lines which may contain @p text.
+     *
+     * Returns false if the index cannot be used to search for @p text,
+     * because it is shorter than a trigram.  Otherwise the candidates are
+     * stored in @p ranges in ascending order; lines outside of these
+     * ranges do not contain @p text.
+     */
+    bool findCandidates(const QString& text, QVector<LineRange>& ranges) const;
+
+    /** Number of lines which share one entry in the index. */
+    static const int LINES_PER_BLOCK = 32;
+
+private:
+    Q_DISABLE_COPY(HistorySearchIndex)
+
+    void addTrigram(quint64 trigram, quint32 block);
+    // removes the entries of blocks before _firstLine
+    void prune();
+
+    // the trigram is made of the three last characters of 'trigram'
+    static quint64 nextTrigram(quint64 trigram, QChar c) {
+        return ((trigram << 16) | c.toLower().unicode()) & Q_UINT64_C(0xffffffffffff);
+    }
+
+    // blocks in which each trigram occurs, in ascending order
+    QHash<quint64, QVector<quint32> > _postings;
+
+    qint64 _firstLine;
+    qint64 _endLine;
+    quint32 _prunedBlock;
+
+    // the last characters of the previous line, if it was wrapped
+    quint64 _carry;
+    int _carryLength;
+
+    PlainTextDecoder _decoder;
+    QString _lineText;
+    QTextStream _lineStream;
+};
+}
+
+#endif // HISTORYSEARCHINDEX_H
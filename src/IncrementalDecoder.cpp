@@ -0,0 +1,266 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "IncrementalDecoder.h"
+
+// Qt
+#include <QtCore/QTextCodec>
+
+// Standard
+#include <string.h>
+
+using namespace Konsole;
+
+// the sequence which is sent by 'sz' to start a z-modem transfer
+static const char ZMODEM_START[] = "\030B00";
+static const int ZMODEM_START_LENGTH = 4;
+
+static const int UTF8_MIB = 106;
+
+namespace
+{
+const quint64 HIGH_BITS = Q_UINT64_C(0x8080808080808080);
+const quint64 LOW_BITS = Q_UINT64_C(0x0101010101010101);
+const quint64 CAN_BYTES = Q_UINT64_C(0x1818181818181818);
+
+// returns true if one of the bytes of 'word' has its high bit set or is
+// the first character of the z-modem start sequence
+inline bool needsSlowPath(quint64 word)
+{
+    if (word & HIGH_BITS)
+        return true;
+
+    // a byte of 'x' is zero where 'word' has a CAN
+    const quint64 x = word ^ CAN_BYTES;
+    return ((x - LOW_BITS) & ~x & HIGH_BITS) != 0;
+}
+
+// decodes the UTF-8 character which starts with the non-ASCII byte at
+// 'src' and returns the number of bytes used, or 0 if the bytes end before
+// the character is complete.
+//
+// Like QTextCodec, an invalid byte is replaced with U+FFFD and decoding
+// continues with the next byte.
+int decodeCharacter(const uchar* src, const uchar* end, ushort*& out)
+{
+    const uchar lead = src[0];
+    int needed;
+    uint minimum;
+    uint c;
+
+    // 0x80 - 0xbf are continuation bytes, 0xc0 and 0xc1 can only start
+    // overlong sequences
+    if (lead < 0xc2) {
+        needed = 0;
+        minimum = 0;
+        c = 0;
+    } else if (lead < 0xe0) {
+        needed = 2;
+        minimum = 0x80;
+        c = lead & 0x1f;
+    } else if (lead < 0xf0) {
+        needed = 3;
+        minimum = 0x800;
+        c = lead & 0x0f;
+    } else if (lead < 0xf5) {
+        needed = 4;
+        minimum = 0x10000;
+        c = lead & 0x07;
+    } else {
+        needed = 0;
+        minimum = 0;
+        c = 0;
+    }
+
+    bool valid = needed > 0;
+    for (int i = 1; valid && i < needed; i++) {
+        if (src + i == end)
+            return 0;
+        if ((src[i] & 0xc0) != 0x80)
+            valid = false;
+        else
+            c = (c << 6) | (src[i] & 0x3f);
+    }
+
+    if (valid && (c < minimum || QChar::isSurrogate(c) || c > QChar::LastValidCodePoint))
+        valid = false;
+
+    if (!valid) {
+        *out++ = QChar::ReplacementCharacter;
+        return 1;
+    }
+
+    if (QChar::requiresSurrogates(c)) {
+        *out++ = QChar::highSurrogate(c);
+        *out++ = QChar::lowSurrogate(c);
+    } else {
+        *out++ = c;
+    }
+    return needed;
+}
+}
+
+IncrementalDecoder::IncrementalDecoder()
+    : _decoder(0)
+    , _pendingCount(0)
+    , _headerDone(false)
+    , _zmodemMatched(0)
+    , _zmodemDetected(false)
+{
+}
+
+IncrementalDecoder::~IncrementalDecoder()
+{
+    delete _decoder;
+}
+
+void IncrementalDecoder::setCodec(const QTextCodec* codec)
+{
+    delete _decoder;
+    _decoder = 0;
+
+    if (codec && codec->mibEnum() != UTF8_MIB)
+        _decoder = codec->makeDecoder();
+
+    _pendingCount = 0;
+    _headerDone = false;
+}
+
+int IncrementalDecoder::decode(const char* data, int length)
+{
+    _zmodemDetected = false;
+
+    if (!_decoder)
+        return decodeUtf8(data, length);
+
+    _decoder->toUnicode(&_text, data, length);
+    scanForZmodem(data, length);
+    return _text.length();
+}
+
+inline void IncrementalDecoder::matchZmodem(uchar byte)
+{
+    if (byte == ZMODEM_START[_zmodemMatched]) {
+        if (++_zmodemMatched == ZMODEM_START_LENGTH) {
+            _zmodemDetected = true;
+            _zmodemMatched = 0;
+        }
+    } else {
+        _zmodemMatched = (byte == ZMODEM_START[0]) ? 1 : 0;
+    }
+}
+
+void IncrementalDecoder::scanForZmodem(const char* data, int length)
+{
+    for (int i = 0; i < length; i++)
+        matchZmodem(data[i]);
+}
+
+int IncrementalDecoder::decodeUtf8(const char* data, int length)
+{
+    // each byte results in one character at most, except for 4 byte
+    // sequences which result in a surrogate pair
+    if (_text.size() < length + _pendingCount)
+        _text.resize(length + _pendingCount);
+
+    ushort* const start = reinterpret_cast<ushort*>(_text.data());
+    ushort* out = start;
+
+    const uchar* src = reinterpret_cast<const uchar*>(data);
+    const uchar* const end = src + length;
+
+    // complete the character which was split from the last block.  The
+    // bytes kept from the last block are decoded together with the first
+    // bytes of this block.
+    if (_pendingCount > 0) {
+        uchar head[2 * sizeof(_pending)];
+        const int pendingCount = _pendingCount;
+        const int headLength = pendingCount + qMin(length, int(sizeof(_pending)) - 1);
+        memcpy(head, _pending, pendingCount);
+        memcpy(head + pendingCount, src, headLength - pendingCount);
+
+        _pendingCount = 0;
+        _zmodemMatched = 0;
+
+        int pos = 0;
+        while (pos < pendingCount) {
+            const int used = decodeCharacter(head + pos, head + headLength, out);
+            if (used == 0) {
+                // this block ends before the character is complete
+                _pendingCount = headLength - pos;
+                memcpy(_pending, head + pos, _pendingCount);
+                break;
+            }
+            pos += used;
+        }
+
+        src = (_pendingCount > 0) ? end : src + pos - pendingCount;
+    }
+
+    while (src < end) {
+        // plain ASCII text is copied a machine word at a time, unless the
+        // z-modem start sequence needs to be matched
+        if (_zmodemMatched == 0) {
+            quint64 word;
+            while (end - src >= int(sizeof(word))) {
+                memcpy(&word, src, sizeof(word));
+                if (needsSlowPath(word))
+                    break;
+
+                for (uint i = 0; i < sizeof(word); i++)
+                    out[i] = src[i];
+                out += sizeof(word);
+                src += sizeof(word);
+            }
+
+            if (src == end)
+                break;
+        }
+
+        if (*src < 0x80) {
+            matchZmodem(*src);
+            *out++ = *src++;
+            continue;
+        }
+
+        const int used = decodeCharacter(src, end, out);
+        if (used == 0) {
+            _pendingCount = end - src;
+            memcpy(_pending, src, _pendingCount);
+            break;
+        }
+
+        _zmodemMatched = 0;
+        src += used;
+    }
+
+    int count = out - start;
+
+    // like QTextCodec, skip the byte order mark at the start of the stream
+    if (!_headerDone && count > 0) {
+        _headerDone = true;
+        if (start[0] == QChar::ByteOrderMark) {
+            memmove(start, start + 1, (count - 1) * sizeof(ushort));
+            count--;
+        }
+    }
+
+    return count;
+}
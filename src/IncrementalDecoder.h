@@ -0,0 +1,108 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef INCREMENTALDECODER_H
+#define INCREMENTALDECODER_H
+
+// Qt
+#include <QtCore/QString>
+
+// Konsole
+#include "konsoleprivate_export.h"
+
+class QTextCodec;
+class QTextDecoder;
+
+namespace Konsole
+{
+/**
+ * Decodes the output of a terminal program, which arrives in blocks of
+ * bytes, into UTF-16 characters.  Multi-byte characters may be split
+ * across blocks.
+ *
+ * The characters are written into a buffer which is reused for each
+ * block, so decoding does not allocate memory once the buffer is large
+ * enough.  UTF-8 is decoded directly, with a fast path which checks whole
+ * machine words for plain ASCII text.  Other encodings are decoded by the
+ * QTextDecoder of their codec.
+ *
+ * While decoding, the decoder also looks for the sequence which starts a
+ * z-modem transfer, see zmodemDetected().
+ */
+class KONSOLEPRIVATE_EXPORT IncrementalDecoder
+{
+public:
+    IncrementalDecoder();
+    ~IncrementalDecoder();
+
+    /**
+     * Sets the codec used to decode the bytes and discards any incomplete
+     * character of the previous codec.
+     */
+    void setCodec(const QTextCodec* codec);
+
+    /**
+     * Decodes @p length bytes from @p data and returns the number of
+     * characters which were decoded.  The characters are available from
+     * characters() until the next call to decode().
+     *
+     * Bytes at the end of @p data which start a character that is not
+     * complete yet are kept until the next call.
+     */
+    int decode(const char* data, int length);
+
+    /** Returns the characters decoded by the last call to decode() */
+    const ushort* characters() const {
+        return _text.utf16();
+    }
+
+    /**
+     * Returns true if the bytes passed to the last call to decode()
+     * completed the z-modem start sequence ("\030B00").
+     */
+    bool zmodemDetected() const {
+        return _zmodemDetected;
+    }
+
+private:
+    Q_DISABLE_COPY(IncrementalDecoder)
+
+    int decodeUtf8(const char* data, int length);
+    void matchZmodem(uchar byte);
+    void scanForZmodem(const char* data, int length);
+
+    // the decoder used for encodings other than UTF-8
+    QTextDecoder* _decoder;
+
+    QString _text;
+
+    // the bytes of an incomplete UTF-8 character
+    uchar _pending[4];
+    int _pendingCount;
+    // true once the first character of the stream has been decoded,
+    // a byte order mark is skipped before that
+    bool _headerDone;
+
+    // the number of characters of the z-modem start sequence matched so far
+    int _zmodemMatched;
+    bool _zmodemDetected;
+};
+}
+
+#endif // INCREMENTALDECODER_H
@@ -0,0 +1,65 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef JOBRUNNER_H
+#define JOBRUNNER_H
+
+// Qt
+#include <QtCore/QObject>
+#include <QtCore/QRunnable>
+#include <QtCore/QThreadPool>
+
+namespace Konsole
+{
+/**
+ * Runs the run() method of a job on a thread of the global thread pool.
+ *
+ * The job is a QObject which belongs to the main thread and reports its
+ * progress with signals, which are emitted by run() on the worker thread.
+ * The runnable deletes itself once run() has returned, and only then
+ * schedules the deletion of the job on the main thread, after the queued
+ * signals which the job has emitted.  The receivers of these signals can
+ * therefore still use the job, e.g. with sender().
+ */
+template <class Job>
+class JobRunner : public QRunnable
+{
+public:
+    /** Starts running @p job, which is deleted after it has finished. */
+    static void start(Job* job) {
+        QThreadPool::globalInstance()->start(new JobRunner<Job>(job));
+    }
+
+    virtual void run() {
+        _job->run();
+    }
+
+    virtual ~JobRunner() {
+        _job->deleteLater();
+    }
+
+private:
+    explicit JobRunner(Job* job)
+        : _job(job) {}
+
+    Job* _job;
+};
+}
+
+#endif // JOBRUNNER_H
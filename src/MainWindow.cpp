@@ -719,6 +719,10 @@ void MainWindow::applyKonsoleSettings()
 
     setAutoSaveSettings(QStringLiteral("MainWindow"), KonsoleSettings::saveGeometryOnExit());
 
+    SessionManager::instance()->setHistoryMemoryBudget(qint64(KonsoleSettings::scrollbackMemoryBudget()) * 1024 * 1024);
+    SessionManager::instance()->setHistorySearchIndexEnabled(KonsoleSettings::scrollbackSearchIndex());
+    SessionManager::instance()->setOutputThreadEnabled(KonsoleSettings::outputThread());
+
     updateWindowCaption();
 }
 
@@ -0,0 +1,129 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef OUTPUTLOCK_H
+#define OUTPUTLOCK_H
+
+// Qt
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QWaitCondition>
+
+namespace Konsole
+{
+/**
+ * The recursive lock which protects the screens and the history of an
+ * Emulation, see Emulation::setOutputThreadEnabled().
+ *
+ * The thread which processes the output takes the lock for every block of
+ * output it processes, and calls yield() between blocks.  yield() waits
+ * until the threads which are waiting for the lock have had it, so that
+ * the user interface is not starved by a terminal program which produces
+ * output without pause.
+ */
+class OutputLock
+{
+public:
+    OutputLock()
+        : _mutex(QMutex::Recursive)
+        , _waiting(0)
+        , _handOvers(0) {
+    }
+
+    void lock() {
+        if (_mutex.tryLock())
+            return;
+
+        {
+            QMutexLocker locker(&_stateMutex);
+            _waiting++;
+        }
+        _mutex.lock();
+        {
+            QMutexLocker locker(&_stateMutex);
+            _waiting--;
+            _handOvers++;
+            _handedOver.wakeAll();
+        }
+    }
+
+    bool tryLock() {
+        return _mutex.tryLock();
+    }
+
+    void unlock() {
+        _mutex.unlock();
+    }
+
+    /**
+     * Waits until the threads which are waiting for the lock have taken
+     * it.  Threads which start waiting meanwhile are not waited for.
+     * Must not be called while the lock is held.
+     */
+    void yield() {
+        QMutexLocker locker(&_stateMutex);
+        const quint64 handOvers = _handOvers + _waiting;
+        while (_handOvers < handOvers)
+            _handedOver.wait(&_stateMutex);
+    }
+
+    /**
+     * Returns the mutex of the lock, for objects which only need to
+     * exclude other threads, such as the history.
+     */
+    QMutex* mutex() {
+        return &_mutex;
+    }
+
+private:
+    Q_DISABLE_COPY(OutputLock)
+
+    QMutex _mutex;
+
+    // protects the number of threads waiting for the lock and the number
+    // of times it has been taken by one of them, see yield()
+    QMutex _stateMutex;
+    QWaitCondition _handedOver;
+    int _waiting;
+    quint64 _handOvers;
+};
+
+/** Holds an OutputLock for the duration of a scope, like QMutexLocker. */
+class OutputLocker
+{
+public:
+    explicit OutputLocker(OutputLock* lock)
+        : _lock(lock) {
+        if (_lock)
+            _lock->lock();
+    }
+
+    ~OutputLocker() {
+        if (_lock)
+            _lock->unlock();
+    }
+
+private:
+    Q_DISABLE_COPY(OutputLocker)
+
+    OutputLock* _lock;
+};
+}
+
+#endif // OUTPUTLOCK_H
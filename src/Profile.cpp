@@ -87,6 +87,8 @@ const Profile::PropertyInfo Profile::DefaultPropertyNames[] = {
     , { HistorySize , "HistorySize" , SCROLLING_GROUP , QVariant::Int }
     , { ScrollBarPosition , "ScrollBarPosition" , SCROLLING_GROUP , QVariant::Int }
     , { ScrollFullPage , "ScrollFullPage" , SCROLLING_GROUP , QVariant::Bool }
+    , { ReflowLines , "ReflowLines" , SCROLLING_GROUP , QVariant::Bool }
+    , { SaveOutputWithSession , "SaveOutputWithSession" , SCROLLING_GROUP , QVariant::Bool }
 
     // Terminal Features
     , { BlinkingTextEnabled , "BlinkingTextEnabled" , TERMINAL_GROUP , QVariant::Bool }
@@ -170,6 +172,8 @@ FallbackProfile::FallbackProfile()
     setProperty(HistorySize, 1000);
     setProperty(ScrollBarPosition, Enum::ScrollBarRight);
     setProperty(ScrollFullPage, false);
+    setProperty(ReflowLines, false);
+    setProperty(SaveOutputWithSession, false);
 
     setProperty(FlowControlEnabled, true);
     setProperty(BlinkingTextEnabled, true);
@@ -148,6 +148,16 @@ public:
 	 * height or half height.
          */
         ScrollFullPage,
+        /** (bool) Specifies whether the lines of the output and of the
+         * history are wrapped again when the width of the terminal changes.
+         * See Screen::setReflowLines()
+         */
+        ReflowLines,
+        /** (bool) Specifies whether the output of the terminal, including
+         * the scrollback, is saved to disk with the session when the
+         * desktop session is saved, so that it is restored with the session.
+         */
+        SaveOutputWithSession,
         /** (bool) Specifies whether the terminal will enable Bidirectional
          * text display
          */
@@ -35,6 +35,11 @@
 
 using Konsole::Pty;
 
+// the size of the blocks in which received data is passed on.  Data which
+// arrives faster than it is processed is left to the pty device, which
+// stops reading from the terminal process when it has a block buffered.
+static const int READ_BLOCK_SIZE = 64 * 1024;
+
 Pty::Pty(int masterFd, QObject* aParent)
     : KPtyProcess(masterFd, aParent)
 {
@@ -54,6 +59,10 @@ void Pty::init()
     _eraseChar     = 0;
     _xonXoff       = true;
     _utf8          = true;
+    _readSuspended = false;
+    _readScheduled = false;
+
+    _readBuffer.resize(READ_BLOCK_SIZE);
 
     setEraseChar(_eraseChar);
     setFlowControlEnabled(_xonXoff);
@@ -84,8 +93,50 @@ void Pty::sendData(const QByteArray& data)
 
 void Pty::dataReceived()
 {
-    QByteArray data = pty()->readAll();
-    emit receivedData(data.constData(), data.count());
+    // the rest of the buffered data is read later anyway
+    if (!_readScheduled)
+        readData();
+}
+
+void Pty::readData()
+{
+    _readScheduled = false;
+
+    if (!_readSuspended && pty()->masterFd() >= 0) {
+        const int length = int(pty()->read(_readBuffer.data(), _readBuffer.size()));
+        if (length > 0)
+            emit receivedData(_readBuffer.constData(), length);
+    }
+
+    updateReading();
+}
+
+void Pty::updateReading()
+{
+    if (pty()->masterFd() < 0)
+        return;
+
+    const qint64 buffered = pty()->bytesAvailable();
+    pty()->setSuspended(_readSuspended || buffered >= READ_BLOCK_SIZE);
+
+    if (!_readSuspended && buffered > 0 && !_readScheduled) {
+        _readScheduled = true;
+        QMetaObject::invokeMethod(this, "readData", Qt::QueuedConnection);
+    }
+}
+
+void Pty::setReadSuspended(bool suspended)
+{
+    if (_readSuspended == suspended)
+        return;
+
+    _readSuspended = suspended;
+    updateReading();
+}
+
+bool Pty::isReadSuspended() const
+{
+    return _readSuspended;
 }
 
 void Pty::setWindowSize(int columns, int lines)
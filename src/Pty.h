@@ -141,6 +141,12 @@ public:
      */
     void closePty();
 
+    /**
+     * Returns true if reading from the teletype is suspended.
+     * See setReadSuspended()
+     */
+    bool isReadSuspended() const;
+
 public slots:
     /**
      * Put the pty into UTF-8 mode on systems which support it.
@@ -155,10 +161,19 @@ public slots:
      */
     void sendData(const QByteArray& data);
 
+    /**
+     * Suspends or resumes reading from the teletype.  While reading is
+     * suspended, the kernel makes the process which writes to the
+     * teletype wait once the teletype's buffer is full.
+     */
+    void setReadSuspended(bool suspended);
+
 signals:
     /**
      * Emitted when a new block of data is received from
-     * the teletype.
+     * the teletype.  Large amounts of data are split into blocks
+     * which are emitted in turns of the event loop, so that other
+     * events are handled in between.
      *
      * @param buffer Pointer to the data received.
      * @param length Length of @p buffer
@@ -171,10 +186,16 @@ protected:
 private slots:
     // called when data is received from the terminal process
     void dataReceived();
+    // emits the next block of the data buffered by the pty device
+    void readData();
 
 private:
     void init();
 
+    // schedules readData() while there is buffered data, and stops the pty
+    // device from reading more while it has enough buffered already
+    void updateReading();
+
     // takes a list of key=value pairs and adds them
     // to the environment for the process
     void addEnvironmentVariables(const QStringList& environment);
@@ -184,6 +205,11 @@ private:
     char _eraseChar;
     bool _xonXoff;
     bool _utf8;
+
+    // reused for each block of received data
+    QByteArray _readBuffer;
+    bool _readSuspended;
+    bool _readScheduled;
 };
 }
 
@@ -25,11 +25,16 @@
 
 // Qt
 #include <QtCore/QTextStream>
+#include <QtCore/QDataStream>
+
+// Standard
+#include <algorithm>
 
 // Konsole
 #include "konsole_wcwidth.h"
 #include "TerminalCharacterDecoder.h"
 #include "History.h"
+#include "HistorySearchIndex.h"
 #include "ExtendedCharTable.h"
 
 using namespace Konsole;
@@ -51,6 +56,13 @@ const bool BS_CLEARS = false;
 #define loc(X,Y) ((Y)*_columns+(X))
 #endif
 
+// returns true if the position at 'column' of 'line' comes before the
+// position at 'otherColumn' of 'otherLine'
+static inline bool isBefore(qint64 line, int column, qint64 otherLine, int otherColumn)
+{
+    return line < otherLine || (line == otherLine && column < otherColumn);
+}
+
 const Character Screen::DefaultChar = Character(' ',
                                       CharacterColor(COLOR_SPACE_DEFAULT, DEFAULT_FORE_COLOR),
                                       CharacterColor(COLOR_SPACE_DEFAULT, DEFAULT_BACK_COLOR),
@@ -62,18 +74,25 @@ Screen::Screen(int lines, int columns):
     _columns(columns),
     _screenLines(new ImageLine[_lines + 1]),
     _screenLinesSize(_lines),
+    _screenLinesHead(0),
     _scrolledLines(0),
     _droppedLines(0),
     _history(new HistoryScrollNone()),
+    _searchIndex(0),
     _cuX(0),
     _cuY(0),
     _currentRendition(DEFAULT_RENDITION),
     _topMargin(0),
     _bottomMargin(0),
-    _selBegin(0),
-    _selTopLeft(0),
-    _selBottomRight(0),
+    _selBeginLine(-1),
+    _selBeginColumn(0),
+    _selTopLine(-1),
+    _selTopColumn(0),
+    _selBottomLine(-1),
+    _selBottomColumn(0),
     _blockSelectionMode(false),
+    _histLinesAdded(0),
+    _reflowLines(false),
     _effectiveForeground(CharacterColor()),
     _effectiveBackground(CharacterColor()),
     _effectiveRendition(DEFAULT_RENDITION),
@@ -92,6 +111,7 @@ Screen::~Screen()
 {
     delete[] _screenLines;
     delete _history;
+    delete _searchIndex;
 }
 
 void Screen::cursorUp(int n)
@@ -194,16 +214,16 @@ void Screen::deleteChars(int n)
         n = 1;
 
     // if cursor is beyond the end of the line there is nothing to do
-    if (_cuX >= _screenLines[_cuY].count())
+    if (_cuX >= screenLine(_cuY).count())
         return;
 
-    if (_cuX + n > _screenLines[_cuY].count())
-        n = _screenLines[_cuY].count() - _cuX;
+    if (_cuX + n > screenLine(_cuY).count())
+        n = screenLine(_cuY).count() - _cuX;
 
     Q_ASSERT(n >= 0);
-    Q_ASSERT(_cuX + n <= _screenLines[_cuY].count());
+    Q_ASSERT(_cuX + n <= screenLine(_cuY).count());
 
-    _screenLines[_cuY].remove(_cuX, n);
+    screenLine(_cuY).remove(_cuX, n);
 
     // Append space(s) with current attributes
     Character spaceWithCurrentAttrs(' ', _effectiveForeground,
@@ -211,20 +231,20 @@ void Screen::deleteChars(int n)
                                     _effectiveRendition, false);
 
     for (int i = 0; i < n; i++)
-        _screenLines[_cuY].append(spaceWithCurrentAttrs);
+        screenLine(_cuY).append(spaceWithCurrentAttrs);
 }
 
 void Screen::insertChars(int n)
 {
     if (n == 0) n = 1; // Default
 
-    if (_screenLines[_cuY].size() < _cuX)
-        _screenLines[_cuY].resize(_cuX);
+    if (screenLine(_cuY).size() < _cuX)
+        screenLine(_cuY).resize(_cuX);
 
-    _screenLines[_cuY].insert(_cuX, n, Character(' '));
+    screenLine(_cuY).insert(_cuX, n, Character(' '));
 
-    if (_screenLines[_cuY].count() > _columns)
-        _screenLines[_cuY].resize(_columns);
+    if (screenLine(_cuY).count() > _columns)
+        screenLine(_cuY).resize(_columns);
 }
 
 void Screen::deleteLines(int n)
@@ -299,6 +319,12 @@ void Screen::resizeImage(int new_lines, int new_columns)
 {
     if ((new_lines == _lines) && (new_columns == _columns)) return;
 
+    if (_reflowLines && new_columns != _columns) {
+        clearSelection();
+        _history = MigratingHistoryScroll::reflow(_history, new_columns);
+        reflowScreen(new_columns);
+    }
+
     if (_cuY > new_lines - 1) {
         // attempt to preserve focus and _lines
         _bottomMargin = _lines - 1; //FIXME: margin lost
@@ -311,20 +337,23 @@ void Screen::resizeImage(int new_lines, int new_columns)
     // create new screen _lines and copy from old to new
 
     ImageLine* newScreenLines = new ImageLine[new_lines + 1];
-    for (int i = 0; i < qMin(_lines, new_lines + 1) ; i++)
-        newScreenLines[i] = _screenLines[i];
-    for (int i = _lines; (i > 0) && (i < new_lines + 1); i++)
+    QVarLengthArray<LineProperty, 64> newLineProperties(new_lines + 1);
+    for (int i = 0; i < qMin(_lines, new_lines + 1) ; i++) {
+        newScreenLines[i].swap(screenLine(i));
+        newLineProperties[i] = lineProperty(i);
+    }
+    for (int i = _lines; (i > 0) && (i < new_lines + 1); i++) {
         newScreenLines[i].resize(new_columns);
-
-    _lineProperties.resize(new_lines + 1);
-    for (int i = _lines; (i > 0) && (i < new_lines + 1); i++)
-        _lineProperties[i] = LINE_DEFAULT;
+        newLineProperties[i] = LINE_DEFAULT;
+    }
 
     clearSelection();
 
     delete[] _screenLines;
     _screenLines = newScreenLines;
     _screenLinesSize = new_lines;
+    _screenLinesHead = 0;
+    _lineProperties = newLineProperties;
 
     _lines = new_lines;
     _columns = new_columns;
@@ -338,6 +367,117 @@ void Screen::resizeImage(int new_lines, int new_columns)
     clearSelection();
 }
 
+void Screen::setReflowLines(bool reflow)
+{
+    _reflowLines = reflow;
+}
+
+int Screen::wrappedLength(const Character* cells, int count, int columns)
+{
+    if (count <= columns)
+        return count;
+
+    // the second half of a double width character has no character of its own
+    if (columns > 1 && cells[columns].character == 0 && !cells[columns].isRealCharacter)
+        return columns - 1;
+
+    return columns;
+}
+
+void Screen::reflowScreen(int columns)
+{
+    // the empty lines below the cursor are not part of the output
+    int lastLine = _cuY;
+    for (int y = _lines - 1; y > lastLine; y--) {
+        if (!screenLine(y).isEmpty()) {
+            lastLine = y;
+            break;
+        }
+    }
+
+    QVector<ImageLine> lines;
+    QVector<LineProperty> properties;
+    int cursorLine = 0;
+    int cursorColumn = 0;
+
+    ImageLine logicalLine;
+    int y = 0;
+    while (y <= lastLine) {
+        const LineProperty property = lineProperty(y) & ~LINE_WRAPPED;
+
+        // join the line with the lines it is wrapped into
+        logicalLine.resize(0);
+        int cursorOffset = -1;
+        bool wrapped = true;
+        while (wrapped && y <= lastLine) {
+            const ImageLine& line = screenLine(y);
+            wrapped = lineProperty(y) & LINE_WRAPPED;
+            if (y == _cuY)
+                cursorOffset = logicalLine.count() + _cuX;
+
+            logicalLine += line;
+            // a wrapped line takes up the whole width, even if it has fewer cells
+            if (wrapped && line.count() < _columns)
+                logicalLine.insert(logicalLine.end(), _columns - line.count(), Screen::DefaultChar);
+            y++;
+        }
+
+        int pos = 0;
+        do {
+            const int length = wrappedLength(logicalLine.constData() + pos, logicalLine.count() - pos, columns);
+            if (cursorOffset >= pos && cursorOffset < pos + length) {
+                cursorLine = lines.count();
+                cursorColumn = cursorOffset - pos;
+                cursorOffset = -1;
+            }
+
+            const bool more = pos + length < logicalLine.count();
+            lines << logicalLine.mid(pos, length);
+            properties << LineProperty(property | ((more || wrapped) ? LINE_WRAPPED : 0));
+            pos += length;
+        } while (pos < logicalLine.count());
+
+        // the cursor is after the end of the text
+        if (cursorOffset != -1) {
+            const int lastLength = lines.last().count();
+            const int lastStart = pos - lastLength;
+            const int offset = cursorOffset - lastStart;
+            cursorLine = lines.count() - 1 + offset / columns;
+            cursorColumn = offset % columns;
+            while (lines.count() <= cursorLine) {
+                properties.last() = LineProperty(properties.last() & ~LINE_WRAPPED);
+                lines << ImageLine();
+                properties << property;
+            }
+        }
+    }
+
+    // the lines which do not fit onto the screen any more are moved into the
+    // history, as far as the cursor line stays on the screen
+    const int historyLines = qBound(0, lines.count() - _lines, cursorLine);
+    for (int i = 0; i < historyLines; i++) {
+        screenLine(0).swap(lines[i]);
+        lineProperty(0) = properties[i];
+        addHistLine();
+    }
+    _histLinesAdded = 0;
+
+    for (int line = 0; line < _lines; line++) {
+        const int i = historyLines + line;
+        if (i < lines.count()) {
+            screenLine(line).swap(lines[i]);
+            lineProperty(line) = properties[i];
+        } else {
+            screenLine(line).resize(0);
+            lineProperty(line) = LINE_DEFAULT;
+        }
+    }
+
+    _cuY = cursorLine - historyLines;
+    _cuX = cursorColumn;
+    _lastPos = -1;
+}
+
 void Screen::setDefaultMargins()
 {
     _topMargin = 0;
@@ -378,15 +518,6 @@ void Screen::setDefaultMargins()
    into RE_BOLD and RE_INTENSIVE.
    */
 
-void Screen::reverseRendition(Character& p) const
-{
-    CharacterColor f = p.foregroundColor;
-    CharacterColor b = p.backgroundColor;
-
-    p.foregroundColor = b;
-    p.backgroundColor = f; //p->r &= ~RE_TRANSPARENT;
-}
-
 void Screen::updateEffectiveRendition()
 {
     _effectiveRendition = _currentRendition;
@@ -414,15 +545,6 @@ void Screen::copyFromHistory(Character* dest, int startLine, int count) const
 
         for (int column = length; column < _columns; column++)
             dest[destLineOffset + column] = Screen::DefaultChar;
-
-        // invert selected text
-        if (_selBegin != -1) {
-            for (int column = 0; column < _columns; column++) {
-                if (isSelected(column, line)) {
-                    reverseRendition(dest[destLineOffset + column]);
-                }
-            }
-        }
     }
 }
 
@@ -438,11 +560,7 @@ void Screen::copyFromScreen(Character* dest , int startLine , int count) const
             int srcIndex = srcLineStartIndex + column;
             int destIndex = destLineStartIndex + column;
 
-            dest[destIndex] = _screenLines[srcIndex / _columns].value(srcIndex % _columns, Screen::DefaultChar);
-
-            // invert selected text
-            if (_selBegin != -1 && isSelected(column, line + _history->getLines()))
-                reverseRendition(dest[destIndex]);
+            dest[destIndex] = screenLine(srcIndex / _columns).value(srcIndex % _columns, Screen::DefaultChar);
         }
     }
 }
@@ -506,7 +624,7 @@ QVector<LineProperty> Screen::getLineProperties(int startLine , int endLine) con
     // copy properties for _lines in screen buffer
     const int firstScreenLine = startLine + linesInHistory - _history->getLines();
     for (int line = firstScreenLine; line < firstScreenLine + linesInScreen; line++) {
-        result[index] = _lineProperties[line];
+        result[index] = lineProperty(line);
         index++;
     }
 
@@ -549,12 +667,12 @@ void Screen::backspace()
     _cuX = qMin(_columns - 1, _cuX); // nowrap!
     _cuX = qMax(0, _cuX - 1);
 
-    if (_screenLines[_cuY].size() < _cuX + 1)
-        _screenLines[_cuY].resize(_cuX + 1);
+    if (screenLine(_cuY).size() < _cuX + 1)
+        screenLine(_cuY).resize(_cuX + 1);
 
     if (BS_CLEARS) {
-        _screenLines[_cuY][_cuX].character = ' ';
-        _screenLines[_cuY][_cuX].rendition = _screenLines[_cuY][_cuX].rendition & ~RE_EXTENDED_CHAR;
+        screenLine(_cuY)[_cuX].character = ' ';
+        screenLine(_cuY)[_cuX].rendition = screenLine(_cuY)[_cuX].rendition & ~RE_EXTENDED_CHAR;
     }
 }
 
@@ -618,11 +736,12 @@ void Screen::newLine()
 
 void Screen::checkSelection(int from, int to)
 {
-    if (_selBegin == -1)
+    if (_selTopLine == -1)
         return;
-    const int scr_TL = loc(0, _history->getLines());
+    const qint64 screenTop = screenTopLine();
     //Clear entire selection if it overlaps region [from, to]
-    if ((_selBottomRight >= (from + scr_TL)) && (_selTopLeft <= (to + scr_TL)))
+    if (!isBefore(_selBottomLine, _selBottomColumn, screenTop + from / _columns, from % _columns) &&
+            !isBefore(screenTop + to / _columns, to % _columns, _selTopLine, _selTopColumn))
         clearSelection();
 }
 
@@ -644,7 +763,7 @@ void Screen::displayCharacter(unsigned short c)
         if (_cuX == 0) {
             // We are at the beginning of a line, check
             // if previous line has a character at the end we can combine with
-            if (_cuY > 0 && _columns == _screenLines[_cuY - 1].size()) {
+            if (_cuY > 0 && _columns == screenLine(_cuY - 1).size()) {
                 charToCombineWithX = _columns - 1;
                 charToCombineWithY = _cuY - 1;
             } else {
@@ -659,11 +778,11 @@ void Screen::displayCharacter(unsigned short c)
         }
 
         // Prevent "cat"ing binary files from causing crashes.
-        if (charToCombineWithX >= _screenLines[charToCombineWithY].size()) {
+        if (charToCombineWithX >= screenLine(charToCombineWithY).size()) {
             return;
         }
 
-        Character& currentChar = _screenLines[charToCombineWithY][charToCombineWithX];
+        Character& currentChar = screenLine(charToCombineWithY)[charToCombineWithX];
         if ((currentChar.rendition & RE_EXTENDED_CHAR) == 0) {
             const ushort chars[2] = { currentChar.character, c };
             currentChar.rendition |= RE_EXTENDED_CHAR;
@@ -687,7 +806,7 @@ void Screen::displayCharacter(unsigned short c)
 
     if (_cuX + w > _columns) {
         if (getMode(MODE_Wrap)) {
-            _lineProperties[_cuY] = (LineProperty)(_lineProperties[_cuY] | LINE_WRAPPED);
+            lineProperty(_cuY) = (LineProperty)(lineProperty(_cuY) | LINE_WRAPPED);
             nextLine();
         } else {
             _cuX = _columns - w;
@@ -695,8 +814,8 @@ void Screen::displayCharacter(unsigned short c)
     }
 
     // ensure current line vector has enough elements
-    if (_screenLines[_cuY].size() < _cuX + w) {
-        _screenLines[_cuY].resize(_cuX + w);
+    if (screenLine(_cuY).size() < _cuX + w) {
+        screenLine(_cuY).resize(_cuX + w);
     }
 
     if (getMode(MODE_Insert)) insertChars(w);
@@ -706,7 +825,7 @@ void Screen::displayCharacter(unsigned short c)
     // check if selection is still valid.
     checkSelection(_lastPos, _lastPos);
 
-    Character& currentChar = _screenLines[_cuY][_cuX];
+    Character& currentChar = screenLine(_cuY)[_cuX];
 
     currentChar.character = c;
     currentChar.foregroundColor = _effectiveForeground;
@@ -719,10 +838,10 @@ void Screen::displayCharacter(unsigned short c)
     while (w) {
         i++;
 
-        if (_screenLines[_cuY].size() < _cuX + i + 1)
-            _screenLines[_cuY].resize(_cuX + i + 1);
+        if (screenLine(_cuY).size() < _cuX + i + 1)
+            screenLine(_cuY).resize(_cuX + i + 1);
 
-        Character& ch = _screenLines[_cuY][_cuX + i];
+        Character& ch = screenLine(_cuY)[_cuX + i];
         ch.character = 0;
         ch.foregroundColor = _effectiveForeground;
         ch.backgroundColor = _effectiveBackground;
@@ -734,6 +853,75 @@ void Screen::displayCharacter(unsigned short c)
     _cuX = newCursorX;
 }
 
+void Screen::displayString(const unsigned short* chars, int count)
+{
+    // inserting characters moves the rest of the line for each of them
+    if (getMode(MODE_Insert)) {
+        for (int i = 0; i < count; i++)
+            displayCharacter(chars[i]);
+        return;
+    }
+
+    QVarLengthArray<quint8, 256> widths;
+
+    int i = 0;
+    while (i < count) {
+        // find the characters which fit onto the current line
+        widths.clear();
+        int width = 0;
+        int end = i;
+        while (end < count) {
+            const unsigned short c = chars[end];
+            const int w = (c >= 0x20 && c < 0x7f) ? 1 : konsole_wcwidth(c);
+            if (w <= 0 || _cuX + width + w > _columns)
+                break;
+
+            widths.append(w);
+            width += w;
+            end++;
+        }
+
+        // characters which are combined with the previous one, which are
+        // not printable or which wrap are displayed one at a time
+        if (end == i) {
+            displayCharacter(chars[i]);
+            i++;
+            continue;
+        }
+
+        // ensure current line vector has enough elements
+        ImageLine& line = screenLine(_cuY);
+        if (line.size() < _cuX + width)
+            line.resize(_cuX + width);
+
+        // check if selection is still valid.
+        checkSelection(loc(_cuX, _cuY), loc(_cuX + width - 1, _cuY));
+
+        Character* currentChar = line.data() + _cuX;
+        for (int j = 0; j < widths.count(); j++) {
+            currentChar->character = chars[i + j];
+            currentChar->foregroundColor = _effectiveForeground;
+            currentChar->backgroundColor = _effectiveBackground;
+            currentChar->rendition = _effectiveRendition;
+            currentChar->isRealCharacter = true;
+            currentChar++;
+
+            for (int k = 1; k < widths[j]; k++) {
+                currentChar->character = 0;
+                currentChar->foregroundColor = _effectiveForeground;
+                currentChar->backgroundColor = _effectiveBackground;
+                currentChar->rendition = _effectiveRendition;
+                currentChar->isRealCharacter = false;
+                currentChar++;
+            }
+        }
+
+        _cuX += width;
+        _lastPos = loc(_cuX - widths.last(), _cuY);
+        i = end;
+    }
+}
+
 int Screen::scrolledLines() const
 {
     return _scrolledLines;
@@ -750,6 +938,38 @@ void Screen::resetScrolledLines()
 {
     _scrolledLines = 0;
 }
+void Screen::resetReflowedLines()
+{
+    _reflowedLines = ReflowedLines();
+}
+
+ReflowedLines Screen::updateReflowedLines()
+{
+    MigratingHistoryScroll* migrating = dynamic_cast<MigratingHistoryScroll*>(_history);
+    if (!migrating)
+        return ReflowedLines();
+
+    const ReflowedLines lines = migrating->takeReflowedLines();
+    if (lines.isEmpty())
+        return lines;
+
+    _reflowedLines.add(lines);
+    _droppedLines += lines.droppedCount;
+
+    // the selection moves along with its lines
+    if (_selTopLine != -1) {
+        _selBeginLine = lines.map(_selBeginLine);
+        _selTopLine = lines.map(_selTopLine);
+        _selBottomLine = lines.map(_selBottomLine);
+    }
+
+    // the lines of the search index do not match the lines of the history
+    // any more
+    if (_searchIndex)
+        _searchIndex->reset(_history->droppedLineCount() + _history->getLines());
+
+    return lines;
+}
 
 void Screen::scrollUp(int n)
 {
@@ -765,13 +985,25 @@ QRect Screen::lastScrolledRegion() const
 
 void Screen::scrollUp(int from, int n)
 {
-    if (n <= 0 || from + n > _bottomMargin) return;
+    if (n <= 0 || from + n > _bottomMargin) {
+        // the first line may have been added to the history even so
+        moveSelection(from, from, 0);
+        return;
+    }
 
     _scrolledLines -= n;
     _lastScrolledRegion = QRect(0, _topMargin, _columns - 1, (_bottomMargin - _topMargin));
 
     //FIXME: make sure `topMargin', `bottomMargin', `from', `n' is in bounds.
-    moveImage(loc(0, from), loc(0, from + n), loc(_columns - 1, _bottomMargin));
+    if (from == 0 && _bottomMargin == _lines - 1) {
+        // the whole screen scrolls, which only moves the start of the ring
+        // of lines.  The lines which were at the top become the bottom lines
+        // and are cleared below.
+        _screenLinesHead = (_screenLinesHead + n) % _lines;
+        imageMoved(loc(0, from), loc(0, from + n), loc(_columns - 1, _bottomMargin));
+    } else {
+        moveImage(loc(0, from), loc(0, from + n), loc(_columns - 1, _bottomMargin));
+    }
     clearImage(loc(0, _bottomMargin - n + 1), loc(_columns - 1, _bottomMargin), ' ');
 }
 
@@ -839,12 +1071,15 @@ int Screen::getCursorY() const
 
 void Screen::clearImage(int loca, int loce, char c)
 {
-    const int scr_TL = loc(0, _history->getLines());
     //FIXME: check positions
 
     //Clear entire selection if it overlaps region to be moved...
-    if ((_selBottomRight > (loca + scr_TL)) && (_selTopLeft < (loce + scr_TL))) {
-        clearSelection();
+    if (_selTopLine != -1) {
+        const qint64 screenTop = screenTopLine();
+        if (isBefore(screenTop + loca / _columns, loca % _columns, _selBottomLine, _selBottomColumn) &&
+                isBefore(_selTopLine, _selTopColumn, screenTop + loce / _columns, loce % _columns)) {
+            clearSelection();
+        }
     }
 
     const int topLine = loca / _columns;
@@ -857,12 +1092,12 @@ void Screen::clearImage(int loca, int loce, char c)
     const bool isDefaultCh = (clearCh == Screen::DefaultChar);
 
     for (int y = topLine; y <= bottomLine; y++) {
-        _lineProperties[y] = 0;
+        lineProperty(y) = 0;
 
         const int endCol = (y == bottomLine) ? loce % _columns : _columns - 1;
         const int startCol = (y == topLine) ? loca % _columns : 0;
 
-        QVector<Character>& line = _screenLines[y];
+        QVector<Character>& line = screenLine(y);
 
         if (isDefaultCh && endCol == _columns - 1) {
             line.resize(startCol);
@@ -870,9 +1105,7 @@ void Screen::clearImage(int loca, int loce, char c)
             if (line.size() < endCol + 1)
                 line.resize(endCol + 1);
 
-            Character* data = line.data();
-            for (int i = startCol; i <= endCol; i++)
-                data[i] = clearCh;
+            std::fill(line.begin() + startCol, line.begin() + endCol + 1, clearCh);
         }
     }
 }
@@ -888,18 +1121,27 @@ void Screen::moveImage(int dest, int sourceBegin, int sourceEnd)
     //so it matters that we do the copy in the right order -
     //forwards if dest < sourceBegin or backwards otherwise.
     //(search the web for 'memmove implementation' for details)
+    //The lines are swapped rather than copied, the lines which are left
+    //behind in the source area are cleared by the caller.
     if (dest < sourceBegin) {
         for (int i = 0; i <= lines; i++) {
-            _screenLines[(dest / _columns) + i ] = _screenLines[(sourceBegin / _columns) + i ];
-            _lineProperties[(dest / _columns) + i] = _lineProperties[(sourceBegin / _columns) + i];
+            screenLine((dest / _columns) + i).swap(screenLine((sourceBegin / _columns) + i));
+            lineProperty((dest / _columns) + i) = lineProperty((sourceBegin / _columns) + i);
         }
     } else {
         for (int i = lines; i >= 0; i--) {
-            _screenLines[(dest / _columns) + i ] = _screenLines[(sourceBegin / _columns) + i ];
-            _lineProperties[(dest / _columns) + i] = _lineProperties[(sourceBegin / _columns) + i];
+            screenLine((dest / _columns) + i).swap(screenLine((sourceBegin / _columns) + i));
+            lineProperty((dest / _columns) + i) = lineProperty((sourceBegin / _columns) + i);
         }
     }
 
+    imageMoved(dest, sourceBegin, sourceEnd);
+}
+
+void Screen::imageMoved(int dest, int sourceBegin, int sourceEnd)
+{
+    const int lines = (sourceEnd - sourceBegin) / _columns;
+
     if (_lastPos != -1) {
         const int diff = dest - sourceBegin; // Scroll by this amount
         _lastPos += diff;
@@ -907,40 +1149,57 @@ void Screen::moveImage(int dest, int sourceBegin, int sourceEnd)
             _lastPos = -1;
     }
 
-    // Adjust selection to follow scroll.
-    if (_selBegin != -1) {
-        const bool beginIsTL = (_selBegin == _selTopLeft);
-        const int diff = dest - sourceBegin; // Scroll by this amount
-        const int scr_TL = loc(0, _history->getLines());
-        const int srca = sourceBegin + scr_TL; // Translate index from screen to global
-        const int srce = sourceEnd + scr_TL; // Translate index from screen to global
-        const int desta = srca + diff;
-        const int deste = srce + diff;
-
-        if ((_selTopLeft >= srca) && (_selTopLeft <= srce))
-            _selTopLeft += diff;
-        else if ((_selTopLeft >= desta) && (_selTopLeft <= deste))
-            _selBottomRight = -1; // Clear selection (see below)
-
-        if ((_selBottomRight >= srca) && (_selBottomRight <= srce))
-            _selBottomRight += diff;
-        else if ((_selBottomRight >= desta) && (_selBottomRight <= deste))
-            _selBottomRight = -1; // Clear selection (see below)
-
-        if (_selBottomRight < 0) {
+    moveSelection(sourceBegin / _columns, sourceEnd / _columns, (dest - sourceBegin) / _columns);
+}
+
+void Screen::moveSelection(int sourceTop, int sourceBottom, int diff)
+{
+    const int histLinesAdded = _histLinesAdded;
+    _histLinesAdded = 0;
+
+    // Adjust selection to follow scroll.  When the whole screen scrolls into
+    // the history the absolute line numbers of the selection stay the same.
+    if (_selTopLine != -1) {
+        const bool beginIsTL = (_selBeginLine == _selTopLine && _selBeginColumn == _selTopColumn);
+
+        if (!moveSelectedLine(_selTopLine, histLinesAdded, sourceTop, sourceBottom, diff) ||
+                !moveSelectedLine(_selBottomLine, histLinesAdded, sourceTop, sourceBottom, diff)) {
             clearSelection();
+        } else if (beginIsTL) {
+            _selBeginLine = _selTopLine;
+            _selBeginColumn = _selTopColumn;
         } else {
-            if (_selTopLeft < 0)
-                _selTopLeft = 0;
+            _selBeginLine = _selBottomLine;
+            _selBeginColumn = _selBottomColumn;
         }
-
-        if (beginIsTL)
-            _selBegin = _selTopLeft;
-        else
-            _selBegin = _selBottomRight;
     }
 }
 
+bool Screen::moveSelectedLine(qint64& line, int histLinesAdded, int sourceTop, int sourceBottom, int lines) const
+{
+    const qint64 screenTop = screenTopLine();
+    // the line on the screen before the lines were added to the history
+    const qint64 oldLine = line - (screenTop - histLinesAdded);
+
+    // the line is in the history
+    if (oldLine < histLinesAdded)
+        return true;
+
+    if (oldLine >= sourceTop && oldLine <= sourceBottom)
+        line = screenTop + oldLine + lines;
+    else if (oldLine >= sourceTop + lines && oldLine <= sourceBottom + lines)
+        return false;
+    else
+        line = screenTop + oldLine;
+
+    return true;
+}
+
+qint64 Screen::screenTopLine() const
+{
+    return _history->droppedLineCount() + _history->getLines();
+}
+
 void Screen::clearToEndOfScreen()
 {
     clearImage(loc(_cuX, _cuY), loc(_columns - 1, _lines - 1), ' ');
@@ -1028,16 +1287,16 @@ void Screen::setBackColor(int space, int color)
 
 void Screen::clearSelection()
 {
-    _selBottomRight = -1;
-    _selTopLeft = -1;
-    _selBegin = -1;
+    _selBottomLine = -1;
+    _selTopLine = -1;
+    _selBeginLine = -1;
 }
 
 void Screen::getSelectionStart(int& column , int& line) const
 {
-    if (_selTopLeft != -1) {
-        column = _selTopLeft % _columns;
-        line = _selTopLeft / _columns;
+    if (_selTopLine != -1) {
+        column = _selTopColumn;
+        line = _selTopLine - _history->droppedLineCount();
     } else {
         column = _cuX + getHistLines();
         line = _cuY + getHistLines();
@@ -1045,9 +1304,9 @@ void Screen::getSelectionStart(int& column , int& line) const
 }
 void Screen::getSelectionEnd(int& column , int& line) const
 {
-    if (_selBottomRight != -1) {
-        column = _selBottomRight % _columns;
-        line = _selBottomRight / _columns;
+    if (_selBottomLine != -1) {
+        column = _selBottomColumn;
+        line = _selBottomLine - _history->droppedLineCount();
     } else {
         column = _cuX + getHistLines();
         line = _cuY + getHistLines();
@@ -1055,56 +1314,83 @@ void Screen::getSelectionEnd(int& column , int& line) const
 }
 void Screen::setSelectionStart(const int x, const int y, const bool blockSelectionMode)
 {
-    _selBegin = loc(x, y);
+    _selBeginLine = _history->droppedLineCount() + y;
+    _selBeginColumn = x;
     /* FIXME, HACK to correct for x too far to the right... */
-    if (x == _columns) _selBegin--;
+    if (x == _columns) _selBeginColumn--;
 
-    _selBottomRight = _selBegin;
-    _selTopLeft = _selBegin;
+    _selBottomLine = _selTopLine = _selBeginLine;
+    _selBottomColumn = _selTopColumn = _selBeginColumn;
     _blockSelectionMode = blockSelectionMode;
 }
 
 void Screen::setSelectionEnd(const int x, const int y)
 {
-    if (_selBegin == -1)
+    if (_selBeginLine == -1)
         return;
 
-    int endPos =  loc(x, y);
-
-    if (endPos < _selBegin) {
-        _selTopLeft = endPos;
-        _selBottomRight = _selBegin;
+    const qint64 endLine = _history->droppedLineCount() + y;
+    int endColumn = x;
+    /* FIXME, HACK to correct for x too far to the right... */
+    if (x == _columns)
+        endColumn--;
+
+    if (isBefore(endLine, endColumn, _selBeginLine, _selBeginColumn)) {
+        _selTopLine = endLine;
+        _selTopColumn = endColumn;
+        _selBottomLine = _selBeginLine;
+        _selBottomColumn = _selBeginColumn;
     } else {
-        /* FIXME, HACK to correct for x too far to the right... */
-        if (x == _columns)
-            endPos--;
-
-        _selTopLeft = _selBegin;
-        _selBottomRight = endPos;
+        _selTopLine = _selBeginLine;
+        _selTopColumn = _selBeginColumn;
+        _selBottomLine = endLine;
+        _selBottomColumn = endColumn;
     }
 
     // Normalize the selection in column mode
     if (_blockSelectionMode) {
-        const int topRow = _selTopLeft / _columns;
-        const int topColumn = _selTopLeft % _columns;
-        const int bottomRow = _selBottomRight / _columns;
-        const int bottomColumn = _selBottomRight % _columns;
+        const int topColumn = _selTopColumn;
+        const int bottomColumn = _selBottomColumn;
 
-        _selTopLeft = loc(qMin(topColumn, bottomColumn), topRow);
-        _selBottomRight = loc(qMax(topColumn, bottomColumn), bottomRow);
+        _selTopColumn = qMin(topColumn, bottomColumn);
+        _selBottomColumn = qMax(topColumn, bottomColumn);
     }
 }
 
 bool Screen::isSelected(const int x, const int y) const
 {
-    bool columnInSelection = true;
+    if (_selTopLine == -1)
+        return false;
+
+    const qint64 line = _history->droppedLineCount() + y;
+
     if (_blockSelectionMode) {
-        columnInSelection = x >= (_selTopLeft % _columns) &&
-                            x <= (_selBottomRight % _columns);
+        return line >= _selTopLine && line <= _selBottomLine &&
+               x >= _selTopColumn && x <= _selBottomColumn;
     }
 
-    const int pos = loc(x, y);
-    return pos >= _selTopLeft && pos <= _selBottomRight && columnInSelection;
+    return !isBefore(line, x, _selTopLine, _selTopColumn) &&
+           !isBefore(_selBottomLine, _selBottomColumn, line, x);
+}
+
+bool Screen::getSelectedColumns(const int line, int& startColumn, int& endColumn) const
+{
+    if (_selTopLine == -1)
+        return false;
+
+    const qint64 absoluteLine = _history->droppedLineCount() + line;
+    if (absoluteLine < _selTopLine || absoluteLine > _selBottomLine)
+        return false;
+
+    if (_blockSelectionMode) {
+        startColumn = _selTopColumn;
+        endColumn = _selBottomColumn;
+    } else {
+        startColumn = (absoluteLine == _selTopLine) ? _selTopColumn : 0;
+        endColumn = (absoluteLine == _selBottomLine) ? _selBottomColumn : _columns - 1;
+    }
+
+    return true;
 }
 
 QString Screen::selectedText(bool preserveLineBreaks, bool trimTrailingSpaces, bool html) const
@@ -1112,10 +1398,19 @@ QString Screen::selectedText(bool preserveLineBreaks, bool trimTrailingSpaces, b
     if (!isSelectionValid())
         return QString();
 
-    return text(_selTopLeft, _selBottomRight, preserveLineBreaks, trimTrailingSpaces, html);
+    const qint64 firstLine = _history->droppedLineCount();
+    return text(_selTopColumn, _selTopLine - firstLine, _selBottomColumn, _selBottomLine - firstLine,
+                preserveLineBreaks, trimTrailingSpaces, html);
 }
 
 QString Screen::text(int startIndex, int endIndex, bool preserveLineBreaks, bool trimTrailingSpaces, bool html) const
+{
+    return text(startIndex % _columns, startIndex / _columns, endIndex % _columns, endIndex / _columns,
+                preserveLineBreaks, trimTrailingSpaces, html);
+}
+
+QString Screen::text(int startColumn, int startLine, int endColumn, int endLine,
+                     bool preserveLineBreaks, bool trimTrailingSpaces, bool html) const
 {
     QString result;
     QTextStream stream(&result, QIODevice::ReadWrite);
@@ -1134,7 +1429,7 @@ QString Screen::text(int startIndex, int endIndex, bool preserveLineBreaks, bool
     }
 
     decoder->begin(&stream);
-    writeToStream(decoder, startIndex, endIndex, preserveLineBreaks, trimTrailingSpaces);
+    writeToStream(decoder, startColumn, startLine, endColumn, endLine, preserveLineBreaks, trimTrailingSpaces);
     decoder->end();
 
     return result;
@@ -1142,7 +1437,7 @@ QString Screen::text(int startIndex, int endIndex, bool preserveLineBreaks, bool
 
 bool Screen::isSelectionValid() const
 {
-    return _selTopLeft >= 0 && _selBottomRight >= 0;
+    return _selTopLine >= 0 && _selBottomLine >= 0;
 }
 
 void Screen::writeSelectionToStream(TerminalCharacterDecoder* decoder ,
@@ -1151,19 +1446,23 @@ void Screen::writeSelectionToStream(TerminalCharacterDecoder* decoder ,
 {
     if (!isSelectionValid())
         return;
-    writeToStream(decoder, _selTopLeft, _selBottomRight, preserveLineBreaks, trimTrailingSpaces);
+
+    const qint64 firstLine = _history->droppedLineCount();
+    writeToStream(decoder, _selTopColumn, _selTopLine - firstLine, _selBottomColumn, _selBottomLine - firstLine,
+                  preserveLineBreaks, trimTrailingSpaces);
 }
 
 void Screen::writeToStream(TerminalCharacterDecoder* decoder,
-                           int startIndex, int endIndex,
+                           int startColumn, int startLine,
+                           int endColumn, int endLine,
                            bool preserveLineBreaks,
                            bool trimTrailingSpaces) const
 {
-    const int top = startIndex / _columns;
-    const int left = startIndex % _columns;
+    const int top = startLine;
+    const int left = startColumn;
 
-    const int bottom = endIndex / _columns;
-    const int right = endIndex % _columns;
+    const int bottom = endLine;
+    const int right = endColumn;
 
     Q_ASSERT(top >= 0 && left >= 0 && bottom >= 0 && right >= 0);
 
@@ -1246,17 +1545,17 @@ int Screen::copyLineToStream(int line ,
 
         Q_ASSERT(count >= 0);
 
-        int screenLine = line - _history->getLines();
+        int screenLineNumber = line - _history->getLines();
 
-        Q_ASSERT(screenLine <= _screenLinesSize);
+        Q_ASSERT(screenLineNumber <= _screenLinesSize);
 
-        screenLine = qMin(screenLine, _screenLinesSize);
+        screenLineNumber = qMin(screenLineNumber, _screenLinesSize);
 
-        Character* data = _screenLines[screenLine].data();
-        int length = _screenLines[screenLine].count();
+        const Character* data = screenLine(screenLineNumber).constData();
+        int length = screenLine(screenLineNumber).count();
 
         // Don't remove end spaces in lines that wrap
-        if (trimTrailingSpaces && !(_lineProperties[screenLine] & LINE_WRAPPED))
+        if (trimTrailingSpaces && !(lineProperty(screenLineNumber) & LINE_WRAPPED))
         {
             // ignore trailing white space at the end of the line
             for (int i = length-1; i >= 0; i--)
@@ -1276,8 +1575,8 @@ int Screen::copyLineToStream(int line ,
         // count cannot be any greater than length
         count = qBound(0, count, length - start);
 
-        Q_ASSERT(screenLine < _lineProperties.count());
-        currentLineProperties |= _lineProperties[screenLine];
+        Q_ASSERT(screenLineNumber < _lineProperties.count());
+        currentLineProperties |= lineProperty(screenLineNumber);
     }
 
     if (appendNewLine && (count + 1 < MAX_CHARS)) {
@@ -1301,7 +1600,7 @@ int Screen::copyLineToStream(int line ,
 
 void Screen::writeLinesToStream(TerminalCharacterDecoder* decoder, int fromLine, int toLine) const
 {
-    writeToStream(decoder, loc(0, fromLine), loc(_columns - 1, toLine));
+    writeToStream(decoder, 0, fromLine, _columns - 1, toLine);
 }
 
 void Screen::addHistLine()
@@ -1310,53 +1609,130 @@ void Screen::addHistLine()
     // we have to take care about scrolling, too...
 
     if (hasScroll()) {
+        const qint64 oldFirstLine = _history->droppedLineCount();
         const int oldHistLines = _history->getLines();
 
-        _history->addCellsVector(_screenLines[0]);
-        _history->addLine(_lineProperties[0] & LINE_WRAPPED);
+        _history->addCellsVector(screenLine(0));
+        _history->addLine(lineProperty(0) & LINE_WRAPPED);
 
         const int newHistLines = _history->getLines();
 
-        const bool beginIsTL = (_selBegin == _selTopLeft);
+        if (_searchIndex)
+            indexHistLine(newHistLines - 1);
 
         // If the history is full, increment the count
         // of dropped _lines
         if (newHistLines == oldHistLines)
             _droppedLines++;
 
-        // Adjust selection for the new point of reference
-        if (newHistLines > oldHistLines) {
-            if (_selBegin != -1) {
-                _selTopLeft += _columns;
-                _selBottomRight += _columns;
+        const qint64 firstLine = _history->droppedLineCount();
+        _histLinesAdded += (firstLine + newHistLines) - (oldFirstLine + oldHistLines);
+
+        forgetDroppedSelection();
+    }
+}
+
+void Screen::forgetDroppedSelection()
+{
+    // Forget the part of the selection which was dropped from the history
+    const qint64 firstLine = _history->droppedLineCount();
+    if (_selTopLine != -1 && _selTopLine < firstLine) {
+        if (_selBottomLine < firstLine) {
+            clearSelection();
+        } else {
+            if (_selBeginLine == _selTopLine && _selBeginColumn == _selTopColumn) {
+                _selBeginLine = firstLine;
+                _selBeginColumn = 0;
             }
+            _selTopLine = firstLine;
+            _selTopColumn = 0;
         }
+    }
+}
 
-        if (_selBegin != -1) {
-            // Scroll selection in history up
-            const int top_BR = loc(0, 1 + newHistLines);
+void Screen::indexHistLine(int line)
+{
+    const qint64 firstLine = _history->droppedLineCount();
+    const qint64 lineNumber = firstLine + line;
 
-            if (_selTopLeft < top_BR)
-                _selTopLeft -= _columns;
+    // lines may have been added to the history without being indexed, e.g.
+    // when it was restored.  The index then starts again at this line.
+    if (lineNumber != _searchIndex->endLine())
+        _searchIndex->reset(lineNumber);
 
-            if (_selBottomRight < top_BR)
-                _selBottomRight -= _columns;
+    _searchIndex->addLine(screenLine(0).constData(), screenLine(0).count(),
+                          lineProperty(0) & LINE_WRAPPED);
+    _searchIndex->removeLinesBefore(firstLine);
+}
 
-            if (_selBottomRight < 0) {
-                clearSelection();
-            } else {
-                if (_selTopLeft < 0)
-                    _selTopLeft = 0;
-            }
+QVector<Character> Screen::imageLine(int line, bool& wrapped) const
+{
+    Q_ASSERT(line >= 0 && line < _lines);
 
-            if (beginIsTL)
-                _selBegin = _selTopLeft;
-            else
-                _selBegin = _selBottomRight;
-        }
+    ImageLine cells = screenLine(line);
+    resolveExtendedChars(cells.data(), cells.count());
+    wrapped = lineProperty(line) & LINE_WRAPPED;
+    return cells;
+}
+
+void Screen::setSearchIndexEnabled(bool enable)
+{
+    if (enable == (_searchIndex != 0))
+        return;
+
+    if (enable) {
+        _searchIndex = new HistorySearchIndex();
+        _searchIndex->reset(_history->droppedLineCount() + _history->getLines());
+    } else {
+        delete _searchIndex;
+        _searchIndex = 0;
     }
 }
 
+bool Screen::searchCandidateLines(const QString& text, QList<QPair<int, int> >& lines) const
+{
+    QVector<HistorySearchIndex::LineRange> ranges;
+    if (!_searchIndex || !_searchIndex->findCandidates(text, ranges))
+        return false;
+
+    const qint64 firstLine = _history->droppedLineCount();
+    const int histLines = _history->getLines();
+    const qint64 endLine = firstLine + histLines;
+
+    // lines of the history which are not in the index are always searched.
+    // The ranges overlap the indexed lines by the length of the text, to
+    // find matches which start or end outside of the index.
+    const qint64 indexStart = qBound(firstLine, _searchIndex->firstLine(), endLine);
+    if (indexStart > firstLine)
+        ranges.prepend(HistorySearchIndex::LineRange(firstLine, indexStart - 1 + text.length()));
+
+    const qint64 indexEnd = qBound(firstLine, _searchIndex->endLine(), endLine);
+    if (indexEnd < endLine)
+        ranges.append(HistorySearchIndex::LineRange(indexEnd - text.length(), endLine - 1));
+
+    std::sort(ranges.begin(), ranges.end());
+
+    foreach(const HistorySearchIndex::LineRange& range, ranges) {
+        const int first = qMax(range.first, firstLine) - firstLine;
+        const int last = qMin(range.second, endLine - 1) - firstLine;
+        if (first > last)
+            continue;
+
+        if (!lines.isEmpty() && lines.last().second >= first - 1)
+            lines.last().second = qMax(lines.last().second, last);
+        else
+            lines << qMakePair(first, last);
+    }
+
+    // the screen image is not indexed
+    if (!lines.isEmpty() && lines.last().second >= histLines - 1)
+        lines.last().second = histLines + _lines - 1;
+    else
+        lines << qMakePair(histLines, histLines + _lines - 1);
+
+    return true;
+}
+
 int Screen::getHistLines() const
 {
     return _history->getLines();
@@ -1385,15 +1761,158 @@ const HistoryType& Screen::getScroll() const
     return _history->getType();
 }
 
+qint64 Screen::historyMemoryUsage() const
+{
+    return _history->allocatedMemory();
+}
+
 void Screen::setLineProperty(LineProperty property , bool enable)
 {
     if (enable)
-        _lineProperties[_cuY] = (LineProperty)(_lineProperties[_cuY] | property);
+        lineProperty(_cuY) = (LineProperty)(lineProperty(_cuY) | property);
     else
-        _lineProperties[_cuY] = (LineProperty)(_lineProperties[_cuY] & ~property);
+        lineProperty(_cuY) = (LineProperty)(lineProperty(_cuY) & ~property);
 }
 void Screen::fillWithDefaultChar(Character* dest, int count)
 {
     for (int i = 0; i < count; i++)
         dest[i] = Screen::DefaultChar;
 }
+
+void Screen::resolveExtendedChars(Character* cells, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (cells[i].rendition & RE_EXTENDED_CHAR) {
+            ushort length = 0;
+            const ushort* chars = ExtendedCharTable::instance.lookupExtendedChar(cells[i].character, length);
+            cells[i].character = (chars && length > 0) ? chars[0] : ' ';
+            cells[i].rendition &= ~RE_EXTENDED_CHAR;
+        }
+    }
+}
+
+static void writeColor(QDataStream& stream, const CharacterColor& color)
+{
+    stream.writeRawData(reinterpret_cast<const char*>(&color), sizeof(CharacterColor));
+}
+
+static void readColor(QDataStream& stream, CharacterColor& color)
+{
+    stream.readRawData(reinterpret_cast<char*>(&color), sizeof(CharacterColor));
+}
+
+void Screen::saveState(QDataStream& stream) const
+{
+    stream << qint32(_lines) << qint32(_columns);
+
+    ImageLine line;
+    for (int i = 0; i < _lines; i++) {
+        line = screenLine(i);
+        resolveExtendedChars(line.data(), line.count());
+
+        stream << qint32(line.count()) << quint8(lineProperty(i));
+        stream.writeRawData(reinterpret_cast<const char*>(line.constData()),
+                            line.count() * sizeof(Character));
+    }
+
+    stream << qint32(_cuX) << qint32(_cuY)
+           << qint32(_topMargin) << qint32(_bottomMargin)
+           << _currentRendition;
+    writeColor(stream, _currentForeground);
+    writeColor(stream, _currentBackground);
+
+    for (int i = 0; i < MODES_SCREEN; i++)
+        stream << qint32(_currentModes[i]) << qint32(_savedModes[i]);
+
+    stream << _tabStops;
+
+    stream << qint32(_savedState.cursorColumn) << qint32(_savedState.cursorLine)
+           << _savedState.rendition;
+    writeColor(stream, _savedState.foreground);
+    writeColor(stream, _savedState.background);
+}
+
+bool Screen::restoreState(QDataStream& stream)
+{
+    static const int MAX_SIZE = 10000;
+
+    qint32 lines = 0;
+    qint32 columns = 0;
+    stream >> lines >> columns;
+    if (stream.status() != QDataStream::Ok ||
+            lines < 1 || lines > MAX_SIZE || columns < 1 || columns > MAX_SIZE)
+        return false;
+
+    // read everything before touching the screen, so that a truncated
+    // state leaves it unchanged
+    QVector<ImageLine> image(lines);
+    QVector<LineProperty> lineProperties(lines);
+    for (int i = 0; i < lines; i++) {
+        qint32 count = 0;
+        quint8 property = 0;
+        stream >> count >> property;
+        if (count < 0 || count > MAX_SIZE)
+            return false;
+
+        image[i].resize(count);
+        stream.readRawData(reinterpret_cast<char*>(image[i].data()), count * sizeof(Character));
+        lineProperties[i] = property;
+    }
+
+    qint32 cursorX, cursorY, topMargin, bottomMargin;
+    quint8 rendition;
+    CharacterColor foreground, background;
+    stream >> cursorX >> cursorY >> topMargin >> bottomMargin >> rendition;
+    readColor(stream, foreground);
+    readColor(stream, background);
+
+    qint32 currentModes[MODES_SCREEN];
+    qint32 savedModes[MODES_SCREEN];
+    for (int i = 0; i < MODES_SCREEN; i++)
+        stream >> currentModes[i] >> savedModes[i];
+
+    QBitArray tabStops;
+    stream >> tabStops;
+
+    SavedState savedState;
+    qint32 savedColumn, savedLine;
+    stream >> savedColumn >> savedLine >> savedState.rendition;
+    readColor(stream, savedState.foreground);
+    readColor(stream, savedState.background);
+    savedState.cursorColumn = qBound(0, int(savedColumn), columns - 1);
+    savedState.cursorLine = qBound(0, int(savedLine), lines - 1);
+
+    if (stream.status() != QDataStream::Ok)
+        return false;
+
+    resizeImage(lines, columns);
+
+    for (int i = 0; i < lines; i++) {
+        screenLine(i) = image[i];
+        lineProperty(i) = lineProperties[i];
+    }
+
+    _cuX = qBound(0, int(cursorX), _columns - 1);
+    _cuY = qBound(0, int(cursorY), _lines - 1);
+    _topMargin = qBound(0, int(topMargin), _lines - 1);
+    _bottomMargin = qBound(_topMargin, int(bottomMargin), _lines - 1);
+    _currentRendition = rendition;
+    _currentForeground = foreground;
+    _currentBackground = background;
+
+    for (int i = 0; i < MODES_SCREEN; i++) {
+        _currentModes[i] = currentModes[i];
+        _savedModes[i] = savedModes[i];
+    }
+
+    if (tabStops.size() == _columns)
+        _tabStops = tabStops;
+
+    _savedState = savedState;
+
+    updateEffectiveRendition();
+    clearSelection();
+    _lastPos = -1;
+
+    return true;
+}
@@ -29,9 +29,14 @@
 #include <QtCore/QVector>
 #include <QtCore/QBitArray>
 #include <QtCore/QVarLengthArray>
+#include <QtCore/QList>
+#include <QtCore/QPair>
+
+class QDataStream;
 
 // Konsole
 #include "Character.h"
+#include "History.h"
 
 #define MODE_Origin    0
 #define MODE_Wrap      1
@@ -47,6 +52,7 @@ class TerminalCharacterDecoder;
 class TerminalDisplay;
 class HistoryType;
 class HistoryScroll;
+class HistorySearchIndex;
 
 /**
     \brief An image of characters with associated attributes.
@@ -68,8 +74,9 @@ class HistoryScroll;
 
     The screen image has a selection associated with it, specified using
     setSelectionStart() and setSelectionEnd().  The selected text can be retrieved
-    using selectedText().  When getImage() is used to retrieve the visible image,
-    characters which are part of the selection have their colors inverted.
+    using selectedText().  The visible image retrieved with getImage() does not
+    include the selection, getSelectedColumns() returns the selected part of each
+    line so that it can be highlighted when the image is drawn.
 */
 class Screen
 {
@@ -349,6 +356,15 @@ public:
      */
     void displayCharacter(unsigned short c);
 
+    /**
+     * Displays @p count characters starting at @p chars at the current cursor
+     * position, in the same way as calling displayCharacter() for each of them.
+     *
+     * The characters which fit onto the current line are written at once,
+     * which is much faster for long runs of text.
+     */
+    void displayString(const unsigned short* chars, int count);
+
     /**
      * Resizes the image to a new fixed size of @p new_lines by @p new_columns.
      * In the case that @p new_columns is smaller than the current number of columns,
@@ -361,6 +377,54 @@ public:
      */
     void resizeImage(int new_lines, int new_columns);
 
+    /**
+     * Specifies whether the lines are wrapped again when the number of
+     * columns changes.  If enabled, resizeImage() joins the lines on the
+     * screen which were wrapped and wraps them at the new width, pushing
+     * lines into the history if they do not fit onto the screen any more.
+     * The lines of the history are wrapped again in the background, see
+     * updateReflowedLines().
+     *
+     * The history is wrapped again from its oldest line to its newest, so
+     * the history lines shown while the view is scrolled up keep their old
+     * width until the background pass reaches them, which takes a moment
+     * for long histories.  Wrapping the lines out of order would change
+     * the numbers of the lines before them, which the other lines of the
+     * history, the selection and the search results are kept by.
+     *
+     * This is disabled by default.
+     */
+    void setReflowLines(bool reflow);
+    /** Returns true if lines are wrapped again on resize. */
+    bool reflowLines() const {
+        return _reflowLines;
+    }
+
+    /**
+     * Takes the lines of the history which have been wrapped again in the
+     * background since the last call and moves the selection and the search
+     * index along with them.  The lines are added to reflowedLines(), and
+     * the lines which have been dropped from the history meanwhile are
+     * added to droppedLines().  Returns the lines which were taken.
+     */
+    ReflowedLines updateReflowedLines();
+    /**
+     * Returns the lines of the history which have been wrapped again since
+     * the last call to resetReflowedLines().
+     */
+    const ReflowedLines& reflowedLines() const {
+        return _reflowedLines;
+    }
+    /** Resets the lines which have been wrapped again, see reflowedLines(). */
+    void resetReflowedLines();
+
+    /**
+     * Forgets the part of the selection which is in lines that have been
+     * dropped from the history, which may also happen when lines are added
+     * to the history of another screen (see HistoryMemoryManager).
+     */
+    void forgetDroppedSelection();
+
     /**
      * Returns the current screen image.
      * The result is an array of Characters of size [getLines()][getColumns()] which
@@ -405,6 +469,52 @@ public:
      */
     bool hasScroll() const;
 
+    /** Returns the number of bytes of memory used by the history buffer. */
+    qint64 historyMemoryUsage() const;
+
+    /**
+     * Sets whether the lines added to the history are indexed, so that
+     * searchCandidateLines() can find them quickly.
+     */
+    void setSearchIndexEnabled(bool enable);
+
+    /**
+     * Finds the lines of the output (the history followed by the screen
+     * image) which may contain @p text.  The ranges of lines which need to
+     * be searched are stored in @p lines as pairs of the first and last line,
+     * in ascending order.
+     *
+     * Returns false if there is no index or it cannot be used to search for
+     * @p text, in which case all lines need to be searched.
+     */
+    bool searchCandidateLines(const QString& text, QList<QPair<int, int> >& lines) const;
+
+    /**
+     * Returns the cells of line @p line of the screen image, with combined
+     * characters reduced to their first character (see resolveExtendedChars()).
+     * @p wrapped is set to whether the line continues on the next line.
+     */
+    QVector<Character> imageLine(int line, bool& wrapped) const;
+
+    /** Returns the history buffer of this screen. */
+    HistoryScroll* historyScroll() const {
+        return _history;
+    }
+
+    /**
+     * Writes the screen image, line properties, cursor, margins, modes
+     * and rendition to @p stream.  The history is not included.
+     */
+    void saveState(QDataStream& stream) const;
+    /**
+     * Restores the state written by saveState(), resizing the screen
+     * to the size it had when it was saved.
+     *
+     * Returns false if the stream does not contain a valid state, in which
+     * case the screen is left unchanged.
+     */
+    bool restoreState(QDataStream& stream);
+
     /**
      * Sets the start of the selection.
      *
@@ -443,6 +553,13 @@ public:
       */
     bool isSelected(const int column, const int line) const;
 
+    /**
+     * Returns the first and the last column of @p line which are part of
+     * the current selection in @p startColumn and @p endColumn.  Returns
+     * false if no character of the line is selected.
+     */
+    bool getSelectedColumns(const int line, int& startColumn, int& endColumn) const;
+
     /**
      * Convenience method.  Returns the currently selected text.
      * @param preserveLineBreaks Specifies whether new line characters should
@@ -565,6 +682,19 @@ public:
       */
     static void fillWithDefaultChar(Character* dest, int count);
 
+    /**
+     * Returns the number of the @p count cells at @p cells which fit onto a
+     * line of @p columns columns, without splitting a double width character.
+     */
+    static int wrappedLength(const Character* cells, int count, int columns);
+
+    /**
+     * Replaces the characters in @p cells which refer to sequences in the
+     * ExtendedCharTable by the first character of their sequence, so that the
+     * cells can be stored outside of this process.
+     */
+    static void resolveExtendedChars(Character* cells, int count);
+
     void setCurrentTerminalDisplay(TerminalDisplay* display) {
         _currentTerminalDisplay = display;
     }
@@ -576,7 +706,7 @@ public:
     QSet<ushort> usedExtendedChars() const {
         QSet<ushort> result;
         for (int i = 0; i < _lines; ++i) {
-            const ImageLine& il = _screenLines[i];
+            const ImageLine& il = screenLine(i);
             for (int j = 0; j < _columns; ++j) {
                 if (il[j].rendition & RE_EXTENDED_CHAR) {
                     result << il[j].character;
@@ -619,6 +749,13 @@ private:
     //
     //NOTE: moveImage() can only move whole lines
     void moveImage(int dest, int sourceBegin, int sourceEnd);
+    //updates the last cursor position and the selection after the lines
+    //between 'sourceBegin' and 'sourceEnd' have been moved to 'dest'
+    void imageMoved(int dest, int sourceBegin, int sourceEnd);
+    //moves the selection along with the screen lines between 'sourceTop'
+    //and 'sourceBottom', which moved by 'diff' lines after the lines in
+    //_histLinesAdded were added to the history
+    void moveSelection(int sourceTop, int sourceBottom, int diff);
     // scroll up 'i' lines in current region, clearing the bottom 'i' lines
     void scrollUp(int from, int i);
     // scroll down 'i' lines in current region, clearing the top 'i' lines
@@ -628,17 +765,34 @@ private:
     TerminalDisplay* _currentTerminalDisplay;
 
     void addHistLine();
+    // adds the history line 'line', which has just been copied from the
+    // first line of the screen, to the search index
+    void indexHistLine(int line);
 
     void initTabStops();
 
+    // joins the wrapped lines on the screen and wraps them at 'columns'
+    // columns, see setReflowLines()
+    void reflowScreen(int columns);
+
     void updateEffectiveRendition();
-    void reverseRendition(Character& p) const;
 
     bool isSelectionValid() const;
-    // copies text from 'startIndex' to 'endIndex' to a stream
-    // startIndex and endIndex are positions generated using the loc(x,y) macro
-    void writeToStream(TerminalCharacterDecoder* decoder, int startIndex,
-                       int endIndex, bool preserveLineBreaks = true, bool trimTrailingSpaces = false) const;
+    // returns the absolute line number of the first line of the screen
+    qint64 screenTopLine() const;
+    // moves the selected absolute line 'line' along with the screen lines
+    // between 'sourceTop' and 'sourceBottom' which moved by 'lines' lines.
+    // 'histLinesAdded' lines were added to the history before the move.
+    // Returns false if the line was overwritten.
+    bool moveSelectedLine(qint64& line, int histLinesAdded, int sourceTop, int sourceBottom, int lines) const;
+    // returns the text between two positions, see writeToStream()
+    QString text(int startColumn, int startLine, int endColumn, int endLine,
+                 bool preserveLineBreaks, bool trimTrailingSpaces, bool html) const;
+    // copies text from 'startColumn' of line 'startLine' to 'endColumn' of line 'endLine' to a stream,
+    // where line 0 is the first line in the history
+    void writeToStream(TerminalCharacterDecoder* decoder, int startColumn, int startLine,
+                       int endColumn, int endLine,
+                       bool preserveLineBreaks = true, bool trimTrailingSpaces = false) const;
     // copies 'count' lines from the screen buffer into 'dest',
     // starting from 'startLine', where 0 is the first line in the screen buffer
     void copyFromScreen(Character* dest, int startLine, int count) const;
@@ -653,16 +807,45 @@ private:
     typedef QVector<Character> ImageLine;      // [0..columns]
     ImageLine*          _screenLines;    // [lines]
     int _screenLinesSize;                // _screenLines.size()
+    // the first _lines entries of _screenLines and _lineProperties are a
+    // ring which starts at this index, so that scrolling the whole screen
+    // does not need to move any lines.  The entry after them is not part
+    // of the ring.
+    int _screenLinesHead;
+
+    // returns the index in _screenLines and _lineProperties of line 'y'
+    // of the screen
+    int lineSlot(int y) const {
+        if (y >= _lines)
+            return y;
+        const int slot = y + _screenLinesHead;
+        return slot < _lines ? slot : slot - _lines;
+    }
+    ImageLine& screenLine(int y) {
+        return _screenLines[lineSlot(y)];
+    }
+    const ImageLine& screenLine(int y) const {
+        return _screenLines[lineSlot(y)];
+    }
+    LineProperty& lineProperty(int y) {
+        return _lineProperties[lineSlot(y)];
+    }
+    LineProperty lineProperty(int y) const {
+        return _lineProperties[lineSlot(y)];
+    }
 
     int _scrolledLines;
     QRect _lastScrolledRegion;
 
     int _droppedLines;
 
+    ReflowedLines _reflowedLines;
+
     QVarLengthArray<LineProperty, 64> _lineProperties;
 
     // history buffer ---------------
     HistoryScroll* _history;
+    HistorySearchIndex* _searchIndex;
 
     // cursor location
     int _cuX;
@@ -686,11 +869,23 @@ private:
     QBitArray _tabStops;
 
     // selection -------------------
-    int _selBegin; // The first location selected.
-    int _selTopLeft;    // TopLeft Location.
-    int _selBottomRight;    // Bottom Right Location.
+    // the lines are absolute line numbers (see HistoryScroll::droppedLineCount()),
+    // which do not change when lines move from the screen into the history or
+    // are dropped from it.  They are -1 if nothing is selected.
+    qint64 _selBeginLine; // The first location selected.
+    int _selBeginColumn;
+    qint64 _selTopLine;    // TopLeft Location.
+    int _selTopColumn;
+    qint64 _selBottomLine;    // Bottom Right Location.
+    int _selBottomColumn;
     bool _blockSelectionMode;  // Column selection mode
 
+    // the number of lines the first line of the screen has moved in the
+    // history since the screen image was last moved
+    int _histLinesAdded;
+
+    bool _reflowLines;
+
     // effective colors and rendition ------------
     CharacterColor _effectiveForeground; // These are derived from
     CharacterColor _effectiveBackground; // the cu_* variables above
@@ -22,11 +22,46 @@
 
 // Konsole
 #include "Screen.h"
+#include "History.h"
+#include "OutputLock.h"
 
 using namespace Konsole;
 
-ScreenWindow::ScreenWindow(Screen* screen, QObject* parent)
+ScreenFrame::ScreenFrame()
+    : lines(0)
+    , columns(0)
+    , histLines(0)
+    , historySerialNumber(0)
+    , droppedLineCount(0)
+    , scrolledLines(0)
+    , droppedLines(0)
+{
+}
+
+ScreenFrame::ScreenFrame(const Screen* screen)
+    : image(screen->getLines() * screen->getColumns())
+    , lines(screen->getLines())
+    , columns(screen->getColumns())
+    , histLines(screen->getHistLines())
+    , historySerialNumber(screen->historyScroll()->serialNumber())
+    , droppedLineCount(screen->historyScroll()->droppedLineCount())
+    , cursor(screen->getCursorX(), screen->getCursorY())
+    , lastScrolledRegion(screen->lastScrolledRegion())
+    , scrolledLines(screen->scrolledLines())
+    , droppedLines(screen->droppedLines())
+    , reflowedLines(screen->reflowedLines())
+{
+    const int lastLine = histLines + lines - 1;
+    screen->getImage(image.data(), image.size(), histLines, lastLine);
+    lineProperties = screen->getLineProperties(histLines, lastLine);
+}
+
+ScreenWindow::ScreenWindow(Screen* screen, OutputLock* lock, QObject* parent)
     : QObject(parent)
+    , _lock(lock)
+    , _hasPendingFrame(false)
+    , _pendingScrolledLines(0)
+    , _pendingDroppedLines(0)
     , _windowBuffer(0)
     , _windowBufferSize(0)
     , _bufferNeedsUpdate(true)
@@ -36,7 +71,9 @@ ScreenWindow::ScreenWindow(Screen* screen, QObject* parent)
     , _trackOutput(true)
     , _scrollCount(0)
 {
+    OutputLocker locker(_lock);
     setScreen(screen);
+    _frame = ScreenFrame(screen);
 }
 
 ScreenWindow::~ScreenWindow()
@@ -55,6 +92,20 @@ Screen* ScreenWindow::screen() const
     return _screen;
 }
 
+OutputLock* ScreenWindow::lock() const
+{
+    return _lock;
+}
+
+void ScreenWindow::addFrame(const ScreenFrame& frame)
+{
+    _pendingFrame = frame;
+    _hasPendingFrame = true;
+    _pendingScrolledLines += frame.scrolledLines;
+    _pendingDroppedLines += frame.droppedLines;
+    _pendingReflowedLines.add(frame.reflowedLines);
+}
+
 Character* ScreenWindow::getImage()
 {
     // reallocate internal buffer if the window size has changed
@@ -69,8 +120,13 @@ Character* ScreenWindow::getImage()
     if (!_bufferNeedsUpdate)
         return _windowBuffer;
 
-    _screen->getImage(_windowBuffer, size,
-                      currentLine(), endWindowLine());
+    {
+        // the histories which have not been displayed for the longest time
+        // are the first to lose lines, see HistoryMemoryManager
+        OutputLocker locker(_lock);
+        _screen->historyScroll()->markViewed();
+        getImage(_windowBuffer, size, currentLine(), endWindowLine());
+    }
 
     // this window may look beyond the end of the screen, in which
     // case there will be an unused area which needs to be filled
@@ -81,9 +137,54 @@ Character* ScreenWindow::getImage()
     return _windowBuffer;
 }
 
+void ScreenWindow::getImage(Character* dest, int size, int startLine, int endLine) const
+{
+    Q_ASSERT(startLine >= 0);
+    Q_ASSERT(endLine >= startLine && endLine < lineCount());
+    Q_ASSERT(size >= (endLine - startLine + 1) * windowColumns());
+    Q_UNUSED(size);
+
+    OutputLocker locker(_lock);
+    copyLines(dest, startLine, endLine);
+}
+
+void ScreenWindow::copyLines(Character* dest, int startLine, int endLine) const
+{
+    const int columns = _frame.columns;
+    const int offset = lineOffset();
+
+    for (int line = startLine; line <= endLine; line++) {
+        Character* destLine = dest + (line - startLine) * columns;
+
+        if (line >= _frame.histLines) {
+            const Character* source = _frame.image.constData() + (line - _frame.histLines) * columns;
+            qCopy(source, source + columns, destLine);
+            continue;
+        }
+
+        // the lines of the history are read from the screen.  Lines which
+        // were dropped since the frame was captured, or which have been
+        // wrapped at a different width, are blank until the next frame.
+        const int screenLine = line - offset;
+        if (screenLine >= 0 && screenLine < _screen->getHistLines() && _screen->getColumns() == columns)
+            _screen->getImage(destLine, columns, screenLine, screenLine);
+        else
+            Screen::fillWithDefaultChar(destLine, columns);
+    }
+}
+
+int ScreenWindow::lineOffset() const
+{
+    const HistoryScroll* history = _screen->historyScroll();
+    if (history->serialNumber() != _frame.historySerialNumber)
+        return 0;
+
+    return int(history->droppedLineCount() - _frame.droppedLineCount);
+}
+
 void ScreenWindow::fillUnusedArea()
 {
-    int screenEndLine = _screen->getHistLines() + _screen->getLines() - 1;
+    int screenEndLine = lineCount() - 1;
     int windowEndLine = currentLine() + windowLines() - 1;
 
     int unusedLines = windowEndLine - screenEndLine;
@@ -112,7 +213,7 @@ int ScreenWindow::endWindowLine() const
 }
 QVector<LineProperty> ScreenWindow::getLineProperties()
 {
-    QVector<LineProperty> result = _screen->getLineProperties(currentLine(), endWindowLine());
+    QVector<LineProperty> result = getLineProperties(currentLine(), endWindowLine());
 
     if (result.count() != windowLines())
         result.resize(windowLines());
@@ -120,56 +221,120 @@ QVector<LineProperty> ScreenWindow::getLineProperties()
     return result;
 }
 
+QVector<LineProperty> ScreenWindow::getLineProperties(int startLine, int endLine) const
+{
+    Q_ASSERT(startLine >= 0);
+    Q_ASSERT(endLine >= startLine && endLine < lineCount());
+
+    QVector<LineProperty> result(endLine - startLine + 1);
+
+    OutputLocker locker(_lock);
+    HistoryScroll* history = _screen->historyScroll();
+    const int offset = lineOffset();
+
+    for (int line = startLine; line <= endLine; line++) {
+        LineProperty property = LINE_DEFAULT;
+        if (line >= _frame.histLines) {
+            property = _frame.lineProperties[line - _frame.histLines];
+        } else {
+            const int screenLine = line - offset;
+            if (screenLine >= 0 && screenLine < history->getLines() && history->isWrappedLine(screenLine))
+                property = LINE_WRAPPED;
+        }
+        result[line - startLine] = property;
+    }
+
+    return result;
+}
+
+QVector<ScreenWindow::ColumnRange> ScreenWindow::getSelectedColumns() const
+{
+    QVector<ColumnRange> result(windowLines(), ColumnRange(0, -1));
+
+    OutputLocker locker(_lock);
+    const int offset = lineOffset();
+    const int screenLineCount = _screen->getHistLines() + _screen->getLines();
+
+    const int firstLine = currentLine();
+    const int lastLine = endWindowLine();
+    for (int line = firstLine; line <= lastLine; line++) {
+        const int screenLine = line - offset;
+        if (screenLine < 0 || screenLine >= screenLineCount)
+            continue;
+
+        int startColumn = 0;
+        int endColumn = -1;
+        if (_screen->getSelectedColumns(screenLine, startColumn, endColumn))
+            result[line - firstLine] = ColumnRange(startColumn, endColumn);
+    }
+
+    return result;
+}
+
 QString ScreenWindow::selectedText(bool preserveLineBreaks, bool trimTrailingSpaces, bool html) const
 {
+    OutputLocker locker(_lock);
     return _screen->selectedText(preserveLineBreaks, trimTrailingSpaces, html);
 }
 
 void ScreenWindow::getSelectionStart(int& column , int& line)
 {
+    OutputLocker locker(_lock);
     _screen->getSelectionStart(column, line);
-    line -= currentLine();
+    line += lineOffset() - currentLine();
 }
 void ScreenWindow::getSelectionEnd(int& column , int& line)
 {
+    OutputLocker locker(_lock);
     _screen->getSelectionEnd(column, line);
-    line -= currentLine();
+    line += lineOffset() - currentLine();
 }
 void ScreenWindow::setSelectionStart(int column , int line , bool columnMode)
 {
-    _screen->setSelectionStart(column , line + currentLine() , columnMode);
+    {
+        OutputLocker locker(_lock);
+        _screen->setSelectionStart(column , qMax(0, line + currentLine() - lineOffset()) , columnMode);
+    }
 
-    _bufferNeedsUpdate = true;
     emit selectionChanged();
 }
 
 void ScreenWindow::setSelectionEnd(int column , int line)
 {
-    _screen->setSelectionEnd(column , line + currentLine());
+    {
+        OutputLocker locker(_lock);
+        _screen->setSelectionEnd(column , qMax(0, line + currentLine() - lineOffset()));
+    }
 
-    _bufferNeedsUpdate = true;
     emit selectionChanged();
 }
 
 void ScreenWindow::setSelectionByLineRange(int start, int end)
 {
-    clearSelection();
+    {
+        OutputLocker locker(_lock);
+        const int offset = lineOffset();
 
-    _screen->setSelectionStart(0 , start , false);
-    _screen->setSelectionEnd(windowColumns() , end);
+        _screen->clearSelection();
+        _screen->setSelectionStart(0 , qMax(0, start - offset) , false);
+        _screen->setSelectionEnd(windowColumns() , qMax(0, end - offset));
+    }
 
-    _bufferNeedsUpdate = true;
     emit selectionChanged();
 }
 
 bool ScreenWindow::isSelected(int column , int line)
 {
-    return _screen->isSelected(column , qMin(line + currentLine(), endWindowLine()));
+    OutputLocker locker(_lock);
+    return _screen->isSelected(column , qMin(line + currentLine(), endWindowLine()) - lineOffset());
 }
 
 void ScreenWindow::clearSelection()
 {
-    _screen->clearSelection();
+    {
+        OutputLocker locker(_lock);
+        _screen->clearSelection();
+    }
 
     emit selectionChanged();
 }
@@ -186,27 +351,27 @@ int ScreenWindow::windowLines() const
 
 int ScreenWindow::windowColumns() const
 {
-    return _screen->getColumns();
+    return _frame.columns;
 }
 
 int ScreenWindow::lineCount() const
 {
-    return _screen->getHistLines() + _screen->getLines();
+    return _frame.histLines + _frame.lines;
 }
 
 int ScreenWindow::columnCount() const
 {
-    return _screen->getColumns();
+    return _frame.columns;
 }
 
-QPoint ScreenWindow::cursorPosition() const
+qint64 ScreenWindow::droppedLineCount() const
 {
-    QPoint position;
-
-    position.setX(_screen->getCursorX());
-    position.setY(_screen->getCursorY());
+    return _frame.droppedLineCount;
+}
 
-    return position;
+QPoint ScreenWindow::cursorPosition() const
+{
+    return _frame.cursor;
 }
 
 int ScreenWindow::currentLine() const
@@ -285,37 +450,74 @@ void ScreenWindow::resetScrollCount()
 
 QRect ScreenWindow::scrollRegion() const
 {
-    bool equalToScreenSize = windowLines() == _screen->getLines();
+    bool equalToScreenSize = windowLines() == _frame.lines;
 
     if (atEndOfOutput() && equalToScreenSize)
-        return _screen->lastScrolledRegion();
+        return _frame.lastScrolledRegion;
     else
         return QRect(0, 0, windowColumns(), windowLines());
 }
 
 void ScreenWindow::notifyOutputChanged()
 {
+    int scrolledLines = 0;
+    int droppedLines = 0;
+    ReflowedLines reflowedLines;
+    const qint64 oldDroppedLineCount = _frame.droppedLineCount;
+    const quint64 oldSerialNumber = _frame.historySerialNumber;
+    {
+        OutputLocker locker(_lock);
+        if (_hasPendingFrame) {
+            _frame = _pendingFrame;
+            _pendingFrame = ScreenFrame();
+            _hasPendingFrame = false;
+
+            scrolledLines = _pendingScrolledLines;
+            droppedLines = _pendingDroppedLines;
+            _pendingScrolledLines = 0;
+            _pendingDroppedLines = 0;
+
+            reflowedLines = _pendingReflowedLines;
+            _pendingReflowedLines = ReflowedLines();
+
+            // lines may also have been dropped from the history when
+            // another history grew, see HistoryMemoryManager
+            if (_frame.historySerialNumber == oldSerialNumber)
+                droppedLines = int(_frame.droppedLineCount - oldDroppedLineCount);
+        }
+    }
+
     // move window to the bottom of the screen and update scroll count
     // if this window is currently tracking the bottom of the screen
     if (_trackOutput) {
-        _scrollCount -= _screen->scrolledLines();
-        _currentLine = qMax(0, _screen->getHistLines() - (windowLines() - _screen->getLines()));
+        _scrollCount -= scrolledLines;
+        _currentLine = qMax(0, _frame.histLines - (windowLines() - _frame.lines));
     } else {
         // if the history is not unlimited then it may
         // have run out of space and dropped the oldest
         // lines of output - in this case the screen
         // window's current line number will need to
         // be adjusted - otherwise the output will scroll
-        _currentLine = qMax(0, _currentLine -
-                            _screen->droppedLines());
+        if (reflowedLines.isEmpty()) {
+            _currentLine = qMax(0, _currentLine - droppedLines);
+        } else {
+            // the lines of the history have been wrapped again, which
+            // moves the lines after them
+            const qint64 line = reflowedLines.map(oldDroppedLineCount + _currentLine);
+            _currentLine = int(qMax(qint64(0), line - _frame.droppedLineCount));
+        }
 
         // ensure that the screen window's current position does
         // not go beyond the bottom of the screen
-        _currentLine = qMin(_currentLine , _screen->getHistLines());
+        _currentLine = qMin(_currentLine , _frame.histLines);
+    }
+
+    if (!reflowedLines.isEmpty() && _currentResultLine != -1) {
+        const qint64 line = reflowedLines.map(oldDroppedLineCount + _currentResultLine);
+        _currentResultLine = int(qMax(qint64(0), line - _frame.droppedLineCount));
     }
 
     _bufferNeedsUpdate = true;
 
     emit outputChanged();
 }
-
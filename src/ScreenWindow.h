@@ -22,16 +22,52 @@
 
 // Qt
 #include <QtCore/QObject>
+#include <QtCore/QPair>
 #include <QtCore/QPoint>
 #include <QtCore/QRect>
+#include <QtCore/QVector>
 
 // Konsole
 #include "Character.h"
+#include "History.h"
 
 namespace Konsole
 {
+class OutputLock;
 class Screen;
 
+/**
+ * The lines of a terminal screen and the state which goes with them at the
+ * time of an update, see Emulation::outputChanged().  Screen windows
+ * display the screen as it was in the latest frame, so that they are not
+ * affected by changes which are made to the screen by another thread in the
+ * meantime.  The lines of the history are not part of the frame.
+ */
+class ScreenFrame
+{
+public:
+    ScreenFrame();
+    /** Captures the current state of @p screen */
+    explicit ScreenFrame(const Screen* screen);
+
+    QVector<Character> image;
+    QVector<LineProperty> lineProperties;
+    int lines;
+    int columns;
+    int histLines;
+    // see HistoryScroll::serialNumber() and HistoryScroll::droppedLineCount()
+    quint64 historySerialNumber;
+    qint64 droppedLineCount;
+    QPoint cursor;
+    // see Screen::lastScrolledRegion(), Screen::scrolledLines() and
+    // Screen::droppedLines()
+    QRect lastScrolledRegion;
+    int scrolledLines;
+    int droppedLines;
+    // see Screen::reflowedLines()
+    ReflowedLines reflowedLines;
+};
+
 /**
  * Provides a window onto a section of a terminal screen.  A terminal widget can then render
  * the contents of the window and use the window to change the terminal screen's selection
@@ -48,12 +84,21 @@ class Screen;
  * Whenever the output from the underlying screen is changed, the notifyOutputChanged() slot should
  * be called.  This in turn will update the window's position and emit the outputChanged() signal
  * if necessary.
+ *
+ * The window displays the screen as it was when the emulation last passed a ScreenFrame to addFrame(),
+ * while the lines of the history and the selection are read from the screen with lock() held.
  */
 class ScreenWindow : public QObject
 {
     Q_OBJECT
 
 public:
+    /**
+     * The first and the last column of a range of columns.  The range is
+     * empty if the first column is greater than the last one.
+     */
+    typedef QPair<int, int> ColumnRange;
+
     /**
      * Constructs a new screen window with the given parent.
      * A screen must be specified by calling setScreen() before calling getImage() or getLineProperties().
@@ -62,14 +107,28 @@ public:
      * to create a window on the emulation which you wish to view.  This allows the emulation
      * to notify the window when the associated screen has changed and synchronize selection updates
      * between all views on a session.
+     *
+     * @p lock is held while the window reads from the screen, see Emulation::outputLock()
      */
-    explicit ScreenWindow(Screen* screen, QObject* parent = 0);
+    explicit ScreenWindow(Screen* screen, OutputLock* lock = 0, QObject* parent = 0);
     virtual ~ScreenWindow();
 
     /** Sets the screen which this window looks onto */
     void setScreen(Screen* screen);
-    /** Returns the screen which this window looks onto */
+    /**
+     * Returns the screen which this window looks onto.  lock() must be held while
+     * the screen is used.
+     */
     Screen* screen() const;
+    /** Returns the lock which protects screen() */
+    OutputLock* lock() const;
+
+    /**
+     * Passes the state of the screen at the time of an update to the window, which
+     * displays it once notifyOutputChanged() is called.  This is called by the
+     * emulation with lock() held.
+     */
+    void addFrame(const ScreenFrame& frame);
 
     /**
      * Returns the image of characters which are currently visible through this window
@@ -86,6 +145,25 @@ public:
      */
     QVector<LineProperty> getLineProperties();
 
+    /**
+     * Copies the lines from @p startLine to @p endLine of the whole output (the history
+     * followed by the screen) into @p dest, which holds @p size characters.  Each line is
+     * windowColumns() characters wide.
+     */
+    void getImage(Character* dest, int size, int startLine, int endLine) const;
+    /**
+     * Returns the line attributes of the lines from @p startLine to @p endLine of the
+     * whole output, see getImage()
+     */
+    QVector<LineProperty> getLineProperties(int startLine, int endLine) const;
+
+    /**
+     * Returns the selected columns of each line which is currently visible
+     * through this window.  The image returned by getImage() does not
+     * include the selection, it is highlighted by the view.
+     */
+    QVector<ColumnRange> getSelectedColumns() const;
+
     /**
      * Returns the number of lines which the region of the window
      * specified by scrollRegion() has been scrolled by since the last call
@@ -171,6 +249,13 @@ public:
     /** Returns the total number of columns in the screen */
     int columnCount() const;
 
+    /**
+     * Returns the number of lines which have been removed from the start of
+     * the screen's history.  Adding it to a line number gives the absolute
+     * number of the line, see HistoryScroll::droppedLineCount().
+     */
+    qint64 droppedLineCount() const;
+
     /** Returns the index of the line which is currently at the top of this window */
     int currentLine() const;
 
@@ -263,8 +348,25 @@ signals:
 private:
     int endWindowLine() const;
     void fillUnusedArea();
+    // returns the number of lines by which the lines of the frame have
+    // moved up in the screen since it was captured
+    int lineOffset() const;
+    // copies the lines from 'startLine' to 'endLine' of the frame into
+    // 'dest', with the lock held
+    void copyLines(Character* dest, int startLine, int endLine) const;
 
     Screen* _screen; // see setScreen() , screen()
+    OutputLock* _lock;
+
+    // the frame which is displayed, and the frame which is displayed
+    // after the next call to notifyOutputChanged()
+    ScreenFrame _frame;
+    ScreenFrame _pendingFrame;
+    bool _hasPendingFrame;
+    int _pendingScrolledLines;
+    int _pendingDroppedLines;
+    ReflowedLines _pendingReflowedLines;
+
     Character* _windowBuffer;
     int _windowBufferSize;
     bool _bufferNeedsUpdate;
@@ -0,0 +1,340 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "SearchMatchCache.h"
+
+// Standard
+#include <algorithm>
+
+// Konsole
+#include "Emulation.h"
+#include "JobRunner.h"
+
+using namespace Konsole;
+
+namespace
+{
+bool endsBeforeLine(const SearchMatch& match, qint64 line)
+{
+    return match.endLine < line;
+}
+
+bool startsBeforeLine(const SearchMatch& match, qint64 line)
+{
+    return match.startLine < line;
+}
+}
+
+SearchMatchCache::SearchMatchCache(Emulation* emulation, QObject* parent)
+    : QObject(parent)
+    , _emulation(emulation)
+    , _enabled(false)
+    , _historySerialNumber(0)
+    , _changedLine(0)
+    , _job(0)
+    , _updatePending(false)
+    , _updateTimer(this)
+{
+    // output usually arrives in many small pieces, which are searched together
+    _updateTimer.setSingleShot(true);
+    _updateTimer.setInterval(100);
+    connect(&_updateTimer, &QTimer::timeout, this, &Konsole::SearchMatchCache::update);
+    connect(emulation, &Konsole::Emulation::outputChanged, this, &Konsole::SearchMatchCache::scheduleUpdate);
+    connect(emulation, &Konsole::Emulation::linesReflowed, this, &Konsole::SearchMatchCache::reflowLines);
+}
+
+SearchMatchCache::~SearchMatchCache()
+{
+    cancelJob();
+}
+
+void SearchMatchCache::setEnabled(bool enable)
+{
+    if (enable == _enabled)
+        return;
+
+    _enabled = enable;
+    reset();
+
+    if (enable)
+        update();
+}
+
+void SearchMatchCache::setRegExp(const QRegExp& regExp)
+{
+    if (regExp == _regExp)
+        return;
+
+    _regExp = regExp;
+    reset();
+
+    update();
+}
+
+void SearchMatchCache::reset()
+{
+    cancelJob();
+    _updateTimer.stop();
+
+    _matches.clear();
+    _historySerialNumber = 0;
+    _changedLine = 0;
+
+    emit matchesChanged();
+}
+
+QVector<SearchMatch> SearchMatchCache::matches(qint64 firstLine, qint64 lastLine) const
+{
+    // matches do not overlap, so they are ordered by their last line as well
+    QVector<SearchMatch>::const_iterator match = std::lower_bound(_matches.constBegin(), _matches.constEnd(),
+                                                                  firstLine, endsBeforeLine);
+
+    QVector<SearchMatch> result;
+    for (; match != _matches.constEnd() && match->startLine <= lastLine; ++match)
+        result << *match;
+
+    return result;
+}
+
+void SearchMatchCache::update()
+{
+    _updateTimer.stop();
+
+    if (!_emulation || !_enabled || _regExp.isEmpty())
+        return;
+
+    // the history is replaced once its lines have been wrapped again, then
+    // it is searched again completely
+    if (_emulation->isReflowingHistory())
+        return;
+
+    // the lines which change while the job is running are searched
+    // when it has finished
+    if (_job) {
+        _updatePending = true;
+        return;
+    }
+
+    const OutputSnapshot snapshot = _emulation->outputSnapshot();
+
+    if (snapshot.historySerialNumber() != _historySerialNumber) {
+        _matches.clear();
+        _historySerialNumber = snapshot.historySerialNumber();
+        _changedLine = snapshot.firstHistoryLine();
+    }
+
+    const int startLine = qBound(qint64(0), _changedLine - snapshot.firstHistoryLine(), qint64(snapshot.lineCount()));
+
+    _job = new SearchMatchJob(snapshot, _regExp, startLine);
+    connect(_job, &Konsole::SearchMatchJob::finished, this, &Konsole::SearchMatchCache::jobFinished);
+
+    JobRunner<SearchMatchJob>::start(_job);
+}
+
+void SearchMatchCache::scheduleUpdate()
+{
+    // the timer is not restarted, so that continuous output is still searched
+    if (_enabled && !_updateTimer.isActive())
+        _updateTimer.start();
+}
+
+void SearchMatchCache::reflowLines(qint64 firstLine, int oldCount, int newCount)
+{
+    if (!_enabled)
+        return;
+
+    // the job has searched the lines at their old positions
+    if (_job) {
+        cancelJob();
+        scheduleUpdate();
+    }
+
+    // forget the matches in the lines which were wrapped again, and move
+    // the matches after them
+    QVector<SearchMatch>::iterator first = std::lower_bound(_matches.begin(), _matches.end(),
+                                                            firstLine, endsBeforeLine);
+    QVector<SearchMatch>::iterator last = std::lower_bound(first, _matches.end(),
+                                                           firstLine + oldCount, startsBeforeLine);
+    first = _matches.erase(first, last);
+
+    for (; first != _matches.end(); ++first) {
+        first->startLine += newCount - oldCount;
+        first->endLine += newCount - oldCount;
+    }
+
+    ReflowedLines lines;
+    lines.add(firstLine, oldCount, newCount);
+    _changedLine = lines.map(_changedLine);
+
+    emit matchesChanged();
+}
+
+void SearchMatchCache::jobFinished()
+{
+    SearchMatchJob* job = qobject_cast<SearchMatchJob*>(sender());
+    if (job != _job)
+        return;
+
+    _job = 0;
+
+    const OutputSnapshot& snapshot = job->snapshot();
+    if (snapshot.historySerialNumber() == _historySerialNumber) {
+        // replace the matches in the lines which were searched again
+        QVector<SearchMatch>::iterator changed = std::lower_bound(_matches.begin(), _matches.end(),
+                                                                  job->searchedFromLine(), startsBeforeLine);
+        _matches.erase(changed, _matches.end());
+
+        // forget the matches in lines which have been removed from the history
+        QVector<SearchMatch>::iterator dropped = std::lower_bound(_matches.begin(), _matches.end(),
+                                                                  snapshot.firstHistoryLine(), endsBeforeLine);
+        _matches.erase(_matches.begin(), dropped);
+
+        _matches += job->matches();
+        if (_matches.count() > MAX_MATCHES)
+            _matches.erase(_matches.begin(), _matches.end() - MAX_MATCHES);
+
+        // lines on the screen may still change, lines in the history do not
+        _changedLine = snapshot.firstHistoryLine() + snapshot.historyLineCount();
+
+        emit matchesChanged();
+    } else {
+        // the history was replaced while searching
+        _updatePending = true;
+    }
+
+    if (_updatePending) {
+        _updatePending = false;
+        update();
+    }
+}
+
+void SearchMatchCache::cancelJob()
+{
+    if (_job) {
+        disconnect(_job, 0, this, 0);
+        _job->cancel();
+        _job = 0;
+    }
+
+    _updatePending = false;
+}
+
+SearchMatchJob::SearchMatchJob(const OutputSnapshot& snapshot, const QRegExp& regExp, int startLine)
+    : _snapshot(snapshot)
+    , _regExp(regExp)
+    , _startLine(startLine)
+    , _cancelled(0)
+    , _searchedFromLine(snapshot.firstHistoryLine() + startLine)
+{
+}
+
+void SearchMatchJob::cancel()
+{
+    _cancelled.store(1);
+}
+
+void SearchMatchJob::run()
+{
+    const int lineCount = _snapshot.lineCount();
+
+    // a match may start on one of the lines before the start line, if
+    // they are wrapped
+    int line = qMin(_startLine, lineCount);
+    bool wrapped = false;
+    while (line > 0) {
+        _snapshot.getLine(line - 1, _cells, wrapped);
+        if (!wrapped)
+            break;
+        line--;
+    }
+
+    _searchedFromLine = _snapshot.firstHistoryLine() + line;
+
+    while (line < lineCount) {
+        if (_cancelled.load()) {
+            emit finished();
+            return;
+        }
+
+        line = searchLine(line);
+    }
+
+    emit finished();
+}
+
+int SearchMatchJob::searchLine(int line)
+{
+    _text.clear();
+    _charLine.clear();
+    _charColumn.clear();
+    _charEndColumn.clear();
+
+    // join the line with the lines it is wrapped into
+    int next = line;
+    bool wrapped = true;
+    while (wrapped && next < _snapshot.lineCount()) {
+        _snapshot.getLine(next, _cells, wrapped);
+
+        for (int column = 0; column < _cells.count(); column++) {
+            // the second cell of a double width character
+            if (_cells[column].character == 0) {
+                if (column > 0 && !_charEndColumn.isEmpty())
+                    _charEndColumn.last() = column + 1;
+                continue;
+            }
+
+            _text += QChar(_cells[column].character);
+            _charLine << next;
+            _charColumn << column;
+            _charEndColumn << column + 1;
+        }
+
+        next++;
+    }
+
+    const qint64 firstLine = _snapshot.firstHistoryLine();
+
+    int pos = 0;
+    while ((pos = _regExp.indexIn(_text, pos)) != -1) {
+        const int length = _regExp.matchedLength();
+        // empty matches cannot be highlighted
+        if (length <= 0) {
+            pos++;
+            continue;
+        }
+
+        const int last = pos + length - 1;
+
+        SearchMatch match;
+        match.startLine = firstLine + _charLine[pos];
+        match.startColumn = _charColumn[pos];
+        match.endLine = firstLine + _charLine[last];
+        match.endColumn = _charEndColumn[last];
+        _matches << match;
+
+        // the oldest matches are dropped in batches
+        if (_matches.count() >= 2 * SearchMatchCache::MAX_MATCHES)
+            _matches.erase(_matches.begin(), _matches.end() - SearchMatchCache::MAX_MATCHES);
+
+        pos += length;
+    }
+
+    return next;
+}
@@ -0,0 +1,228 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef SEARCHMATCHCACHE_H
+#define SEARCHMATCHCACHE_H
+
+// Qt
+#include <QtCore/QAtomicInt>
+#include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QRegExp>
+#include <QtCore/QTimer>
+#include <QtCore/QVector>
+
+// Konsole
+#include "History.h"
+#include "konsoleprivate_export.h"
+
+namespace Konsole
+{
+class Emulation;
+class SearchMatchJob;
+
+/**
+ * A match of a search, identified by absolute line numbers (see
+ * HistoryScroll::droppedLineCount()) and columns.  The end column is the
+ * column after the last character of the match.
+ */
+struct SearchMatch {
+    qint64 startLine;
+    int startColumn;
+    qint64 endLine;
+    int endColumn;
+};
+
+/**
+ * Keeps all matches of a regular expression in the output of an emulation,
+ * both in the history and on the screen, so that they can be highlighted
+ * without running the regular expression each time the display is painted.
+ *
+ * The matches are found by a SearchMatchJob on a worker thread, only while
+ * the cache is enabled.  When the emulation's output changes, the lines
+ * from the first line of the screen onwards are searched again a little
+ * later, together with the output which follows, because the lines in the
+ * history do not change.  The whole output is searched again when the
+ * history is cleared or replaced.  While the lines of the history are
+ * wrapped again (see Screen::setReflowLines()), the matches move along with
+ * their lines and the output is searched again once that has finished.
+ *
+ * At most MAX_MATCHES matches are kept, those closest to the end of the
+ * output.  The matches in older lines are not highlighted.
+ *
+ * Regular expressions are matched against each line of the output, lines
+ * which were wrapped are joined with the next line.
+ */
+class KONSOLEPRIVATE_EXPORT SearchMatchCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit SearchMatchCache(Emulation* emulation, QObject* parent = 0);
+    virtual ~SearchMatchCache();
+
+    /**
+     * Specifies whether the matches are searched for.  The cache is disabled
+     * initially, disabling it forgets the matches which have been found.
+     */
+    void setEnabled(bool enable);
+    /** Returns true if the matches are searched for. */
+    bool isEnabled() const {
+        return _enabled;
+    }
+
+    /** Sets the regular expression to search for and starts the search. */
+    void setRegExp(const QRegExp& regExp);
+    /** Returns the regular expression which is searched for. */
+    QRegExp regExp() const {
+        return _regExp;
+    }
+
+    /** Returns the number of matches which have been found. */
+    int matchCount() const {
+        return _matches.count();
+    }
+
+    /**
+     * Returns the matches which cover any of the absolute lines from
+     * @p firstLine to @p lastLine, in order.
+     */
+    QVector<SearchMatch> matches(qint64 firstLine, qint64 lastLine) const;
+
+    /** Returns true while the output is being searched or is about to be. */
+    bool isUpdating() const {
+        return _job != 0 || _updateTimer.isActive();
+    }
+
+    /** The maximum number of matches which are kept. */
+    static const int MAX_MATCHES = 100000;
+
+public slots:
+    /** Searches the lines which changed since the last update. */
+    void update();
+
+signals:
+    /** Emitted when the matches have been updated. */
+    void matchesChanged();
+
+private slots:
+    void jobFinished();
+    // updates the matches shortly, unless that is scheduled already
+    void scheduleUpdate();
+    // see Emulation::linesReflowed()
+    void reflowLines(qint64 firstLine, int oldCount, int newCount);
+
+private:
+    Q_DISABLE_COPY(SearchMatchCache)
+
+    void cancelJob();
+    // forgets the matches and stops searching
+    void reset();
+
+    QPointer<Emulation> _emulation;
+    QRegExp _regExp;
+    bool _enabled;
+
+    // matches in ascending order
+    QVector<SearchMatch> _matches;
+
+    // the history for which the matches were found and the absolute
+    // line from which the output may have changed since
+    quint64 _historySerialNumber;
+    qint64 _changedLine;
+
+    SearchMatchJob* _job;
+    bool _updatePending;
+    // collects the changes of the output into one update
+    QTimer _updateTimer;
+};
+
+/**
+ * Finds the matches of a regular expression in an OutputSnapshot, starting
+ * from a given line, on a worker thread.  See SearchMatchCache.  Like the
+ * cache, the job keeps only the last SearchMatchCache::MAX_MATCHES matches.
+ * The job is run with JobRunner.
+ */
+class KONSOLEPRIVATE_EXPORT SearchMatchJob : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructs a job which searches @p snapshot for @p regExp from the
+     * start of the line which contains line @p startLine of the snapshot.
+     */
+    SearchMatchJob(const OutputSnapshot& snapshot, const QRegExp& regExp, int startLine);
+
+    /** Stops the search.  finished() is emitted regardless. */
+    void cancel();
+
+    /** Searches the snapshot, this is called on a worker thread. */
+    void run();
+
+    /**
+     * Returns the absolute number of the line from which the snapshot was
+     * searched.  Valid once finished() has been emitted.
+     */
+    qint64 searchedFromLine() const {
+        return _searchedFromLine;
+    }
+    /** Returns the matches which were found.  Valid once finished() has been emitted. */
+    const QVector<SearchMatch>& matches() const {
+        return _matches;
+    }
+    /** Returns true if the job was cancelled before searching all lines. */
+    bool isCancelled() const {
+        return _cancelled.load() != 0;
+    }
+
+    /** Returns the snapshot which is searched. */
+    const OutputSnapshot& snapshot() const {
+        return _snapshot;
+    }
+
+signals:
+    /** Emitted when the search is complete. */
+    void finished();
+
+private:
+    // searches the logical line which starts at 'line' of the snapshot
+    // and returns the line after it
+    int searchLine(int line);
+
+    OutputSnapshot _snapshot;
+    QRegExp _regExp;
+    int _startLine;
+    QAtomicInt _cancelled;
+
+    qint64 _searchedFromLine;
+    QVector<SearchMatch> _matches;
+
+    // the text of a logical line and the position of each character
+    QString _text;
+    QVector<int> _charLine;
+    QVector<int> _charColumn;
+    QVector<int> _charEndColumn;
+    QVector<Character> _cells;
+};
+}
+
+Q_DECLARE_TYPEINFO(Konsole::SearchMatch, Q_PRIMITIVE_TYPE);
+
+#endif // SEARCHMATCHCACHE_H
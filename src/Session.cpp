@@ -35,6 +35,7 @@
 #include <QtCore/QDir>
 #include <QtCore/QFile>
 #include <QtCore/QStringList>
+#include <QtCore/QStandardPaths>
 #include <QtDBus/QtDBus>
 #include <QKeyEvent>
 
@@ -57,6 +58,7 @@
 #include "Vt102Emulation.h"
 #include "ZModemDialog.h"
 #include "History.h"
+#include "SessionSnapshot.h"
 
 using namespace Konsole;
 
@@ -99,6 +101,8 @@ Session::Session(QObject* parent) :
     QObject(parent)
     , _shellProcess(0)
     , _emulation(0)
+    , _snapshot(0)
+    , _saveOutputEnabled(false)
     , _monitorActivity(false)
     , _monitorSilence(false)
     , _notifiedActivity(false)
@@ -115,6 +119,7 @@ Session::Session(QObject* parent) :
     , _zmodemProc(0)
     , _zmodemProgress(0)
     , _hasDarkBackground(false)
+    , _outputThreadEnabled(false)
 {
     _uniqueIdentifier = createUuid();
 
@@ -136,6 +141,7 @@ Session::Session(QObject* parent) :
     connect(_emulation, &Konsole::Emulation::selectionChanged, this, &Konsole::Session::selectionChanged);
     connect(_emulation, &Konsole::Emulation::imageResizeRequest, this, &Konsole::Session::resizeRequest);
     connect(_emulation, &Konsole::Emulation::sessionAttributeRequest, this, &Konsole::Session::sessionAttributeRequest);
+    connect(_emulation, &Konsole::Emulation::outputBacklogChanged, this, &Konsole::Session::onOutputBacklogChanged);
 
     //create new teletype for I/O with shell process
     openTeletype(-1);
@@ -154,6 +160,8 @@ Session::~Session()
 {
     delete _foregroundProcessInfo;
     delete _sessionProcessInfo;
+    delete _snapshot;
+    _emulation->setOutputThreadEnabled(false);
     delete _emulation;
     delete _shellProcess;
     delete _zmodemProc;
@@ -223,6 +231,14 @@ void Session::setDarkBackground(bool darkBackground)
     _hasDarkBackground = darkBackground;
 }
 
+void Session::setOutputThreadEnabled(bool enable)
+{
+    _outputThreadEnabled = enable;
+
+    if (isRunning() || !enable)
+        _emulation->setOutputThreadEnabled(enable);
+}
+
 bool Session::isRunning() const
 {
     return _shellProcess && (_shellProcess->state() == QProcess::Running);
@@ -296,9 +312,11 @@ void Session::addView(TerminalDisplay* widget)
     _views.append(widget);
 
     // connect emulation - view signals and slots
-    connect(widget, &Konsole::TerminalDisplay::keyPressedSignal, _emulation, &Konsole::Emulation::sendKeyEvent);
-    connect(widget, &Konsole::TerminalDisplay::mouseSignal, _emulation, &Konsole::Emulation::sendMouseEvent);
-    connect(widget, &Konsole::TerminalDisplay::sendStringToEmu, _emulation, &Konsole::Emulation::sendString);
+    // the emulation may live on its output thread.  Input is still handled
+    // right away on the main thread, the key events can not be queued.
+    connect(widget, &Konsole::TerminalDisplay::keyPressedSignal, _emulation, &Konsole::Emulation::sendKeyEvent, Qt::DirectConnection);
+    connect(widget, &Konsole::TerminalDisplay::mouseSignal, _emulation, &Konsole::Emulation::sendMouseEvent, Qt::DirectConnection);
+    connect(widget, &Konsole::TerminalDisplay::sendStringToEmu, _emulation, &Konsole::Emulation::sendString, Qt::DirectConnection);
 
     // allow emulation to notify view when the foreground process
     // indicates whether or not it is interested in mouse signals
@@ -317,8 +335,8 @@ void Session::addView(TerminalDisplay* widget)
 
     connect(widget, &Konsole::TerminalDisplay::destroyed, this, &Konsole::Session::viewDestroyed);
 
-    connect(widget, &Konsole::TerminalDisplay::focusLost, _emulation, &Konsole::Emulation::focusLost);
-    connect(widget, &Konsole::TerminalDisplay::focusGained, _emulation, &Konsole::Emulation::focusGained);
+    connect(widget, &Konsole::TerminalDisplay::focusLost, _emulation, &Konsole::Emulation::focusLost, Qt::DirectConnection);
+    connect(widget, &Konsole::TerminalDisplay::focusGained, _emulation, &Konsole::Emulation::focusGained, Qt::DirectConnection);
 }
 
 void Session::viewDestroyed(QObject* view)
@@ -487,6 +505,8 @@ void Session::run()
 
     _shellProcess->setWriteable(false);  // We are reachable via kwrited.
 
+    _emulation->setOutputThreadEnabled(_outputThreadEnabled);
+
     emit started();
 }
 
@@ -779,6 +799,9 @@ bool Session::closeInNormalWay()
     _autoClose    = true;
     _closePerUserRequest = true;
 
+    // the session will not be restored any more
+    removeSnapshot();
+
     // for the possible case where following events happen in sequence:
     //
     // 1). the terminal process crashes
@@ -804,6 +827,8 @@ bool Session::closeInForceWay()
     _autoClose    = true;
     _closePerUserRequest = true;
 
+    removeSnapshot();
+
     if (kill(SIGKILL)) {
         return true;
     } else {
@@ -1069,6 +1094,11 @@ void Session::setHistoryType(const HistoryType& hType)
     _emulation->setHistory(hType);
 }
 
+void Session::setReflowLines(bool reflow)
+{
+    _emulation->setReflowLines(reflow);
+}
+
 const HistoryType& Session::historyType() const
 {
     return _emulation->history();
@@ -1276,6 +1306,14 @@ void Session::onReceiveBlock(const char* buf, int len)
     _emulation->receiveData(buf, len);
 }
 
+void Session::onOutputBacklogChanged()
+{
+    // while the pty is not read, the kernel makes the terminal program
+    // wait once the pty's buffer is full.  The signal may be delivered
+    // late, so the current state is used.
+    _shellProcess->setReadSuspended(_emulation->outputBacklogged());
+}
+
 QSize Session::size()
 {
     return _emulation->imageSize();
@@ -1384,6 +1422,11 @@ int Session::historySize() const
     }
 }
 
+qlonglong Session::historyMemoryUsage() const
+{
+    return _emulation->historyMemoryUsage();
+}
+
 int Session::foregroundProcessId()
 {
     int pid;
@@ -1423,6 +1466,19 @@ void Session::saveSession(KConfigGroup& group)
     group.writeEntry("RemoteTab",      tabTitleFormat(RemoteTabTitle));
     group.writeEntry("SessionGuid",    _uniqueIdentifier.toString());
     group.writeEntry("Encoding",       QString(codec()));
+
+    // the snapshot contains all of the output, which is only stored on
+    // disk if the profile asks for it
+    if (!_saveOutputEnabled) {
+        removeSnapshot();
+        group.deleteEntry("Snapshot");
+        return;
+    }
+
+    if (!_snapshot)
+        _snapshot = new SessionSnapshot(_emulation);
+    _snapshot->save(snapshotFileName());
+    group.writePathEntry("Snapshot", snapshotFileName());
 }
 
 void Session::restoreSession(KConfigGroup& group)
@@ -1439,6 +1495,39 @@ void Session::restoreSession(KConfigGroup& group)
     if (!value.isEmpty()) _uniqueIdentifier = QUuid(value);
     value = group.readEntry("Encoding");
     if (!value.isEmpty()) setCodec(value.toUtf8());
+    value = group.readPathEntry("Snapshot", QString());
+    if (!value.isEmpty()) {
+        // the snapshot is written again when the session is saved the next
+        // time.  Snapshots of sessions which were saved earlier and have not
+        // been restored are not needed any more either.
+        SessionSnapshot::restore(_emulation, value);
+        SessionSnapshot::removeStaleSnapshots(value);
+        QFile::remove(value);
+    }
+}
+
+void Session::setSaveOutputEnabled(bool enable)
+{
+    _saveOutputEnabled = enable;
+}
+
+QString Session::snapshotFileName() const
+{
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)
+           + QStringLiteral("/sessions/") + shellSessionId() + QStringLiteral(".snapshot");
+}
+
+void Session::removeSnapshot()
+{
+    if (!_snapshot)
+        return;
+
+    // the file may still be being written
+    _snapshot->waitForFinished();
+    QFile::remove(snapshotFileName());
+
+    delete _snapshot;
+    _snapshot = 0;
 }
 
 SessionGroup::SessionGroup(QObject* parent)
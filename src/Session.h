@@ -50,6 +50,7 @@ class ProcessInfo;
 class TerminalDisplay;
 class ZModemDialog;
 class HistoryType;
+class SessionSnapshot;
 
 /**
  * Platform-specific main shortcut "opcode":
@@ -225,6 +226,11 @@ public:
      * Returns the type of history store used by this session.
      */
     const HistoryType& historyType() const;
+    /**
+     * Sets whether the lines of the output and of the history are wrapped
+     * again when the width of the terminal changes.
+     */
+    void setReflowLines(bool reflow);
     /**
      * Clears the history store used by this session.
      */
@@ -330,6 +336,13 @@ public:
      */
     void setDarkBackground(bool darkBackground);
 
+    /**
+     * Sets whether the output of the session is processed by a thread of
+     * its own.  The thread is started once the session is running, after
+     * its snapshot has been restored.  See Emulation::setOutputThreadEnabled()
+     */
+    void setOutputThreadEnabled(bool enable);
+
     /**
      * Attempts to get the shell program to redraw the current display area.
      * This can be used after clearing the screen, for example, to get the
@@ -361,10 +374,19 @@ public:
     // Sets the text codec used by this sessions terminal emulation.
     void setCodec(QTextCodec* codec);
 
-    // session management
+    // session management.  Besides the settings, saveSession() writes a
+    // snapshot of the terminal output if setSaveOutputEnabled() is on,
+    // which restoreSession() brings back.
     void saveSession(KConfigGroup& group);
     void restoreSession(KConfigGroup& group);
 
+    /**
+     * Sets whether the output of the terminal, including the history, is
+     * saved with the session, see saveSession().  This is disabled by
+     * default.
+     */
+    void setSaveOutputEnabled(bool enable);
+
     void sendSignal(int signal);
 
     void reportBackgroundColor(const QColor& c);
@@ -563,6 +585,12 @@ public slots:
      */
     Q_SCRIPTABLE int historySize() const;
 
+    /**
+     * Returns the number of bytes of memory used by the history of this session.
+     * Unlimited history is stored on disk and does not count.
+     */
+    Q_SCRIPTABLE qlonglong historyMemoryUsage() const;
+
 signals:
 
     /** Emitted when the terminal process starts. */
@@ -677,6 +705,7 @@ private slots:
     void fireZModemDetected();
 
     void onReceiveBlock(const char* buffer, int len);
+    void onOutputBacklogChanged();
     void silenceTimerDone();
     void activityTimerDone();
 
@@ -716,11 +745,17 @@ private:
     void updateSessionProcessInfo();
     bool updateForegroundProcessInfo();
     void updateWorkingDirectory();
+    // returns the file which the snapshot of the output is saved to
+    QString snapshotFileName() const;
+    // removes the snapshot written by saveSession(), if any
+    void removeSnapshot();
 
     QUuid            _uniqueIdentifier; // SHELL_SESSION_ID
 
     Pty*          _shellProcess;
     Emulation*    _emulation;
+    SessionSnapshot* _snapshot;
+    bool _saveOutputEnabled;
 
     QList<TerminalDisplay*> _views;
 
@@ -766,6 +801,7 @@ private:
     ZModemDialog*  _zmodemProgress;
 
     bool _hasDarkBackground;
+    bool _outputThreadEnabled;
 
     QSize _preferredSize;
 
@@ -62,8 +62,10 @@
 #include "History.h"
 #include "HistorySizeDialog.h"
 #include "IncrementalSearchBar.h"
+#include "JobRunner.h"
 #include "RenameTabDialog.h"
 #include "ScreenWindow.h"
+#include "SearchMatchCache.h"
 #include "Session.h"
 #include "ProfileList.h"
 #include "TerminalDisplay.h"
@@ -72,8 +74,13 @@
 #include "PrintOptions.h"
 
 // for SaveHistoryTask
-#include <KIO/Job>
+#include <KIO/FileCopyJob>
 #include <KJob>
+#include <QProgressDialog>
+#include <QtCore/QSaveFile>
+#include <QtCore/QScopedPointer>
+#include <QtCore/QTemporaryFile>
+#include <QtCore/QTextStream>
 #include "TerminalCharacterDecoder.h"
 
 // For Unix signal names
@@ -99,7 +106,7 @@ SessionController::SessionController(Session* session , TerminalDisplay* view, Q
     , _profileList(0)
     , _previousState(-1)
     , _viewUrlFilter(0)
-    , _searchFilter(0)
+    , _searchMatches(0)
     , _copyInputToAllTabsAction(0)
     , _findAction(0)
     , _findNextAction(0)
@@ -502,14 +509,14 @@ bool SessionController::eventFilter(QObject* watched , QEvent* event)
     return false;
 }
 
-void SessionController::removeSearchFilter()
+void SessionController::removeSearchMatches()
 {
-    if (!_searchFilter)
+    if (!_searchMatches)
         return;
 
-    _view->filterChain()->removeFilter(_searchFilter);
-    delete _searchFilter;
-    _searchFilter = 0;
+    _view->setSearchMatches(0);
+    delete _searchMatches;
+    _searchMatches = 0;
 }
 
 void SessionController::setSearchBar(IncrementalSearchBar* searchBar)
@@ -1110,20 +1117,11 @@ void SessionController::listenForScreenWindowUpdates()
     if (_listenForScreenWindowUpdates)
         return;
 
-    connect(_view->screenWindow(), &Konsole::ScreenWindow::outputChanged, this, &Konsole::SessionController::updateSearchFilter);
-    connect(_view->screenWindow(), &Konsole::ScreenWindow::scrolled, this, &Konsole::SessionController::updateSearchFilter);
     connect(_view->screenWindow(), &Konsole::ScreenWindow::currentResultLineChanged, _view.data(), static_cast<void(TerminalDisplay::*)()>(&Konsole::TerminalDisplay::update));
 
     _listenForScreenWindowUpdates = true;
 }
 
-void SessionController::updateSearchFilter()
-{
-    if (_searchFilter && _searchBar) {
-        _view->processFilters();
-    }
-}
-
 void SessionController::searchBarEvent()
 {
     QString selectedText = _view->screenWindow()->selectedText(true, true);
@@ -1193,20 +1191,21 @@ void SessionController::searchHistory(bool showSearchBar)
 
     if (_searchBar) {
         if (showSearchBar) {
-            removeSearchFilter();
+            removeSearchMatches();
 
             listenForScreenWindowUpdates();
 
-            _searchFilter = new RegExpFilter();
-            _searchFilter->setRegExp(regexpFromSearchBarOptions());
-            _view->filterChain()->addFilter(_searchFilter);
-            _view->processFilters();
+            // all matches in the output are found once, and then only
+            // in the new output, rather than each time the view is painted
+            _searchMatches = new SearchMatchCache(_session->emulation(), this);
+            _searchMatches->setRegExp(regexpFromSearchBarOptions());
+            highlightMatches(_searchBar->optionsChecked().at(IncrementalSearchBar::HighlightMatches));
 
             setFindNextPrevEnabled(true);
         } else {
             setFindNextPrevEnabled(false);
 
-            removeSearchFilter();
+            removeSearchMatches();
 
             _view->setFocus(Qt::ActiveWindowFocusReason);
         }
@@ -1247,10 +1246,10 @@ void SessionController::searchCompleted(bool success)
 void SessionController::beginSearch(const QString& text , int direction)
 {
     Q_ASSERT(_searchBar);
-    Q_ASSERT(_searchFilter);
+    Q_ASSERT(_searchMatches);
 
     QRegExp regExp = regexpFromSearchBarOptions();
-    _searchFilter->setRegExp(regExp);
+    _searchMatches->setRegExp(regExp);
 
     if (_searchStartLine == -1) {
         if (direction == SearchHistoryTask::ForwardsSearch) {
@@ -1262,7 +1261,12 @@ void SessionController::beginSearch(const QString& text , int direction)
 
     if (!regExp.isEmpty()) {
         _view->screenWindow()->setCurrentResultLine(-1);
+        // only the results of the latest search are of interest
+        if (_searchTask)
+            _searchTask->cancel();
+
         SearchHistoryTask* task = new SearchHistoryTask(this);
+        _searchTask = task;
 
         connect(task, &Konsole::SearchHistoryTask::completed, this, &Konsole::SessionController::searchCompleted);
 
@@ -1275,25 +1279,21 @@ void SessionController::beginSearch(const QString& text , int direction)
     } else if (text.isEmpty()) {
         searchCompleted(false);
     }
-
-    _view->processFilters();
 }
 void SessionController::highlightMatches(bool highlight)
 {
-    if (highlight) {
-        _view->filterChain()->addFilter(_searchFilter);
-        _view->processFilters();
-    } else {
-        _view->filterChain()->removeFilter(_searchFilter);
-    }
+    if (!_searchMatches)
+        return;
 
-    _view->update();
+    // the output is only searched for matches while they are highlighted
+    _searchMatches->setEnabled(highlight);
+    _view->setSearchMatches(highlight ? _searchMatches : 0);
 }
 
 void SessionController::searchFrom()
 {
     Q_ASSERT(_searchBar);
-    Q_ASSERT(_searchFilter);
+    Q_ASSERT(_searchMatches);
 
     if (reverseSearchChecked()) {
         setSearchStartTo(_view->screenWindow()->lineCount());
@@ -1307,7 +1307,7 @@ void SessionController::searchFrom()
 void SessionController::findNextInHistory()
 {
     Q_ASSERT(_searchBar);
-    Q_ASSERT(_searchFilter);
+    Q_ASSERT(_searchMatches);
 
     setSearchStartTo(_prevSearchResultLine);
 
@@ -1316,7 +1316,7 @@ void SessionController::findNextInHistory()
 void SessionController::findPreviousInHistory()
 {
     Q_ASSERT(_searchBar);
-    Q_ASSERT(_searchFilter);
+    Q_ASSERT(_searchMatches);
 
     setSearchStartTo(_prevSearchResultLine);
 
@@ -1325,7 +1325,7 @@ void SessionController::findPreviousInHistory()
 void SessionController::changeSearchMatch()
 {
     Q_ASSERT(_searchBar);
-    Q_ASSERT(_searchFilter);
+    Q_ASSERT(_searchMatches);
 
     // reset Selection for new case match
     _view->screenWindow()->clearSelection();
@@ -1667,6 +1667,11 @@ SaveHistoryTask::SaveHistoryTask(QObject* parent)
 }
 SaveHistoryTask::~SaveHistoryTask()
 {
+    // the jobs finish on their own, but there is no one to report to
+    foreach(SaveHistoryJob* job, _saveJobs.keys()) {
+        disconnect(job, 0, this, 0);
+        job->cancel();
+    }
 }
 
 void SaveHistoryTask::execute()
@@ -1674,7 +1679,6 @@ void SaveHistoryTask::execute()
     // TODO - think about the UI when saving multiple history sessions, if there are more than two or
     //        three then providing a URL for each one will be tedious
 
-    // TODO - show a warning ( preferably passive ) if saving the history output fails
     QFileDialog* dialog = new QFileDialog(QApplication::activeWindow(),
             QString(),
             QDir::homePath());
@@ -1687,7 +1691,7 @@ void SaveHistoryTask::execute()
 
     // iterate over each session in the task and display a dialog to allow the user to choose where
     // to save that session's history.
-    // then start a KIO job to transfer the data from the history to the chosen URL
+    // then start a job which writes a snapshot of the output to the chosen URL on a worker thread
     foreach(const SessionPtr& session, sessions()) {
         dialog->setWindowTitle(i18n("Save Output From %1", session->title(Session::NameRole)));
 
@@ -1704,72 +1708,74 @@ void SaveHistoryTask::execute()
             continue;
         }
 
-        KIO::TransferJob* job = KIO::put(url,
-                                         -1,   // no special permissions
-                                         // overwrite existing files
-                                         // do not resume an existing transfer
-                                         // show progress information only for remote
-                                         // URLs
-                                         KIO::Overwrite | (url.isLocalFile() ? KIO::HideProgressInfo : KIO::DefaultFlags)
-                                         // a better solution would be to show progress
-                                         // information after a certain period of time
-                                         // instead, since the overall speed of transfer
-                                         // depends on factors other than just the protocol
-                                         // used
-                                        );
-
         SaveJob jobInfo;
-        jobInfo.session = session;
-        jobInfo.lastLineFetched = -1;  // when each request for data comes in from the KIO subsystem
-        // lastLineFetched is used to keep track of how much of the history
-        // has already been sent, and where the next request should continue
-        // from.
-        // this is set to -1 to indicate the job has just been started
-
-        if ((dialog->selectedNameFilter()).contains("html", Qt::CaseInsensitive)) {
-            jobInfo.decoder = new HTMLDecoder();
+        jobInfo.url = url;
+
+        // the output is always written to a local file, remote files are
+        // uploaded from a temporary file once it is complete
+        QString fileName;
+        if (url.isLocalFile()) {
+            fileName = url.toLocalFile();
         } else {
-            jobInfo.decoder = new PlainTextDecoder();
+            QTemporaryFile temporaryFile(QDir::tempPath() + QStringLiteral("/konsole_output_XXXXXX"));
+            temporaryFile.setAutoRemove(false);
+            if (!temporaryFile.open()) {
+                KMessageBox::sorry(0 , i18n("A problem occurred when saving the output.\n%1", temporaryFile.errorString()));
+                continue;
+            }
+            fileName = temporaryFile.fileName();
+            jobInfo.temporaryFileName = fileName;
         }
 
-        _jobSession.insert(job, jobInfo);
+        const bool html = (dialog->selectedNameFilter()).contains("html", Qt::CaseInsensitive);
 
-        connect(job, &KIO::TransferJob::dataReq, this, &Konsole::SaveHistoryTask::jobDataRequested);
-        connect(job, &KIO::TransferJob::result, this, &Konsole::SaveHistoryTask::jobResult);
-    }
+        SaveHistoryJob* job = new SaveHistoryJob(session->emulation()->outputSnapshot(), fileName, html);
 
-    dialog->deleteLater();
-}
-void SaveHistoryTask::jobDataRequested(KIO::Job* job , QByteArray& data)
-{
-    // TODO - Report progress information for the job
+        QProgressDialog* progress = new QProgressDialog(i18n("Saving output from %1...", session->title(Session::NameRole)),
+                                                        i18n("Cancel"), 0, 100, QApplication::activeWindow());
+        progress->setWindowTitle(i18n("Save Output"));
+        progress->setMinimumDuration(500);
+        progress->setValue(0);
+        jobInfo.progress = progress;
 
-    // PERFORMANCE:  Do some tests and tweak this value to get faster saving
-    const int LINES_PER_REQUEST = 500;
+        connect(job, &Konsole::SaveHistoryJob::progress, progress, &QProgressDialog::setValue);
+        connect(progress, &QProgressDialog::canceled, job, &Konsole::SaveHistoryJob::cancel);
+        connect(job, &Konsole::SaveHistoryJob::finished, this, &Konsole::SaveHistoryTask::saveJobFinished);
 
-    SaveJob& info = _jobSession[job];
+        _saveJobs.insert(job, jobInfo);
 
-    // transfer LINES_PER_REQUEST lines from the session's history
-    // to the save location
-    if (info.session) {
-        // note:  when retrieving lines from the emulation,
-        // the first line is at index 0.
+        JobRunner<SaveHistoryJob>::start(job);
+    }
 
-        int sessionLines = info.session->emulation()->lineCount();
+    dialog->deleteLater();
 
-        if (sessionLines - 1 == info.lastLineFetched)
-            return; // if there is no more data to transfer then stop the job
+    finishIfDone();
+}
+void SaveHistoryTask::saveJobFinished(bool success)
+{
+    SaveHistoryJob* job = qobject_cast<SaveHistoryJob*>(sender());
+    if (!_saveJobs.contains(job))
+        return;
 
-        int copyUpToLine = qMin(info.lastLineFetched + LINES_PER_REQUEST ,
-                                sessionLines - 1);
+    const SaveJob info = _saveJobs.take(job);
+    delete info.progress;
 
-        QTextStream stream(&data, QIODevice::ReadWrite);
-        info.decoder->begin(&stream);
-        info.session->emulation()->writeToStream(info.decoder , info.lastLineFetched + 1 , copyUpToLine);
-        info.decoder->end();
+    if (success && !info.temporaryFileName.isEmpty()) {
+        KIO::FileCopyJob* upload = KIO::file_copy(QUrl::fromLocalFile(info.temporaryFileName), info.url, -1,
+                                                  KIO::Overwrite);
+        _uploads.insert(upload, info.temporaryFileName);
+        connect(upload, &KIO::FileCopyJob::result, this, &Konsole::SaveHistoryTask::jobResult);
+        return;
+    }
 
-        info.lastLineFetched = copyUpToLine;
+    if (!success && !job->isCancelled()) {
+        KMessageBox::sorry(0 , i18n("A problem occurred when saving the output.\n%1", job->errorString()));
     }
+
+    if (!info.temporaryFileName.isEmpty())
+        QFile::remove(info.temporaryFileName);
+
+    finishIfDone();
 }
 void SaveHistoryTask::jobResult(KJob* job)
 {
@@ -1777,11 +1783,14 @@ void SaveHistoryTask::jobResult(KJob* job)
         KMessageBox::sorry(0 , i18n("A problem occurred when saving the output.\n%1", job->errorString()));
     }
 
-    TerminalCharacterDecoder * decoder = _jobSession[job].decoder;
+    QFile::remove(_uploads.take(job));
 
-    _jobSession.remove(job);
-
-    delete decoder;
+    finishIfDone();
+}
+void SaveHistoryTask::finishIfDone()
+{
+    if (!_saveJobs.isEmpty() || !_uploads.isEmpty())
+        return;
 
     // notify the world that the task is done
     emit completed(true);
@@ -1789,138 +1798,249 @@ void SaveHistoryTask::jobResult(KJob* job)
     if (autoDelete())
         deleteLater();
 }
+
+SaveHistoryJob::SaveHistoryJob(const OutputSnapshot& snapshot, const QString& fileName, bool html)
+    : _snapshot(snapshot)
+    , _fileName(fileName)
+    , _html(html)
+    , _cancelled(0)
+{
+}
+
+void SaveHistoryJob::cancel()
+{
+    _cancelled.store(1);
+}
+
+void SaveHistoryJob::run()
+{
+    // progress is reported and cancellation checked once per block
+    static const int BLOCK_SIZE = 10000;
+
+    // the file replaces an existing one only when it is committed
+    QSaveFile file(_fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        _errorString = file.errorString();
+        emit finished(false);
+        return;
+    }
+
+    QTextStream stream(&file);
+    stream.setCodec("UTF-8");
+
+    QScopedPointer<TerminalCharacterDecoder> decoder;
+    if (_html) {
+        stream << "<meta charset=\"utf-8\">\n";
+        decoder.reset(new HTMLDecoder());
+    } else {
+        decoder.reset(new PlainTextDecoder());
+    }
+
+    decoder->begin(&stream);
+
+    QVector<Character> cells;
+    const int lineCount = _snapshot.lineCount();
+    for (int line = 0; line < lineCount; line++) {
+        if (line % BLOCK_SIZE == 0) {
+            if (_cancelled.load()) {
+                file.cancelWriting();
+                emit finished(false);
+                return;
+            }
+            emit progress(qint64(line) * 100 / lineCount);
+        }
+
+        bool wrapped = false;
+        _snapshot.getLine(line, cells, wrapped);
+
+        // see Emulation::writeToStream()
+        if (line != lineCount - 1 && !wrapped)
+            cells << Character('\n');
+
+        decoder->decodeLine(cells.constData(), cells.count(), wrapped ? LINE_WRAPPED : LINE_DEFAULT);
+    }
+
+    decoder->end();
+    stream.flush();
+
+    if (!file.commit()) {
+        _errorString = file.errorString();
+        emit finished(false);
+        return;
+    }
+
+    emit progress(100);
+    emit finished(true);
+}
+
 void SearchHistoryTask::addScreenWindow(Session* session , ScreenWindow* searchWindow)
 {
     _windows.insert(session, searchWindow);
 }
 void SearchHistoryTask::execute()
 {
+    _foundMatch = false;
+
     QMapIterator< SessionPtr , ScreenWindowPtr > iter(_windows);
 
     while (iter.hasNext()) {
         iter.next();
         executeOnScreenWindow(iter.key() , iter.value());
     }
+
+    if (_jobs.isEmpty()) {
+        emit completed(false);
+
+        if (autoDelete())
+            deleteLater();
+    }
 }
 
-void SearchHistoryTask::executeOnScreenWindow(SessionPtr session , ScreenWindowPtr window)
+void SearchHistoryTask::executeOnScreenWindow(SessionPtr session , ScreenWindowPtr window,
+                                             const PendingSearch* restarted)
 {
     Q_ASSERT(session);
     Q_ASSERT(window);
 
     Emulation* emulation = session->emulation();
 
-    if (!_regExp.isEmpty()) {
-        int pos = -1;
-        const bool forwards = (_direction == ForwardsSearch);
-        const int lastLine = window->lineCount() - 1;
-
-        int startLine;
-        if (forwards && (_startLine == lastLine)) {
-            startLine = 0;
-        } else if (!forwards && (_startLine == 0)) {
-            startLine = lastLine;
-        } else {
-            startLine = _startLine + (forwards ? 1 : -1);
-        }
-
-        QString string;
+    if (_regExp.isEmpty())
+        return;
 
-        //text stream to read history into string for pattern or regular expression searching
-        QTextStream searchStream(&string);
+    const OutputSnapshot snapshot = emulation->outputSnapshot();
+
+    const bool forwards = (_direction == ForwardsSearch);
+    const int lastLine = snapshot.lineCount() - 1;
+
+    int startLine;
+    if (restarted) {
+        // start from the same line of the output, if it is still there
+        qint64 line = restarted->startLine - restarted->firstHistoryLine;
+        if (restarted->historySerialNumber == snapshot.historySerialNumber())
+            line = restarted->startLine - snapshot.firstHistoryLine();
+        startLine = int(qBound<qint64>(0, line, lastLine));
+    } else if (forwards && (_startLine == lastLine)) {
+        startLine = 0;
+    } else if (!forwards && (_startLine == 0)) {
+        startLine = lastLine;
+    } else {
+        startLine = _startLine + (forwards ? 1 : -1);
+    }
 
-        PlainTextDecoder decoder;
-        decoder.setRecordLinePositions(true);
+    // plain text can be looked up in the history search index, if the
+    // session has one, so that only the lines which may contain it are read
+    QList<QPair<int, int> > lines;
+    if (_regExp.patternSyntax() != QRegExp::FixedString ||
+            !emulation->searchCandidateLines(_regExp.pattern(), lines)) {
+        lines.clear();
+        lines << qMakePair(0, lastLine);
+    }
 
-        //setup first and last lines depending on search direction
-        int line = startLine;
+    PendingSearch search;
+    search.session = session;
+    search.window = window;
+    search.historySerialNumber = snapshot.historySerialNumber();
+    search.firstHistoryLine = snapshot.firstHistoryLine();
+    search.startLine = snapshot.firstHistoryLine() + startLine;
+    search.restarts = restarted ? restarted->restarts + 1 : 0;
 
-        //read through and search history in blocks of 10K lines.
-        //this balances the need to retrieve lots of data from the history each time
-        //(for efficient searching)
-        //without using silly amounts of memory if the history is very large.
-        const int maxDelta = qMin(window->lineCount(), 10000);
-        int delta = forwards ? maxDelta : -maxDelta;
+    SearchHistoryJob* job = new SearchHistoryJob(snapshot, _regExp, forwards, startLine, lines);
+    _jobs.insert(job, search);
 
-        int endLine = line;
-        bool hasWrapped = false;  // set to true when we reach the top/bottom
-        // of the output and continue from the other
-        // end
+    connect(job, &Konsole::SearchHistoryJob::progress, this, &Konsole::SearchHistoryTask::progress);
+    connect(job, &Konsole::SearchHistoryJob::finished, this, &Konsole::SearchHistoryTask::jobFinished);
+    connect(emulation, &Konsole::Emulation::linesReflowed, this, &Konsole::SearchHistoryTask::reflowLines,
+            Qt::UniqueConnection);
 
-        //loop through history in blocks of <delta> lines.
-        do {
-            // ensure that application does not appear to hang
-            // if searching through a lengthy output
-            QApplication::processEvents();
+    JobRunner<SearchHistoryJob>::start(job);
+}
 
-            // calculate lines to search in this iteration
-            if (hasWrapped) {
-                if (endLine == lastLine)
-                    line = 0;
-                else if (endLine == 0)
-                    line = lastLine;
+void SearchHistoryTask::jobFinished(int line)
+{
+    SearchHistoryJob* job = qobject_cast<SearchHistoryJob*>(sender());
+    if (!_jobs.contains(job))
+        return;
 
-                endLine += delta;
+    const PendingSearch search = _jobs.take(job);
+
+    if (search.session && search.window) {
+        // lines may have been removed from the history or wrapped again
+        // while searching
+        bool historyReplaced;
+        {
+            OutputLocker locker(search.session->emulation()->outputLock());
+            HistoryScroll* history = search.session->emulation()->historyScroll();
+            historyReplaced = history->serialNumber() != search.historySerialNumber;
+            if (line != -1 && !historyReplaced)
+                line = int(search.reflowedLines.map(search.firstHistoryLine + line) - history->droppedLineCount());
+        }
 
-                if (forwards)
-                    endLine = qMin(startLine , endLine);
-                else
-                    endLine = qMax(startLine , endLine);
-            } else {
-                endLine += delta;
-
-                if (endLine > lastLine) {
-                    hasWrapped = true;
-                    endLine = lastLine;
-                } else if (endLine < 0) {
-                    hasWrapped = true;
-                    endLine = 0;
-                }
+        // the lines of a history which has been cleared or replaced (eg.
+        // to wrap its lines again) while searching read as empty lines,
+        // so the new history is searched.  Lines dropped from the history
+        // are not shown anymore either, those are just skipped.
+        if (historyReplaced) {
+            if (search.restarts < MAX_SEARCH_RESTARTS) {
+                executeOnScreenWindow(search.session, search.window, &search);
+                return;
             }
+            // the match cannot be found in the new history
+            line = -1;
+        }
 
-            decoder.begin(&searchStream);
-            emulation->writeToStream(&decoder, qMin(endLine, line) , qMax(endLine, line));
-            decoder.end();
-
-            // line number search below assumes that the buffer ends with a new-line
-            string.append('\n');
-
-            if (forwards)
-                pos = string.indexOf(_regExp);
-            else
-                pos = string.lastIndexOf(_regExp);
-
-            //if a match is found, position the cursor on that line and update the screen
-            if (pos != -1) {
-                int newLines = 0;
-                QList<int> linePositions = decoder.linePositions();
-                while (newLines < linePositions.count() && linePositions[newLines] <= pos)
-                    newLines++;
+        if (line >= 0 && !_foundMatch) {
+            _foundMatch = true;
+            highlightResult(search.window, line);
+        } else if (line < 0 && _jobs.isEmpty() && !_foundMatch) {
+            // if no match was found, clear selection to indicate this
+            search.window->clearSelection();
+            search.window->notifyOutputChanged();
+        }
+    }
 
-                // ignore the new line at the start of the buffer
-                newLines--;
+    if (_jobs.isEmpty()) {
+        emit completed(_foundMatch);
 
-                int findPos = qMin(line, endLine) + newLines;
+        if (autoDelete())
+            deleteLater();
+    }
+}
 
-                highlightResult(window, findPos);
+void SearchHistoryTask::reflowLines(qint64 firstLine, int oldCount, int newCount)
+{
+    ReflowedLines lines;
+    lines.add(firstLine, oldCount, newCount);
 
-                emit completed(true);
+    QMutableHashIterator<SearchHistoryJob*, PendingSearch> iter(_jobs);
+    while (iter.hasNext()) {
+        iter.next();
+        if (iter.value().session && iter.value().session->emulation() == sender())
+            iter.value().reflowedLines.add(lines);
+    }
+}
 
-                return;
-            }
+void SearchHistoryTask::cancel()
+{
+    QHashIterator<SearchHistoryJob*, PendingSearch> iter(_jobs);
+    while (iter.hasNext()) {
+        iter.next();
+        disconnect(iter.key(), 0, this, 0);
+        iter.key()->cancel();
+    }
+    _jobs.clear();
 
-            //clear the current block of text and move to the next one
-            string.clear();
-            line = endLine;
-        } while (startLine != endLine);
+    if (autoDelete())
+        deleteLater();
+}
 
-        // if no match was found, clear selection to indicate this
-        window->clearSelection();
-        window->notifyOutputChanged();
+SearchHistoryTask::~SearchHistoryTask()
+{
+    // the jobs are deleted once they have stopped
+    foreach(SearchHistoryJob* job, _jobs.keys()) {
+        job->cancel();
     }
-
-    emit completed(false);
 }
+
 void SearchHistoryTask::highlightResult(ScreenWindowPtr window , int findPos)
 {
     //work out how many lines into the current block of text the search result was found
@@ -1948,6 +2068,7 @@ SearchHistoryTask::SearchHistoryTask(QObject* parent)
     : SessionTask(parent)
     , _direction(BackwardsSearch)
     , _startLine(0)
+    , _foundMatch(false)
 {
 }
 void SearchHistoryTask::setSearchDirection(SearchDirection direction)
@@ -1971,6 +2092,129 @@ QRegExp SearchHistoryTask::regExp() const
     return _regExp;
 }
 
+SearchHistoryJob::SearchHistoryJob(const OutputSnapshot& snapshot, const QRegExp& regExp, bool forwards,
+                                   int startLine, const QList<QPair<int, int> >& lines)
+    : _snapshot(snapshot)
+    , _regExp(regExp)
+    , _forwards(forwards)
+    , _startLine(startLine)
+    , _lines(lines)
+    , _cancelled(0)
+{
+}
+
+void SearchHistoryJob::cancel()
+{
+    _cancelled.store(1);
+}
+
+void SearchHistoryJob::run()
+{
+    // read through and search the output in blocks of 10K lines.
+    // this balances the need to retrieve lots of data each time
+    // (for efficient searching)
+    // without using silly amounts of memory if the history is very large.
+    static const int BLOCK_SIZE = 10000;
+
+    typedef QPair<int, int> LineRange;
+
+    // split the lines at the start line and order them the way the
+    // output is searched: from the start line to the end of the output in
+    // the direction of the search, then from the other end back to it
+    const int split = _forwards ? _startLine : _startLine + 1;
+    QList<LineRange> beforeStart;
+    QList<LineRange> afterStart;
+    int totalLines = 0;
+    foreach(const LineRange& range, _lines) {
+        if (range.first < split)
+            beforeStart << qMakePair(range.first, qMin(range.second, split - 1));
+        if (range.second >= split)
+            afterStart << qMakePair(qMax(range.first, split), range.second);
+        totalLines += range.second - range.first + 1;
+    }
+
+    QList<LineRange> ordered;
+    if (_forwards) {
+        ordered << afterStart << beforeStart;
+    } else {
+        for (int i = beforeStart.count() - 1; i >= 0; i--)
+            ordered << beforeStart[i];
+        for (int i = afterStart.count() - 1; i >= 0; i--)
+            ordered << afterStart[i];
+    }
+
+    int searchedLines = 0;
+    int result = -1;
+    foreach(const LineRange& range, ordered) {
+        int line = _forwards ? range.first : range.second;
+        while (result == -1 && line >= range.first && line <= range.second) {
+            if (_cancelled.load()) {
+                emit finished(-1);
+                return;
+            }
+
+            int first, last;
+            if (_forwards) {
+                first = line;
+                last = qMin(range.second, line + BLOCK_SIZE - 1);
+                line = last + 1;
+            } else {
+                first = qMax(range.first, line - BLOCK_SIZE + 1);
+                last = line;
+                line = first - 1;
+            }
+
+            result = searchLines(first, last);
+
+            searchedLines += last - first + 1;
+            emit progress(totalLines > 0 ? qint64(searchedLines) * 100 / totalLines : 100);
+        }
+
+        if (result != -1)
+            break;
+    }
+
+    emit finished(result);
+}
+
+int SearchHistoryJob::searchLines(int fromLine, int toLine)
+{
+    QString string;
+
+    //text stream to read history into string for pattern or regular expression searching
+    QTextStream searchStream(&string);
+
+    PlainTextDecoder decoder;
+    decoder.setRecordLinePositions(true);
+
+    decoder.begin(&searchStream);
+    _snapshot.writeToStream(&decoder, fromLine, toLine);
+    decoder.end();
+
+    // line number search below assumes that the buffer ends with a new-line
+    string.append('\n');
+
+    int pos;
+    if (_forwards)
+        pos = string.indexOf(_regExp);
+    else
+        pos = string.lastIndexOf(_regExp);
+
+    if (pos == -1)
+        return -1;
+
+    //work out how many lines into the current block of text the search result was found
+    int newLines = 0;
+    QList<int> linePositions = decoder.linePositions();
+    while (newLines < linePositions.count() && linePositions[newLines] <= pos)
+        newLines++;
+
+    // ignore the new line at the start of the buffer
+    newLines--;
+
+    return fromLine + newLines;
+}
+
 QString SessionController::userTitle() const
 {
     if (_session) {
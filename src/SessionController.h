@@ -27,6 +27,8 @@
 #include <QtCore/QPointer>
 #include <QtCore/QString>
 #include <QtCore/QHash>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QUrl>
 
 // KDE
 #include <KXMLGUIClient>
@@ -34,17 +36,13 @@
 // Konsole
 #include "ViewProperties.h"
 #include "Profile.h"
-
-namespace KIO
-{
-class Job;
-}
+#include "History.h"
 
 class QAction;
 class QTextCodec;
 class QKeyEvent;
 class QTimer;
-class QUrl;
+class QProgressDialog;
 
 class KCodecAction;
 class KJob;
@@ -53,6 +51,7 @@ class KActionMenu;
 
 namespace Konsole
 {
+class Emulation;
 class Session;
 class SessionGroup;
 class ScreenWindow;
@@ -60,8 +59,11 @@ class TerminalDisplay;
 class IncrementalSearchBar;
 class ProfileList;
 class UrlFilter;
-class RegExpFilter;
+class SaveHistoryJob;
+class SearchMatchCache;
 class EditProfileDialog;
+class SearchHistoryTask;
+class SearchHistoryJob;
 
 // SaveHistoryTask
 class TerminalCharacterDecoder;
@@ -278,8 +280,6 @@ private slots:
     // when a key press occurs in the
     // display area
 
-    void updateSearchFilter();
-
     void zmodemDownload();
     void zmodemUpload();
 
@@ -300,7 +300,7 @@ private:
     bool reverseSearchChecked() const;
     void setupCommonActions();
     void setupExtraActions();
-    void removeSearchFilter(); // remove and delete the current search filter if set
+    void removeSearchMatches(); // remove and delete the current search matches if set
     void setFindNextPrevEnabled(bool enabled);
     void listenForScreenWindowUpdates();
 
@@ -318,7 +318,7 @@ private:
     int        _previousState;
 
     UrlFilter*      _viewUrlFilter;
-    RegExpFilter*   _searchFilter;
+    SearchMatchCache* _searchMatches;
 
     QAction* _copyInputToAllTabsAction;
 
@@ -332,6 +332,7 @@ private:
 
     int _searchStartLine;
     int _prevSearchResultLine;
+    QPointer<SearchHistoryTask> _searchTask;
     QPointer<IncrementalSearchBar> _searchBar;
 
     KCodecAction* _codecAction;
@@ -439,39 +440,86 @@ public:
     virtual void execute();
 
 private slots:
-    void jobDataRequested(KIO::Job* job , QByteArray& data);
+    void saveJobFinished(bool success);
     void jobResult(KJob* job);
 
 private:
-    class SaveJob // structure to keep information needed to process
-        // incoming data requests from jobs
+    // emits completed() once all output has been saved
+    void finishIfDone();
+
+    class SaveJob // structure to keep information needed while
+        // the output of a session is saved
     {
     public:
-        SessionPtr session; // the session associated with a history save job
-        int lastLineFetched; // the last line processed in the previous data request
-        // set this to -1 at the start of the save job
-
-        TerminalCharacterDecoder* decoder;  // decoder used to convert terminal characters
-        // into output
+        QUrl url; // the location the output is saved to
+        QString temporaryFileName; // the file the output is written to before
+        // it is copied to a remote url, empty for local files
+        QPointer<QProgressDialog> progress;
     };
 
-    QHash<KJob*, SaveJob> _jobSession;
+    QHash<SaveHistoryJob*, SaveJob> _saveJobs;
+    QHash<KJob*, QString> _uploads; // copy jobs and the temporary files they upload
+};
+
+/**
+ * Writes an OutputSnapshot to a local file on a worker thread, as UTF-8
+ * encoded plain text or HTML, see SaveHistoryTask.
+ *
+ * The file is only replaced once all of the output has been written.  The
+ * job is run with JobRunner.
+ */
+class SaveHistoryJob : public QObject
+{
+    Q_OBJECT
+
+public:
+    SaveHistoryJob(const OutputSnapshot& snapshot, const QString& fileName, bool html);
+
+    /** Stops writing the file as soon as possible.  This may be called from any thread. */
+    void cancel();
+    /** Returns true if the job has been cancelled. */
+    bool isCancelled() const {
+        return _cancelled.load() != 0;
+    }
+
+    /** Returns a description of the error if the file could not be written. */
+    QString errorString() const {
+        return _errorString;
+    }
+
+    /** Writes the file, this is called on a worker thread. */
+    void run();
+
+signals:
+    /** Emitted while writing, with the percentage of the lines written so far. */
+    void progress(int percent);
+    /**
+     * Emitted when the job has finished.  @p success is false if the job was
+     * cancelled or the file could not be written.
+     */
+    void finished(bool success);
+
+private:
+    OutputSnapshot _snapshot;
+    QString _fileName;
+    bool _html;
+    QAtomicInt _cancelled;
+    QString _errorString;
 };
 
-//class SearchHistoryThread;
 /**
  * A task which searches through the output of sessions for matches for a given regular expression.
  * SearchHistoryTask operates on ScreenWindow instances rather than sessions added by addSession().
  * A screen window can be added to the list to search using addScreenWindow()
  *
  * When execute() is called, the search begins in the direction specified by searchDirection(),
- * starting at the position of the current selection.
+ * starting at the position of the current selection.  The output is searched on a worker
+ * thread, using a snapshot of the output taken when execute() is called, and the completed()
+ * signal is emitted once the search has finished.  If the history is cleared or replaced
+ * while searching, the search is started again on the new one.
  *
  * FIXME - This is not a proper implementation of SessionTask, in that it ignores sessions specified
  * with addSession()
- *
- * TODO - Implementation requirements:
- *          May provide progress feedback to the user when searching very large output logs.
  */
 class SearchHistoryTask : public SessionTask
 {
@@ -493,6 +541,7 @@ public:
      * Constructs a new search task.
      */
     explicit SearchHistoryTask(QObject* parent = 0);
+    virtual ~SearchHistoryTask();
 
     /** Adds a screen window to the list to search when execute() is called. */
     void addScreenWindow(Session* session , ScreenWindow* searchWindow);
@@ -511,21 +560,52 @@ public:
     void setStartLine(int startLine);
 
     /**
-     * Performs a search through the session's history, starting at the position
+     * Starts a search through the session's history, starting at the position
      * of the current selection, in the direction specified by setSearchDirection().
      *
      * If it finds a match, the ScreenWindow specified in the constructor is
      * scrolled to the position where the match occurred and the selection
-     * is set to the matching text.  execute() then returns immediately.
+     * is set to the matching text.
      *
      * To continue the search looking for further matches, call execute() again.
      */
     virtual void execute();
 
+    /**
+     * Stops the search.  The completed() signal is not emitted for a
+     * cancelled search.
+     */
+    void cancel();
+
+signals:
+    /** Emitted while searching, with the percentage of the output searched so far. */
+    void progress(int percent);
+
+private slots:
+    void jobFinished(int line);
+    // see Emulation::linesReflowed()
+    void reflowLines(qint64 firstLine, int oldCount, int newCount);
+
 private:
     typedef QPointer<ScreenWindow> ScreenWindowPtr;
 
-    void executeOnScreenWindow(SessionPtr session , ScreenWindowPtr window);
+    struct PendingSearch {
+        SessionPtr session;
+        ScreenWindowPtr window;
+        quint64 historySerialNumber;
+        qint64 firstHistoryLine;
+        // the absolute line the search started at
+        qint64 startLine;
+        // how often the search has been started again, see jobFinished()
+        int restarts;
+        // the lines which have been wrapped again while searching
+        ReflowedLines reflowedLines;
+    };
+
+    // searches the output of 'session'.  If 'restarted' is set, the search
+    // it describes is started again from the same line
+    void executeOnScreenWindow(SessionPtr session , ScreenWindowPtr window,
+                               const PendingSearch* restarted = 0);
     void highlightResult(ScreenWindowPtr window , int position);
 
     QMap< SessionPtr , ScreenWindowPtr > _windows;
@@ -533,7 +613,60 @@ private:
     SearchDirection _direction;
     int _startLine;
 
-    //static QPointer<SearchHistoryThread> _thread;
+    // the number of times a search is started again at most while the
+    // history keeps being replaced
+    static const int MAX_SEARCH_RESTARTS = 3;
+
+    QHash<SearchHistoryJob*, PendingSearch> _jobs;
+    bool _foundMatch;
+};
+
+/**
+ * Searches an OutputSnapshot for a regular expression on a worker thread,
+ * see SearchHistoryTask.
+ *
+ * The lines are searched in blocks, beginning at the start line and
+ * continuing from the other end of the output when the end in the direction
+ * of the search is reached.  The job is run with JobRunner.
+ */
+class SearchHistoryJob : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructs a job which searches the ranges of lines in @p lines, given as
+     * pairs of first and last line in ascending order, for @p regExp.
+     */
+    SearchHistoryJob(const OutputSnapshot& snapshot, const QRegExp& regExp, bool forwards,
+                     int startLine, const QList<QPair<int, int> >& lines);
+
+    /** Stops the search as soon as possible.  This may be called from any thread. */
+    void cancel();
+
+    /** Searches the lines, this is called on a worker thread. */
+    void run();
+
+signals:
+    /** Emitted while searching, with the percentage of the lines searched so far. */
+    void progress(int percent);
+    /**
+     * Emitted when the search has finished, with the line of the match
+     * or -1 if there was no match or the search was cancelled.
+     */
+    void finished(int line);
+
+private:
+    // searches the lines from 'fromLine' to 'toLine' and returns the line
+    // of the first match in the search direction, or -1
+    int searchLines(int fromLine, int toLine);
+
+    OutputSnapshot _snapshot;
+    QRegExp _regExp;
+    bool _forwards;
+    int _startLine;
+    QList<QPair<int, int> > _lines;
+    QAtomicInt _cancelled;
 };
 }
 
@@ -36,11 +36,14 @@
 #include "Session.h"
 #include "ProfileManager.h"
 #include "History.h"
+#include "Emulation.h"
 #include "Enumeration.h"
 
 using namespace Konsole;
 
 SessionManager::SessionManager()
+    : _historySearchIndexEnabled(false)
+    , _outputThreadEnabled(false)
 {
     //map finished() signals from sessions
     _sessionMapper = new QSignalMapper(this);
@@ -95,6 +98,8 @@ Session* SessionManager::createSession(Profile::Ptr profile)
     Session* session = new Session();
     Q_ASSERT(session);
     applyProfile(session, profile, false);
+    session->emulation()->setHistorySearchIndexEnabled(_historySearchIndexEnabled);
+    session->setOutputThreadEnabled(_outputThreadEnabled);
 
     connect(session , &Konsole::Session::profileChangeCommandReceived , this , &Konsole::SessionManager::sessionProfileCommandReceived);
 
@@ -223,6 +228,11 @@ void SessionManager::applyProfile(Session* session, const Profile::Ptr profile ,
         }
     }
 
+    if (apply.shouldApply(Profile::ReflowLines))
+        session->setReflowLines(profile->property<bool>(Profile::ReflowLines));
+    if (apply.shouldApply(Profile::SaveOutputWithSession))
+        session->setSaveOutputEnabled(profile->property<bool>(Profile::SaveOutputWithSession));
+
     // Terminal features
     if (apply.shouldApply(Profile::FlowControlEnabled))
         session->setFlowControlEnabled(profile->flowControlEnabled());
@@ -265,6 +275,29 @@ void SessionManager::sessionProfileCommandReceived(const QString& text)
     emit sessionUpdated(session);
 }
 
+void SessionManager::setHistoryMemoryBudget(qint64 bytes)
+{
+    HistoryMemoryManager::instance()->setBudget(bytes);
+}
+
+void SessionManager::setHistorySearchIndexEnabled(bool enable)
+{
+    _historySearchIndexEnabled = enable;
+
+    foreach(Session * session, _sessions) {
+        session->emulation()->setHistorySearchIndexEnabled(enable);
+    }
+}
+
+void SessionManager::setOutputThreadEnabled(bool enable)
+{
+    _outputThreadEnabled = enable;
+
+    foreach(Session * session, _sessions) {
+        session->setOutputThreadEnabled(enable);
+    }
+}
+
 void SessionManager::saveSessions(KConfig* config)
 {
     // The session IDs can't be restored.
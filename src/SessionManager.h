@@ -89,6 +89,25 @@ public:
      */
     const QList<Session*> sessions() const;
 
+    /**
+     * Sets the number of bytes which the fixed-size history of all sessions
+     * together may use, or 0 for no limit.  When the limit is exceeded, the
+     * oldest lines of the least recently viewed sessions are dropped.
+     */
+    void setHistoryMemoryBudget(qint64 bytes);
+
+    /**
+     * Sets whether the history of sessions is indexed, which makes searching
+     * through large histories faster at the cost of some memory.
+     */
+    void setHistorySearchIndexEnabled(bool enable);
+
+    /**
+     * Sets whether the output of sessions is processed by a thread per
+     * session.  See Session::setOutputThreadEnabled()
+     */
+    void setOutputThreadEnabled(bool enable);
+
     // System session management
     void saveSessions(KConfig* config);
     void restoreSessions(KConfig* config);
@@ -135,6 +154,9 @@ private:
     QHash<Session*, int> _restoreMapping;
 
     QSignalMapper* _sessionMapper;
+
+    bool _historySearchIndexEnabled;
+    bool _outputThreadEnabled;
 };
 
 /** Utility class to simplify code in SessionManager::applyProfile(). */
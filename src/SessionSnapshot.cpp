@@ -0,0 +1,238 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "SessionSnapshot.h"
+
+// Qt
+#include <QtCore/QDataStream>
+#include <QtCore/QDateTime>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QRunnable>
+#include <QtCore/QSaveFile>
+#include <QtCore/QSet>
+#include <QtCore/QStandardPaths>
+#include <QDebug>
+
+// KDE
+#include <KConfig>
+#include <KConfigGroup>
+
+// Konsole
+#include "Emulation.h"
+#include "History.h"
+
+using namespace Konsole;
+
+static const quint32 SNAPSHOT_MAGIC = 0x4b534e50; // "KSNP"
+static const quint32 SNAPSHOT_VERSION = 1;
+
+// snapshots which were written this long before a restored one belong to
+// an earlier save of the sessions, unless a saved session refers to them
+static const int STALE_SNAPSHOT_AGE = 60 * 60; // seconds
+
+// returns the snapshot files which the sessions saved by any instance of
+// Konsole refer to, see Session::saveSession()
+static QSet<QString> savedSnapshots()
+{
+    QSet<QString> snapshots;
+    const QDir sessionDir(QStandardPaths::writableLocation(QStandardPaths::GenericConfigLocation)
+                          + QStringLiteral("/session"));
+    const QFileInfoList configs = sessionDir.entryInfoList(QStringList() << QStringLiteral("konsole_*"), QDir::Files);
+    foreach(const QFileInfo& info, configs) {
+        const KConfig config(info.absoluteFilePath(), KConfig::SimpleConfig);
+        foreach(const QString& groupName, config.groupList()) {
+            const QString snapshot = config.group(groupName).readPathEntry("Snapshot", QString());
+            if (!snapshot.isEmpty())
+                snapshots.insert(QFileInfo(snapshot).absoluteFilePath());
+        }
+    }
+    return snapshots;
+}
+
+namespace
+{
+// compresses the history of a snapshot and writes it to disk
+class SnapshotFileWriter : public QRunnable
+{
+public:
+    SnapshotFileWriter(const QString& fileName, const QByteArray& screens,
+                       const OutputSnapshot& output)
+        : _fileName(fileName)
+        , _screens(screens)
+        , _output(output)
+    {
+    }
+
+    virtual void run() {
+        QDir().mkpath(QFileInfo(_fileName).absolutePath());
+
+        QSaveFile file(_fileName);
+        if (!file.open(QIODevice::WriteOnly)) {
+            qWarning() << "Unable to write session snapshot" << _fileName << file.errorString();
+            return;
+        }
+        // the output of the terminal is private
+        file.setPermissions(QFileDevice::ReadOwner | QFileDevice::WriteOwner);
+
+        const int lineCount = _output.historyLineCount();
+        const int chunkSize = OutputSnapshot::LINES_PER_CHUNK;
+
+        QDataStream stream(&file);
+        stream.setVersion(QDataStream::Qt_5_0);
+        stream << SNAPSHOT_MAGIC << SNAPSHOT_VERSION << _screens << quint32((lineCount + chunkSize - 1) / chunkSize);
+
+        // the chunks are read from the history one at a time
+        CompressedHistoryChunk chunk;
+        QVector<Character> cells;
+        for (int start = 0; start < lineCount; start += chunkSize) {
+            chunk.clear();
+            const int end = qMin(lineCount, start + chunkSize);
+            for (int line = start; line < end; line++) {
+                bool wrapped = false;
+                _output.getLine(line, cells, wrapped);
+                chunk.appendCells(cells.constData(), cells.count());
+                chunk.closeLine(wrapped);
+            }
+            stream << qCompress(chunk.serialize(), 1);
+        }
+
+        if (!file.commit())
+            qWarning() << "Unable to write session snapshot" << _fileName << file.errorString();
+    }
+
+private:
+    QString _fileName;
+    QByteArray _screens;
+    OutputSnapshot _output;
+};
+}
+
+SessionSnapshot::SessionSnapshot(Emulation* emulation)
+    : _emulation(emulation)
+{
+    _writer.setMaxThreadCount(1);
+}
+
+SessionSnapshot::~SessionSnapshot()
+{
+    waitForFinished();
+}
+
+void SessionSnapshot::waitForFinished()
+{
+    _writer.waitForDone();
+}
+
+void SessionSnapshot::save(const QString& fileName)
+{
+    waitForFinished();
+
+    QByteArray screens;
+    QDataStream screenStream(&screens, QIODevice::WriteOnly);
+    screenStream.setVersion(QDataStream::Qt_5_0);
+    OutputSnapshot output;
+    {
+        // the screens and the history are written at the same point of
+        // the output
+        OutputLocker locker(_emulation->outputLock());
+        _emulation->saveScreenState(screenStream);
+        output = _emulation->outputSnapshot();
+    }
+
+    _writer.start(new SnapshotFileWriter(fileName, screens, output));
+}
+
+bool SessionSnapshot::restore(Emulation* emulation, const QString& fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    const qint64 size = file.size();
+    uchar* data = file.map(0, size);
+    if (!data) {
+        qWarning() << "Unable to map session snapshot" << fileName << file.errorString();
+        return false;
+    }
+
+    // the stream reads from the mapped file directly
+    const QByteArray bytes = QByteArray::fromRawData(reinterpret_cast<const char*>(data), size);
+    QDataStream stream(bytes);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    bool ok = false;
+    quint32 magic = 0;
+    quint32 version = 0;
+    QByteArray screens;
+    quint32 chunkCount = 0;
+    stream >> magic >> version >> screens >> chunkCount;
+
+    if (stream.status() == QDataStream::Ok && magic == SNAPSHOT_MAGIC && version == SNAPSHOT_VERSION) {
+        OutputLocker locker(emulation->outputLock());
+        HistoryScroll* history = emulation->historyScroll();
+        CompressedHistoryChunk chunk;
+        QVector<Character> cells;
+
+        ok = true;
+        for (quint32 i = 0; i < chunkCount && ok; i++) {
+            QByteArray compressed;
+            stream >> compressed;
+            ok = stream.status() == QDataStream::Ok && chunk.deserialize(qUncompress(compressed));
+            if (!ok)
+                break;
+
+            for (int line = 0; line < chunk.lineCount(); line++) {
+                const int length = chunk.lineLength(line);
+                cells.resize(length);
+                chunk.getCells(line, 0, length, cells.data());
+                history->addCells(cells.constData(), length);
+                history->addLine(chunk.isWrappedLine(line));
+            }
+        }
+
+        QDataStream screenStream(screens);
+        screenStream.setVersion(QDataStream::Qt_5_0);
+        ok = emulation->restoreScreenState(screenStream) && ok;
+    }
+
+    file.unmap(data);
+
+    if (!ok)
+        qWarning() << "Session snapshot" << fileName << "is invalid";
+
+    return ok;
+}
+
+void SessionSnapshot::removeStaleSnapshots(const QString& fileName)
+{
+    const QFileInfo info(fileName);
+    if (!info.exists())
+        return;
+
+    const QDateTime staleTime = info.lastModified().addSecs(-STALE_SNAPSHOT_AGE);
+    const QSet<QString> saved = savedSnapshots();
+    const QFileInfoList snapshots = info.dir().entryInfoList(QStringList() << QStringLiteral("*.snapshot"), QDir::Files);
+    foreach(const QFileInfo& snapshot, snapshots) {
+        if (snapshot.lastModified() < staleTime && !saved.contains(snapshot.absoluteFilePath()))
+            QFile::remove(snapshot.absoluteFilePath());
+    }
+}
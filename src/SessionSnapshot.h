@@ -0,0 +1,85 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef SESSIONSNAPSHOT_H
+#define SESSIONSNAPSHOT_H
+
+// Qt
+#include <QtCore/QThreadPool>
+
+// Konsole
+#include "History.h"
+#include "konsoleprivate_export.h"
+
+namespace Konsole
+{
+class Emulation;
+
+/**
+ * Saves the output of a terminal emulation (both screens, the cursor,
+ * modes and the history) to a binary snapshot file, from which it can be
+ * restored quickly when the session is restored after a restart.
+ *
+ * Only the screens are copied when the snapshot is saved, the lines of the
+ * history are read from an OutputSnapshot, compressed and written to the
+ * file by a worker thread.
+ */
+class KONSOLEPRIVATE_EXPORT SessionSnapshot
+{
+public:
+    explicit SessionSnapshot(Emulation* emulation);
+    ~SessionSnapshot();
+
+    /**
+     * Captures the current state of the emulation and writes it to
+     * @p fileName in the background.  Any previous write started by this
+     * snapshot is completed first.
+     */
+    void save(const QString& fileName);
+
+    /** Blocks until the file written by the last call to save() is complete. */
+    void waitForFinished();
+
+    /**
+     * Restores the screens and the history of @p emulation from the snapshot
+     * file @p fileName.  The lines of the history are appended to the
+     * emulation's current history.
+     *
+     * Returns false if the file does not exist or is not a valid snapshot.
+     */
+    static bool restore(Emulation* emulation, const QString& fileName);
+
+    /**
+     * Removes the snapshot files next to @p fileName which were written
+     * well before it and which no saved session of any instance of Konsole
+     * refers to.  These were saved with sessions which have not been
+     * restored, and are not needed any more.
+     */
+    static void removeStaleSnapshots(const QString& fileName);
+
+private:
+    Q_DISABLE_COPY(SessionSnapshot)
+
+    Emulation* _emulation;
+
+    QThreadPool _writer;
+};
+}
+
+#endif // SESSIONSNAPSHOT_H
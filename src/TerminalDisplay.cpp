@@ -59,6 +59,7 @@
 
 // Konsole
 #include "Filter.h"
+#include "SearchMatchCache.h"
 #include "konsoledebug.h"
 #include "konsole_wcwidth.h"
 #include "TerminalCharacterDecoder.h"
@@ -992,6 +993,11 @@ void TerminalDisplay::scrollImage(int lines , const QRect& screenWindowRegion)
         //scroll internal image down
         memmove(firstCharPos , lastCharPos , bytesToMove);
 
+        if (_selectedColumns.count() >= region.top() + abs(lines) + linesToMove) {
+            for (int i = 0; i < linesToMove; i++)
+                _selectedColumns[region.top() + i] = _selectedColumns[region.top() + lines + i];
+        }
+
         //set region of display to scroll
         scrollRect.setTop(top);
     } else {
@@ -1002,6 +1008,11 @@ void TerminalDisplay::scrollImage(int lines , const QRect& screenWindowRegion)
         //scroll internal image up
         memmove(lastCharPos , firstCharPos , bytesToMove);
 
+        if (_selectedColumns.count() >= region.top() + abs(lines) + linesToMove) {
+            for (int i = linesToMove - 1; i >= 0; i--)
+                _selectedColumns[region.top() - lines + i] = _selectedColumns[region.top() + i];
+        }
+
         //set region of the display to scroll
         scrollRect.setTop(top + abs(lines) * _fontHeight);
     }
@@ -1092,6 +1103,7 @@ void TerminalDisplay::updateImage()
     }
 
     Character* const newimg = _screenWindow->getImage();
+    const QVector<ScreenWindow::ColumnRange> selectedColumns = _screenWindow->getSelectedColumns();
     const int lines = _screenWindow->windowLines();
     const int columns = _screenWindow->windowColumns();
 
@@ -1203,12 +1215,18 @@ void TerminalDisplay::updateImage()
                                     _fontHeight);
 
             dirtyRegion |= dirtyRect;
+        } else {
+            // only the columns of the line which were selected or deselected
+            // are repainted
+            dirtyRegion |= selectionChangeRegion(y, _selectedColumns.value(y, ScreenWindow::ColumnRange(0, -1)),
+                                                 selectedColumns.value(y, ScreenWindow::ColumnRange(0, -1)));
         }
 
         // replace the line of characters in the old _image with the
         // current line of the new _image
         memcpy((void*)currentLine, (const void*)newLine, columnsToUpdate * sizeof(Character));
     }
+    _selectedColumns = selectedColumns;
 
     // if the new _image is smaller than the previous _image, then ensure that the area
     // outside the new _image is cleared
@@ -1285,6 +1303,7 @@ void TerminalDisplay::paintEvent(QPaintEvent* pe)
     drawCurrentResultRect(paint);
     drawInputMethodPreeditString(paint, preeditRect());
     paintFilters(paint);
+    paintSearchMatches(paint);
 }
 
 void TerminalDisplay::printContent(QPainter& painter, bool friendly)
@@ -1321,6 +1340,99 @@ FilterChain* TerminalDisplay::filterChain() const
     return _filterChain;
 }
 
+void TerminalDisplay::setSearchMatches(SearchMatchCache* matches)
+{
+    if (_searchMatches)
+        disconnect(_searchMatches.data(), 0, this, 0);
+
+    _searchMatches = matches;
+
+    if (_searchMatches)
+        connect(_searchMatches.data(), &Konsole::SearchMatchCache::matchesChanged, this, static_cast<void(TerminalDisplay::*)()>(&Konsole::TerminalDisplay::update));
+
+    update();
+}
+
+void TerminalDisplay::paintSearchMatches(QPainter& painter)
+{
+    if (!_searchMatches || !_screenWindow)
+        return;
+
+    // the matches are found in advance by the search match cache, only
+    // those in the window are looked up here
+    const qint64 firstLine = _screenWindow->droppedLineCount() + _screenWindow->currentLine();
+    const qint64 lastLine = firstLine + _usedLines - 1;
+    const qint64 currentResultLine = _screenWindow->droppedLineCount() + _screenWindow->currentResultLine();
+
+    foreach(const SearchMatch& match, _searchMatches->matches(firstLine, lastLine)) {
+        //TODO - Do not use a hardcoded color for this
+        const bool isCurrentResultLine = _screenWindow->currentResultLine() != -1 &&
+                                         currentResultLine >= match.startLine && currentResultLine <= match.endLine;
+        const QColor color = isCurrentResultLine ? QColor(255, 255, 0, 120) : QColor(255, 0, 0, 120);
+
+        const int startLine = qMax(match.startLine, firstLine) - firstLine;
+        const int endLine = qMin(match.endLine, lastLine) - firstLine;
+        for (int line = startLine; line <= endLine; line++) {
+            const int startColumn = (line + firstLine == match.startLine) ? match.startColumn : 0;
+            const int endColumn = (line + firstLine == match.endLine) ? match.endColumn : _usedColumns;
+
+            QRect r;
+            r.setCoords(startColumn * _fontWidth + _contentRect.left(),
+                        line * _fontHeight + _contentRect.top(),
+                        endColumn * _fontWidth + _contentRect.left() - 1,
+                        (line + 1)*_fontHeight + _contentRect.top() - 1);
+            painter.fillRect(r, color);
+        }
+    }
+}
+
+bool TerminalDisplay::isSelectedColumn(int column, int line) const
+{
+    if (line >= _selectedColumns.count())
+        return false;
+
+    const ScreenWindow::ColumnRange& range = _selectedColumns.at(line);
+    return column >= range.first && column <= range.second;
+}
+
+QRegion TerminalDisplay::selectionChangeRegion(int line, const ScreenWindow::ColumnRange& oldRange,
+                                               const ScreenWindow::ColumnRange& newRange) const
+{
+    if (oldRange == newRange)
+        return QRegion();
+
+    const bool oldEmpty = oldRange.first > oldRange.second;
+    const bool newEmpty = newRange.first > newRange.second;
+
+    // the columns in which one range starts before the other and in which
+    // one range ends after the other
+    QRegion region;
+    if (oldEmpty || newEmpty) {
+        const ScreenWindow::ColumnRange& range = oldEmpty ? newRange : oldRange;
+        if (range.first <= range.second)
+            region |= imageToWidget(QRect(range.first, line, range.second - range.first + 1, 1));
+    } else {
+        if (oldRange.first != newRange.first) {
+            const int left = qMin(oldRange.first, newRange.first);
+            const int right = qMax(oldRange.first, newRange.first);
+            region |= imageToWidget(QRect(left, line, right - left + 1, 1));
+        }
+        if (oldRange.second != newRange.second) {
+            const int left = qMin(oldRange.second, newRange.second);
+            const int right = qMax(oldRange.second, newRange.second);
+            region |= imageToWidget(QRect(left, line, right - left + 1, 1));
+        }
+    }
+
+    // characters may exceed their cell, so the neighbouring columns are
+    // repainted as well
+    QRegion result;
+    foreach(const QRect& rect, region.rects()) {
+        result |= rect.adjusted(-_fontWidth, 0, _fontWidth, 0);
+    }
+    return result;
+}
+
 void TerminalDisplay::paintFilters(QPainter& painter)
 {
     // get color of character under mouse and use it to draw
@@ -1487,8 +1599,10 @@ void TerminalDisplay::drawContents(QPainter& paint, const QRect& rect)
             const CharacterColor currentForeground = _image[loc(x, y)].foregroundColor;
             const CharacterColor currentBackground = _image[loc(x, y)].backgroundColor;
             const quint8 currentRendition = _image[loc(x, y)].rendition;
+            const bool selected = isSelectedColumn(x, y);
 
             while (x + len <= rlx &&
+                    isSelectedColumn(x + len, y) == selected &&
                     _image[loc(x + len, y)].foregroundColor == currentForeground &&
                     _image[loc(x + len, y)].backgroundColor == currentBackground &&
                     (_image[loc(x + len, y)].rendition & ~RE_EXTENDED_CHAR) == (currentRendition & ~RE_EXTENDED_CHAR) &&
@@ -1556,17 +1670,24 @@ void TerminalDisplay::drawContents(QPainter& paint, const QRect& rect)
             //(instead of textArea.topLeft() * painter-scale)
             textArea.moveTopLeft(textScale.inverted().map(textArea.topLeft()));
 
+            // selected text is drawn with its colors inverted
+            Character style = _image[loc(x, y)];
+            if (selected) {
+                style.foregroundColor = currentBackground;
+                style.backgroundColor = currentForeground;
+            }
+
             //paint text fragment
             if (_printerFriendly) {
                 drawPrinterFriendlyTextFragment(paint,
                                                 textArea,
                                                 unistr,
-                                                &_image[loc(x, y)]);
+                                                &style);
             } else {
                 drawTextFragment(paint,
                                  textArea,
                                  unistr,
-                                 &_image[loc(x, y)]);
+                                 &style);
             }
 
             _fixedFont = save__fixedFont;
@@ -2520,7 +2641,6 @@ QPoint TerminalDisplay::findLineStart(const QPoint &pnt)
 {
     const int visibleScreenLines = _lineProperties.size();
     const int topVisibleLine = _screenWindow->currentLine();
-    Screen *screen = _screenWindow->screen();
     int line = pnt.y();
     int lineInHistory= line + topVisibleLine;
 
@@ -2539,7 +2659,7 @@ QPoint TerminalDisplay::findLineStart(const QPoint &pnt)
 
         // _lineProperties is only for the visible screen, so grab new data
         int newRegionStart = qMax(0, lineInHistory - visibleScreenLines);
-        lineProperties = screen->getLineProperties(newRegionStart, lineInHistory - 1);
+        lineProperties = _screenWindow->getLineProperties(newRegionStart, lineInHistory - 1);
         line = lineInHistory - newRegionStart;
     }
     return QPoint(0, lineInHistory - topVisibleLine);
@@ -2553,7 +2673,6 @@ QPoint TerminalDisplay::findLineEnd(const QPoint &pnt)
     const int visibleScreenLines = _lineProperties.size();
     const int topVisibleLine = _screenWindow->currentLine();
     const int maxY = _screenWindow->lineCount() - 1;
-    Screen *screen = _screenWindow->screen();
     int line = pnt.y();
     int lineInHistory= line + topVisibleLine;
 
@@ -2568,7 +2687,7 @@ QPoint TerminalDisplay::findLineEnd(const QPoint &pnt)
         }
 
         line = 0;
-        lineProperties = screen->getLineProperties(lineInHistory, qMin(lineInHistory + visibleScreenLines, maxY));
+        lineProperties = _screenWindow->getLineProperties(lineInHistory, qMin(lineInHistory + visibleScreenLines, maxY));
     }
     return QPoint(_columns - 1, lineInHistory - topVisibleLine);
 }
@@ -2582,7 +2701,6 @@ QPoint TerminalDisplay::findWordStart(const QPoint &pnt)
     int y = i + curLine;
     int j = loc(x, i);
     QVector<LineProperty> lineProperties = _lineProperties;
-    Screen *screen = _screenWindow->screen();
     Character *image = _image;
     Character *tmp_image = NULL;
     const QChar selClass = charClass(image[j]);
@@ -2610,13 +2728,13 @@ QPoint TerminalDisplay::findWordStart(const QPoint &pnt)
             }
         }
         int newRegStart = qMax(0, y - regSize);
-        lineProperties = screen->getLineProperties(newRegStart, y - 1);
+        lineProperties = _screenWindow->getLineProperties(newRegStart, y - 1);
         i = y - newRegStart;
         if (!tmp_image) {
             tmp_image = new Character[imageSize];
             image = tmp_image;
         }
-        screen->getImage(tmp_image, imageSize, newRegStart, y - 1);
+        _screenWindow->getImage(tmp_image, imageSize, newRegStart, y - 1);
         j = loc(x, i);
     }
 out:
@@ -2635,7 +2753,6 @@ QPoint TerminalDisplay::findWordEnd(const QPoint &pnt)
     int y = i + curLine;
     int j = loc(x, i);
     QVector<LineProperty> lineProperties = _lineProperties;
-    Screen *screen = _screenWindow->screen();
     Character *image = _image;
     Character *tmp_image = NULL;
     const QChar selClass = charClass(image[j]);
@@ -2668,13 +2785,13 @@ QPoint TerminalDisplay::findWordEnd(const QPoint &pnt)
             }
         }
         int newRegEnd = qMin(y + regSize - 1, maxY);
-        lineProperties = screen->getLineProperties(y, newRegEnd);
+        lineProperties = _screenWindow->getLineProperties(y, newRegEnd);
         i = 0;
         if (!tmp_image) {
             tmp_image = new Character[imageSize];
             image = tmp_image;
         }
-        screen->getImage(tmp_image, imageSize, y, newRegEnd);
+        _screenWindow->getImage(tmp_image, imageSize, y, newRegEnd);
         x--;
         j = loc(x, i);
     }
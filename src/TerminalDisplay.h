@@ -51,6 +51,7 @@ namespace Konsole
 {
 class FilterChain;
 class TerminalImageFilterChain;
+class SearchMatchCache;
 class SessionController;
 /**
  * A widget which displays output from a terminal emulation and sends input keypresses and mouse activity
@@ -140,6 +141,13 @@ public:
      */
     void processFilters();
 
+    /**
+     * Sets the matches of a search which are highlighted on top of the
+     * terminal output, or none if @p matches is 0.  The display is
+     * repainted when the matches change.
+     */
+    void setSearchMatches(SearchMatchCache* matches);
+
     /**
      * Returns a list of menu actions created by the filters for the content
      * at the given @p position.
@@ -765,6 +773,14 @@ private:
     void makeImage();
 
     void paintFilters(QPainter& painter);
+    void paintSearchMatches(QPainter& painter);
+
+    // returns true if 'column' of 'line' in the image is selected
+    bool isSelectedColumn(int column, int line) const;
+    // returns the area of 'line' which needs to be repainted when its
+    // selected columns change from 'oldRange' to 'newRange'
+    QRegion selectionChangeRegion(int line, const ScreenWindow::ColumnRange& oldRange,
+                                  const ScreenWindow::ColumnRange& newRange) const;
 
     // returns a region covering all of the areas of the widget which contain
     // a hotspot
@@ -821,6 +837,9 @@ private:
 
     int _imageSize;
     QVector<LineProperty> _lineProperties;
+    // the selected columns of each line of the image, the selection is
+    // highlighted when the image is drawn
+    QVector<ScreenWindow::ColumnRange> _selectedColumns;
 
     ColorEntry _colorTable[TABLE_COLORS];
     uint _randomSeed;
@@ -887,6 +906,7 @@ private:
     // list of filters currently applied to the display.  used for links and
     // search highlight
     TerminalImageFilterChain* _filterChain;
+    QPointer<SearchMatchCache> _searchMatches;
     QRegion _mouseOverHotspotArea;
 
     Enum::CursorShapeEnum _cursorShape;
@@ -50,8 +50,10 @@ int TerminalDisplayAccessible::cursorPosition()
     if (!display()->screenWindow())
         return 0;
 
-    int offset = display()->_usedColumns * display()->screenWindow()->screen()->getCursorY();
-    return offset + display()->screenWindow()->screen()->getCursorX();
+    // the screen may be changed by the emulation meanwhile, the window
+    // keeps the cursor position of the frame it displays
+    const QPoint cursor = display()->screenWindow()->cursorPosition();
+    return display()->_usedColumns * cursor.y() + cursor.x();
 }
 
 void TerminalDisplayAccessible::selection(int selectionIndex, int* startOffset, int* endOffset)
@@ -94,6 +96,7 @@ QString TerminalDisplayAccessible::visibleText() const
     if (!display->screenWindow())
         return QString();
 
+    OutputLocker locker(display->screenWindow()->lock());
     return display->screenWindow()->screen()->text(0, display->_usedColumns * display->_usedLines, true);
 }
 
@@ -152,6 +155,7 @@ void TerminalDisplayAccessible::setCursorPosition(int position)
     if (!display()->screenWindow())
         return;
 
+    OutputLocker locker(display()->screenWindow()->lock());
     display()->screenWindow()->screen()->setCursorYX(lineForOffset(position), columnForOffset(position));
 }
 
@@ -174,6 +178,7 @@ QString TerminalDisplayAccessible::text(int startOffset, int endOffset)
     if (!display()->screenWindow())
         return QString();
 
+    OutputLocker locker(display()->screenWindow()->lock());
     return display()->screenWindow()->screen()->text(startOffset, endOffset, true);
 }
 
@@ -33,6 +33,7 @@
 #include "TerminalDisplay.h"
 #include "ScreenWindow.h"
 #include "Screen.h"
+#include "OutputLock.h"
 
 namespace Konsole
 {
@@ -66,6 +66,9 @@ unsigned short Konsole::vt100_graphics[32] = {
 
 Vt102Emulation::Vt102Emulation()
     : Emulation(),
+      _parserState(GroundState),
+      _escapeCharacter(0),
+      _vt52Row(0),
       _titleUpdateTimer(new QTimer(this)),
       _reportFocusEvents(false)
 {
@@ -81,22 +84,40 @@ Vt102Emulation::~Vt102Emulation()
 
 void Vt102Emulation::clearEntireScreen()
 {
-    _currentScreen->clearEntireScreen();
+    // moving the image into the history creates history objects
+    if (onOtherThread()) {
+        QMetaObject::invokeMethod(this, "clearEntireScreen", Qt::BlockingQueuedConnection);
+        return;
+    }
+
+    {
+        OutputLocker locker(&_outputLock);
+        _currentScreen->clearEntireScreen();
+    }
     bufferedUpdate();
 }
 
 void Vt102Emulation::reset()
 {
+    // the state of the parser belongs to the output thread
+    if (onOtherThread()) {
+        QMetaObject::invokeMethod(this, "reset", Qt::BlockingQueuedConnection);
+        return;
+    }
+
     // Save the current codec so we can set it later.
     // Ideally we would want to use the profile setting
     const QTextCodec* currentCodec = codec();
 
-    resetTokenizer();
-    resetModes();
-    resetCharset(0);
-    _screen[0]->reset();
-    resetCharset(1);
-    _screen[1]->reset();
+    {
+        OutputLocker locker(&_outputLock);
+        resetTokenizer();
+        resetModes();
+        resetCharset(0);
+        _screen[0]->reset();
+        resetCharset(1);
+        _screen[1]->reset();
+    }
 
     if (currentCodec)
         setCodec(currentCodec);
@@ -186,14 +207,23 @@ const int MAX_ARGUMENT = 4096;
 
 /* The tokenizer's state
 
-   The state is represented by the buffer (tokenBuffer, tokenBufferPos),
-   and accompanied by decoded arguments kept in (argv,argc).
+   The tokenizer is a state machine in the style of the DEC ANSI parser
+   described at http://vt100.net/emu/dec_ansi_parser.  The state is kept in
+   _parserState and accompanied by the decoded arguments kept in (argv,argc),
+   the character after ESC of sequences such as ESC ( B (_escapeCharacter),
+   the text of xterm window attribute requests (_oscBuffer) and the row of
+   VT52 cursor position sequences (_vt52Row).
    Note that they are kept internal in the tokenizer.
 */
 
 void Vt102Emulation::resetTokenizer()
 {
-    tokenBufferPos = 0;
+    _parserState = GroundState;
+    resetArguments();
+}
+
+void Vt102Emulation::resetArguments()
+{
     argc = 0;
     argv[0] = 0;
     argv[1] = 0;
@@ -211,183 +241,272 @@ void Vt102Emulation::addArgument()
     argv[argc] = 0;
 }
 
-void Vt102Emulation::addToCurrentToken(int cc)
+#define CNTL(c) ((c)-'@')
+const int ESC = 27;
+const int DEL = 127;
+
+// The longest text of a window attribute request which is kept
+const int MAX_OSC_LENGTH = 65536;
+
+// The actions of the tokenizer, which are taken when a character is
+// received in a state.  See initTokenizer()
+enum TokenizerAction {
+    NoAction,                   // only change the state
+    ExecuteAction,              // execute a control character
+    CancelAction,               // abort the sequence and execute the control character (CAN, SUB)
+    EscapeAction,               // start an escape sequence
+    PrintAction,                // display a character of the current character set
+    PrintPlainAction,           // display a character as it is (VT52 mode)
+    EscapeDispatchAction,       // ESC <char>
+    IntermediateAction,         // remember the character after ESC
+    IntermediateDispatchAction, // ESC <intermediate> <char>
+    CsiEntryAction,             // start a CSI sequence with the 8-bit CSI character
+    DigitAction,                // add a digit to the current argument
+    ArgumentAction,             // start the next argument
+    CsiPnDispatchAction,        // ESC [ {Pn} ; {Pn} <char>
+    CsiResizeDispatchAction,    // ESC [ 8 ; <row> ; <col> t
+    CsiPsDispatchAction,        // ESC [ {Pn} ; ... <char>
+    CsiPrDispatchAction,        // ESC [ ? {Pn} ; ... <char>
+    CsiPgDispatchAction,        // ESC [ > {Pn} ; ... <char>
+    CsiPeDispatchAction,        // ESC [ ! <char>
+    OscStartAction,             // start a window attribute request
+    OscPutAction,               // add a character to the window attribute request
+    OscDispatchAction,          // ESC ] {Pn} ; {Text} <BEL>
+    Vt52DispatchAction,         // ESC <char> in VT52 mode
+    Vt52RowAction,              // remember the row of ESC Y <row> <col>
+    Vt52CursorDispatchAction    // ESC Y <row> <col>
+};
+
+static inline quint16 transition(int action, int state)
 {
-    tokenBuffer[tokenBufferPos] = cc;
-    tokenBufferPos = qMin(tokenBufferPos + 1, MAX_TOKEN_LENGTH - 1);
+    return (action << 8) | state;
 }
 
-// Character Class flags used while decoding
-const int CTL =  1;  // Control character
-const int CHR =  2;  // Printable character
-const int CPN =  4;  // TODO: Document me
-const int DIG =  8;  // Digit
-const int SCS = 16;  // Select Character Set
-const int GRP = 32;  // TODO: Document me
-const int CPS = 64;  // Character which indicates end of window resize
+/* The transition table
+
+   For each state and each character, the table holds the action to take
+   and the state to change to.  All characters from 256 upwards share the
+   last entry of a state.
+
+   Control characters are executed in all states without leaving the state,
+   this means that they are allowed *within* escape sequences as in the VT100,
+   except for CAN and SUB, which abort the sequence, and ESC, which starts a
+   new one.  DEL is ignored.
+
+   Some transitions are particular to Konsole: ESC ( ? behaves like ESC [ ?,
+   and ESC [ ! accepts a single character.
+*/
 
 void Vt102Emulation::initTokenizer()
 {
-    int i;
-    quint8* s;
-    for (i = 0; i < 256; ++i)
-        charClass[i] = 0;
-    for (i = 0; i < 32; ++i)
-        charClass[i] |= CTL;
-    for (i = 32; i < 256; ++i)
-        charClass[i] |= CHR;
-    for (s = (quint8*)"@ABCDGHILMPSTXZcdfry"; *s; ++s)
-        charClass[*s] |= CPN;
-    // resize = \e[8;<row>;<col>t
-    for (s = (quint8*)"t"; *s; ++s)
-        charClass[*s] |= CPS;
-    for (s = (quint8*)"0123456789"; *s; ++s)
-        charClass[*s] |= DIG;
-    for (s = (quint8*)"()+*%"; *s; ++s)
-        charClass[*s] |= SCS;
-    for (s = (quint8*)"()+*#[]%"; *s; ++s)
-        charClass[*s] |= GRP;
-
-    resetTokenizer();
-}
+    for (int state = 0; state < ParserStateCount; state++) {
+        // VT52 mode shares the ground state, see receiveChar()
+        const int self = (state == Vt52GroundState) ? GroundState : state;
+        const bool vt52 = (state >= Vt52GroundState);
+        quint16* transitions = _transitions[state];
+
+        for (int c = 0; c < 32; c++)
+            transitions[c] = transition(ExecuteAction, self);
+        transitions[CNTL('X')] = transition(CancelAction, GroundState);
+        transitions[CNTL('Z')] = transition(CancelAction, GroundState);
+        transitions[ESC] = transition(EscapeAction, vt52 ? Vt52EscapeState : EscapeState);
+        transitions[DEL] = transition(NoAction, self);
+    }
 
-/* Ok, here comes the nasty part of the decoder.
+    for (int c = 32; c <= 256; c++) {
+        if (c == DEL)
+            continue;
+
+        _transitions[GroundState][c] = transition(PrintAction, GroundState);
+        _transitions[EscapeState][c] = transition(EscapeDispatchAction, GroundState);
+        _transitions[EscapeIntermediateState][c] = transition(IntermediateDispatchAction, GroundState);
+        _transitions[CsiEntryState][c] = transition(CsiPsDispatchAction, GroundState);
+        _transitions[CsiParamState][c] = transition(CsiPsDispatchAction, GroundState);
+        _transitions[CsiPrivateState][c] = transition(CsiPrDispatchAction, GroundState);
+        _transitions[CsiGreaterState][c] = transition(CsiPgDispatchAction, GroundState);
+        _transitions[CsiBangState][c] = transition(CsiPeDispatchAction, GroundState);
+        _transitions[OscStringState][c] = transition(OscPutAction, OscStringState);
+        _transitions[Vt52GroundState][c] = transition(PrintPlainAction, GroundState);
+        _transitions[Vt52EscapeState][c] = transition(Vt52DispatchAction, GroundState);
+        _transitions[Vt52CursorRowState][c] = transition(Vt52RowAction, Vt52CursorColumnState);
+        _transitions[Vt52CursorColumnState][c] = transition(Vt52CursorDispatchAction, GroundState);
+    }
 
-   Instead of keeping an explicit state, we deduce it from the
-   token scanned so far. It is then immediately combined with
-   the current character to form a scanning decision.
+    // the 8-bit CSI character
+    _transitions[GroundState][ESC + 128] = transition(CsiEntryAction, CsiEntryState);
 
-   This is done by the following defines.
+    for (const quint8* s = (const quint8*)"()+*#%"; *s; ++s)
+        _transitions[EscapeState][*s] = transition(IntermediateAction, EscapeIntermediateState);
+    _transitions[EscapeState]['['] = transition(NoAction, CsiEntryState);
+    _transitions[EscapeState][']'] = transition(OscStartAction, OscStringState);
 
-   - P is the length of the token scanned so far.
-   - L (often P-1) is the position on which contents we base a decision.
-   - C is a character or a group of characters (taken from 'charClass').
+    _transitions[EscapeIntermediateState]['?'] = transition(NoAction, CsiPrivateState);
+    _transitions[EscapeIntermediateState]['>'] = transition(NoAction, CsiGreaterState);
+    _transitions[EscapeIntermediateState]['!'] = transition(NoAction, CsiBangState);
+    _transitions[CsiEntryState]['?'] = transition(NoAction, CsiPrivateState);
+    _transitions[CsiEntryState]['>'] = transition(NoAction, CsiGreaterState);
+    _transitions[CsiEntryState]['!'] = transition(NoAction, CsiBangState);
 
-   - 'cc' is the current character
-   - 's' is a pointer to the start of the token buffer
-   - 'p' is the current position within the token buffer
+    for (const quint8* s = (const quint8*)"@ABCDGHILMPSTXZcdfry"; *s; ++s) {
+        _transitions[CsiEntryState][*s] = transition(CsiPnDispatchAction, GroundState);
+        _transitions[CsiParamState][*s] = transition(CsiPnDispatchAction, GroundState);
+    }
+    // resize = \e[8;<row>;<col>t
+    _transitions[CsiEntryState]['t'] = transition(CsiResizeDispatchAction, GroundState);
+    _transitions[CsiParamState]['t'] = transition(CsiResizeDispatchAction, GroundState);
+
+    const int argumentStates[] = { CsiEntryState, CsiParamState, CsiPrivateState, CsiGreaterState };
+    for (int i = 0; i < 4; i++) {
+        const int state = argumentStates[i];
+        const int nextState = (state == CsiEntryState) ? CsiParamState : state;
+        for (int c = '0'; c <= '9'; c++)
+            _transitions[state][c] = transition(DigitAction, nextState);
+        _transitions[state][';'] = transition(ArgumentAction, nextState);
+    }
 
-   Note that they need to applied in proper order.
-*/
+    _transitions[OscStringState][7] = transition(OscDispatchAction, GroundState);
 
-#define lec(P,L,C) (p == (P) && s[(L)] == (C))
-#define lun(     ) (p ==  1  && cc >= 32 )
-#define les(P,L,C) (p == (P) && s[L] < 256 && (charClass[s[(L)]] & (C)) == (C))
-#define eec(C)     (p >=  3  && cc == (C))
-#define ees(C)     (p >=  3  && cc < 256 && (charClass[cc] & (C)) == (C))
-#define eps(C)     (p >=  3  && s[2] != '?' && s[2] != '!' && s[2] != '>' && cc < 256 && (charClass[cc] & (C)) == (C))
-#define epp( )     (p >=  3  && s[2] == '?')
-#define epe( )     (p >=  3  && s[2] == '!')
-#define egt( )     (p >=  3  && s[2] == '>')
-#define Xpe        (tokenBufferPos >= 2 && tokenBuffer[1] == ']')
-#define Xte        (Xpe      && cc ==  7 )
-#define ces(C)     (cc < 256 && (charClass[cc] & (C)) == (C) && !Xte)
+    _transitions[Vt52EscapeState]['Y'] = transition(NoAction, Vt52CursorRowState);
 
-#define CNTL(c) ((c)-'@')
-const int ESC = 27;
-const int DEL = 127;
+    resetTokenizer();
+}
 
 // process an incoming unicode character
 void Vt102Emulation::receiveChar(int cc)
 {
-  if (cc == DEL)
-    return; //VT100: ignore.
-
-  if (ces(CTL))
-  {
-    // DEC HACK ALERT! Control Characters are allowed *within* esc sequences in VT100
-    // This means, they do neither a resetTokenizer() nor a pushToToken(). Some of them, do
-    // of course. Guess this originates from a weakly layered handling of the X-on
-    // X-off protocol, which comes really below this level.
-    if (cc == CNTL('X') || cc == CNTL('Z') || cc == ESC)
-        resetTokenizer(); //VT100: CAN or SUB
-    if (cc != ESC)
-    {
-        processToken(TY_CTL(cc+'@' ),0,0);
-        return;
-    }
-  }
-  // advance the state
-  addToCurrentToken(cc);
+  int state = _parserState;
+  if (state == GroundState && !getMode(MODE_Ansi))
+    state = Vt52GroundState;
 
-  int* s = tokenBuffer;
-  const int  p = tokenBufferPos;
+  const quint16 next = _transitions[state][qMin(cc, 256)];
+  _parserState = next & 0xff;
 
-  if (getMode(MODE_Ansi))
+  switch (next >> 8)
   {
-    if (lec(1,0,ESC)) { return; }
-    if (lec(1,0,ESC+128)) { s[0] = ESC; receiveChar('['); return; }
-    if (les(2,1,GRP)) { return; }
-    if (Xte         ) { processWindowAttributeRequest(); resetTokenizer(); return; }
-    if (Xpe         ) { return; }
-    if (lec(3,2,'?')) { return; }
-    if (lec(3,2,'>')) { return; }
-    if (lec(3,2,'!')) { return; }
-    if (lun(       )) { processToken( TY_CHR(), applyCharset(cc), 0);   resetTokenizer(); return; }
-    if (lec(2,0,ESC)) { processToken( TY_ESC(s[1]), 0, 0);              resetTokenizer(); return; }
-    if (les(3,1,SCS)) { processToken( TY_ESC_CS(s[1],s[2]), 0, 0);      resetTokenizer(); return; }
-    if (lec(3,1,'#')) { processToken( TY_ESC_DE(s[2]), 0, 0);           resetTokenizer(); return; }
-    if (eps(    CPN)) { processToken( TY_CSI_PN(cc), argv[0],argv[1]);  resetTokenizer(); return; }
-
-    // resize = \e[8;<row>;<col>t
-    if (eps(CPS))
-    {
-        processToken( TY_CSI_PS(cc, argv[0]), argv[1], argv[2]);
-        resetTokenizer();
-        return;
-    }
-
-    if (epe(   )) { processToken( TY_CSI_PE(cc), 0, 0); resetTokenizer(); return; }
-    if (ees(DIG)) { addDigit(cc-'0'); return; }
-    if (eec(';')) { addArgument();    return; }
-    for (int i = 0; i <= argc; i++)
-    {
-        if (epp())
-            processToken(TY_CSI_PR(cc,argv[i]), 0, 0);
-        else if (egt())
-            processToken(TY_CSI_PG(cc), 0, 0); // spec. case for ESC]>0c or ESC]>c
-        else if (cc == 'm' && argc - i >= 4 && (argv[i] == 38 || argv[i] == 48) && argv[i+1] == 2)
+    case NoAction:
+      break;
+    case ExecuteAction:
+      processToken(TY_CTL(cc+'@'), 0, 0);
+      break;
+    case CancelAction:
+      resetArguments(); //VT100: CAN or SUB
+      processToken(TY_CTL(cc+'@'), 0, 0);
+      break;
+    case EscapeAction:
+      resetArguments();
+      break;
+    case PrintAction:
+      processToken(TY_CHR(), applyCharset(cc), 0);
+      break;
+    case PrintPlainAction:
+      processToken(TY_CHR(), cc, 0);
+      break;
+    case EscapeDispatchAction:
+      processToken(TY_ESC(cc), 0, 0);
+      break;
+    case IntermediateAction:
+      _escapeCharacter = cc;
+      break;
+    case IntermediateDispatchAction:
+      if (_escapeCharacter == '#')
+        processToken(TY_ESC_DE(cc), 0, 0);
+      else
+        processToken(TY_ESC_CS(_escapeCharacter, cc), 0, 0);
+      break;
+    case CsiEntryAction:
+      resetArguments();
+      break;
+    case DigitAction:
+      addDigit(cc - '0');
+      break;
+    case ArgumentAction:
+      addArgument();
+      break;
+    case CsiPnDispatchAction:
+      processToken(TY_CSI_PN(cc), argv[0], argv[1]);
+      break;
+    case CsiResizeDispatchAction:
+      processToken(TY_CSI_PS(cc, argv[0]), argv[1], argv[2]);
+      break;
+    case CsiPrDispatchAction:
+      for (int i = 0; i <= argc; i++)
+        processToken(TY_CSI_PR(cc, argv[i]), 0, 0);
+      break;
+    case CsiPgDispatchAction:
+      for (int i = 0; i <= argc; i++)
+        processToken(TY_CSI_PG(cc), 0, 0); // spec. case for ESC]>0c or ESC]>c
+      break;
+    case CsiPsDispatchAction:
+      for (int i = 0; i <= argc; i++)
+      {
+        if (cc == 'm' && argc - i >= 4 && (argv[i] == 38 || argv[i] == 48) && argv[i+1] == 2)
         {
-            // ESC[ ... 48;2;<red>;<green>;<blue> ... m -or- ESC[ ... 38;2;<red>;<green>;<blue> ... m
-            i += 2;
-            processToken(TY_CSI_PS(cc, argv[i-2]), COLOR_SPACE_RGB, (argv[i] << 16) | (argv[i+1] << 8) | argv[i+2]);
-            i += 2;
+          // ESC[ ... 48;2;<red>;<green>;<blue> ... m -or- ESC[ ... 38;2;<red>;<green>;<blue> ... m
+          i += 2;
+          processToken(TY_CSI_PS(cc, argv[i-2]), COLOR_SPACE_RGB, (argv[i] << 16) | (argv[i+1] << 8) | argv[i+2]);
+          i += 2;
         }
         else if (cc == 'm' && argc - i >= 2 && (argv[i] == 38 || argv[i] == 48) && argv[i+1] == 5)
         {
-            // ESC[ ... 48;5;<index> ... m -or- ESC[ ... 38;5;<index> ... m
-            i += 2;
-            processToken(TY_CSI_PS(cc, argv[i-2]), COLOR_SPACE_256, argv[i]);
+          // ESC[ ... 48;5;<index> ... m -or- ESC[ ... 38;5;<index> ... m
+          i += 2;
+          processToken(TY_CSI_PS(cc, argv[i-2]), COLOR_SPACE_256, argv[i]);
         }
         else
-            processToken(TY_CSI_PS(cc,argv[i]), 0, 0);
-    }
-    resetTokenizer();
+          processToken(TY_CSI_PS(cc, argv[i]), 0, 0);
+      }
+      break;
+    case CsiPeDispatchAction:
+      processToken(TY_CSI_PE(cc), 0, 0);
+      break;
+    case OscStartAction:
+      _oscBuffer.clear();
+      break;
+    case OscPutAction:
+      if (_oscBuffer.length() < MAX_OSC_LENGTH)
+        _oscBuffer.append(QChar(cc));
+      break;
+    case OscDispatchAction:
+      processWindowAttributeRequest();
+      break;
+    case Vt52DispatchAction:
+      processToken(TY_VT52(cc), 0, 0);
+      break;
+    case Vt52RowAction:
+      _vt52Row = cc;
+      break;
+    case Vt52CursorDispatchAction:
+      processToken(TY_VT52('Y'), _vt52Row, cc);
+      break;
   }
-  else
+}
+
+// process a block of incoming unicode characters
+void Vt102Emulation::receiveChars(const ushort* chars, int count)
+{
+  int i = 0;
+  while (i < count)
   {
-    // VT52 Mode
-    if (lec(1,0,ESC))
-        return;
-    if (les(1,0,CHR))
+    // outside of escape sequences, runs of plain characters go straight to
+    // the screen.  This is what receiveChar() does for each of them, as long
+    // as no VT100 character set is mapping them.
+    const CharCodes& charset = _charset[_currentScreen == _screen[1]];
+    if (_parserState == GroundState && getMode(MODE_Ansi) && !charset.graphic && !charset.pound)
     {
-        processToken( TY_CHR(), s[0], 0);
-        resetTokenizer();
-        return;
+      int end = i;
+      while (end < count && chars[end] >= 32 && chars[end] != DEL && chars[end] != ESC+128)
+        end++;
+
+      if (end > i)
+      {
+        _currentScreen->displayString(chars + i, end - i);
+        i = end;
+        continue;
+      }
     }
-    if (lec(2,1,'Y'))
-        return;
-    if (lec(3,1,'Y'))
-        return;
-    if (p < 4)
-    {
-        processToken(TY_VT52(s[1] ), 0, 0);
-        resetTokenizer();
-        return;
-    }
-    processToken(TY_VT52(s[1]), s[2], s[3]);
-    resetTokenizer();
-    return;
+
+    receiveChar(chars[i]);
+    i++;
   }
 }
 
@@ -397,23 +516,20 @@ void Vt102Emulation::processWindowAttributeRequest()
   // See Session::UserTitleChange for possible values
   int attribute = 0;
   int i;
-  for (i = 2; i < tokenBufferPos     &&
-              tokenBuffer[i] >= '0'  &&
-              tokenBuffer[i] <= '9'; i++)
+  for (i = 0; i < _oscBuffer.length()     &&
+              _oscBuffer[i] >= QLatin1Char('0') &&
+              _oscBuffer[i] <= QLatin1Char('9'); i++)
   {
-    attribute = 10 * attribute + (tokenBuffer[i]-'0');
+    attribute = 10 * attribute + (_oscBuffer[i].unicode()-'0');
   }
 
-  if (tokenBuffer[i] != ';')
+  if (i == _oscBuffer.length() || _oscBuffer[i] != QLatin1Char(';'))
   {
-    reportDecodingError();
+    // not a window attribute request
     return;
   }
 
-  QString value;
-  value.reserve(tokenBufferPos-i-2);
-  for (int j = 0; j < tokenBufferPos-i-2; j++)
-    value[j] = tokenBuffer[i+1+j];
+  const QString value = _oscBuffer.mid(i+1);
 
   if (value == "?") {
       emit sessionAttributeRequest(attribute);
@@ -830,7 +946,7 @@ void Vt102Emulation::processToken(int token, int p, int q)
     case TY_CSI_PG('c'      ) :  reportSecondaryAttributes(          ); break; //VT100
 
     default:
-        reportDecodingError();
+        reportDecodingError(token);
         break;
   };
 }
@@ -927,6 +1043,8 @@ void Vt102Emulation::sendMouseEvent(int cb, int cx, int cy , int eventType)
     if (cx < 1 || cy < 1)
         return;
 
+    OutputLocker locker(&_outputLock);
+
     // With the exception of the 1006 mode, button release is encoded in cb.
     // Note that if multiple extensions are enabled, the 1006 is used, so it's okay to check for only that.
     if (eventType == 2 && !getMode(MODE_Mouse1006))
@@ -1009,12 +1127,18 @@ void Vt102Emulation::sendKeyEvent(QKeyEvent* event)
     KeyboardTranslator::States states = KeyboardTranslator::NoState;
 
     // get current states
-    if (getMode(MODE_NewLine)) states |= KeyboardTranslator::NewLineState;
-    if (getMode(MODE_Ansi)) states |= KeyboardTranslator::AnsiState;
-    if (getMode(MODE_AppCuKeys)) states |= KeyboardTranslator::CursorKeysState;
-    if (getMode(MODE_AppScreen)) states |= KeyboardTranslator::AlternateScreenState;
-    if (getMode(MODE_AppKeyPad) && (modifiers & Qt::KeypadModifier))
-        states |= KeyboardTranslator::ApplicationKeypadState;
+    TerminalDisplay* currentView = 0;
+    {
+        OutputLocker locker(&_outputLock);
+        if (getMode(MODE_NewLine)) states |= KeyboardTranslator::NewLineState;
+        if (getMode(MODE_Ansi)) states |= KeyboardTranslator::AnsiState;
+        if (getMode(MODE_AppCuKeys)) states |= KeyboardTranslator::CursorKeysState;
+        if (getMode(MODE_AppScreen)) states |= KeyboardTranslator::AlternateScreenState;
+        if (getMode(MODE_AppKeyPad) && (modifiers & Qt::KeypadModifier))
+            states |= KeyboardTranslator::ApplicationKeypadState;
+
+        currentView = _currentScreen->currentTerminalDisplay();
+    }
 
     // check flow control state
     if (modifiers & Qt::ControlModifier) {
@@ -1061,8 +1185,6 @@ void Vt102Emulation::sendKeyEvent(QKeyEvent* event)
 
         if ( entry.command() != KeyboardTranslator::NoCommand )
         {
-            TerminalDisplay * currentView = _currentScreen->currentTerminalDisplay();
-
             if (entry.command() & KeyboardTranslator::EraseCommand) {
                 textToSend += eraseChar();
             } else if (entry.command() & KeyboardTranslator::ScrollPageUpCommand)
@@ -1340,52 +1462,19 @@ char Vt102Emulation::eraseChar() const
         return '\b';
 }
 
-#if 0
-// print contents of the scan buffer
-static void hexdump(int* s, int len)
-{
-    int i;
-    for (i = 0; i < len; i++) {
-        if (s[i] == '\\')
-            printf("\\\\");
-        else if ((s[i]) > 32 && s[i] < 127)
-            printf("%c", s[i]);
-        else
-            printf("\\%04x(hex)", s[i]);
-    }
-}
-#endif
-
-// return contents of the scan buffer
-static QString hexdump2(int* s, int len)
+void Vt102Emulation::reportDecodingError(int token)
 {
-    int i;
-    char dump[128];
-    QString returnDump;
-
-    for (i = 0; i < len; i++) {
-        if (s[i] == '\\')
-            snprintf(dump, sizeof(dump), "%s", "\\\\");
-        else if ((s[i]) > 32 && s[i] < 127)
-            snprintf(dump, sizeof(dump), "%c", s[i]);
-        else
-            snprintf(dump, sizeof(dump), "\\%04x(hex)", s[i]);
-        returnDump.append(QString(dump));
-    }
-    return returnDump;
-}
-
-void Vt102Emulation::reportDecodingError()
-{
-    if (tokenBufferPos == 0 || (tokenBufferPos == 1 && (tokenBuffer[0] & 0xff) >= 32))
-        return;
-
-//    printf("Undecodable sequence: ");
-//    hexdump(tokenBuffer, tokenBufferPos);
-//    printf("\n");
-
-    QString outputError = QString("Undecodable sequence: ");
-    outputError.append(hexdump2(tokenBuffer, tokenBufferPos));
+    // the type, character and argument of the token, see TY_CONSTRUCT
+    const int type = token & 0xff;
+    const int character = (token >> 8) & 0xff;
+    const int argument = (token >> 16) & 0xffff;
+
+    QString outputError = QString("Undecodable sequence: type %1, character ").arg(type);
+    if (character > 32 && character < 127)
+        outputError.append(QChar(character));
+    else
+        outputError.append(QString("\\%1(hex)").arg(character, 4, 16, QLatin1Char('0')));
+    outputError.append(QString(", argument %1").arg(argument));
     //qDebug() << outputError;
 }
 
@@ -101,6 +101,7 @@ protected:
     virtual void setMode(int mode) Q_DECL_OVERRIDE;
     virtual void resetMode(int mode) Q_DECL_OVERRIDE;
     virtual void receiveChar(int cc) Q_DECL_OVERRIDE;
+    virtual void receiveChars(const ushort* chars, int count) Q_DECL_OVERRIDE;
 
 private slots:
     //causes changeTitle() to be emitted for each (int,QString) pair in pendingTitleUpdates
@@ -130,11 +131,26 @@ private:
     // (except MODE_Allow132Columns)
     void resetModes();
 
+    // the states of the tokenizer, see initTokenizer()
+    enum ParserState {
+        GroundState,
+        EscapeState,
+        EscapeIntermediateState,
+        CsiEntryState,
+        CsiParamState,
+        CsiPrivateState,
+        CsiGreaterState,
+        CsiBangState,
+        OscStringState,
+        Vt52GroundState,
+        Vt52EscapeState,
+        Vt52CursorRowState,
+        Vt52CursorColumnState,
+        ParserStateCount
+    };
+
     void resetTokenizer();
-#define MAX_TOKEN_LENGTH 256 // Max length of tokens (e.g. window title)
-    void addToCurrentToken(int cc);
-    int tokenBuffer[MAX_TOKEN_LENGTH]; //FIXME: overflow?
-    int tokenBufferPos;
+    void resetArguments();
 #define MAXARGS 15
     void addDigit(int dig);
     void addArgument();
@@ -142,12 +158,17 @@ private:
     int argc;
     void initTokenizer();
 
-    // Set of flags for each of the ASCII characters which indicates
-    // what category they fall into (printable character, control, digit etc.)
-    // for the purposes of decoding terminal output
-    int charClass[256];
+    int _parserState;
+    int _escapeCharacter;
+    int _vt52Row;
+    QString _oscBuffer;
+
+    // For each state, the action to take and the state to change to when
+    // a character is received, as (action << 8) | state.  Characters from
+    // 256 upwards share the last entry.
+    quint16 _transitions[ParserStateCount][257];
 
-    void reportDecodingError();
+    void reportDecodingError(int token);
 
     void processToken(int code, int p, int q);
     void processWindowAttributeRequest();
@@ -21,11 +21,19 @@
 #include "HistoryTest.h"
 
 #include "qtest.h"
+#include <QDir>
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QTextStream>
 
 // Konsole
 #include "../Session.h"
 #include "../Emulation.h"
 #include "../History.h"
+#include "../HistorySearchIndex.h"
+#include "../SearchMatchCache.h"
+#include "../SessionController.h"
+#include "../TerminalCharacterDecoder.h"
 
 using namespace Konsole;
 
@@ -137,5 +145,957 @@ void HistoryTest::testHistoryScroll()
     delete historyScroll;
 }
 
+// Builds a line in which the foreground color changes every 'runLength' cells
+static TextLine createColorfulLine(int columns, int runLength)
+{
+    TextLine line(columns);
+    for (int i = 0; i < columns; i++) {
+        line[i].character = 'a' + (i % 26);
+        line[i].foregroundColor = CharacterColor(COLOR_SPACE_256, (i / runLength) % 256);
+    }
+    return line;
+}
+
+void HistoryTest::testCompactHistoryManyRuns()
+{
+    const TextLine line = createColorfulLine(1000, 3);
+
+    CompactHistoryScroll historyScroll(10);
+    historyScroll.addCellsVector(line);
+    historyScroll.addLine(false);
+    QCOMPARE(historyScroll.getLineLen(0), line.size());
+
+    // whole line
+    QVector<Character> cells(line.size());
+    historyScroll.getCells(0, 0, line.size(), cells.data());
+    for (int i = 0; i < line.size(); i++)
+        QCOMPARE(cells[i], line[i]);
+
+    // span starting and ending in the middle of a run
+    historyScroll.getCells(0, 301, 500, cells.data());
+    for (int i = 0; i < 500; i++)
+        QCOMPARE(cells[i], line[301 + i]);
+}
+
+void HistoryTest::benchmarkCompactHistoryManyRuns()
+{
+    // 2000 columns with 1000 attribute runs
+    const TextLine line = createColorfulLine(2000, 2);
+
+    CompactHistoryScroll historyScroll(10);
+    historyScroll.addCellsVector(line);
+    historyScroll.addLine(false);
+
+    QVector<Character> cells(line.size());
+    QBENCHMARK {
+        historyScroll.getCells(0, 0, line.size(), cells.data());
+    }
+}
+
+void HistoryTest::testCompressedHistoryFile()
+{
+    CompressedHistoryScrollFile historyScroll(QStringLiteral("test.log"));
+    QVERIFY(historyScroll.hasScroll());
+    QCOMPARE(historyScroll.getLines(), 0);
+    QCOMPARE(historyScroll.getLineLen(0), 0);
+
+    // enough lines to fill several compressed chunks plus a partial one
+    const int lineCount = CompressedHistoryScrollFile::LINES_PER_CHUNK * 3 + 17;
+    for (int i = 0; i < lineCount; i++) {
+        const TextLine line = createColorfulLine(i % 120, 1 + i % 7);
+        historyScroll.addCellsVector(line);
+        historyScroll.addLine(i % 3 == 0);
+    }
+    QCOMPARE(historyScroll.getLines(), lineCount);
+
+    // read back out of order to exercise the chunk cache
+    QVector<Character> cells(120);
+    for (int i = lineCount - 1; i >= 0; i -= 5) {
+        const TextLine line = createColorfulLine(i % 120, 1 + i % 7);
+        QCOMPARE(historyScroll.getLineLen(i), line.size());
+        QCOMPARE(historyScroll.isWrappedLine(i), i % 3 == 0);
+
+        historyScroll.getCells(i, 0, line.size(), cells.data());
+        for (int j = 0; j < line.size(); j++)
+            QCOMPARE(cells[j], line[j]);
+    }
+}
+
+void HistoryTest::testHistoryScrollFileContainer()
+{
+    const QStringList nameFilter(QStringLiteral("konsole-*.history"));
+    const int historyFileCount = QDir::temp().entryList(nameFilter, QDir::Files).count();
+
+    HistoryScrollFile historyScroll(QStringLiteral("test.log"));
+
+    // the history does not leave a file behind, not even while it is in use
+    QCOMPARE(QDir::temp().entryList(nameFilter, QDir::Files).count(), historyFileCount);
+
+    // the cells of this many lines do not fit into one extent of the
+    // container, so the extents of the streams are interleaved
+    const int lineCount = 20000;
+    for (int i = 0; i < lineCount; i++) {
+        const TextLine line = createColorfulLine(i % 120, 1 + i % 7);
+        historyScroll.addCellsVector(line);
+        historyScroll.addLine(i % 3 == 0);
+    }
+    QCOMPARE(historyScroll.getLines(), lineCount);
+
+    QVector<Character> cells(120);
+    for (int i = lineCount - 1; i >= 0; i -= 7) {
+        const TextLine line = createColorfulLine(i % 120, 1 + i % 7);
+        QCOMPARE(historyScroll.getLineLen(i), line.size());
+        QCOMPARE(historyScroll.isWrappedLine(i), i % 3 == 0);
+
+        historyScroll.getCells(i, 0, line.size(), cells.data());
+        for (int j = 0; j < line.size(); j++)
+            QCOMPARE(cells[j], line[j]);
+    }
+}
+
+void HistoryTest::testHistoryFileUnflushedRead()
+{
+    HistoryScrollFile historyScroll(QStringLiteral("test.log"));
+
+    // these lines fit into the write buffer, so they are read from it
+    const int lineCount = 10;
+    for (int i = 0; i < lineCount; i++) {
+        historyScroll.addCellsVector(createColorfulLine(40 + i, 3));
+        historyScroll.addLine(i % 2 == 0);
+    }
+
+    QVector<Character> cells(60);
+    for (int i = 0; i < lineCount; i++) {
+        const TextLine line = createColorfulLine(40 + i, 3);
+        QCOMPARE(historyScroll.getLineLen(i), line.size());
+        QCOMPARE(historyScroll.isWrappedLine(i), i % 2 == 0);
+
+        historyScroll.getCells(i, 0, line.size(), cells.data());
+        for (int j = 0; j < line.size(); j++)
+            QCOMPARE(cells[j], line[j]);
+    }
+}
+
+void HistoryTest::testHistoryFileSpanningRead()
+{
+    HistoryScrollFile historyScroll(QStringLiteral("test.log"));
+
+    historyScroll.addCellsVector(createColorfulLine(50, 3));
+    historyScroll.addLine(false);
+
+    // the first half of the line is written by the flush timer, the second
+    // half stays in the write buffer
+    const TextLine line = createColorfulLine(80, 5);
+    historyScroll.addCells(line.constData(), 30);
+    QTest::qWait(1000);
+    historyScroll.addCells(line.constData() + 30, line.size() - 30);
+    historyScroll.addLine(false);
+
+    QCOMPARE(historyScroll.getLines(), 2);
+    QCOMPARE(historyScroll.getLineLen(1), line.size());
+
+    QVector<Character> cells(line.size());
+    historyScroll.getCells(1, 0, line.size(), cells.data());
+    for (int j = 0; j < line.size(); j++)
+        QCOMPARE(cells[j], line[j]);
+
+    // part of each half
+    historyScroll.getCells(1, 20, 20, cells.data());
+    for (int j = 0; j < 20; j++)
+        QCOMPARE(cells[j], line[20 + j]);
+}
+
+void HistoryTest::testCompactHistoryRingBuffer()
+{
+    CompactHistoryScroll historyScroll(10);
+
+    for (int i = 0; i < 25; i++) {
+        const TextLine line = createColorfulLine(i + 1, 2);
+        historyScroll.addCellsVector(line);
+        historyScroll.addLine(i % 2 == 0);
+    }
+
+    // only the 10 most recent lines are kept, oldest first
+    QCOMPARE(historyScroll.getLines(), 10);
+    for (int i = 0; i < 10; i++) {
+        QCOMPARE(historyScroll.getLineLen(i), 16 + i);
+        QCOMPARE(historyScroll.isWrappedLine(i), (15 + i) % 2 == 0);
+    }
+
+    // shrinking keeps the most recent lines
+    historyScroll.setMaxNbLines(4);
+    QCOMPARE(historyScroll.getLines(), 4);
+    QCOMPARE(historyScroll.getLineLen(0), 22);
+    QCOMPARE(historyScroll.getLineLen(3), 25);
+
+    // growing again appends after them
+    historyScroll.setMaxNbLines(6);
+    historyScroll.addCellsVector(createColorfulLine(30, 2));
+    historyScroll.addLine(false);
+    QCOMPARE(historyScroll.getLines(), 5);
+    QCOMPARE(historyScroll.getLineLen(0), 22);
+    QCOMPARE(historyScroll.getLineLen(4), 30);
+}
+
+void HistoryTest::benchmarkCompactHistoryMemory()
+{
+    const int maxLines = 1000;
+    CompactHistoryScroll historyScroll(maxLines);
+    const TextLine line = createColorfulLine(80, 8);
+
+    // fill the history a few times over to reach the steady state
+    for (int i = 0; i < maxLines * 10; i++) {
+        historyScroll.addCellsVector(line);
+        historyScroll.addLine(false);
+    }
+    const size_t steadyStateMemory = historyScroll.allocatedMemory();
+
+    // the benchmark runs with the unit tests, so it adds few lines unless
+    // more are asked for, e.g. KONSOLE_BENCHMARK_LINES=10000000
+    int lineCount = qgetenv("KONSOLE_BENCHMARK_LINES").toInt();
+    if (lineCount <= 0)
+        lineCount = maxLines * 100;
+
+    QBENCHMARK_ONCE {
+        for (int i = 0; i < lineCount; i++) {
+            historyScroll.addCellsVector(line);
+            historyScroll.addLine(false);
+        }
+    }
+
+    QCOMPARE(historyScroll.getLines(), maxLines);
+    QVERIFY(historyScroll.allocatedMemory() <= steadyStateMemory);
+}
+
+void HistoryTest::testCompactHistoryNarrowText()
+{
+    const int lineCount = 10000;
+    CompactHistoryScroll narrowScroll(lineCount);
+    CompactHistoryScroll wideScroll(lineCount);
+
+    // the same lines, except for one character which does not fit into a byte
+    TextLine narrowLine(80);
+    for (int i = 0; i < narrowLine.size(); i++)
+        narrowLine[i].character = (i == 0) ? 0xff : 'a' + (i % 26);
+    TextLine wideLine = narrowLine;
+    wideLine[0].character = 0x4e2d;
+
+    for (int i = 0; i < lineCount; i++) {
+        narrowScroll.addCellsVector(narrowLine);
+        narrowScroll.addLine(false);
+        wideScroll.addCellsVector(wideLine);
+        wideScroll.addLine(false);
+    }
+
+    QVector<Character> cells(narrowLine.size());
+    narrowScroll.getCells(lineCount - 1, 0, cells.size(), cells.data());
+    for (int i = 0; i < cells.size(); i++)
+        QCOMPARE(cells[i], narrowLine[i]);
+    wideScroll.getCells(lineCount - 1, 0, cells.size(), cells.data());
+    for (int i = 0; i < cells.size(); i++)
+        QCOMPARE(cells[i], wideLine[i]);
+
+    Character character;
+    narrowScroll.getCells(0, 0, 1, &character);
+    QCOMPARE(character.character, quint16(0xff));
+
+    // one byte per character instead of two saves at least a quarter of
+    // the memory for single colored lines
+    QVERIFY(narrowScroll.allocatedMemory() * 4 < wideScroll.allocatedMemory() * 3);
+}
+
+void HistoryTest::testCompactHistoryFormatTable()
+{
+    // the runs of colorful lines only store the index of their format
+    const int lineCount = 10000;
+    const int runLength = 2;
+    const TextLine line = createColorfulLine(80, runLength);
+    const int runs = line.size() / runLength;
+
+    CompactHistoryScroll historyScroll(lineCount);
+    for (int i = 0; i < lineCount; i++) {
+        historyScroll.addCellsVector(line);
+        historyScroll.addLine(false);
+    }
+    QVERIFY(historyScroll.allocatedMemory() < lineCount * (line.size() + runs * sizeof(CharacterFormat)));
+
+    // formats which are no longer used are removed when the table is full
+    CompactHistoryScroll smallScroll(10);
+    TextLine rgbLine(1000);
+    int color = 0;
+    for (int i = 0; i < CompactHistoryFormatTable::MAX_FORMATS / rgbLine.size() * 3; i++) {
+        for (int j = 0; j < rgbLine.size(); j++) {
+            rgbLine[j].character = 'x';
+            rgbLine[j].foregroundColor = CharacterColor(COLOR_SPACE_RGB, color++);
+        }
+        smallScroll.addCellsVector(rgbLine);
+        smallScroll.addLine(false);
+    }
+
+    QVector<Character> cells(rgbLine.size());
+    smallScroll.getCells(9, 0, cells.size(), cells.data());
+    for (int i = 0; i < cells.size(); i++)
+        QCOMPARE(cells[i], rgbLine[i]);
+    smallScroll.getCells(0, 0, cells.size(), cells.data());
+    QCOMPARE(cells[0].foregroundColor, CharacterColor(COLOR_SPACE_RGB, color - 10 * rgbLine.size()));
+
+    // if the lines use more formats than the table can hold, the lines
+    // which do not fit keep their formats themselves
+    const int bigLineCount = 100;
+    const int firstColor = color;
+    CompactHistoryScroll bigScroll(bigLineCount);
+    for (int i = 0; i < bigLineCount; i++) {
+        for (int j = 0; j < rgbLine.size(); j++)
+            rgbLine[j].foregroundColor = CharacterColor(COLOR_SPACE_RGB, color++);
+        bigScroll.addCellsVector(rgbLine);
+        bigScroll.addLine(false);
+    }
+
+    QCOMPARE(bigScroll.getLines(), bigLineCount);
+    bigScroll.getCells(bigLineCount - 1, 0, cells.size(), cells.data());
+    for (int i = 0; i < cells.size(); i++)
+        QCOMPARE(cells[i], rgbLine[i]);
+    bigScroll.getCells(0, 0, cells.size(), cells.data());
+    for (int i = 0; i < cells.size(); i++) {
+        QCOMPARE(cells[i].character, quint16('x'));
+        QCOMPARE(cells[i].foregroundColor, CharacterColor(COLOR_SPACE_RGB, firstColor + i));
+    }
+
+    // the formats of the lines are kept while more lines replace them
+    for (int i = 0; i < bigLineCount; i++) {
+        for (int j = 0; j < rgbLine.size(); j++)
+            rgbLine[j].foregroundColor = CharacterColor(COLOR_SPACE_RGB, color++);
+        bigScroll.addCellsVector(rgbLine);
+        bigScroll.addLine(false);
+
+        bigScroll.getCells(0, 0, cells.size(), cells.data());
+        QCOMPARE(cells[0].foregroundColor, CharacterColor(COLOR_SPACE_RGB, firstColor + (i + 1) * rgbLine.size()));
+    }
+}
+
+void HistoryTest::testHistoryMemoryBudget()
+{
+    HistoryMemoryManager* manager = HistoryMemoryManager::instance();
+    const TextLine line = createColorfulLine(200, 4);
+    const int lineCount = 20000;
+
+    CompactHistoryScroll viewedScroll(lineCount);
+    CompactHistoryScroll otherScroll(lineCount);
+
+    for (int i = 0; i < lineCount / 10; i++) {
+        viewedScroll.addCellsVector(line);
+        viewedScroll.addLine(false);
+    }
+    viewedScroll.markViewed();
+
+    // reading lines, e.g. to search them, does not count as viewing them
+    otherScroll.addCellsVector(line);
+    otherScroll.addLine(false);
+    QVector<Character> cells(line.size());
+    otherScroll.getCells(0, 0, line.size(), cells.data());
+
+    const qint64 budget = manager->usage() + 4 * 1024 * 1024;
+    manager->setBudget(budget);
+
+    // the scroll which was not viewed loses its oldest lines first
+    for (int i = 0; i < lineCount; i++) {
+        otherScroll.addCellsVector(line);
+        otherScroll.addLine(false);
+    }
+    QVERIFY(manager->usage() <= budget);
+    QCOMPARE(viewedScroll.getLines(), lineCount / 10);
+    QVERIFY(otherScroll.getLines() < lineCount);
+    QVERIFY(otherScroll.getLines() > 0);
+
+    manager->setBudget(0);
+}
+
+static QVector<Character> textToCells(const QString& text)
+{
+    QVector<Character> cells(text.length());
+    for (int i = 0; i < text.length(); i++)
+        cells[i] = Character(text[i].unicode());
+    return cells;
+}
+
+void HistoryTest::testHistorySearchIndex()
+{
+    HistorySearchIndex index;
+    index.reset(100);
+
+    const int lineCount = 10 * HistorySearchIndex::LINES_PER_BLOCK;
+    for (int i = 0; i < lineCount; i++) {
+        QString text = QStringLiteral("plain line");
+        if (i == 150)
+            text = QStringLiteral("the Needle is here");
+        if (i == 250)
+            text = QStringLiteral("a needle wrapp");
+        if (i == 251)
+            text = QStringLiteral("ed into the next line");
+        const QVector<Character> cells = textToCells(text);
+        index.addLine(cells.constData(), cells.count(), i == 250);
+    }
+    QCOMPARE(index.firstLine(), qint64(100));
+    QCOMPARE(index.endLine(), qint64(100 + lineCount));
+
+    QVector<HistorySearchIndex::LineRange> ranges;
+    QVERIFY(!index.findCandidates(QStringLiteral("ne"), ranges));
+
+    // the index is case-insensitive and only returns the blocks around matches
+    QVERIFY(index.findCandidates(QStringLiteral("NEEDLE"), ranges));
+    QCOMPARE(ranges.count(), 2);
+    QVERIFY(ranges[0].first <= 250 && ranges[0].second >= 250);
+    QVERIFY(ranges[1].first <= 350 && ranges[1].second >= 350);
+    QVERIFY(ranges[0].second - ranges[0].first < 4 * HistorySearchIndex::LINES_PER_BLOCK);
+
+    // trigrams which continue on the next line are found
+    ranges.clear();
+    QVERIFY(index.findCandidates(QStringLiteral("wrapped"), ranges));
+    QCOMPARE(ranges.count(), 1);
+    QVERIFY(ranges[0].first <= 350 && ranges[0].second >= 351);
+
+    ranges.clear();
+    QVERIFY(index.findCandidates(QStringLiteral("haystack"), ranges));
+    QVERIFY(ranges.isEmpty());
+
+    // removed lines are not returned any more
+    index.removeLinesBefore(280);
+    ranges.clear();
+    QVERIFY(index.findCandidates(QStringLiteral("needle"), ranges));
+    QCOMPARE(ranges.count(), 1);
+    QVERIFY(ranges[0].first >= 280);
+}
+
+void HistoryTest::testHistorySearchIndexEmulation()
+{
+    Session* session = new Session();
+    Emulation* emulation = session->emulation();
+    emulation->setHistory(CompactHistoryType(100000));
+    emulation->setHistorySearchIndexEnabled(true);
+
+    QByteArray output;
+    for (int i = 0; i < 10000; i++)
+        output += "output line " + QByteArray::number(i) + "\r\n";
+    emulation->receiveData(output.constData(), output.size());
+
+    QList<QPair<int, int> > lines;
+    QVERIFY(emulation->searchCandidateLines(QStringLiteral("line 4242"), lines));
+
+    int candidateCount = 0;
+    bool found = false;
+    for (int i = 0; i < lines.count(); i++) {
+        candidateCount += lines[i].second - lines[i].first + 1;
+        if (lines[i].first <= 4242 && lines[i].second >= 4242)
+            found = true;
+    }
+    QVERIFY(found);
+    QVERIFY(candidateCount < 1000);
+
+    // the screen image is always searched
+    QCOMPARE(lines.last().second, emulation->lineCount() - 1);
+
+    delete session;
+}
+
+void HistoryTest::testOutputSnapshot()
+{
+    Session* session = new Session();
+    Emulation* emulation = session->emulation();
+    emulation->setHistory(CompactHistoryType(1000));
+
+    QByteArray output;
+    for (int i = 0; i < 700; i++)
+        output += "snapshot line " + QByteArray::number(i) + "\r\n";
+    // a line which is wrapped on the screen
+    output += QByteArray(200, 'x') + "\r\n";
+    emulation->receiveData(output.constData(), output.size());
+
+    OutputSnapshot snapshot = emulation->outputSnapshot();
+    QCOMPARE(snapshot.lineCount(), emulation->lineCount());
+
+    // more output does not change the snapshot
+    emulation->receiveData("more\r\n", 6);
+
+    OutputSnapshot expectedSnapshot = emulation->outputSnapshot();
+    QCOMPARE(expectedSnapshot.lineCount(), snapshot.lineCount() + 1);
+
+    QString actual;
+    QTextStream actualStream(&actual);
+    PlainTextDecoder decoder;
+    decoder.begin(&actualStream);
+    // the last line is the one the new output is written to
+    snapshot.writeToStream(&decoder, 0, snapshot.lineCount() - 2);
+    decoder.end();
+
+    QString expected;
+    QTextStream expectedStream(&expected);
+    decoder.begin(&expectedStream);
+    expectedSnapshot.writeToStream(&decoder, 0, snapshot.lineCount() - 2);
+    decoder.end();
+
+    QCOMPARE(actual, expected);
+    QVERIFY(actual.contains(QStringLiteral("snapshot line 0\n")));
+    QVERIFY(actual.contains(QStringLiteral("snapshot line 699\n")));
+    QVERIFY(actual.contains(QString(200, QLatin1Char('x'))));
+
+    // the history lines are only read when they are needed, those of a
+    // history which has been cleared in the meantime are empty
+    OutputSnapshot clearedSnapshot = emulation->outputSnapshot();
+    emulation->clearHistory();
+    QVector<Character> cells;
+    bool wrapped = true;
+    clearedSnapshot.getLine(0, cells, wrapped);
+    QVERIFY(cells.isEmpty());
+    QVERIFY(!wrapped);
+    clearedSnapshot.getLine(clearedSnapshot.lineCount() - 1, cells, wrapped);
+    QVERIFY(!cells.isEmpty());
+
+    delete session;
+}
+
+void HistoryTest::testSearchHistoryJob()
+{
+    Session* session = new Session();
+    Emulation* emulation = session->emulation();
+    emulation->setHistory(CompactHistoryType(1000));
+
+    QByteArray output;
+    for (int i = 0; i < 700; i++)
+        output += "search line " + QByteArray::number(i) + "\r\n";
+    emulation->receiveData(output.constData(), output.size());
+
+    const OutputSnapshot snapshot = emulation->outputSnapshot();
+    const int lastLine = snapshot.lineCount() - 1;
+    QList<QPair<int, int> > lines;
+    lines << qMakePair(0, lastLine);
+
+    const QRegExp regExp(QStringLiteral("line 12\\b"));
+
+    // forwards from the start, backwards from the end and wrapping around
+    SearchHistoryJob forwards(snapshot, regExp, true, 0, lines);
+    QSignalSpy forwardsSpy(&forwards, SIGNAL(finished(int)));
+    forwards.run();
+    QCOMPARE(forwardsSpy.count(), 1);
+    QCOMPARE(forwardsSpy.at(0).at(0).toInt(), 12);
+
+    SearchHistoryJob backwards(snapshot, regExp, false, lastLine, lines);
+    QSignalSpy backwardsSpy(&backwards, SIGNAL(finished(int)));
+    backwards.run();
+    QCOMPARE(backwardsSpy.at(0).at(0).toInt(), 12);
+
+    SearchHistoryJob wrapped(snapshot, regExp, true, 500, lines);
+    QSignalSpy wrappedSpy(&wrapped, SIGNAL(finished(int)));
+    QSignalSpy progressSpy(&wrapped, SIGNAL(progress(int)));
+    wrapped.run();
+    QCOMPARE(wrappedSpy.at(0).at(0).toInt(), 12);
+    QVERIFY(progressSpy.count() > 0);
+
+    SearchHistoryJob cancelled(snapshot, regExp, true, 0, lines);
+    QSignalSpy cancelledSpy(&cancelled, SIGNAL(finished(int)));
+    cancelled.cancel();
+    cancelled.run();
+    QCOMPARE(cancelledSpy.at(0).at(0).toInt(), -1);
+
+    delete session;
+}
+
+void HistoryTest::testSearchMatchCache()
+{
+    Session* session = new Session();
+    Emulation* emulation = session->emulation();
+    emulation->setHistory(CompactHistoryType(1000));
+    const int columns = emulation->imageSize().width();
+
+    QByteArray output;
+    for (int i = 0; i < 300; i++)
+        output += "match " + QByteArray::number(i) + " match\r\n";
+    // a match which is wrapped into the next line
+    output += QByteArray(columns - 3, 'x') + "match\r\n";
+    emulation->receiveData(output.constData(), output.size());
+
+    const OutputSnapshot snapshot = emulation->outputSnapshot();
+    const QRegExp regExp(QStringLiteral("match"));
+
+    SearchMatchJob job(snapshot, regExp, 0);
+    QSignalSpy spy(&job, SIGNAL(finished()));
+    job.run();
+    QCOMPARE(spy.count(), 1);
+    QCOMPARE(job.matches().count(), 601);
+
+    const SearchMatch first = job.matches().at(1);
+    QCOMPARE(first.startLine, qint64(0));
+    QCOMPARE(first.startColumn, 8);
+    QCOMPARE(first.endLine, qint64(0));
+    QCOMPARE(first.endColumn, 13);
+
+    const SearchMatch wrapped = job.matches().last();
+    QCOMPARE(wrapped.startLine, qint64(300));
+    QCOMPARE(wrapped.startColumn, columns - 3);
+    QCOMPARE(wrapped.endLine, qint64(301));
+    QCOMPARE(wrapped.endColumn, 2);
+
+    // searching from a wrapped line starts at the line it is wrapped from
+    SearchMatchJob continued(snapshot, regExp, 301);
+    continued.run();
+    QCOMPARE(continued.searchedFromLine(), qint64(300));
+    QCOMPARE(continued.matches().count(), 1);
+
+    SearchMatchJob cancelled(snapshot, regExp, 0);
+    QSignalSpy cancelledSpy(&cancelled, SIGNAL(finished()));
+    cancelled.cancel();
+    cancelled.run();
+    QCOMPARE(cancelledSpy.count(), 1);
+    QVERIFY(cancelled.matches().isEmpty());
+
+    // nothing is searched until the cache is enabled
+    SearchMatchCache* cache = new SearchMatchCache(emulation);
+    cache->setRegExp(regExp);
+    QVERIFY(!cache->isUpdating());
+    QCOMPARE(cache->matchCount(), 0);
+
+    cache->setEnabled(true);
+    QTRY_VERIFY(!cache->isUpdating());
+    QCOMPARE(cache->matchCount(), 601);
+    QCOMPARE(cache->matches(0, 1).count(), 4);
+    QCOMPARE(cache->matches(301, 301).count(), 1);
+
+    // new output is added to the matches which were found before, once
+    // the output has stopped changing for a moment
+    emulation->receiveData("match\r\n", 7);
+    QTRY_COMPARE(cache->matchCount(), 602);
+
+    // disabling the cache forgets the matches
+    cache->setEnabled(false);
+    QCOMPARE(cache->matchCount(), 0);
+    emulation->receiveData("match\r\n", 7);
+    QTest::qWait(300);
+    QVERIFY(!cache->isUpdating());
+    QCOMPARE(cache->matchCount(), 0);
+
+    delete cache;
+    delete session;
+}
+
+void HistoryTest::testSaveHistoryJob()
+{
+    Session* session = new Session();
+    Emulation* emulation = session->emulation();
+    emulation->setHistory(CompactHistoryType(1000));
+
+    QByteArray output;
+    for (int i = 0; i < 500; i++)
+        output += "saved line " + QByteArray::number(i) + "\r\n";
+    output += "caf\xc3\xa9\r\n";
+    emulation->receiveData(output.constData(), output.size());
+
+    const OutputSnapshot snapshot = emulation->outputSnapshot();
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString fileName = dir.path() + QStringLiteral("/output.txt");
+
+    SaveHistoryJob job(snapshot, fileName, false);
+    QSignalSpy finishedSpy(&job, SIGNAL(finished(bool)));
+    QSignalSpy progressSpy(&job, SIGNAL(progress(int)));
+    job.run();
+    QCOMPARE(finishedSpy.count(), 1);
+    QCOMPARE(finishedSpy.at(0).at(0).toBool(), true);
+    QCOMPARE(progressSpy.last().at(0).toInt(), 100);
+
+    QFile file(fileName);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    const QString text = QString::fromUtf8(file.readAll());
+    file.close();
+    QVERIFY(text.startsWith(QStringLiteral("saved line 0\nsaved line 1\n")));
+    QVERIFY(text.contains(QStringLiteral("saved line 499\ncaf\u00e9\n")));
+
+    // a cancelled job leaves the existing file alone
+    SaveHistoryJob cancelled(snapshot, fileName, true);
+    QSignalSpy cancelledSpy(&cancelled, SIGNAL(finished(bool)));
+    cancelled.cancel();
+    cancelled.run();
+    QCOMPARE(cancelledSpy.at(0).at(0).toBool(), false);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(QString::fromUtf8(file.readAll()), text);
+    file.close();
+
+    SaveHistoryJob html(snapshot, fileName, true);
+    html.run();
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    const QString htmlText = QString::fromUtf8(file.readAll());
+    QVERIFY(htmlText.startsWith(QStringLiteral("<meta charset=\"utf-8\">")));
+    QVERIFY(htmlText.contains(QStringLiteral("saved line 499")));
+    file.close();
+
+    delete session;
+}
+
+static void addHistoryLine(HistoryScroll* history, const QString& text, bool wrapped = false)
+{
+    QVector<Character> cells;
+    foreach(const QChar& c, text)
+        cells << Character(c.unicode());
+    history->addCells(cells.constData(), cells.count());
+    history->addLine(wrapped);
+}
+
+static QString historyLineText(HistoryScroll* history, int line)
+{
+    QVector<Character> cells(history->getLineLen(line));
+    history->getCells(line, 0, cells.count(), cells.data());
+
+    QString text;
+    foreach(const Character& c, cells)
+        text += QChar(c.character);
+    return text;
+}
+
+void HistoryTest::testMigratingHistoryScroll()
+{
+    HistoryScroll* history = HistoryTypeFile().scroll(0);
+    for (int i = 0; i < 1000; i++)
+        addHistoryLine(history, QStringLiteral("line %1").arg(i), i == 999);
+
+    // the history can be used before the lines have been copied
+    history = CompactHistoryType(300).scroll(history);
+    MigratingHistoryScroll* migrating = dynamic_cast<MigratingHistoryScroll*>(history);
+    QVERIFY(migrating);
+    QCOMPARE(history->getType().maximumLineCount(), 300);
+    QCOMPARE(history->getLines(), 300);
+    QCOMPARE(historyLineText(history, 0), QStringLiteral("line 700"));
+    QCOMPARE(historyLineText(history, 299), QStringLiteral("line 999"));
+    QVERIFY(history->isWrappedLine(299));
+
+    addHistoryLine(history, QStringLiteral("new line"));
+    QCOMPARE(history->getLines(), 301);
+    QCOMPARE(historyLineText(history, 300), QStringLiteral("new line"));
+
+    QTRY_VERIFY(migrating->isFinished());
+
+    // the new line is added after the copied lines
+    QCOMPARE(history->getLines(), 300);
+    QCOMPARE(history->droppedLineCount(), qint64(1));
+    QCOMPARE(historyLineText(history, 0), QStringLiteral("line 701"));
+    QCOMPARE(historyLineText(history, 298), QStringLiteral("line 999"));
+    QVERIFY(history->isWrappedLine(298));
+    QCOMPARE(historyLineText(history, 299), QStringLiteral("new line"));
+    QVERIFY(!history->isWrappedLine(299));
+
+    // converting again does not wait for the previous conversion, the
+    // lines are copied from where they are
+    history = HistoryTypeFile().scroll(history);
+    QVERIFY(dynamic_cast<MigratingHistoryScroll*>(history));
+    history = CompactHistoryType(300).scroll(history);
+    migrating = dynamic_cast<MigratingHistoryScroll*>(history);
+    QVERIFY(migrating);
+    QCOMPARE(history->getLines(), 300);
+    QCOMPARE(historyLineText(history, 0), QStringLiteral("line 701"));
+    QCOMPARE(historyLineText(history, 299), QStringLiteral("new line"));
+    QTRY_VERIFY(migrating->isFinished());
+    QCOMPARE(history->getLines(), 300);
+    QCOMPARE(historyLineText(history, 0), QStringLiteral("line 701"));
+    QCOMPARE(historyLineText(history, 299), QStringLiteral("new line"));
+
+    // the lines which are added while converting are limited to the size
+    // of the new history, the old lines make room for them
+    history = HistoryTypeFile().scroll(history);
+    history = CompactHistoryType(300).scroll(history);
+    migrating = dynamic_cast<MigratingHistoryScroll*>(history);
+    QVERIFY(migrating);
+    for (int i = 0; i < 400; i++)
+        addHistoryLine(history, QStringLiteral("added line %1").arg(i));
+    QCOMPARE(history->getLines(), 300);
+    QCOMPARE(history->droppedLineCount(), qint64(400));
+    QCOMPARE(historyLineText(history, 0), QStringLiteral("added line 100"));
+    QTRY_VERIFY(migrating->isFinished());
+    QCOMPARE(history->getLines(), 300);
+    QCOMPARE(history->droppedLineCount(), qint64(400));
+    QCOMPARE(historyLineText(history, 0), QStringLiteral("added line 100"));
+    QCOMPARE(historyLineText(history, 299), QStringLiteral("added line 399"));
+
+    history = HistoryTypeFile().scroll(history);
+    dynamic_cast<MigratingHistoryScroll*>(history)->finish();
+    QCOMPARE(history->getLines(), 300);
+
+    // the history type is unchanged
+    HistoryScroll* unchanged = HistoryTypeFile().scroll(history);
+    QVERIFY(!dynamic_cast<MigratingHistoryScroll*>(unchanged));
+    QCOMPARE(unchanged->getLines(), 300);
+
+    // if the new history has no limit, the old lines are copied at once
+    // once the lines which are added meanwhile use too much memory
+    history = HistoryTypeFile().scroll(CompactHistoryType(300).scroll(unchanged));
+    migrating = dynamic_cast<MigratingHistoryScroll*>(history);
+    QVERIFY(migrating);
+    const QString longLine(1000, QLatin1Char('y'));
+    int addedCount = 0;
+    while (!migrating->isFinished() && addedCount < 10000) {
+        addHistoryLine(history, longLine);
+        addedCount++;
+    }
+    QVERIFY(migrating->isFinished());
+    QCOMPARE(history->getLines(), 300 + addedCount);
+    QCOMPARE(historyLineText(history, 0), QStringLiteral("added line 100"));
+    QCOMPARE(historyLineText(history, 300), longLine);
+
+    delete history;
+}
+
+void HistoryTest::testReflowHistoryScroll()
+{
+    HistoryScroll* history = new CompactHistoryScroll(100);
+    addHistoryLine(history, QStringLiteral("aaaaaaaaaa"), true);
+    addHistoryLine(history, QStringLiteral("bbbbb"));
+    addHistoryLine(history, QStringLiteral("ccc"));
+    const quint64 serialNumber = history->serialNumber();
+
+    // the lines keep their old width until they are wrapped again
+    history = MigratingHistoryScroll::reflow(history, 5);
+    MigratingHistoryScroll* migrating = dynamic_cast<MigratingHistoryScroll*>(history);
+    QVERIFY(migrating);
+    QVERIFY(history->serialNumber() != serialNumber);
+    QCOMPARE(history->getType().maximumLineCount(), 100);
+    QCOMPARE(history->getLines(), 3);
+    QCOMPARE(historyLineText(history, 0), QStringLiteral("aaaaaaaaaa"));
+
+    QTRY_VERIFY(migrating->isFinished());
+    QCOMPARE(history->getLines(), 4);
+    QCOMPARE(historyLineText(history, 0), QStringLiteral("aaaaa"));
+    QVERIFY(history->isWrappedLine(0));
+    QCOMPARE(historyLineText(history, 1), QStringLiteral("aaaaa"));
+    QVERIFY(history->isWrappedLine(1));
+    QCOMPARE(historyLineText(history, 2), QStringLiteral("bbbbb"));
+    QVERIFY(!history->isWrappedLine(2));
+    QCOMPARE(historyLineText(history, 3), QStringLiteral("ccc"));
+
+    // the changed line numbers are reported once
+    ReflowedLines reflowed = migrating->takeReflowedLines();
+    QCOMPARE(reflowed.ranges.count(), 1);
+    QCOMPARE(reflowed.ranges[0].firstLine, qint64(0));
+    QCOMPARE(reflowed.ranges[0].oldCount, 3);
+    QCOMPARE(reflowed.ranges[0].newCount, 4);
+    QCOMPARE(reflowed.droppedCount, 0);
+    QVERIFY(migrating->takeReflowedLines().isEmpty());
+    QCOMPARE(reflowed.map(2), qint64(0));
+    QCOMPARE(reflowed.map(5), qint64(6));
+
+    // wrapping again while the lines are being wrapped starts over, lines
+    // added in the meantime follow the old lines
+    history = MigratingHistoryScroll::reflow(history, 20);
+    migrating = dynamic_cast<MigratingHistoryScroll*>(history);
+    addHistoryLine(history, QStringLiteral("new line"));
+    QCOMPARE(MigratingHistoryScroll::reflow(history, 8), history);
+    migrating->finish();
+    QCOMPARE(history->getLines(), 4);
+    QCOMPARE(historyLineText(history, 0), QStringLiteral("aaaaaaaa"));
+    QCOMPARE(historyLineText(history, 1), QStringLiteral("aabbbbb"));
+    QCOMPARE(historyLineText(history, 2), QStringLiteral("ccc"));
+    QCOMPARE(historyLineText(history, 3), QStringLiteral("new line"));
+
+    reflowed = migrating->takeReflowedLines();
+    QCOMPARE(reflowed.ranges.count(), 1);
+    QCOMPARE(reflowed.ranges[0].oldCount, 4);
+    QCOMPARE(reflowed.ranges[0].newCount, 3);
+
+    delete history;
+
+    // lines which are wrapped back when wrapping starts over, and wrapped
+    // again afterwards, end up where the last wrapping puts them
+    reflowed = ReflowedLines();
+    reflowed.add(100, 10, 20);
+    reflowed.add(100, 20, 10);
+    reflowed.add(100, 4, 2);
+    QCOMPARE(reflowed.map(50), qint64(50));
+    QCOMPARE(reflowed.map(102), qint64(100));
+    QCOMPARE(reflowed.map(105), qint64(100));
+    QCOMPARE(reflowed.map(115), qint64(113));
+}
+
+void HistoryTest::testReflowHistoryMemoryBudget()
+{
+    HistoryMemoryManager* manager = HistoryMemoryManager::instance();
+    const QString padding(40, QLatin1Char('x'));
+
+    HistoryScroll* history = new CompactHistoryScroll(1000);
+    for (int i = 0; i < 1000; i++)
+        addHistoryLine(history, QStringLiteral("line %1 ").arg(i, 4) + padding);
+
+    history = MigratingHistoryScroll::reflow(history, 30);
+    MigratingHistoryScroll* migrating = dynamic_cast<MigratingHistoryScroll*>(history);
+    QVERIFY(migrating);
+
+    // the old lines are not dropped while they are wrapped again, only
+    // the new lines are
+    manager->setBudget(1);
+    QCOMPARE(history->getLines(), 1000);
+    QCOMPARE(historyLineText(history, 0), QStringLiteral("line    0 ") + padding);
+    QCOMPARE(historyLineText(history, 999), QStringLiteral("line  999 ") + padding);
+
+    QTRY_VERIFY(migrating->isFinished());
+    QCOMPARE(history->droppedLineCount() + history->getLines(), qint64(2000));
+    if (history->getLines() > 0)
+        QCOMPARE(historyLineText(history, history->getLines() - 1), padding.left(20));
+
+    manager->setBudget(0);
+    delete history;
+}
+
+void HistoryTest::testCompactHistoryBlockCompression()
+{
+    const int lineCount = 200000;
+    const QString padding = QStringLiteral("abcdefghijklmnopqrstuvwxyz").repeated(3);
+
+    CompactHistoryScroll historyScroll(lineCount);
+    for (int i = 0; i < lineCount; i++)
+        addHistoryLine(&historyScroll, QStringLiteral("line %1 ").arg(i, 6) + padding);
+    const int textSize = lineCount * historyLineText(&historyScroll, 0).size();
+
+    // the blocks which are no longer written to are compressed in the
+    // background, reading the newest line collects them
+    QTRY_VERIFY_WITH_TIMEOUT(historyScroll.getLineLen(lineCount - 1) > 0
+                             && historyScroll.allocatedMemory() * 3 < size_t(textSize), 10000);
+
+    // old lines are decompressed when they are read
+    QCOMPARE(historyLineText(&historyScroll, 0), QStringLiteral("line      0 ") + padding);
+    QCOMPARE(historyLineText(&historyScroll, lineCount / 2), QStringLiteral("line 100000 ") + padding);
+    QCOMPARE(historyLineText(&historyScroll, lineCount - 1), QStringLiteral("line 199999 ") + padding);
+
+    // only a few of the blocks which were read are kept decompressed
+    for (int i = 0; i < lineCount; i += 1000)
+        QCOMPARE(historyLineText(&historyScroll, i), QStringLiteral("line %1 ").arg(i, 6) + padding);
+    QVERIFY(historyScroll.allocatedMemory() * 3 < size_t(textSize));
+
+    // old lines can still be dropped and replaced
+    historyScroll.dropOldestLines(lineCount / 2);
+    addHistoryLine(&historyScroll, QStringLiteral("new line"));
+    QCOMPARE(historyScroll.getLines(), lineCount / 2 + 1);
+    QCOMPARE(historyLineText(&historyScroll, 0), QStringLiteral("line 100000 ") + padding);
+    QCOMPARE(historyLineText(&historyScroll, lineCount / 2), QStringLiteral("new line"));
+}
+
+void HistoryTest::testCompactHistoryReadDuringCompression()
+{
+    const int lineCount = 60000;
+    const QString padding = QStringLiteral("abcdefghijklmnopqrstuvwxyz").repeated(3);
+
+    // the lines are read while the compressions of the blocks they are in
+    // are still running or have just finished, and the oldest lines are
+    // replaced once the history is full
+    CompactHistoryScroll historyScroll(lineCount);
+    for (int i = 0; i < 2 * lineCount; i++) {
+        addHistoryLine(&historyScroll, QStringLiteral("line %1 ").arg(i, 6) + padding);
+
+        if (i % 97 == 0) {
+            const int first = historyScroll.getLines() == lineCount ? i - lineCount + 1 : 0;
+            QCOMPARE(historyLineText(&historyScroll, 0), QStringLiteral("line %1 ").arg(first, 6) + padding);
+            const int middle = historyScroll.getLines() / 2;
+            QCOMPARE(historyLineText(&historyScroll, middle), QStringLiteral("line %1 ").arg(first + middle, 6) + padding);
+        }
+    }
+
+    for (int i = 0; i < lineCount; i += 7)
+        QCOMPARE(historyLineText(&historyScroll, i), QStringLiteral("line %1 ").arg(lineCount + i, 6) + padding);
+}
+
 QTEST_MAIN(HistoryTest )
 
@@ -35,6 +35,28 @@ private slots:
     void testCompactHistory();
     void testEmulationHistory();
     void testHistoryScroll();
+    void testCompactHistoryManyRuns();
+    void benchmarkCompactHistoryManyRuns();
+    void testCompressedHistoryFile();
+    void testHistoryScrollFileContainer();
+    void testHistoryFileUnflushedRead();
+    void testHistoryFileSpanningRead();
+    void testCompactHistoryRingBuffer();
+    void benchmarkCompactHistoryMemory();
+    void testCompactHistoryNarrowText();
+    void testCompactHistoryFormatTable();
+    void testHistoryMemoryBudget();
+    void testHistorySearchIndex();
+    void testHistorySearchIndexEmulation();
+    void testOutputSnapshot();
+    void testSearchHistoryJob();
+    void testSearchMatchCache();
+    void testSaveHistoryJob();
+    void testMigratingHistoryScroll();
+    void testReflowHistoryScroll();
+    void testReflowHistoryMemoryBudget();
+    void testCompactHistoryBlockCompression();
+    void testCompactHistoryReadDuringCompression();
 
 private:
 };
@@ -0,0 +1,161 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "IncrementalDecoderTest.h"
+
+// Qt
+#include <QTextCodec>
+
+// KDE
+#include <qtest.h>
+
+// Konsole
+#include "../IncrementalDecoder.h"
+
+using namespace Konsole;
+
+static QString decode(IncrementalDecoder& decoder, const QByteArray& block)
+{
+    const int count = decoder.decode(block.constData(), block.size());
+    return QString::fromUtf16(decoder.characters(), count);
+}
+
+// the output of a program which prints text with colors
+static QByteArray typicalOutput()
+{
+    QByteArray data;
+    for (int i = 0; i < 10000; i++) {
+        data += "\033[0m\033[01;34mdirectory\033[0m  -rw-r--r-- 1 user user  4096 Jan  1 00:00 ";
+        data += "\033[01;32mexecutable\033[0m  file.txt\r\n";
+    }
+    return data;
+}
+
+void IncrementalDecoderTest::testUtf8_data()
+{
+    QTest::addColumn<QByteArray>("input");
+
+    QTest::newRow("ascii") << QByteArray("hello world, this is a line of plain text\r\n");
+    QTest::newRow("control characters") << QByteArray("abc\030def\033[0mghijklmnopq\007");
+    QTest::newRow("two bytes") << QByteArray("caf\xc3\xa9 au lait, cr\xc3\xa8me br\xc3\xbbl\xc3\xa9\x65");
+    QTest::newRow("three bytes") << QByteArray("\xe4\xb8\xad\xe6\x96\x87 text \xe2\x94\x80\xe2\x94\x80");
+    QTest::newRow("four bytes") << QByteArray("smile \xf0\x9f\x98\x80 please");
+    QTest::newRow("byte order mark") << QByteArray("\xef\xbb\xbf" "abc\xef\xbb\xbf");
+    QTest::newRow("continuation bytes") << QByteArray("a\x80\xbf" "b");
+    QTest::newRow("overlong") << QByteArray("\xc0\xaf\xe0\x80\xaf" "a");
+    QTest::newRow("interrupted") << QByteArray("\xe4\xb8\033[0m\xc3" "a");
+    QTest::newRow("surrogate") << QByteArray("\xed\xa0\x80" "x");
+    QTest::newRow("out of range") << QByteArray("\xf4\x90\x80\x80\xf5\x80" "x");
+    QTest::newRow("typical output") << typicalOutput().left(1000) + QByteArray("\xe4\xb8\xad");
+}
+
+void IncrementalDecoderTest::testUtf8()
+{
+    QFETCH(QByteArray, input);
+
+    const QString expected = QTextCodec::codecForName("UTF-8")->toUnicode(input);
+
+    IncrementalDecoder whole;
+    whole.setCodec(QTextCodec::codecForName("UTF-8"));
+    QCOMPARE(decode(whole, input), expected);
+
+    // characters may be split between blocks
+    for (int i = 0; i <= input.size(); i++) {
+        IncrementalDecoder split;
+        split.setCodec(QTextCodec::codecForName("UTF-8"));
+        const QString first = decode(split, input.left(i));
+        const QString second = decode(split, input.mid(i));
+        QCOMPARE(first + second, expected);
+    }
+
+    IncrementalDecoder bytes;
+    bytes.setCodec(QTextCodec::codecForName("UTF-8"));
+    QString result;
+    for (int i = 0; i < input.size(); i++)
+        result += decode(bytes, input.mid(i, 1));
+    QCOMPARE(result, expected);
+}
+
+void IncrementalDecoderTest::testLegacyCodec()
+{
+    IncrementalDecoder decoder;
+    decoder.setCodec(QTextCodec::codecForName("ISO 8859-15"));
+
+    QCOMPARE(decode(decoder, "caf\xe9 \xa4"), QStringLiteral("caf") + QChar(0xe9) + QStringLiteral(" ") + QChar(0x20ac));
+
+    // switching back to UTF-8
+    decoder.setCodec(QTextCodec::codecForName("UTF-8"));
+    QCOMPARE(decode(decoder, "caf\xc3\xa9"), QStringLiteral("caf") + QChar(0xe9));
+}
+
+void IncrementalDecoderTest::testZmodem()
+{
+    IncrementalDecoder decoder;
+    decoder.setCodec(QTextCodec::codecForName("UTF-8"));
+
+    decode(decoder, "**\030B00000000000000");
+    QVERIFY(decoder.zmodemDetected());
+
+    decode(decoder, "plain text");
+    QVERIFY(!decoder.zmodemDetected());
+
+    // the start sequence within text which is copied a word at a time
+    decode(decoder, "0123456789**\030B0000000000000000000");
+    QVERIFY(decoder.zmodemDetected());
+
+    // the start sequence split between blocks
+    decode(decoder, "**\030B");
+    QVERIFY(!decoder.zmodemDetected());
+    decode(decoder, "0000000000000000");
+    QVERIFY(decoder.zmodemDetected());
+
+    decode(decoder, "\030B0");
+    decode(decoder, "\xc3\xa9" "0");
+    QVERIFY(!decoder.zmodemDetected());
+
+    decoder.setCodec(QTextCodec::codecForName("ISO 8859-1"));
+    decode(decoder, "\xe9**\030B00000000000000");
+    QVERIFY(decoder.zmodemDetected());
+}
+
+void IncrementalDecoderTest::benchmarkAscii()
+{
+    const QByteArray data = typicalOutput();
+    IncrementalDecoder decoder;
+    decoder.setCodec(QTextCodec::codecForName("UTF-8"));
+
+    QBENCHMARK {
+        decoder.decode(data.constData(), data.size());
+    }
+}
+
+void IncrementalDecoderTest::benchmarkQTextDecoder()
+{
+    const QByteArray data = typicalOutput();
+    QTextDecoder* decoder = QTextCodec::codecForName("UTF-8")->makeDecoder();
+
+    QBENCHMARK {
+        decoder->toUnicode(data.constData(), data.size());
+    }
+
+    delete decoder;
+}
+
+QTEST_GUILESS_MAIN(IncrementalDecoderTest)
@@ -31,6 +31,12 @@ using namespace Konsole;
 
 void PtyTest::init()
 {
+    _received.clear();
+}
+
+void PtyTest::receiveData(const char* buffer, int length)
+{
+    _received.append(buffer, length);
 }
 
 void PtyTest::cleanup()
@@ -89,5 +95,37 @@ void PtyTest::testRunProgram()
     QCOMPARE(pty.foregroundProcessGroup(), pty.pid());
 }
 
+void PtyTest::testReceiveLargeOutput()
+{
+    Pty pty;
+    connect(&pty, &Konsole::Pty::receivedData, this, &Konsole::PtyTest::receiveData);
+
+    // more output than is passed on in one block
+    QStringList arguments;
+    arguments << QStringLiteral("sh") << QStringLiteral("-c") << QStringLiteral("yes | head -c 500000; sleep 1");
+    QCOMPARE(pty.start(QStringLiteral("sh"), arguments, QStringList()), 0);
+
+    QTRY_COMPARE(_received.count('y'), 250000);
+}
+
+void PtyTest::testReadSuspended()
+{
+    Pty pty;
+    connect(&pty, &Konsole::Pty::receivedData, this, &Konsole::PtyTest::receiveData);
+
+    pty.setReadSuspended(true);
+    QVERIFY(pty.isReadSuspended());
+
+    QStringList arguments;
+    arguments << QStringLiteral("sh") << QStringLiteral("-c") << QStringLiteral("echo output; sleep 1");
+    QCOMPARE(pty.start(QStringLiteral("sh"), arguments, QStringList()), 0);
+
+    QTest::qWait(300);
+    QVERIFY(!_received.contains("output"));
+
+    pty.setReadSuspended(false);
+    QTRY_VERIFY(_received.contains("output"));
+}
+
 QTEST_GUILESS_MAIN(PtyTest)
 
@@ -29,6 +29,10 @@ class PtyTest : public QObject
 {
     Q_OBJECT
 
+public slots:
+    // collects the data received from the pty
+    void receiveData(const char* buffer, int length);
+
 private slots:
     void init();
     void cleanup();
@@ -39,6 +43,11 @@ private slots:
     void testWindowSize();
 
     void testRunProgram();
+    void testReceiveLargeOutput();
+    void testReadSuspended();
+
+private:
+    QByteArray _received;
 };
 
 }
@@ -0,0 +1,332 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "ScreenTest.h"
+
+// KDE
+#include <qtest.h>
+
+// Konsole
+#include "../History.h"
+#include "../Screen.h"
+
+using namespace Konsole;
+
+static void writeLine(Screen& screen, const QString& text)
+{
+    foreach(const QChar& c, text)
+        screen.displayCharacter(c.unicode());
+    screen.nextLine();
+}
+
+// returns the text of 'line', counting from the first line of the history
+static QString lineText(const Screen& screen, int line)
+{
+    QVector<Character> cells(screen.getColumns());
+    screen.getImage(cells.data(), cells.size(), line, line);
+
+    QString text;
+    foreach(const Character& c, cells)
+        text += QChar(c.character);
+    return text.trimmed();
+}
+
+void ScreenTest::testScrollRing()
+{
+    Screen screen(4, 10);
+    screen.setScroll(CompactHistoryType(100));
+
+    for (int i = 0; i < 10; i++)
+        writeLine(screen, QStringLiteral("line %1").arg(i));
+
+    // the lines which scrolled off the top are in the history, in order
+    QCOMPARE(screen.getHistLines(), 7);
+    for (int i = 0; i < 10; i++)
+        QCOMPARE(lineText(screen, i), QStringLiteral("line %1").arg(i));
+    QCOMPARE(lineText(screen, 10), QString());
+
+    // deleting the top line scrolls the whole screen without adding to
+    // the history
+    screen.setCursorYX(1, 1);
+    screen.deleteLines(1);
+    QCOMPARE(screen.getHistLines(), 7);
+    QCOMPARE(lineText(screen, 7), QStringLiteral("line 8"));
+    QCOMPARE(lineText(screen, 8), QStringLiteral("line 9"));
+    QCOMPARE(lineText(screen, 9), QString());
+    QCOMPARE(lineText(screen, 10), QString());
+
+    // scrolling part of the screen moves the lines
+    screen.setCursorYX(2, 1);
+    screen.insertLines(1);
+    QCOMPARE(lineText(screen, 7), QStringLiteral("line 8"));
+    QCOMPARE(lineText(screen, 8), QString());
+    QCOMPARE(lineText(screen, 9), QStringLiteral("line 9"));
+
+    screen.deleteLines(1);
+    QCOMPARE(lineText(screen, 7), QStringLiteral("line 8"));
+    QCOMPARE(lineText(screen, 8), QStringLiteral("line 9"));
+    QCOMPARE(lineText(screen, 9), QString());
+
+    // resizing keeps the order of the lines
+    screen.resizeImage(6, 10);
+    QCOMPARE(screen.getHistLines(), 7);
+    QCOMPARE(lineText(screen, 7), QStringLiteral("line 8"));
+    QCOMPARE(lineText(screen, 8), QStringLiteral("line 9"));
+    QCOMPARE(lineText(screen, 12), QString());
+
+    screen.setCursorYX(6, 1);
+    writeLine(screen, QStringLiteral("last"));
+    QCOMPARE(screen.getHistLines(), 8);
+    QCOMPARE(lineText(screen, 7), QStringLiteral("line 8"));
+    QCOMPARE(lineText(screen, 8), QStringLiteral("line 9"));
+    QCOMPARE(lineText(screen, 12), QStringLiteral("last"));
+    QCOMPARE(lineText(screen, 13), QString());
+}
+
+void ScreenTest::testReflow()
+{
+    Screen screen(4, 10);
+    screen.setScroll(CompactHistoryType(100));
+    screen.setReflowLines(true);
+
+    // a line which is wrapped and one which the cursor is on
+    writeLine(screen, QStringLiteral("0123456789abcde"));
+    foreach(const QChar& c, QStringLiteral("xy"))
+        screen.displayCharacter(c.unicode());
+    QCOMPARE(lineText(screen, 0), QStringLiteral("0123456789"));
+    QCOMPARE(lineText(screen, 1), QStringLiteral("abcde"));
+
+    // the wrapped line is joined again
+    screen.resizeImage(4, 20);
+    QCOMPARE(lineText(screen, 0), QStringLiteral("0123456789abcde"));
+    QCOMPARE(lineText(screen, 1), QStringLiteral("xy"));
+    QCOMPARE(lineText(screen, 2), QString());
+    QCOMPARE(screen.getCursorY(), 1);
+    QCOMPARE(screen.getCursorX(), 2);
+
+    screen.resizeImage(4, 5);
+    QCOMPARE(screen.getHistLines(), 0);
+    QCOMPARE(lineText(screen, 0), QStringLiteral("01234"));
+    QCOMPARE(lineText(screen, 1), QStringLiteral("56789"));
+    QCOMPARE(lineText(screen, 2), QStringLiteral("abcde"));
+    QCOMPARE(lineText(screen, 3), QStringLiteral("xy"));
+    QCOMPARE(screen.getCursorY(), 3);
+
+    // the lines which do not fit onto the screen move into the history
+    screen.resizeImage(4, 4);
+    QCOMPARE(screen.getHistLines(), 1);
+    QCOMPARE(lineText(screen, 0), QStringLiteral("0123"));
+    QCOMPARE(lineText(screen, 1), QStringLiteral("4567"));
+    QCOMPARE(lineText(screen, 2), QStringLiteral("89ab"));
+    QCOMPARE(lineText(screen, 3), QStringLiteral("cde"));
+    QCOMPARE(lineText(screen, 4), QStringLiteral("xy"));
+    QCOMPARE(screen.getCursorY(), 3);
+    QCOMPARE(screen.getCursorX(), 2);
+
+    // the alternate screen is not reflowed
+    Screen alternateScreen(4, 10);
+    writeLine(alternateScreen, QStringLiteral("0123456789abcde"));
+    alternateScreen.resizeImage(4, 20);
+    QCOMPARE(lineText(alternateScreen, 0), QStringLiteral("0123456789"));
+    QCOMPARE(lineText(alternateScreen, 1), QStringLiteral("abcde"));
+}
+
+void ScreenTest::testSelection()
+{
+    Screen screen(4, 10);
+    screen.setScroll(CompactHistoryType(5));
+
+    for (int i = 0; i < 3; i++)
+        writeLine(screen, QStringLiteral("line %1").arg(i));
+
+    screen.setSelectionStart(0, 1, false);
+    screen.setSelectionEnd(5, 2);
+    QCOMPARE(screen.selectedText(true, true), QStringLiteral("line 1\nline 2"));
+
+    // the selection stays on its lines while they scroll into the history
+    for (int i = 3; i < 7; i++)
+        writeLine(screen, QStringLiteral("line %1").arg(i));
+    QCOMPARE(screen.getHistLines(), 4);
+    QVERIFY(screen.isSelected(0, 1));
+    QVERIFY(!screen.isSelected(0, 3));
+    QCOMPARE(screen.selectedText(true, true), QStringLiteral("line 1\nline 2"));
+
+    // and is cut when its first line is dropped from the history
+    for (int i = 7; i < 10; i++)
+        writeLine(screen, QStringLiteral("line %1").arg(i));
+    QCOMPARE(lineText(screen, 0), QStringLiteral("line 2"));
+    int column = -1;
+    int line = -1;
+    screen.getSelectionStart(column, line);
+    QCOMPARE(column, 0);
+    QCOMPARE(line, 0);
+    QCOMPARE(screen.selectedText(true, true), QStringLiteral("line 2"));
+
+    writeLine(screen, QStringLiteral("line 10"));
+    QCOMPARE(screen.selectedText(true, true), QString());
+
+    // a selection on the screen moves with the lines which are scrolled
+    screen.setSelectionStart(0, 6, false);
+    screen.setSelectionEnd(5, 6);
+    QCOMPARE(screen.selectedText(true, true), QStringLiteral("line 9"));
+
+    screen.setCursorYX(1, 1);
+    screen.insertLines(1);
+    screen.getSelectionStart(column, line);
+    QCOMPARE(line, 7);
+    QCOMPARE(screen.selectedText(true, true), QStringLiteral("line 9"));
+
+    // and is cleared when they are overwritten
+    screen.setCursorYX(3, 1);
+    screen.clearToEndOfLine();
+    QCOMPARE(screen.selectedText(true, true), QString());
+
+void ScreenTest::testSelectionScrollUpTooFar()
+{
+    Screen screen(4, 10);
+    screen.setScroll(CompactHistoryType(100));
+
+    for (int i = 0; i < 3; i++)
+        writeLine(screen, QStringLiteral("line %1").arg(i));
+    screen.setSelectionStart(0, 1, false);
+    screen.setSelectionEnd(5, 1);
+
+    // scrolling by more lines than the screen has only adds the first line
+    // to the history, the selection stays on its line
+    screen.scrollUp(100);
+    QCOMPARE(screen.getHistLines(), 1);
+    QCOMPARE(screen.selectedText(true, true), QStringLiteral("line 1"));
+
+    writeLine(screen, QStringLiteral("line 3"));
+    QCOMPARE(screen.getHistLines(), 2);
+    QCOMPARE(screen.selectedText(true, true), QStringLiteral("line 1"));
+}
+
+void ScreenTest::testSelectedColumns()
+{
+    Screen screen(4, 10);
+    for (int i = 0; i < 3; i++)
+        writeLine(screen, QStringLiteral("line %1").arg(i));
+
+    QVector<Character> before(screen.getLines() * screen.getColumns());
+    screen.getImage(before.data(), before.size(), 0, screen.getLines() - 1);
+
+    screen.setSelectionStart(2, 0, false);
+    screen.setSelectionEnd(3, 2);
+
+    int startColumn = -1;
+    int endColumn = -1;
+    QVERIFY(screen.getSelectedColumns(0, startColumn, endColumn));
+    QCOMPARE(startColumn, 2);
+    QCOMPARE(endColumn, 9);
+    QVERIFY(screen.getSelectedColumns(1, startColumn, endColumn));
+    QCOMPARE(startColumn, 0);
+    QCOMPARE(endColumn, 9);
+    QVERIFY(screen.getSelectedColumns(2, startColumn, endColumn));
+    QCOMPARE(startColumn, 0);
+    QCOMPARE(endColumn, 3);
+    QVERIFY(!screen.getSelectedColumns(3, startColumn, endColumn));
+
+    // the selection is not part of the image
+    QVector<Character> after(before.size());
+    screen.getImage(after.data(), after.size(), 0, screen.getLines() - 1);
+    QVERIFY(before == after);
+
+    // a block selection covers the same columns on each line
+    screen.setSelectionStart(3, 0, true);
+    screen.setSelectionEnd(1, 1);
+    QVERIFY(screen.getSelectedColumns(0, startColumn, endColumn));
+    QCOMPARE(startColumn, 1);
+    QCOMPARE(endColumn, 3);
+    QVERIFY(screen.getSelectedColumns(1, startColumn, endColumn));
+    QCOMPARE(startColumn, 1);
+    QCOMPARE(endColumn, 3);
+
+    screen.clearSelection();
+    QVERIFY(!screen.getSelectedColumns(0, startColumn, endColumn));
+}
+
+void ScreenTest::testDisplayString()
+{
+    // wrapped text, double width characters and combining characters
+    const QString text = QStringLiteral("0123456789abcdef") + QChar(0x4e2d) + QChar(0x6587) +
+                         QStringLiteral("e") + QChar(0x0301) + QStringLiteral("xyz0123") + QChar(0x4e2d);
+
+    Screen expected(4, 10);
+    Screen screen(4, 10);
+    expected.setScroll(CompactHistoryType(100));
+    screen.setScroll(CompactHistoryType(100));
+
+    for (int i = 0; i < 3; i++) {
+        foreach(const QChar& c, text)
+            expected.displayCharacter(c.unicode());
+        screen.displayString(text.utf16(), text.length());
+    }
+
+    QCOMPARE(screen.getHistLines(), expected.getHistLines());
+    QCOMPARE(screen.getCursorX(), expected.getCursorX());
+    QCOMPARE(screen.getCursorY(), expected.getCursorY());
+
+    const int lines = screen.getHistLines() + screen.getLines();
+    QVector<Character> expectedImage(lines * screen.getColumns());
+    QVector<Character> image(expectedImage.size());
+    expected.getImage(expectedImage.data(), expectedImage.size(), 0, lines - 1);
+    screen.getImage(image.data(), image.size(), 0, lines - 1);
+    for (int i = 0; i < image.size(); i++)
+        QCOMPARE(image[i].character, expectedImage[i].character);
+    QCOMPARE(screen.getLineProperties(0, lines - 1), expected.getLineProperties(0, lines - 1));
+
+    // writing over a selection clears it
+    screen.setSelectionStart(0, lines - 1, false);
+    screen.setSelectionEnd(5, lines - 1);
+    screen.setCursorYX(screen.getLines(), 1);
+    screen.displayString(text.utf16(), 3);
+    QVERIFY(!screen.isSelected(0, lines - 1));
+}
+
+void ScreenTest::benchmarkScrollUp()
+{
+    Screen screen(200, 200);
+    screen.setScroll(CompactHistoryType(1000));
+    const QString text(200, QLatin1Char('x'));
+
+    QBENCHMARK {
+        for (int i = 0; i < 1000; i++)
+            writeLine(screen, text);
+    }
+}
+
+void ScreenTest::benchmarkDisplayString()
+{
+    Screen screen(50, 200);
+    screen.setScroll(CompactHistoryType(1000));
+    const QString text = QString(80, QLatin1Char('x'));
+
+    QBENCHMARK {
+        for (int i = 0; i < 1000; i++) {
+            screen.displayString(text.utf16(), text.length());
+            screen.nextLine();
+            screen.toStartOfLine();
+        }
+    }
+}
+
+QTEST_GUILESS_MAIN(ScreenTest)
+
@@ -20,12 +20,24 @@
 // Own
 #include "SessionTest.h"
 
+#include <utime.h>
+
 #include "qtest.h"
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+
+#include <KConfig>
+#include <KConfigGroup>
 
 // Konsole
 #include "../Session.h"
 #include "../Emulation.h"
 #include "../History.h"
+#include "../SessionSnapshot.h"
 
 using namespace Konsole;
 
@@ -56,5 +68,91 @@ void SessionTest::testEmulation()
     delete session;
 }
 
+void SessionTest::testSnapshot()
+{
+    QTemporaryDir dir;
+    const QString fileName = dir.path() + QStringLiteral("/test.snapshot");
+
+    Session* session = new Session();
+    Emulation* emulation = session->emulation();
+    emulation->setHistory(CompactHistoryType(1000));
+
+    // enough lines to fill several history chunks
+    QByteArray output;
+    for (int i = 0; i < 1000; i++)
+        output += "line " + QByteArray::number(i) + "\r\n";
+    emulation->receiveData(output.constData(), output.size());
+
+    SessionSnapshot* snapshot = new SessionSnapshot(emulation);
+    snapshot->save(fileName);
+    // saving again waits for the first file to be written
+    snapshot->save(fileName);
+    snapshot->waitForFinished();
+
+    // snapshots which were saved at the same time are kept
+    const QString otherFileName = dir.path() + QStringLiteral("/other.snapshot");
+    snapshot->save(otherFileName);
+    snapshot->waitForFinished();
+    SessionSnapshot::removeStaleSnapshots(fileName);
+    QVERIFY(QFile::exists(fileName));
+    QVERIFY(QFile::exists(otherFileName));
+
+    // older snapshots are removed, unless the saved sessions of another
+    // instance refer to them
+    const QString staleFileName = dir.path() + QStringLiteral("/stale.snapshot");
+    const QString savedFileName = dir.path() + QStringLiteral("/saved.snapshot");
+    struct utimbuf times;
+    times.actime = times.modtime = QFileInfo(fileName).lastModified().toTime_t() - 2 * 60 * 60;
+    foreach(const QString& oldFileName, QStringList() << staleFileName << savedFileName) {
+        QVERIFY(QFile::copy(fileName, oldFileName));
+        QCOMPARE(utime(QFile::encodeName(oldFileName).constData(), &times), 0);
+    }
+
+    QStandardPaths::setTestModeEnabled(true);
+    const QString sessionDir = QStandardPaths::writableLocation(QStandardPaths::GenericConfigLocation)
+                               + QStringLiteral("/session");
+    const QString configFileName = sessionDir + QStringLiteral("/konsole_sessiontest");
+    QVERIFY(QDir().mkpath(sessionDir));
+    {
+        KConfig config(configFileName, KConfig::SimpleConfig);
+        KConfigGroup group(&config, "Session1");
+        group.writePathEntry("Snapshot", savedFileName);
+    }
+
+    SessionSnapshot::removeStaleSnapshots(fileName);
+    QVERIFY(QFile::exists(fileName));
+    QVERIFY(!QFile::exists(staleFileName));
+    QVERIFY(QFile::exists(savedFileName));
+    QFile::remove(configFileName);
+
+    Session* restoredSession = new Session();
+    Emulation* restored = restoredSession->emulation();
+    restored->setHistory(CompactHistoryType(1000));
+    QVERIFY(SessionSnapshot::restore(restored, fileName));
+
+    HistoryScroll* history = emulation->historyScroll();
+    HistoryScroll* restoredHistory = restored->historyScroll();
+    QCOMPARE(restoredHistory->getLines(), history->getLines());
+    QCOMPARE(restored->lineCount(), emulation->lineCount());
+    QCOMPARE(restored->imageSize(), emulation->imageSize());
+
+    for (int line = 0; line < history->getLines(); line += 97) {
+        const int length = history->getLineLen(line);
+        QCOMPARE(restoredHistory->getLineLen(line), length);
+        QVector<Character> expected(length);
+        QVector<Character> actual(length);
+        history->getCells(line, 0, length, expected.data());
+        restoredHistory->getCells(line, 0, length, actual.data());
+        for (int i = 0; i < length; i++)
+            QCOMPARE(actual[i].character, expected[i].character);
+    }
+
+    QVERIFY(!SessionSnapshot::restore(restored, dir.path() + QStringLiteral("/missing.snapshot")));
+
+    delete snapshot;
+    delete restoredSession;
+    delete session;
+}
+
 QTEST_MAIN(SessionTest )
 
@@ -32,6 +32,7 @@ class SessionTest : public QObject
 private slots:
     void testNoProfile();
     void testEmulation();
+    void testSnapshot();
 
 private:
 };
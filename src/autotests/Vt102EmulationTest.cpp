@@ -0,0 +1,307 @@
+/*
+    Copyright 2016 by the Konsole developers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "Vt102EmulationTest.h"
+
+// Qt
+#include <QSignalSpy>
+#include <QTextCodec>
+#include <QThread>
+
+// KDE
+#include <qtest.h>
+
+// Konsole
+#include "../History.h"
+#include "../Screen.h"
+#include "../ScreenWindow.h"
+#include "../Vt102Emulation.h"
+
+using namespace Konsole;
+
+namespace
+{
+// gives access to the screen which the emulation is writing to
+class TestEmulation : public Vt102Emulation
+{
+public:
+    TestEmulation() {
+        setCodec(QTextCodec::codecForName("UTF-8"));
+    }
+
+    const Screen* screen() const {
+        return _currentScreen;
+    }
+
+    void receive(const QByteArray& data) {
+        receiveData(data.constData(), data.size());
+    }
+};
+}
+
+// returns line 'line' of the emulation's screen without trailing spaces
+static QString lineText(const TestEmulation& emulation, int line)
+{
+    const Screen* screen = emulation.screen();
+    const int imageLine = screen->getHistLines() + line;
+    QVector<Character> cells(screen->getColumns());
+    screen->getImage(cells.data(), cells.size(), imageLine, imageLine);
+
+    QString text;
+    foreach(const Character& c, cells)
+        text += QChar(c.character);
+
+    int length = text.length();
+    while (length > 0 && text[length - 1] == QLatin1Char(' '))
+        length--;
+    return text.left(length);
+}
+
+// returns line 'line' of the window without trailing spaces
+static QString windowLineText(ScreenWindow* window, int line)
+{
+    const int columns = window->windowColumns();
+    const Character* image = window->getImage() + line * columns;
+
+    QString text;
+    for (int column = 0; column < columns; column++)
+        text += QChar(image[column].character);
+
+    int length = text.length();
+    while (length > 0 && text[length - 1] == QLatin1Char(' '))
+        length--;
+    return text.left(length);
+}
+
+static Character cellAt(const TestEmulation& emulation, int column, int line)
+{
+    const Screen* screen = emulation.screen();
+    const int imageLine = screen->getHistLines() + line;
+    QVector<Character> cells(screen->getColumns());
+    screen->getImage(cells.data(), cells.size(), imageLine, imageLine);
+    return cells[column];
+}
+
+void Vt102EmulationTest::testSequences_data()
+{
+    QTest::addColumn<QByteArray>("input");
+    QTest::addColumn<int>("line");
+    QTest::addColumn<QString>("text");
+    QTest::addColumn<int>("cursorX");
+    QTest::addColumn<int>("cursorY");
+
+    QTest::newRow("plain text") << QByteArray("hello") << 0 << QStringLiteral("hello") << 5 << 0;
+    QTest::newRow("new line") << QByteArray("ab\r\ncd") << 1 << QStringLiteral("cd") << 2 << 1;
+    QTest::newRow("cursor position") << QByteArray("\033[2;3Hx") << 1 << QStringLiteral("  x") << 3 << 1;
+    QTest::newRow("default arguments") << QByteArray("ab\033[Hx") << 0 << QStringLiteral("xb") << 1 << 0;
+    QTest::newRow("cursor movement") << QByteArray("\033[5;5H\033[2A\033[3Dy") << 2 << QStringLiteral(" y") << 2 << 2;
+    QTest::newRow("erase in line") << QByteArray("abcdef\033[1;3H\033[K") << 0 << QStringLiteral("ab") << 2 << 0;
+    QTest::newRow("insert characters") << QByteArray("abc\033[1;2H\033[2@") << 0 << QStringLiteral("a  bc") << 1 << 0;
+    QTest::newRow("control character in sequence") << QByteArray("\033[2\n;3Hx") << 1 << QStringLiteral("  x") << 3 << 1;
+    QTest::newRow("escape restarts sequence") << QByteArray("\033[3\033[1;2Hx") << 0 << QStringLiteral(" x") << 2 << 0;
+    QTest::newRow("private mode") << QByteArray("a\033[?25lb\033[?25h") << 0 << QStringLiteral("ab") << 2 << 0;
+    QTest::newRow("secondary attributes") << QByteArray("a\033[>0cb") << 0 << QStringLiteral("ab") << 2 << 0;
+    QTest::newRow("soft reset") << QByteArray("a\033[!pb") << 0 << QStringLiteral("ab") << 2 << 0;
+    QTest::newRow("unknown escape") << QByteArray("a\033Qb") << 0 << QStringLiteral("ab") << 2 << 0;
+    QTest::newRow("delete ignored") << QByteArray("a\177b\033[1\1772Gc") << 0 << QStringLiteral("ab")
+                                    + QString(9, QLatin1Char(' ')) + QStringLiteral("c") << 12 << 0;
+    QTest::newRow("too many arguments") << QByteArray("\033[1;1;1;1;1;1;1;1;1;1;1;1;1;1;1;1;1;1;1;1;31mx")
+                                        << 0 << QStringLiteral("x") << 1 << 0;
+    QTest::newRow("character set") << QByteArray("\033(0q\033(Bq") << 0 << (QString(QChar(0x2500)) + QStringLiteral("q")) << 2 << 0;
+    QTest::newRow("alignment test") << QByteArray("\033#8") << 0 << QString(80, QLatin1Char('E')) << 0 << 0;
+    QTest::newRow("window title") << QByteArray("a\033]2;title\007b") << 0 << QStringLiteral("ab") << 2 << 0;
+    QTest::newRow("utf-8") << QByteArray("a\303\251b") << 0 << (QStringLiteral("a") + QChar(0xe9) + QStringLiteral("b")) << 3 << 0;
+}
+
+void Vt102EmulationTest::testSequences()
+{
+    QFETCH(QByteArray, input);
+    QFETCH(int, line);
+    QFETCH(QString, text);
+    QFETCH(int, cursorX);
+    QFETCH(int, cursorY);
+
+    // the result must not depend on how the output is split into blocks
+    TestEmulation whole;
+    whole.receive(input);
+
+    TestEmulation bytes;
+    for (int i = 0; i < input.size(); i++)
+        bytes.receive(input.mid(i, 1));
+
+    foreach(const TestEmulation* emulation, QList<const TestEmulation*>() << &whole << &bytes) {
+        QCOMPARE(lineText(*emulation, line), text);
+        QCOMPARE(emulation->screen()->getCursorX(), cursorX);
+        QCOMPARE(emulation->screen()->getCursorY(), cursorY);
+    }
+}
+
+void Vt102EmulationTest::testColors()
+{
+    TestEmulation emulation;
+    emulation.receive("\033[38;2;1;2;3mA\033[48;5;100mB\033[0;32mC\033[1mD\033[0mE");
+
+    QVERIFY(cellAt(emulation, 0, 0).foregroundColor == CharacterColor(COLOR_SPACE_RGB, 0x010203));
+    QVERIFY(cellAt(emulation, 1, 0).foregroundColor == CharacterColor(COLOR_SPACE_RGB, 0x010203));
+    QVERIFY(cellAt(emulation, 1, 0).backgroundColor == CharacterColor(COLOR_SPACE_256, 100));
+    QVERIFY(cellAt(emulation, 2, 0).foregroundColor == CharacterColor(COLOR_SPACE_SYSTEM, 2));
+    QVERIFY(cellAt(emulation, 2, 0).backgroundColor == CharacterColor(COLOR_SPACE_DEFAULT, DEFAULT_BACK_COLOR));
+    QVERIFY(cellAt(emulation, 3, 0).rendition & RE_BOLD);
+    QVERIFY(cellAt(emulation, 4, 0).rendition == DEFAULT_RENDITION);
+    QVERIFY(cellAt(emulation, 4, 0).foregroundColor == CharacterColor(COLOR_SPACE_DEFAULT, DEFAULT_FORE_COLOR));
+}
+
+void Vt102EmulationTest::testCancel()
+{
+    // CAN and SUB abort the sequence and display a checker board
+    TestEmulation emulation;
+    emulation.receive("\033[31\030x\033]2;title\032y");
+
+    const QString checkerBoard(QChar(0x2592));
+    QCOMPARE(lineText(emulation, 0), checkerBoard + QStringLiteral("x") + checkerBoard + QStringLiteral("y"));
+    QVERIFY(cellAt(emulation, 1, 0).foregroundColor == CharacterColor(COLOR_SPACE_DEFAULT, DEFAULT_FORE_COLOR));
+}
+
+void Vt102EmulationTest::testEightBitCsi()
+{
+    TestEmulation emulation;
+    emulation.setCodec(QTextCodec::codecForName("ISO 8859-1"));
+    emulation.receive("\2332;3Hx");
+
+    QCOMPARE(lineText(emulation, 1), QStringLiteral("  x"));
+}
+
+void Vt102EmulationTest::testWindowTitle()
+{
+    TestEmulation emulation;
+    QSignalSpy titleSpy(&emulation, SIGNAL(titleChanged(int,QString)));
+    QSignalSpy requestSpy(&emulation, SIGNAL(sessionAttributeRequest(int)));
+
+    // titles are not limited in length
+    const QString title = QStringLiteral("title ") + QString(1000, QLatin1Char('x'));
+    emulation.receive("\033]2;" + title.toUtf8() + "\007");
+    QVERIFY(titleSpy.wait());
+    QCOMPARE(titleSpy.count(), 1);
+    QCOMPARE(titleSpy.at(0).at(0).toInt(), 2);
+    QCOMPARE(titleSpy.at(0).at(1).toString(), title);
+
+    emulation.receive("\033]30;?\007");
+    QCOMPARE(requestSpy.count(), 1);
+    QCOMPARE(requestSpy.at(0).at(0).toInt(), 30);
+
+    // requests without an attribute are ignored
+    emulation.receive("\033]title\007");
+    QVERIFY(!titleSpy.wait(100));
+}
+
+void Vt102EmulationTest::testVt52()
+{
+    TestEmulation emulation;
+
+    // ESC Y <row> <column> where both are offset by 32
+    emulation.receive("\033[?2l\033Y\042\043x\033A");
+    QCOMPARE(lineText(emulation, 2), QStringLiteral("   x"));
+    QCOMPARE(emulation.screen()->getCursorX(), 4);
+    QCOMPARE(emulation.screen()->getCursorY(), 1);
+
+    emulation.receive("\033<\033[1;1Hy");
+    QCOMPARE(lineText(emulation, 0), QStringLiteral("y"));
+}
+
+void Vt102EmulationTest::testOutputThread()
+{
+    TestEmulation emulation;
+    emulation.setImageSize(5, 20);
+    ScreenWindow* window = emulation.createWindow();
+    window->setWindowLines(5);
+
+    emulation.setOutputThreadEnabled(true);
+    QVERIFY(emulation.thread() != QThread::currentThread());
+
+    // more output than the output thread processes at once
+    QByteArray data;
+    for (int i = 0; i < 10000; i++)
+        data += QByteArray::number(i) + "\r\n";
+    emulation.receive(data);
+    emulation.receive("last");
+
+    QTRY_COMPARE(windowLineText(window, 4), QStringLiteral("last"));
+    QCOMPARE(windowLineText(window, 3), QStringLiteral("9999"));
+    QCOMPARE(window->cursorPosition(), QPoint(4, 4));
+
+    // the history is replaced by the output thread
+    emulation.setHistory(CompactHistoryType(100));
+    QCOMPARE(emulation.history().maximumLineCount(), 100);
+    emulation.receive("\r\nmore");
+    QTRY_COMPARE(window->lineCount(), 6);
+    QCOMPARE(windowLineText(window, 3), QStringLiteral("last"));
+
+    emulation.setImageSize(4, 10);
+    QCOMPARE(emulation.imageSize(), QSize(10, 4));
+
+    emulation.reset();
+    QTRY_COMPARE(windowLineText(window, 3), QString());
+
+    emulation.setOutputThreadEnabled(false);
+    QCOMPARE(emulation.thread(), QThread::currentThread());
+
+    // output is processed right away again
+    emulation.receive("abc");
+    QCOMPARE(lineText(emulation, 0), QStringLiteral("abc"));
+}
+
+void Vt102EmulationTest::testOutputBacklog()
+{
+    TestEmulation emulation;
+    emulation.setImageSize(5, 20);
+    QSignalSpy spy(&emulation, SIGNAL(outputBacklogChanged()));
+
+    emulation.receive("abc");
+    QVERIFY(!emulation.outputBacklogged());
+
+    // the output is still processed right away, but the terminal program
+    // is not read from until the views have been updated
+    QThread::msleep(150);
+    emulation.receive("def");
+    QCOMPARE(lineText(emulation, 0), QStringLiteral("abcdef"));
+    QVERIFY(emulation.outputBacklogged());
+    QCOMPARE(spy.count(), 1);
+
+    QTRY_VERIFY(!emulation.outputBacklogged());
+    QCOMPARE(spy.count(), 2);
+}
+
+void Vt102EmulationTest::benchmarkReceiveData()
+{
+    TestEmulation emulation;
+
+    // the output of a colored directory listing
+    QByteArray data;
+    for (int i = 0; i < 1000; i++) {
+        data += "\033[0m\033[01;34mdirectory\033[0m  -rw-r--r-- 1 user user  4096 Jan  1 00:00 ";
+        data += "\033[01;32mexecutable\033[0m  file.txt\r\n";
+    }
+
+    QBENCHMARK {
+        emulation.receive(data);
+    }
+}
+
+QTEST_GUILESS_MAIN(Vt102EmulationTest)